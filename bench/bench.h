@@ -0,0 +1,23 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "../src/util.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#define run_benchmark(bench) \
+  printf("Running %s:\n", #bench);\
+  bench()
+
+void bench_html(void);
+void bench_object(void);
+void bench_template(void);
+
+#endif
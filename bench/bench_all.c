@@ -0,0 +1,14 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "bench.h"
+
+int main(void) {
+  run_benchmark(bench_html);
+  run_benchmark(bench_object);
+  run_benchmark(bench_template);
+  return 0;
+}
@@ -0,0 +1,223 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "../src/build.h"
+#include "../src/html.h"
+#include "../src/module.h"
+
+#include "bench.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BENCH_SECTIONS 20000
+#define BENCH_ROUNDS 5
+#define BENCH_DOCUMENT_SECTIONS 2000
+#define BENCH_INCLUDE_INTERVAL 100
+
+typedef struct {
+  size_t links;
+  size_t comments;
+  size_t headings;
+  size_t title;
+  size_t elements;
+} BenchCounts;
+
+static Value create_section(size_t i, Env *env) {
+  Value section = html_create_element("section", 0, env);
+  Value heading = html_create_element("h2", 0, env);
+  html_append_child(heading, copy_c_string("Section", env->arena), env->arena);
+  html_append_child(section, heading, env->arena);
+  Value paragraph = html_create_element("p", 0, env);
+  html_append_child(paragraph, copy_c_string("Lorem ipsum dolor sit amet ", env->arena), env->arena);
+  Value link = html_create_element("a", 0, env);
+  html_set_attribute(link, "href", copy_c_string("image.png", env->arena).string_value, env);
+  html_append_child(link, copy_c_string("link", env->arena), env->arena);
+  html_append_child(paragraph, link, env->arena);
+  html_append_child(section, paragraph, env->arena);
+  Value comment = create_object(0, env->arena);
+  object_put(comment.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_COMMENT), env->arena);
+  object_put(comment.object_value, create_known_symbol(SYM_COMMENT),
+      copy_c_string(i % 100 ? "note" : "more", env->arena), env->arena);
+  html_append_child(section, comment, env->arena);
+  return section;
+}
+
+static HtmlTransformation count_links(Value node, void *context) {
+  BenchCounts *counts = context;
+  if (html_get_attribute(node, "href").type == V_STRING) {
+    counts->links++;
+  }
+  return HTML_NO_ACTION;
+}
+
+static HtmlTransformation count_comments(Value node, void *context) {
+  BenchCounts *counts = context;
+  Value comment;
+  if (node.type == V_OBJECT && object_get(node.object_value, create_known_symbol(SYM_COMMENT), &comment)) {
+    counts->comments++;
+  }
+  return HTML_NO_ACTION;
+}
+
+static HtmlTransformation find_title(Value node, void *context) {
+  BenchCounts *counts = context;
+  if (!counts->title && html_is_tag(node, "h1")) {
+    counts->title = 1;
+  }
+  return HTML_NO_ACTION;
+}
+
+static void count_headings(Value node, void *context) {
+  BenchCounts *counts = context;
+  if (html_is_tag(node, "h2")) {
+    counts->headings++;
+  }
+}
+
+static HtmlTransformation count_elements(Value node, void *context) {
+  BenchCounts *counts = context;
+  Value tag;
+  if (node.type == V_OBJECT && object_get(node.object_value, create_known_symbol(SYM_TAG), &tag)) {
+    counts->elements++;
+  }
+  return HTML_NO_ACTION;
+}
+
+static double elapsed_ms(clock_t start) {
+  return (double) (clock() - start) / CLOCKS_PER_SEC * 1e3 / BENCH_ROUNDS;
+}
+
+#ifdef WITH_GUMBO
+
+static const char *bench_index =
+  "docs = []\n"
+  "for i in [1, 2, 3, 4, 5]\n"
+  "  docs | push(read_content('content/long.html'))\n"
+  "end for\n";
+
+static void write_document(const Path *dir) {
+  Path *part_path = path_append(dir, "part.html");
+  FILE *file = fopen(part_path->path, "w");
+  assert(file);
+  fputs("<p>Included <a href=\"image.png\">image</a></p>\n", file);
+  fclose(file);
+  delete_path(part_path);
+  Path *path = path_append(dir, "long.html");
+  file = fopen(path->path, "w");
+  assert(file);
+  fputs("<h1>Long document</h1>\n<p>Introduction</p>\n<!--more-->\n<!--toc-->\n", file);
+  for (size_t i = 0; i < BENCH_DOCUMENT_SECTIONS; i++) {
+    fprintf(file, "<h2>Section %zu</h2>\n", i);
+    fputs("<p>Lorem ipsum <a href=\"page.html\">dolor</a> sit <img src=\"image.png\"> amet "
+        "<a href=\"https://example.com/\">consectetur</a></p>\n", file);
+    fprintf(file, "<h3>Subsection %zu</h3>\n<p>Adipiscing <a href=\"#section-%zu\">elit</a></p>\n", i, i);
+    if (i % BENCH_INCLUDE_INTERVAL == 0) {
+      fputs("<!--include:part.html-->\n", file);
+    }
+  }
+  fclose(file);
+  delete_path(path);
+}
+
+/* Times the post-processing of content as it is done for the html, title, read_more and toc properties of content
+ * objects: parsing followed by the link, include, title, read more and table of contents visitors. */
+static void bench_parse_content(void) {
+  char template[] = "/tmp/plet-bench-XXXXXX";
+  assert(mkdtemp(template));
+  Path *src_root = create_path(template, -1);
+  Path *index_path = path_append(src_root, "index.plet");
+  FILE *file = fopen(index_path->path, "w");
+  assert(file);
+  fputs(bench_index, file);
+  fclose(file);
+  Path *content_dir = path_append(src_root, "content");
+  assert(mkdir(content_dir->path, 0777) == 0);
+  write_document(content_dir);
+  ModuleMap *modules = create_module_map();
+  SymbolMap *symbol_map = create_symbol_map();
+  add_system_modules(modules);
+  Env *env = eval_index(src_root, modules, symbol_map, 1);
+  assert(env && !env->error);
+  Value docs;
+  assert(env_get(get_symbol("docs", symbol_map), &docs, env) && docs.type == V_ARRAY);
+  assert(docs.array_value->size == BENCH_ROUNDS);
+  clock_t start = clock();
+  for (size_t i = 0; i < docs.array_value->size; i++) {
+    Value html;
+    assert(object_get_symbol(docs.array_value->cells[i].object_value, "html", &html) && html.type == V_OBJECT);
+  }
+  double parse_time = elapsed_ms(start);
+  Value toc;
+  assert(object_get_symbol(docs.array_value->cells[0].object_value, "toc", &toc) && toc.type == V_ARRAY);
+  assert(toc.array_value->size == BENCH_DOCUMENT_SECTIONS);
+  printf("  parse_content, %d sections: %.1f ms per document\n", BENCH_DOCUMENT_SECTIONS, parse_time);
+  delete_arena(env->arena);
+  delete_module_map(modules);
+  delete_symbol_map(symbol_map);
+  delete_dir(src_root);
+  delete_path(content_dir);
+  delete_path(index_path);
+  delete_path(src_root);
+}
+
+#else /* ifdef WITH_GUMBO */
+
+static void bench_parse_content(void) {
+  printf("  parse_content: skipped, Plet was built without gumbo\n");
+}
+
+#endif /* ifdef WITH_GUMBO */
+
+static void bench_visitors(void) {
+  Arena *arena = create_arena();
+  ModuleMap *modules = create_module_map();
+  SymbolMap *symbol_map = create_symbol_map();
+  Env *env = create_env(arena, modules, symbol_map);
+  Value root = html_create_element("div", 0, env);
+  for (size_t i = 0; i < BENCH_SECTIONS; i++) {
+    html_append_child(root, create_section(i, env), env->arena);
+  }
+  BenchCounts separate = {0}, fused = {0};
+  HtmlVisitor visitors[] = {
+    {count_links, NULL, &separate},
+    {count_comments, NULL, &separate},
+    {find_title, NULL, &separate},
+    {NULL, count_headings, &separate},
+    {count_elements, NULL, &separate},
+  };
+  size_t count = sizeof(visitors) / sizeof(HtmlVisitor);
+  clock_t start = clock();
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    for (size_t i = 0; i < count; i++) {
+      html_visit(root, &visitors[i], 1);
+    }
+  }
+  double separate_time = elapsed_ms(start);
+  for (size_t i = 0; i < count; i++) {
+    visitors[i].context = &fused;
+  }
+  start = clock();
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    html_visit(root, visitors, count);
+  }
+  double fused_time = elapsed_ms(start);
+  assert(separate.links == fused.links && separate.links == BENCH_ROUNDS * BENCH_SECTIONS);
+  assert(separate.comments == fused.comments && separate.headings == fused.headings);
+  assert(separate.elements == fused.elements);
+  printf("  %d sections, %zu visitors: separate passes %.1f ms, single pass %.1f ms\n", BENCH_SECTIONS, count,
+      separate_time, fused_time);
+  delete_arena(arena);
+  delete_module_map(modules);
+  delete_symbol_map(symbol_map);
+}
+
+void bench_html(void) {
+  bench_visitors();
+  bench_parse_content();
+}
@@ -0,0 +1,87 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "../src/value.h"
+
+#include "bench.h"
+
+#include <time.h>
+
+#define BENCH_OPERATIONS 1000000
+
+static Value create_key(size_t i, Arena *arena) {
+  char name[32];
+  snprintf(name, sizeof(name), "post-%zu", i);
+  return copy_c_string(name, arena);
+}
+
+static double elapsed_ns(clock_t start, size_t operations) {
+  return (double) (clock() - start) / CLOCKS_PER_SEC * 1e9 / operations;
+}
+
+static void bench_object_size(size_t size) {
+  Arena *arena = create_arena();
+  Value *keys = arena_allocate(size * sizeof(Value), arena);
+  for (size_t i = 0; i < size; i++) {
+    keys[i] = create_key(i, arena);
+  }
+  size_t rounds = BENCH_OPERATIONS / size;
+  if (!rounds) {
+    rounds = 1;
+  }
+  clock_t start = clock();
+  for (size_t r = 0; r < rounds; r++) {
+    Value object = create_object(0, arena);
+    for (size_t i = 0; i < size; i++) {
+      object_put(object.object_value, keys[i], create_int(i), arena);
+    }
+  }
+  double insert = elapsed_ns(start, rounds * size);
+  Value object = create_object(0, arena);
+  for (size_t i = 0; i < size; i++) {
+    object_put(object.object_value, keys[i], create_int(i), arena);
+  }
+  int64_t sum = 0;
+  start = clock();
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < size; i++) {
+      Value value;
+      object_get(object.object_value, keys[(i * 7919) % size], &value);
+      sum += value.int_value;
+    }
+  }
+  double lookup = elapsed_ns(start, rounds * size);
+  assert(sum == (int64_t) rounds * (int64_t) (size * (size - 1) / 2));
+  printf("  %zu keys: insert %.1f ns/op, lookup %.1f ns/op\n", size, insert, lookup);
+  delete_arena(arena);
+}
+
+/* Looks up well-known symbols in a small object with symbol keys, like the page objects in SITE_MAP. */
+static void bench_object_symbols(void) {
+  Arena *arena = create_arena();
+  Value object = create_object(0, arena);
+  for (int i = 0; i < NUM_KNOWN_SYMBOLS; i++) {
+    object_put(object.object_value, create_known_symbol(i), create_int(i), arena);
+  }
+  int64_t sum = 0;
+  clock_t start = clock();
+  for (size_t i = 0; i < BENCH_OPERATIONS; i++) {
+    Value value;
+    object_get(object.object_value, create_known_symbol((i * 7) % NUM_KNOWN_SYMBOLS), &value);
+    sum += value.int_value;
+  }
+  double lookup = elapsed_ns(start, BENCH_OPERATIONS);
+  assert(sum > 0);
+  printf("  %d symbol keys: lookup %.1f ns/op\n", NUM_KNOWN_SYMBOLS, lookup);
+  delete_arena(arena);
+}
+
+void bench_object(void) {
+  bench_object_symbols();
+  bench_object_size(8);
+  bench_object_size(1000);
+  bench_object_size(100000);
+}
@@ -0,0 +1,103 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "../src/build.h"
+#include "../src/module.h"
+
+#include "bench.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BENCH_PAGES 200
+#define BENCH_ITEMS 1000
+
+static const char *bench_index =
+  "digits = [0, 1, 2, 3, 4, 5, 6, 7, 8, 9]\n"
+  "export items = []\n"
+  "for a in digits\n"
+  "  for b in digits\n"
+  "    for c in digits\n"
+  "      items | push({id: a * 100 + b * 10 + c, title: \"Item {a}{b}{c}\", tags: ['x', 'y'], price: c * 3})\n"
+  "    end for\n"
+  "  end for\n"
+  "end for\n"
+  "export format_price = p => \"${p}.00\"\n";
+
+static const char *bench_layout =
+  "<html><head><title>{title}</title></head><body>\n"
+  "{CONTENT}\n"
+  "</body></html>\n";
+
+static const char *bench_page =
+  "{LAYOUT = 'layout.plet.html'}\n"
+  "<h1>{title | upper}</h1>\n"
+  "<ul>\n"
+  "{for item in items}\n"
+  "{if item.id % 3 == 0}<li class=\"a\">{item.title | lower}</li>\n"
+  "{else if item.price > 10}<li>{format_price(item.price)}</li>\n"
+  "{else}<li>{item.title}{for tag in item.tags}<span>{tag}</span>{end for}</li>\n"
+  "{end if}\n"
+  "{end for}\n"
+  "</ul>\n";
+
+static void write_file(const Path *dir, const char *name, const char *text) {
+  Path *path = path_append(dir, name);
+  FILE *file = fopen(path->path, "w");
+  assert(file);
+  fputs(text, file);
+  fclose(file);
+  delete_path(path);
+}
+
+/* Times the evaluation of a template with a layout that iterates over a list of objects with nested conditionals
+ * and calls a function defined in index.plet, the way pages are compiled by compile_page_object(). */
+void bench_template(void) {
+  char template[] = "/tmp/plet-bench-XXXXXX";
+  assert(mkdtemp(template));
+  Path *src_root = create_path(template, -1);
+  write_file(src_root, "index.plet", bench_index);
+  Path *templates_dir = path_append(src_root, "templates");
+  assert(mkdir(templates_dir->path, 0777) == 0);
+  write_file(templates_dir, "layout.plet.html", bench_layout);
+  write_file(templates_dir, "page.plet.html", bench_page);
+  ModuleMap *modules = create_module_map();
+  SymbolMap *symbol_map = create_symbol_map();
+  add_system_modules(modules);
+  Env *env = eval_index(src_root, modules, symbol_map, 1);
+  assert(env && !env->error);
+  Value items;
+  assert(env_get(get_symbol("items", symbol_map), &items, env) && items.type == V_ARRAY);
+  assert(items.array_value->size == BENCH_ITEMS);
+  Path *page_path = path_append(templates_dir, "page.plet.html");
+  Module *module = get_template(page_path, env);
+  assert(module);
+  size_t output_size = 0;
+  clock_t start = clock();
+  for (int i = 0; i < BENCH_PAGES; i++) {
+    Value data = create_object(0, env->arena);
+    char title[32];
+    snprintf(title, sizeof(title), "Page %d", i);
+    object_def(data.object_value, "title", copy_c_string(title, env->arena), env);
+    Env *template_env = create_template_env(data, env);
+    Value output = eval_template(module, template_env);
+    assert(output.type == V_STRING && !template_env->error);
+    output_size += output.string_value->size;
+    delete_template_env(template_env);
+  }
+  double time = (double) (clock() - start) / CLOCKS_PER_SEC * 1e3 / BENCH_PAGES;
+  printf("  %d pages, %d items each: %.2f ms per page, %zu bytes per page\n", BENCH_PAGES, BENCH_ITEMS, time,
+      output_size / BENCH_PAGES);
+  delete_arena(env->arena);
+  delete_module_map(modules);
+  delete_symbol_map(symbol_map);
+  delete_dir(src_root);
+  delete_path(page_path);
+  delete_path(templates_dir);
+  delete_path(src_root);
+}
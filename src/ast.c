@@ -58,6 +58,7 @@ void delete_node(Node node) {
     case N_FN:
       delete_name_list(node.fn_value.params);
       delete_name_list(node.fn_value.free_variables);
+      delete_name_list(node.fn_value.locals);
       DELETE_NODE(node.fn_value.body);
       break;
     case N_IF:
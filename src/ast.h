@@ -13,6 +13,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Slot of a name in a function body that isn't a local of the function. Other names that aren't resolved to a slot,
+ * e.g. at the top level of a module, have slot -1. */
+#define FREE_SLOT -2
+
 #define LL_SIZE(HEAD) ((HEAD) ? (HEAD)->size : 0)
 
 #define LL_APPEND(TYPE, HEAD, LAST, ELEM) \
@@ -107,6 +111,7 @@ struct Node {
   Pos start;
   Pos end;
   NodeType type;
+  int slot;
   union {
     Symbol name_value;
     int64_t int_value;
@@ -142,6 +147,7 @@ struct Node {
     struct {
       NameList *params;
       NameList *free_variables;
+      NameList *locals;
       Node *body;
     } fn_value;
     struct {
@@ -152,6 +158,8 @@ struct Node {
     struct {
       Symbol key;
       Symbol value;
+      int key_slot;
+      int value_slot;
       Node *collection;
       Node *body;
       Node *alt;
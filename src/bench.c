@@ -0,0 +1,484 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include "lipsum.h"
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_POSTS 500
+#define BENCH_STATIC_FILES 50
+#define BENCH_STATIC_FILE_SIZE 16384
+#define BENCH_CLIENTS 16
+#define BENCH_REQUESTS 20000
+#define BENCH_STARTUP_TIMEOUT 60
+
+typedef struct {
+  const char *name;
+  char **paths;
+  size_t path_count;
+  size_t requests;
+  size_t next;
+  size_t failed;
+  double *latencies;
+  int port;
+  pthread_mutex_t lock;
+} BenchPhase;
+
+typedef struct {
+  GlobalArgs args;
+  int stop_pipe[2];
+  int status;
+  int done;
+  pthread_mutex_t lock;
+} BenchServer;
+
+static const char *bench_layout =
+  "<!DOCTYPE html>\n"
+  "<html>\n"
+  "  <head>\n"
+  "    <meta charset=\"utf-8\"/>\n"
+  "    <title>{PAGE_TITLE? or 'Benchmark'}</title>\n"
+  "    <link rel=\"stylesheet\" href=\"{'static/style-0.css' | link}\"/>\n"
+  "  </head>\n"
+  "  <body>\n"
+  "    <header><h1><a href=\"{'/' | link}\">Benchmark</a></h1></header>\n"
+  "    <article>\n"
+  "      {CONTENT}\n"
+  "    </article>\n"
+  "  </body>\n"
+  "</html>\n";
+
+static const char *bench_list =
+  "{LAYOUT = 'layout.plet.html'}\n"
+  "<ul>\n"
+  "  {for post in posts}\n"
+  "  <li><a href=\"{post.link | link}\">{post.title | h}</a> &ndash; {post.published | date('%Y-%m-%d')}</li>\n"
+  "  {end for}\n"
+  "</ul>\n";
+
+static const char *bench_post =
+  "{LAYOUT = 'layout.plet.html'}\n"
+  "{PAGE_TITLE = post.title}\n"
+  "<p>Published {post.published | date('%Y-%m-%d')}</p>\n"
+  "{post.content}\n";
+
+static const char *bench_index =
+  "posts = list_content('content', {suffix: '.html'}) | sort_by_desc(.published)\n"
+  "for post in posts\n"
+  "  post.link = \"posts/{post.name}/index.html\"\n"
+  "  add_page(post.link, 'templates/post.plet.html', {post: post})\n"
+  "end for\n"
+  "add_page('index.html', 'templates/list.plet.html', {posts: posts})\n";
+
+static int write_text_file(const Path *path, const char *text) {
+  FILE *file = fopen(path->path, "w");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    return 0;
+  }
+  int status = fputs(text, file) >= 0;
+  if (fclose(file) != 0 || !status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", path->path, strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+static int write_site_file(const Path *root, const char *name, const char *text) {
+  Path *path = path_append(root, name);
+  int status = write_text_file(path, text);
+  delete_path(path);
+  return status;
+}
+
+static char *create_post(int i) {
+  Buffer buffer = create_buffer(0);
+  char *title = lipsum_words(rand() % 6 + 1);
+  title[0] = toupper(title[0]);
+  buffer_printf(&buffer, "{\n  title: '%s',\n  published: '%04d-%02d-%02d 12:00' | time,\n}\n\n", title,
+      2000 + i % 20, i % 12 + 1, i % 28 + 1);
+  buffer_printf(&buffer, "<h1>%s</h1>\n", title);
+  free(title);
+  int paragraphs = rand() % 6 + 3;
+  for (int j = 0; j < paragraphs; j++) {
+    char *paragraph = lipsum_paragraph(rand() % 6 + 1);
+    buffer_printf(&buffer, "<p>%s</p>\n", paragraph);
+    free(paragraph);
+  }
+  buffer_put(&buffer, '\0');
+  return (char *) buffer.data;
+}
+
+static char *create_static_file(void) {
+  Buffer buffer = create_buffer(BENCH_STATIC_FILE_SIZE + 256);
+  while (buffer.size < BENCH_STATIC_FILE_SIZE) {
+    char *word = lipsum_words(1);
+    buffer_printf(&buffer, ".%s-%d { margin: %dpx; padding: %dpx; }\n", word, rand() % 1000, rand() % 20,
+        rand() % 20);
+    free(word);
+  }
+  buffer_put(&buffer, '\0');
+  return (char *) buffer.data;
+}
+
+/* Generates a blog with BENCH_POSTS posts. The static files are written directly to dist, so they aren't part of the
+ * site map and are served from disk. */
+static int generate_site(const Path *root) {
+  srand(1);
+  Path *templates = path_append(root, "templates");
+  Path *content = path_append(root, "content");
+  Path *static_dir = path_append(root, "dist/static");
+  int status = mkdir_rec(templates->path) && mkdir_rec(content->path) && mkdir_rec(static_dir->path)
+    && write_site_file(root, "index.plet", bench_index)
+    && write_site_file(templates, "layout.plet.html", bench_layout)
+    && write_site_file(templates, "list.plet.html", bench_list)
+    && write_site_file(templates, "post.plet.html", bench_post);
+  char name[32];
+  for (int i = 0; status && i < BENCH_POSTS; i++) {
+    snprintf(name, sizeof(name), "post-%d.html", i);
+    char *post = create_post(i);
+    status = write_site_file(content, name, post);
+    free(post);
+  }
+  for (int i = 0; status && i < BENCH_STATIC_FILES; i++) {
+    snprintf(name, sizeof(name), "style-%d.css", i);
+    char *file = create_static_file();
+    status = write_site_file(static_dir, name, file);
+    free(file);
+  }
+  delete_path(static_dir);
+  delete_path(content);
+  delete_path(templates);
+  return status;
+}
+
+static void *server_thread(void *arg) {
+  BenchServer *server = arg;
+  int status = serve_until(server->args, server->stop_pipe[0]);
+  pthread_mutex_lock(&server->lock);
+  server->status = status;
+  server->done = 1;
+  pthread_mutex_unlock(&server->lock);
+  return NULL;
+}
+
+static int connect_to_server(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Waits until the server accepts connections. Returns 0 if the server stopped or didn't start in time. */
+static int wait_for_server(BenchServer *server, int port) {
+  for (int i = 0; i < BENCH_STARTUP_TIMEOUT * 10; i++) {
+    pthread_mutex_lock(&server->lock);
+    int done = server->done;
+    pthread_mutex_unlock(&server->lock);
+    if (done) {
+      return 0;
+    }
+    int fd = connect_to_server(port);
+    if (fd >= 0) {
+      close(fd);
+      return 1;
+    }
+    struct timespec delay = { 0, 100000000 };
+    nanosleep(&delay, NULL);
+  }
+  return 0;
+}
+
+static double get_time_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+static int send_all(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t n = send(fd, data, size, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    data += n;
+    size -= n;
+  }
+  return 1;
+}
+
+/* Reads a single response from a keep-alive connection. Returns the status code, or 0 if the connection failed. */
+static int read_response(int fd, Buffer *input) {
+  size_t head_size = 0;
+  long long content_length = -1;
+  int status_code = 0;
+  while (1) {
+    if (!head_size) {
+      uint8_t *end = memmem(input->data, input->size, "\r\n\r\n", 4);
+      if (end) {
+        head_size = end - input->data + 4;
+        // Terminate the buffer for the string functions below, this may move the data
+        buffer_put(input, '\0');
+        input->size--;
+        end = input->data + head_size - 4;
+        if (sscanf((char *) input->data, "HTTP/1.1 %d", &status_code) != 1) {
+          return 0;
+        }
+        char *line = strstr((char *) input->data, "\r\n");
+        while (line && line < (char *) end) {
+          line += 2;
+          if (strncasecmp(line, "Content-Length:", sizeof("Content-Length:") - 1) == 0) {
+            content_length = strtoll(line + sizeof("Content-Length:") - 1, NULL, 10);
+          }
+          line = strstr(line, "\r\n");
+        }
+        if (content_length < 0) {
+          return 0;
+        }
+      }
+    }
+    if (head_size && input->size >= head_size + content_length) {
+      size_t response_size = head_size + content_length;
+      memmove(input->data, input->data + response_size, input->size - response_size);
+      input->size -= response_size;
+      return status_code;
+    }
+    if (input->capacity - input->size < 8192) {
+      input->capacity = input->capacity * 2 + 8192;
+      input->data = reallocate(input->data, input->capacity);
+    }
+    ssize_t n = recv(fd, input->data + input->size, input->capacity - input->size, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return 0;
+    }
+    input->size += n;
+  }
+}
+
+/* A client sends requests one at a time over a single keep-alive connection, reconnecting if the connection fails. */
+static void *client_thread(void *arg) {
+  BenchPhase *phase = arg;
+  Buffer input = create_buffer(16384);
+  Buffer request = create_buffer(256);
+  int fd = -1;
+  while (1) {
+    pthread_mutex_lock(&phase->lock);
+    size_t i = phase->next++;
+    pthread_mutex_unlock(&phase->lock);
+    if (i >= phase->requests) {
+      break;
+    }
+    if (fd < 0) {
+      fd = connect_to_server(phase->port);
+      input.size = 0;
+    }
+    request.size = 0;
+    buffer_printf(&request, "GET %s HTTP/1.1\r\nHost: localhost:%d\r\n\r\n", phase->paths[i % phase->path_count],
+        phase->port);
+    double start = get_time_ms();
+    int status_code = 0;
+    if (fd >= 0 && send_all(fd, (char *) request.data, request.size)) {
+      status_code = read_response(fd, &input);
+    }
+    phase->latencies[i] = get_time_ms() - start;
+    if (status_code != 200) {
+      pthread_mutex_lock(&phase->lock);
+      phase->failed++;
+      pthread_mutex_unlock(&phase->lock);
+      if (!status_code && fd >= 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  delete_buffer(request);
+  delete_buffer(input);
+  return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  double latency_a = *(const double *) a;
+  double latency_b = *(const double *) b;
+  return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+static double get_percentile(const double *sorted, size_t count, double percentile) {
+  return sorted[(size_t) (percentile / 100.0 * (count - 1) + 0.5)];
+}
+
+static void run_phase(const char *name, char **paths, size_t path_count, size_t requests, int clients, int port) {
+  BenchPhase phase;
+  phase.name = name;
+  phase.paths = paths;
+  phase.path_count = path_count;
+  phase.requests = requests;
+  phase.next = 0;
+  phase.failed = 0;
+  phase.latencies = allocate(requests * sizeof(double));
+  phase.port = port;
+  pthread_mutex_init(&phase.lock, NULL);
+  pthread_t *threads = allocate(clients * sizeof(pthread_t));
+  int started = 0;
+  double start = get_time_ms();
+  while (started < clients) {
+    int error = pthread_create(&threads[started], NULL, client_thread, &phase);
+    if (error) {
+      fprintf(stderr, ERROR_LABEL "unable to create client thread: %s" SGR_RESET "\n", strerror(error));
+      break;
+    }
+    started++;
+  }
+  if (!started) {
+    client_thread(&phase);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = get_time_ms() - start;
+  free(threads);
+  pthread_mutex_destroy(&phase.lock);
+  qsort(phase.latencies, requests, sizeof(double), compare_latencies);
+  printf("%-14s %9zu %9zu %11.1f %9.3f %9.3f %9.3f\n", name, requests, phase.failed, requests / elapsed * 1000.0,
+      get_percentile(phase.latencies, requests, 50), get_percentile(phase.latencies, requests, 95),
+      get_percentile(phase.latencies, requests, 99));
+  fflush(stdout);
+  free(phase.latencies);
+}
+
+static int parse_count(const char *arg, size_t *count) {
+  char *end;
+  long long value = strtoll(arg, &end, 10);
+  if (*end || value < 1) {
+    fprintf(stderr, ERROR_LABEL "invalid number: %s" SGR_RESET "\n", arg);
+    return 0;
+  }
+  *count = value;
+  return 1;
+}
+
+static void run_benchmark(int clients, size_t requests, int port) {
+  char **post_paths = allocate(BENCH_POSTS * sizeof(char *));
+  char **static_paths = allocate(BENCH_STATIC_FILES * sizeof(char *));
+  char path[64];
+  for (int i = 0; i < BENCH_POSTS; i++) {
+    snprintf(path, sizeof(path), "/posts/post-%d/", i);
+    post_paths[i] = copy_string(path);
+  }
+  for (int i = 0; i < BENCH_STATIC_FILES; i++) {
+    snprintf(path, sizeof(path), "/static/style-%d.css", i);
+    static_paths[i] = copy_string(path);
+  }
+  printf("%-14s %9s %9s %11s %9s %9s %9s\n", "", "requests", "failed", "req/s", "p50 ms", "p95 ms", "p99 ms");
+  // Every post is requested once, so each request renders a page
+  run_phase("cold renders", post_paths, BENCH_POSTS, BENCH_POSTS, clients, port);
+  run_phase("cached pages", post_paths, BENCH_POSTS, requests, clients, port);
+  run_phase("static files", static_paths, BENCH_STATIC_FILES, requests, clients, port);
+  for (int i = 0; i < BENCH_POSTS; i++) {
+    free(post_paths[i]);
+  }
+  for (int i = 0; i < BENCH_STATIC_FILES; i++) {
+    free(static_paths[i]);
+  }
+  free(post_paths);
+  free(static_paths);
+}
+
+int bench_serve(GlobalArgs args) {
+  size_t clients = BENCH_CLIENTS;
+  size_t requests = BENCH_REQUESTS;
+  if ((args.argc >= 1 && !parse_count(args.argv[0], &clients))
+      || (args.argc >= 2 && !parse_count(args.argv[1], &requests))) {
+    printf("usage: %s bench-serve [<clients> [<requests>]]\n", args.program_name);
+    return 1;
+  }
+  if (clients > 1024) {
+    fprintf(stderr, ERROR_LABEL "too many clients: %zu" SGR_RESET "\n", clients);
+    return 1;
+  }
+  int port = atoi(args.port);
+  if (port <= 0 || port > 65535) {
+    fprintf(stderr, ERROR_LABEL "invalid port: %s" SGR_RESET "\n", args.port);
+    return 1;
+  }
+  char root_name[] = "/tmp/plet-bench-XXXXXX";
+  if (!mkdtemp(root_name)) {
+    fprintf(stderr, ERROR_LABEL "unable to create temporary directory: %s" SGR_RESET "\n", strerror(errno));
+    return 1;
+  }
+  Path *root = create_path(root_name, -1);
+  int status = 1;
+  if (generate_site(root) && chdir(root->path) == 0) {
+    BenchServer server;
+    server.args = args;
+    server.status = 0;
+    server.done = 0;
+    pthread_mutex_init(&server.lock, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    pthread_t thread;
+    if (pipe(server.stop_pipe) != 0) {
+      fprintf(stderr, ERROR_LABEL "unable to create pipe: %s" SGR_RESET "\n", strerror(errno));
+    } else {
+      int error = pthread_create(&thread, NULL, server_thread, &server);
+      if (error) {
+        fprintf(stderr, ERROR_LABEL "unable to create server thread: %s" SGR_RESET "\n", strerror(error));
+      } else {
+        if (wait_for_server(&server, port)) {
+          fprintf(stderr, INFO_LABEL "running benchmark with %zu clients and %d render workers" SGR_RESET "\n",
+              clients, args.jobs);
+          run_benchmark((int) clients, requests, port);
+          status = 0;
+        } else {
+          fprintf(stderr, ERROR_LABEL "server did not start" SGR_RESET "\n");
+        }
+        close(server.stop_pipe[1]);
+        server.stop_pipe[1] = -1;
+        pthread_join(thread, NULL);
+      }
+      close(server.stop_pipe[0]);
+      if (server.stop_pipe[1] >= 0) {
+        close(server.stop_pipe[1]);
+      }
+    }
+    pthread_mutex_destroy(&server.lock);
+  }
+  delete_dir(root);
+  delete_path(root);
+  return status;
+}
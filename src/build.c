@@ -8,41 +8,60 @@
 #include "build.h"
 
 #include "collections.h"
+#include "contentcache.h"
 #include "contentmap.h"
 #include "core.h"
 #include "datetime.h"
 #include "html.h"
 #include "images.h"
 #include "interpreter.h"
+#include "manifest.h"
 #include "markdown.h"
 #include "parser.h"
 #include "reader.h"
 #include "sitemap.h"
 #include "strings.h"
 #include "template.h"
+#include "virtualdist.h"
+#include "watcher.h"
 
 #include <errno.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+typedef struct OutputLock OutputLock;
+
+struct OutputLock {
+  OutputLock *next;
+  char *path;
+};
+
 typedef struct {
   Path *src_root;
   Path *dist_root;
   SymbolMap *symbol_map;
   ModuleMap *modules;
+  int jobs;
 } BuildInfo;
 
+/* Destination paths that are currently being written to, at most one per worker thread. */
+static OutputLock *output_locks = NULL;
+static pthread_mutex_t output_locks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_unlocked = PTHREAD_COND_INITIALIZER;
+
 static void import_build_info(BuildInfo *build_info, Env *env) {
   env_def("SRC_ROOT", path_to_string(build_info->src_root, env->arena), env);
   env_def("DIST_ROOT", path_to_string(build_info->dist_root, env->arena), env);
   env_export("SRC_ROOT", env);
   env_export("DIST_ROOT", env);
+  env_def("JOBS", create_int(build_info->jobs), env);
 }
 
-Module *get_template(const Path *name, Env *env) {
+static Module *get_template_unlocked(const Path *name, Env *env) {
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     if (m->type != M_USER) {
@@ -50,6 +69,7 @@ Module *get_template(const Path *name, Env *env) {
     }
     return m;
   }
+  FileStamp stamp = get_file_stamp(name->path);
   FILE *file = fopen(name->path, "r");
   if (!file) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", name->path, strerror(errno));
@@ -69,29 +89,28 @@ Module *get_template(const Path *name, Env *env) {
     delete_module(m);
     return NULL;
   }
+  m->stamp = stamp;
   add_module(m, env->modules);
   return m;
 }
 
+Module *get_template(const Path *name, Env *env) {
+  lock_module_map(env->modules);
+  Module *m = get_template_unlocked(name, env);
+  unlock_module_map(env->modules);
+  return m;
+}
+
 Env *create_template_env(Value data, Env *parent) {
   Arena *arena = create_arena();
   Env *env = create_env(arena, parent->modules, parent->symbol_map);
-  import_core(env);
-  import_strings(env);
-  import_collections(env);
-  import_datetime(env);
-  import_contentmap(env);
-  import_template(env);
-  import_html(env);
-  import_images(env);
-  import_markdown(env);
-  Env *export_env = create_env(env->arena, env->modules, env->symbol_map);
+  env->parent_env = get_prelude(PRELUDE_TEMPLATE, parent->modules, parent->symbol_map);
   if (data.type == V_OBJECT) {
     ObjectIterator it = iterate_object(data.object_value);
     Value entry_key, entry_value;
     while (object_iterator_next(&it, &entry_key, &entry_value)) {
       if (entry_key.type == V_SYMBOL) {
-        env_put(entry_key.symbol_value, copy_value(entry_value, export_env), env);
+        env_put(entry_key.symbol_value, entry_value, env);
       }
     }
   }
@@ -100,7 +119,7 @@ Env *create_template_env(Value data, Env *parent) {
       Symbol symbol = parent->exports->cells[i].symbol_value;
       Value value;
       if (env_get(symbol, &value, parent)) {
-        env_put(symbol, copy_value(value, export_env), env);
+        env_put(symbol, value, env);
       }
     }
   }
@@ -111,32 +130,60 @@ void delete_template_env(Env *env) {
   delete_arena(env->arena);
 }
 
-Value eval_template(Module *module, Env *env) {
+int eval_template_output(Module *module, Buffer *output, Value *value, Env *env) {
   if (module->type != M_USER) {
-    return nil_value;
+    *value = nil_value;
+    return 0;
   }
+  add_dependency(module->file_name, module->stamp, module->type);
   env_def("FILE", path_to_string(module->file_name, env->arena), env);
   Path *dir = path_get_parent(module->file_name);
   env_def("DIR", path_to_string(dir, env->arena), env);
-  Value content = interpret(*module->user_value.root, env).value;
+  size_t start = output->size;
+  int written = 1;
+  InterpreterResult result = interpret_output(module->user_value.code, output, env);
+  if (result.type == IR_RETURN) {
+    if (result.value.type == V_STRING) {
+      buffer_append_bytes(output, result.value.string_value->bytes, result.value.string_value->size);
+    } else {
+      *value = result.value;
+      written = 0;
+    }
+  }
   Value layout;
   if (env_get_symbol("LAYOUT", &layout, env) && layout.type == V_STRING) {
-    env_def("CONTENT", content, env);
-    env_def("LAYOUT", nil_value, env);
     Path *layout_name = string_to_path(layout.string_value);
     Path *layout_path = path_join(dir, layout_name, 0);
     Module *layout_module = get_template(layout_path, env);
     if (layout_module) {
-      content = eval_template(layout_module, env);
+      if (written) {
+        env_def("CONTENT", create_string(output->data + start, output->size - start, env->arena), env);
+        output->size = start;
+      } else {
+        env_def("CONTENT", *value, env);
+      }
+      env_def("LAYOUT", nil_value, env);
+      written = eval_template_output(layout_module, output, value, env);
     }
     delete_path(layout_path);
     delete_path(layout_name);
   }
   delete_path(dir);
+  return written;
+}
+
+Value eval_template(Module *module, Env *env) {
+  Buffer output = create_buffer(0);
+  Value content;
+  if (eval_template_output(module, &output, &content, env)) {
+    content = create_string(output.data, output.size, env->arena);
+  }
+  delete_buffer(output);
   return content;
 }
 
 static Env *eval_script(FILE *file, const Path *file_name, BuildInfo *build_info) {
+  FileStamp stamp = get_file_stamp(file_name->path);
   Reader *reader = open_reader(file, file_name, build_info->symbol_map);
   TokenStream tokens = read_all(reader, 0);
   if (reader_errors(reader)) {
@@ -149,14 +196,16 @@ static Env *eval_script(FILE *file, const Path *file_name, BuildInfo *build_info
     delete_module(module);
     return NULL;
   }
+  module->stamp = stamp;
   add_module(module, build_info->modules);
+  add_dependency(module->file_name, module->stamp, module->type);
 
   Env *env = create_user_env(module, build_info->modules, build_info->symbol_map);
   import_sitemap(env);
   import_contentmap(env);
   import_markdown(env);
   import_build_info(build_info, env);
-  interpret(*module->user_value.root, env);
+  interpret(module->user_value.code, env);
   return env;
 }
 
@@ -261,19 +310,69 @@ Path *get_dist_root(Env *env) {
 }
 
 int asset_has_changed(const Path *src, const Path *dest) {
-  return !file_exists(dest->path) || get_mtime(src->path) != get_mtime(dest->path);
+  FileStamp stamp = get_file_stamp(src->path);
+  add_dependency(src, stamp, M_ASSET);
+  return !file_exists(dest->path) || !file_stamp_equals(stamp, get_file_stamp(dest->path));
 }
 
-int copy_asset(const Path *src, const Path *dest) {
-  int result = 0;
-  if (!asset_has_changed(src, dest)) {
-    return 1;
+/* Like asset_has_changed() but for files generated from the source, e.g. resized images. Their size differs from that
+ * of the source, so only the modification times are compared. */
+int derived_asset_has_changed(const Path *src, const Path *dest) {
+  FileStamp stamp = get_file_stamp(src->path);
+  add_dependency(src, stamp, M_ASSET);
+  FileStamp dest_stamp = get_file_stamp(dest->path);
+  return dest_stamp.size < 0 || stamp.mtime != dest_stamp.mtime || stamp.mtime_nsec != dest_stamp.mtime_nsec;
+}
+
+/* Waits until no other thread is writing to `dest` and then claims it. Pages compiled in parallel may copy or resize
+ * the same asset, so checking whether the output is up to date and writing it must happen while holding the lock. */
+void lock_output_path(const Path *dest) {
+  pthread_mutex_lock(&output_locks_lock);
+  int locked;
+  do {
+    locked = 0;
+    for (OutputLock *lock = output_locks; lock; lock = lock->next) {
+      if (strcmp(lock->path, dest->path) == 0) {
+        locked = 1;
+        pthread_cond_wait(&output_unlocked, &output_locks_lock);
+        break;
+      }
+    }
+  } while (locked);
+  OutputLock *lock = allocate(sizeof(OutputLock));
+  lock->path = copy_string(dest->path);
+  lock->next = output_locks;
+  output_locks = lock;
+  pthread_mutex_unlock(&output_locks_lock);
+}
+
+void unlock_output_path(const Path *dest) {
+  pthread_mutex_lock(&output_locks_lock);
+  for (OutputLock **lock = &output_locks; *lock; lock = &(*lock)->next) {
+    if (strcmp((*lock)->path, dest->path) == 0) {
+      OutputLock *unlocked = *lock;
+      *lock = unlocked->next;
+      free(unlocked->path);
+      free(unlocked);
+      break;
+    }
   }
-  Path *dest_dir = path_get_parent(dest);
-  if (mkdir_rec(dest_dir->path)) {
-    result = copy_file(src->path, dest->path);
+  pthread_cond_broadcast(&output_unlocked);
+  pthread_mutex_unlock(&output_locks_lock);
+}
+
+int copy_asset(const Path *src, const Path *dest) {
+  int result = 1;
+  lock_output_path(dest);
+  if (asset_has_changed(src, dest)) {
+    result = 0;
+    Path *dest_dir = path_get_parent(dest);
+    if (mkdir_rec(dest_dir->path)) {
+      result = copy_file(src->path, dest->path);
+    }
+    delete_path(dest_dir);
   }
-  delete_path(dest_dir);
+  unlock_output_path(dest);
   return result;
 }
 
@@ -307,7 +406,7 @@ Path *find_project_root(void) {
   return NULL;
 }
 
-Env *eval_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map) {
+Env *eval_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map, int jobs) {
   Env *env = NULL;
   Path *index_path = path_append(src_root, "index.plet");
   FILE *index = fopen(index_path->path, "r");
@@ -316,9 +415,10 @@ Env *eval_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map) {
     BuildInfo build_info;
     build_info.src_root = src_root;
     build_info.dist_root = path_append(src_root, "dist");
-    if (mkdir_rec(build_info.dist_root->path)) {
+    if (virtual_dist_is_used() || mkdir_rec(build_info.dist_root->path)) {
       build_info.symbol_map = symbol_map;
       build_info.modules = modules;
+      build_info.jobs = jobs;
       env = eval_script(index, index_path, &build_info);
     }
     delete_path(build_info.dist_root);
@@ -330,17 +430,30 @@ Env *eval_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map) {
   return env;
 }
 
+static void build_site(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map, GlobalArgs args) {
+  ContentCache *content_cache = load_content_cache(src_root);
+  ContentCache *previous_cache = use_content_cache(content_cache);
+  DependencySet *index_dependencies = create_dependency_set();
+  DependencySet *previous = record_dependencies(index_dependencies);
+  Env *env = eval_index(src_root, modules, symbol_map, args.jobs);
+  record_dependencies(previous);
+  if (env) {
+    compile_pages(env, index_dependencies, args.jobs, args.compress);
+    delete_arena(env->arena);
+    save_content_cache(content_cache, src_root);
+  }
+  delete_dependency_set(index_dependencies);
+  use_content_cache(previous_cache);
+  delete_content_cache(content_cache);
+}
+
 int build(GlobalArgs args) {
   Path *src_root = find_project_root();
   if (src_root) {
     ModuleMap *modules = create_module_map();
     SymbolMap *symbol_map = create_symbol_map();
     add_system_modules(modules);
-    Env *env = eval_index(src_root, modules, symbol_map);
-    if (env) {
-      compile_pages(env);
-      delete_arena(env->arena);
-    }
+    build_site(src_root, modules, symbol_map, args);
     delete_module_map(modules);
     delete_symbol_map(symbol_map);
     delete_path(src_root);
@@ -356,25 +469,20 @@ int watch(GlobalArgs args) {
     ModuleMap *modules = create_module_map();
     SymbolMap *symbol_map = create_symbol_map();
     add_system_modules(modules);
-    Env *env = eval_index(src_root, modules, symbol_map);
-    if (env) {
-      compile_pages(env);
-      delete_arena(env->arena);
-    }
+    Watcher *watcher = create_watcher(src_root, modules);
     while (1) {
-      struct timespec delay;
-      delay.tv_sec = 0;
-      delay.tv_nsec = 100000000L;
-      nanosleep(&delay, NULL);
-      if (detect_changes(modules)) {
-        fprintf(stderr, INFO_LABEL "changes detected" SGR_RESET "\n");
-        env = eval_index(src_root, modules, symbol_map);
-        if (env) {
-          compile_pages(env);
-          delete_arena(env->arena);
-        }
+      build_site(src_root, modules, symbol_map, args);
+      // Templates and assets used only by pages that were up to date are not in the module map
+      clear_watched_files(watcher);
+      Manifest *manifest = load_manifest(src_root);
+      if (manifest) {
+        watch_manifest_files(manifest, watcher);
+        delete_manifest(manifest);
       }
+      wait_for_changes(watcher, -1);
+      fprintf(stderr, INFO_LABEL "changes detected" SGR_RESET "\n");
     }
+    delete_watcher(watcher);
     delete_module_map(modules);
     delete_symbol_map(symbol_map);
     delete_path(src_root);
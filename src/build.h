@@ -9,6 +9,8 @@
 
 #include "value.h"
 
+#define PLET_VERSION "0.1.0"
+
 typedef struct {
   char *program_name;
   char *command_name;
@@ -16,15 +18,19 @@ typedef struct {
   char **argv;
   int parse_as_template;
   char *port;
+  int jobs;
+  int compress;
+  int in_memory;
 } GlobalArgs;
 
 Module *get_template(const Path *name, Env *env);
 Env *create_template_env(Value data, Env *parent);
 void delete_template_env(Env *env);
+int eval_template_output(Module *module, Buffer *output, Value *value, Env *env);
 Value eval_template(Module *module, Env *env);
 
 Path *find_project_root(void);
-Env *eval_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map);
+Env *eval_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map, int jobs);
 int build(GlobalArgs args);
 int watch(GlobalArgs args);
 
@@ -37,6 +43,9 @@ Path *get_src_root(Env *env);
 Path *get_dist_root(Env *env);
 
 int asset_has_changed(const Path *src, const Path *dest);
+int derived_asset_has_changed(const Path *src, const Path *dest);
+void lock_output_path(const Path *dest);
+void unlock_output_path(const Path *dest);
 int copy_asset(const Path *src, const Path *dest);
 
 #endif
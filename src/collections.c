@@ -627,6 +627,10 @@ static Value pop(const Tuple *args, Env *env) {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
   }
+  if (!is_writable(src, env)) {
+    env_error(env, 0, "%s: array is read-only", __func__);
+    return nil_value;
+  }
   Value element;
   if (array_pop(src.array_value, &element)) {
     return element;
@@ -641,6 +645,10 @@ static Value push(const Tuple *args, Env *env) {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
   }
+  if (!is_writable(src, env)) {
+    env_error(env, 0, "%s: array is read-only", __func__);
+    return nil_value;
+  }
   array_push(src.array_value, args->values[1], env->arena);
   return src;
 }
@@ -652,6 +660,10 @@ static Value push_all(const Tuple *args, Env *env) {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
   }
+  if (!is_writable(src, env)) {
+    env_error(env, 0, "%s: array is read-only", __func__);
+    return nil_value;
+  }
   Value elements = args->values[1];
   if (src.type != V_ARRAY) {
     arg_type_error(1, V_ARRAY, args, env);
@@ -670,6 +682,10 @@ static Value shift(const Tuple *args, Env *env) {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
   }
+  if (!is_writable(src, env)) {
+    env_error(env, 0, "%s: array is read-only", __func__);
+    return nil_value;
+  }
   Value element;
   if (array_shift(src.array_value, &element)) {
     return element;
@@ -684,6 +700,10 @@ static Value unshift(const Tuple *args, Env *env) {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
   }
+  if (!is_writable(src, env)) {
+    env_error(env, 0, "%s: array is read-only", __func__);
+    return nil_value;
+  }
   array_unshift(src.array_value, args->values[1], env->arena);
   return src;
 }
@@ -716,6 +736,10 @@ static Value delete(const Tuple *args, Env *env) {
     arg_type_error(0, V_OBJECT, args, env);
     return nil_value;
   }
+  if (!is_writable(src, env)) {
+    env_error(env, 0, "%s: object is read-only", __func__);
+    return nil_value;
+  }
   if (object_remove(src.object_value, args->values[1], NULL)) {
     return true_value;
   }
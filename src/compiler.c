@@ -0,0 +1,530 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "compiler.h"
+
+#include <stdlib.h>
+
+#define INITIAL_CODE_CAPACITY 32
+
+typedef struct JumpList JumpList;
+typedef struct Scope Scope;
+
+struct JumpList {
+  JumpList *next;
+  size_t instruction;
+};
+
+/* A for-loop or a block whose output is captured. Breaking out of a scope requires popping the values it has pushed,
+ * which are the values below `height`. */
+struct Scope {
+  Scope *next;
+  int loop;
+  int height;
+  size_t next_iteration;
+  JumpList *exits;
+};
+
+typedef struct {
+  Code *code;
+  int height;
+  Scope *scopes;
+} Compiler;
+
+static void compile_value(const Node *node, Compiler *compiler);
+static void compile_output(const Node *node, Compiler *compiler);
+
+static Code *create_code(int output) {
+  Code *code = allocate(sizeof(Code));
+  code->capacity = INITIAL_CODE_CAPACITY;
+  code->instructions = allocate(code->capacity * sizeof(Instruction));
+  code->size = 0;
+  code->functions = NULL;
+  code->functions_size = 0;
+  code->functions_capacity = 0;
+  code->stack_size = 0;
+  code->output = output;
+  code->buffered = 0;
+  return code;
+}
+
+void delete_code(Code *code) {
+  for (size_t i = 0; i < code->functions_size; i++) {
+    delete_code(code->functions[i]);
+  }
+  if (code->functions) {
+    free(code->functions);
+  }
+  free(code->instructions);
+  free(code);
+}
+
+/* Appends an instruction that changes the height of the stack by `effect` and returns its index. */
+static size_t emit(OpCode op, int arg, const Node *node, int effect, Compiler *compiler) {
+  Code *code = compiler->code;
+  if (code->size >= code->capacity) {
+    code->capacity <<= 1;
+    code->instructions = reallocate(code->instructions, code->capacity * sizeof(Instruction));
+  }
+  code->instructions[code->size] = (Instruction) { .op = op, .arg = arg, .node = node };
+  compiler->height += effect;
+  if (compiler->height > code->stack_size) {
+    code->stack_size = compiler->height;
+  }
+  return code->size++;
+}
+
+/* Sets the target of a jump instruction to the next instruction. */
+static void patch_jump(size_t instruction, Compiler *compiler) {
+  compiler->code->instructions[instruction].arg = compiler->code->size;
+}
+
+static int add_function(Code *function, Code *code) {
+  if (code->functions_size >= code->functions_capacity) {
+    code->functions_capacity = code->functions_capacity ? code->functions_capacity << 1 : 4;
+    code->functions = reallocate(code->functions, code->functions_capacity * sizeof(Code *));
+  }
+  code->functions[code->functions_size] = function;
+  return code->functions_size++;
+}
+
+static void enter_scope(Scope *scope, int loop, Compiler *compiler) {
+  scope->next = compiler->scopes;
+  scope->loop = loop;
+  scope->height = compiler->height;
+  scope->next_iteration = 0;
+  scope->exits = NULL;
+  compiler->scopes = scope;
+}
+
+static void exit_scope(Scope *scope, Compiler *compiler) {
+  compiler->scopes = scope->next;
+  while (scope->exits) {
+    JumpList *exit = scope->exits;
+    patch_jump(exit->instruction, compiler);
+    scope->exits = exit->next;
+    free(exit);
+  }
+}
+
+/* Pops the values of a block of code that has ended by jumping elsewhere. */
+static void emit_pop(int count, Compiler *compiler) {
+  if (count > 0) {
+    emit(OP_POP, count, NULL, 0, compiler);
+  }
+}
+
+static void compile_jump(const Node *node, Compiler *compiler) {
+  int loops = 0;
+  for (Scope *scope = compiler->scopes; scope; scope = scope->next) {
+    loops += scope->loop;
+  }
+  if (!loops) {
+    emit(OP_CONTROL_ERROR, 0, node, 0, compiler);
+    return;
+  }
+  int64_t level = node->type == N_BREAK ? node->break_value : node->continue_value;
+  if (level < 1 || level > loops) {
+    emit(OP_CONTROL_ERROR, loops, node, 0, compiler);
+    level = level < 1 ? 1 : loops;
+  }
+  int height = compiler->height;
+  for (Scope *scope = compiler->scopes; scope; scope = scope->next) {
+    if (!scope->loop) {
+      emit_pop(height - scope->height, compiler);
+      emit(OP_DISCARD, 0, NULL, 0, compiler);
+      height = scope->height - 1;
+    } else if (--level == 0) {
+      emit_pop(height - scope->height, compiler);
+      if (node->type == N_BREAK) {
+        JumpList *exit = allocate(sizeof(JumpList));
+        exit->instruction = emit(OP_JUMP, 0, NULL, 0, compiler);
+        exit->next = scope->exits;
+        scope->exits = exit;
+      } else {
+        emit(OP_JUMP, scope->next_iteration, NULL, 0, compiler);
+      }
+      break;
+    }
+  }
+}
+
+static void compile_function(const Node *node, Compiler *compiler) {
+  Code *function = create_code(0);
+  Compiler function_compiler = { .code = function, .height = 0, .scopes = NULL };
+  compile_value(node->fn_value.body, &function_compiler);
+  emit(OP_EXIT, 0, NULL, -1, &function_compiler);
+  emit(OP_CLOSURE, add_function(function, compiler->code), node, 1, compiler);
+}
+
+static void compile_if(const Node *node, int output, Compiler *compiler) {
+  compile_value(node->if_value.cond, compiler);
+  size_t alt = emit(OP_JUMP_IF_FALSE, 0, NULL, -1, compiler);
+  if (output) {
+    compile_output(node->if_value.cons, compiler);
+  } else {
+    compile_value(node->if_value.cons, compiler);
+    compiler->height--;
+  }
+  size_t end = emit(OP_JUMP, 0, NULL, 0, compiler);
+  patch_jump(alt, compiler);
+  if (output) {
+    if (node->if_value.alt) {
+      compile_output(node->if_value.alt, compiler);
+    }
+  } else if (node->if_value.alt) {
+    compile_value(node->if_value.alt, compiler);
+  } else {
+    emit(OP_NIL, 0, NULL, 1, compiler);
+  }
+  patch_jump(end, compiler);
+}
+
+static void compile_for(const Node *node, int output, Compiler *compiler) {
+  Scope output_scope;
+  if (!output) {
+    emit(OP_BEGIN, 0, NULL, 1, compiler);
+    compiler->code->buffered = 1;
+    enter_scope(&output_scope, 0, compiler);
+  }
+  compile_value(node->for_value.collection, compiler);
+  size_t alt = emit(OP_ITERATE, 0, node, 1, compiler);
+  Scope scope;
+  enter_scope(&scope, 1, compiler);
+  scope.next_iteration = emit(OP_NEXT, 0, node, 0, compiler);
+  compile_output(node->for_value.body, compiler);
+  emit(OP_JUMP, scope.next_iteration, NULL, 0, compiler);
+  patch_jump(scope.next_iteration, compiler);
+  exit_scope(&scope, compiler);
+  emit(OP_POP, 2, NULL, -2, compiler);
+  if (output) {
+    size_t end = emit(OP_JUMP, 0, NULL, 0, compiler);
+    patch_jump(alt, compiler);
+    if (node->for_value.alt) {
+      compile_output(node->for_value.alt, compiler);
+    }
+    patch_jump(end, compiler);
+  } else {
+    exit_scope(&output_scope, compiler);
+    emit(OP_END, 0, NULL, 0, compiler);
+    size_t end = emit(OP_JUMP, 0, NULL, 0, compiler);
+    patch_jump(alt, compiler);
+    // The value of a skipped loop is the value of the else-branch instead of the output
+    emit(OP_DISCARD, 0, NULL, -1, compiler);
+    if (node->for_value.alt) {
+      compile_value(node->for_value.alt, compiler);
+    } else {
+      emit(OP_NIL, 0, NULL, 1, compiler);
+    }
+    patch_jump(end, compiler);
+  }
+}
+
+static void compile_switch(const Node *node, int output, Compiler *compiler) {
+  compile_value(node->switch_value.expr, compiler);
+  // The sizes of the case lists aren't set by the parser
+  size_t cases_size = 0;
+  for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+    cases_size++;
+  }
+  size_t *cases = allocate((cases_size + 1) * sizeof(size_t));
+  size_t i = 0;
+  for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+    compile_value(&c->key, compiler);
+    cases[i++] = emit(OP_CASE, 0, NULL, -1, compiler);
+  }
+  emit(OP_POP, 1, NULL, -1, compiler);
+  if (output) {
+    if (node->switch_value.default_case) {
+      compile_output(node->switch_value.default_case, compiler);
+    }
+  } else if (node->switch_value.default_case) {
+    compile_value(node->switch_value.default_case, compiler);
+  } else {
+    emit(OP_NIL, 0, NULL, 1, compiler);
+  }
+  JumpList *ends = NULL;
+  i = 0;
+  for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+    JumpList *end = allocate(sizeof(JumpList));
+    end->instruction = emit(OP_JUMP, 0, NULL, 0, compiler);
+    end->next = ends;
+    ends = end;
+    patch_jump(cases[i++], compiler);
+    if (output) {
+      compile_output(&c->value, compiler);
+    } else {
+      compiler->height--;
+      compile_value(&c->value, compiler);
+    }
+  }
+  while (ends) {
+    JumpList *end = ends;
+    patch_jump(end->instruction, compiler);
+    ends = end->next;
+    free(end);
+  }
+  free(cases);
+}
+
+static void compile_assign(const Node *node, Compiler *compiler) {
+  compile_value(node->assign_value.right, compiler);
+  switch (node->assign_value.left->type) {
+    case N_SUBSCRIPT:
+      compile_value(node->assign_value.left->subscript_value.list, compiler);
+      compile_value(node->assign_value.left->subscript_value.index, compiler);
+      emit(OP_ASSIGN, 3, node, -3, compiler);
+      break;
+    case N_DOT:
+      compile_value(node->assign_value.left->dot_value.object, compiler);
+      emit(OP_ASSIGN, 2, node, -2, compiler);
+      break;
+    default:
+      emit(OP_ASSIGN, 1, node, -1, compiler);
+      break;
+  }
+}
+
+static void compile_block(const Node *node, Compiler *compiler) {
+  emit(OP_BEGIN, 0, NULL, 1, compiler);
+  compiler->code->buffered = 1;
+  Scope scope;
+  enter_scope(&scope, 0, compiler);
+  compile_output(node, compiler);
+  exit_scope(&scope, compiler);
+  emit(OP_END, 0, NULL, 0, compiler);
+}
+
+static void compile_infix(const Node *node, Compiler *compiler) {
+  compile_value(node->infix_value.left, compiler);
+  if (node->infix_value.operator == I_AND || node->infix_value.operator == I_OR) {
+    size_t end = emit(node->infix_value.operator == I_AND ? OP_AND : OP_OR, 0, NULL, -1, compiler);
+    compile_value(node->infix_value.right, compiler);
+    patch_jump(end, compiler);
+    return;
+  }
+  compile_value(node->infix_value.right, compiler);
+  switch (node->infix_value.operator) {
+    case I_NONE:
+      emit(OP_POP, 2, NULL, -2, compiler);
+      emit(OP_NIL, 0, NULL, 1, compiler);
+      break;
+    case I_ADD:
+      emit(OP_ADD, 0, node, -1, compiler);
+      break;
+    case I_SUB:
+      emit(OP_SUB, 0, node, -1, compiler);
+      break;
+    case I_MUL:
+      emit(OP_MUL, 0, node, -1, compiler);
+      break;
+    case I_DIV:
+      emit(OP_DIV, 0, node, -1, compiler);
+      break;
+    case I_MOD:
+      emit(OP_MOD, 0, node, -1, compiler);
+      break;
+    case I_LT:
+      emit(OP_LT, 0, node, -1, compiler);
+      break;
+    case I_LEQ:
+      emit(OP_LEQ, 0, node, -1, compiler);
+      break;
+    case I_GT:
+      emit(OP_GT, 0, node, -1, compiler);
+      break;
+    case I_GEQ:
+      emit(OP_GEQ, 0, node, -1, compiler);
+      break;
+    case I_EQ:
+      emit(OP_EQ, 0, node, -1, compiler);
+      break;
+    case I_NEQ:
+      emit(OP_NEQ, 0, node, -1, compiler);
+      break;
+    case I_AND:
+    case I_OR:
+      break;
+  }
+}
+
+static void compile_value(const Node *node, Compiler *compiler) {
+  switch (node->type) {
+    case N_NAME:
+      emit(OP_LOAD, 0, node, 1, compiler);
+      break;
+    case N_INT:
+      emit(OP_INT, 0, node, 1, compiler);
+      break;
+    case N_FLOAT:
+      emit(OP_FLOAT, 0, node, 1, compiler);
+      break;
+    case N_STRING:
+      emit(OP_STRING, 0, node, 1, compiler);
+      break;
+    case N_LIST: {
+      int size = 0;
+      for (NodeList *items = node->list_value; items; items = items->tail) {
+        compile_value(&items->head, compiler);
+        size++;
+      }
+      emit(OP_LIST, size, NULL, 1 - size, compiler);
+      break;
+    }
+    case N_OBJECT: {
+      int size = 0;
+      for (PropertyList *properties = node->object_value; properties; properties = properties->tail) {
+        if (properties->key.type == N_NAME) {
+          emit(OP_SYMBOL, 0, &properties->key, 1, compiler);
+        } else {
+          compile_value(&properties->key, compiler);
+        }
+        compile_value(&properties->value, compiler);
+        size++;
+      }
+      emit(OP_OBJECT, size, NULL, 1 - 2 * size, compiler);
+      break;
+    }
+    case N_APPLY: {
+      int size = 0;
+      for (NodeList *args = node->apply_value.args; args; args = args->tail) {
+        compile_value(&args->head, compiler);
+        size++;
+      }
+      if (node->apply_value.callee->type == N_NAME) {
+        emit(OP_CALL_NAME, size, node, 1 - size, compiler);
+      } else {
+        compile_value(node->apply_value.callee, compiler);
+        emit(OP_CALL, size, node, -size, compiler);
+      }
+      break;
+    }
+    case N_SUBSCRIPT:
+      compile_value(node->subscript_value.list, compiler);
+      compile_value(node->subscript_value.index, compiler);
+      emit(OP_SUBSCRIPT, 0, node, -1, compiler);
+      break;
+    case N_DOT:
+      compile_value(node->dot_value.object, compiler);
+      emit(OP_DOT, 0, node, 0, compiler);
+      break;
+    case N_PREFIX:
+      compile_value(node->prefix_value.operand, compiler);
+      emit(node->prefix_value.operator == P_NOT ? OP_NOT : OP_NEG, 0, node, 0, compiler);
+      break;
+    case N_INFIX:
+      compile_infix(node, compiler);
+      break;
+    case N_TUPLE:
+      emit(OP_TUPLE, 0, node, 1, compiler);
+      break;
+    case N_FN:
+      compile_function(node, compiler);
+      break;
+    case N_IF:
+      compile_if(node, 0, compiler);
+      break;
+    case N_FOR:
+      compile_for(node, 0, compiler);
+      break;
+    case N_SWITCH:
+      compile_switch(node, 0, compiler);
+      break;
+    case N_BLOCK:
+      compile_block(node, compiler);
+      break;
+    case N_SUPPRESS:
+      switch (node->suppress_value->type) {
+        case N_NAME:
+          emit(OP_LOAD, 1, node->suppress_value, 1, compiler);
+          break;
+        case N_SUBSCRIPT:
+          compile_value(node->suppress_value->subscript_value.list, compiler);
+          compile_value(node->suppress_value->subscript_value.index, compiler);
+          emit(OP_SUBSCRIPT, 1, node->suppress_value, -1, compiler);
+          break;
+        case N_DOT:
+          compile_value(node->suppress_value->dot_value.object, compiler);
+          emit(OP_DOT, 1, node->suppress_value, 0, compiler);
+          break;
+        default:
+          compile_value(node->suppress_value, compiler);
+          break;
+      }
+      break;
+    case N_EXPORT:
+    case N_ASSIGN:
+    case N_RETURN:
+    case N_BREAK:
+    case N_CONTINUE:
+      // Statements that don't produce a value
+      compile_output(node, compiler);
+      emit(OP_NIL, 0, NULL, 1, compiler);
+      break;
+  }
+}
+
+static void compile_output(const Node *node, Compiler *compiler) {
+  switch (node->type) {
+    case N_STRING:
+      emit(OP_WRITE_STRING, 0, node, 0, compiler);
+      break;
+    case N_IF:
+      compile_if(node, 1, compiler);
+      break;
+    case N_FOR:
+      compile_for(node, 1, compiler);
+      break;
+    case N_SWITCH:
+      compile_switch(node, 1, compiler);
+      break;
+    case N_BLOCK:
+      for (NodeList *statements = node->block_value; statements; statements = statements->tail) {
+        compile_output(&statements->head, compiler);
+      }
+      break;
+    case N_EXPORT:
+      if (node->export_value.right) {
+        compile_value(node->export_value.right, compiler);
+        emit(OP_EXPORT, 1, node, -1, compiler);
+      } else {
+        emit(OP_EXPORT, 0, node, 0, compiler);
+      }
+      break;
+    case N_ASSIGN:
+      compile_assign(node, compiler);
+      break;
+    case N_RETURN:
+      if (node->return_value) {
+        compile_value(node->return_value, compiler);
+      } else {
+        emit(OP_NIL, 0, NULL, 1, compiler);
+      }
+      emit(OP_RETURN, 0, NULL, -1, compiler);
+      break;
+    case N_BREAK:
+    case N_CONTINUE:
+      compile_jump(node, compiler);
+      break;
+    default:
+      compile_value(node, compiler);
+      emit(OP_WRITE, 0, NULL, -1, compiler);
+      break;
+  }
+}
+
+Code *compile(const Node *node, int output) {
+  Code *code = create_code(output);
+  Compiler compiler = { .code = code, .height = 0, .scopes = NULL };
+  if (output) {
+    compile_output(node, &compiler);
+    emit(OP_EXIT, 0, NULL, 0, &compiler);
+  } else {
+    compile_value(node, &compiler);
+    emit(OP_EXIT, 0, NULL, -1, &compiler);
+  }
+  return code;
+}
@@ -0,0 +1,116 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include "ast.h"
+#include "value.h"
+
+#include <stddef.h>
+
+/* Instructions of the stack machine executed by the interpreter. Operands are taken from the top of the stack in the
+ * order they were pushed. `node` is the syntax tree node that the instruction was compiled from, which is used for
+ * literals, names and error messages. Jump targets are instruction indices stored in `arg`. */
+typedef enum {
+  OP_NIL,
+  OP_INT,
+  OP_FLOAT,
+  OP_STRING,
+  OP_SYMBOL,
+  /* Pushes the value of the variable `node`, `arg` is 1 if undefined variable errors should be suppressed. */
+  OP_LOAD,
+  /* Pops `arg` values and pushes an array containing them. */
+  OP_LIST,
+  /* Pops `arg` key-value pairs and pushes an object containing them. */
+  OP_OBJECT,
+  /* Pops `arg` arguments and a callee, and pushes the return value. */
+  OP_CALL,
+  /* Pops `arg` arguments and pushes the return value of the function named by the callee of `node`. */
+  OP_CALL_NAME,
+  /* Pops an object and an index. `arg` is 1 if undefined property errors should be suppressed. */
+  OP_SUBSCRIPT,
+  /* Pops an object. `arg` is 1 if undefined property errors should be suppressed. */
+  OP_DOT,
+  OP_NOT,
+  OP_NEG,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_LT,
+  OP_LEQ,
+  OP_GT,
+  OP_GEQ,
+  OP_EQ,
+  OP_NEQ,
+  /* Replaces the top of the stack with nil and jumps if it is falsy, otherwise pops it. */
+  OP_AND,
+  /* Jumps if the top of the stack is truthy, otherwise pops it. */
+  OP_OR,
+  OP_TUPLE,
+  /* Pushes a closure of the function at index `arg` in the list of functions of the code. */
+  OP_CLOSURE,
+  OP_JUMP,
+  /* Pops a value and jumps if it is falsy. */
+  OP_JUMP_IF_FALSE,
+  /* Pops a collection and jumps if it is empty or not iterable, otherwise pushes the collection and an index. */
+  OP_ITERATE,
+  /* Assigns the next element of the collection below the top of the stack to the loop variables of the for-loop
+   * `node`, or jumps if there are no more elements. */
+  OP_NEXT,
+  /* Pops a value and compares it to the value below it. If they are equal, that value is also popped and the
+   * instruction jumps. */
+  OP_CASE,
+  /* Exports the name of `node`. `arg` is 1 if a value should be popped and assigned to it first. */
+  OP_EXPORT,
+  /* Pops `arg` values: the right side of the assignment `node` followed by the object and index of the left side if
+   * any. */
+  OP_ASSIGN,
+  /* Starts capturing output, pushing the position in the output buffer. */
+  OP_BEGIN,
+  /* Pops the position pushed by OP_BEGIN and replaces the output written since then with a string. */
+  OP_END,
+  /* Pops the position pushed by OP_BEGIN and discards the output written since then. */
+  OP_DISCARD,
+  /* Pops a value and writes it to the output buffer. */
+  OP_WRITE,
+  OP_WRITE_STRING,
+  /* Pops `arg` values. */
+  OP_POP,
+  OP_RETURN,
+  /* Reports an invalid break or continue, `arg` is the number of enclosing loops. */
+  OP_CONTROL_ERROR,
+  /* Ends the execution, popping the result if the code doesn't write to an output buffer. */
+  OP_EXIT
+} OpCode;
+
+typedef struct {
+  OpCode op;
+  int arg;
+  const Node *node;
+} Instruction;
+
+struct Code {
+  Instruction *instructions;
+  size_t size;
+  size_t capacity;
+  Code **functions;
+  size_t functions_size;
+  size_t functions_capacity;
+  int stack_size;
+  int output;
+  int buffered;
+};
+
+/* Compiles a syntax tree. If `output` is set, values of statements are written to an output buffer, otherwise the code
+ * produces the value of the node. The code refers to the nodes of the tree, so it must not outlive it. */
+Code *compile(const Node *node, int output);
+
+void delete_code(Code *code);
+
+#endif
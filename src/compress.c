@@ -0,0 +1,248 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "compress.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+
+const char *compressible_extensions[] = {"html", "htm", "css", "js", "mjs", "json", "xml", "rss", "atom", "svg",
+  "txt"};
+
+int encoding_is_available(ContentEncoding encoding) {
+  switch (encoding) {
+    case ENC_IDENTITY:
+      return 1;
+    case ENC_GZIP:
+#ifdef WITH_ZLIB
+      return 1;
+#else
+      return 0;
+#endif
+    case ENC_BROTLI:
+#ifdef WITH_BROTLI
+      return 1;
+#else
+      return 0;
+#endif
+  }
+  return 0;
+}
+
+const char *get_encoding_name(ContentEncoding encoding) {
+  switch (encoding) {
+    case ENC_IDENTITY:
+      return "identity";
+    case ENC_GZIP:
+      return "gzip";
+    case ENC_BROTLI:
+      return "br";
+  }
+  return "identity";
+}
+
+const char *get_encoding_extension(ContentEncoding encoding) {
+  switch (encoding) {
+    case ENC_IDENTITY:
+      return "";
+    case ENC_GZIP:
+      return "gz";
+    case ENC_BROTLI:
+      return "br";
+  }
+  return "";
+}
+
+int extension_is_compressible(const char *extension) {
+  size_t length = sizeof(compressible_extensions) / sizeof(char *);
+  for (size_t i = 0; i < length; i++) {
+    if (strcmp(extension, compressible_extensions[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void reserve_bytes(Buffer *buffer, size_t size) {
+  size_t new_size = buffer->size + size;
+  if (new_size > buffer->capacity) {
+    while (new_size > buffer->capacity) {
+      buffer->capacity <<= 1;
+    }
+    buffer->data = reallocate(buffer->data, buffer->capacity);
+  }
+}
+
+#ifdef WITH_ZLIB
+static int gzip_bytes(const uint8_t *data, size_t size, CompressionLevel level, Buffer *output) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  // A window size of 15 + 16 selects the gzip wrapper instead of zlib
+  if (deflateInit2(&stream, level == COMPRESS_BEST ? Z_BEST_COMPRESSION : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+        8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return 0;
+  }
+  size_t bound = deflateBound(&stream, size);
+  if (size > UINT_MAX || bound > UINT_MAX) {
+    deflateEnd(&stream);
+    return 0;
+  }
+  reserve_bytes(output, bound);
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = size;
+  stream.next_out = output->data + output->size;
+  stream.avail_out = bound;
+  int status = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+  if (status) {
+    output->size += stream.total_out;
+  }
+  deflateEnd(&stream);
+  return status;
+}
+#endif
+
+#ifdef WITH_BROTLI
+static int brotli_bytes(const uint8_t *data, size_t size, CompressionLevel level, Buffer *output) {
+  size_t bound = BrotliEncoderMaxCompressedSize(size);
+  if (!bound) {
+    return 0;
+  }
+  reserve_bytes(output, bound);
+  size_t compressed_size = bound;
+  // Quality 5 is roughly as fast as the default gzip level while still producing smaller output
+  if (!BrotliEncoderCompress(level == COMPRESS_BEST ? BROTLI_MAX_QUALITY : 5, BROTLI_DEFAULT_WINDOW,
+        BROTLI_MODE_TEXT, size, data, &compressed_size, output->data + output->size)) {
+    return 0;
+  }
+  output->size += compressed_size;
+  return 1;
+}
+#endif
+
+int compress_bytes(const uint8_t *data, size_t size, ContentEncoding encoding, CompressionLevel level,
+    Buffer *output) {
+  switch (encoding) {
+    case ENC_IDENTITY:
+      buffer_append_bytes(output, data, size);
+      return 1;
+    case ENC_GZIP:
+#ifdef WITH_ZLIB
+      return gzip_bytes(data, size, level, output);
+#else
+      return 0;
+#endif
+    case ENC_BROTLI:
+#ifdef WITH_BROTLI
+      return brotli_bytes(data, size, level, output);
+#else
+      return 0;
+#endif
+  }
+  return 0;
+}
+
+static int read_whole_file(const char *path, Buffer *output) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path, strerror(errno));
+    return 0;
+  }
+  size_t n;
+  do {
+    reserve_bytes(output, 8192);
+    n = fread(output->data + output->size, 1, 8192, file);
+    output->size += n;
+  } while (n == 8192);
+  int status = feof(file);
+  if (!status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "read error: %s" SGR_RESET "\n", path, strerror(errno));
+  }
+  fclose(file);
+  return status;
+}
+
+static int write_whole_file(const char *path, const Buffer *content) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path, strerror(errno));
+    return 0;
+  }
+  int status = fwrite(content->data, 1, content->size, file) == content->size;
+  if (fclose(file) != 0) {
+    status = 0;
+  }
+  if (!status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", path, strerror(errno));
+    remove(path);
+  }
+  return status;
+}
+
+/* Writes a precompressed sibling (e.g. "style.css.gz") for each available encoding. The modification time of each
+ * sibling is set to that of the file, so unless `force` is set, a sibling is only compressed again once the file has
+ * changed. */
+int compress_file(const Path *path, int force) {
+  if (!extension_is_compressible(path_get_extension(path))) {
+    return 1;
+  }
+  struct stat stat_buffer;
+  if (stat(path->path, &stat_buffer) != 0) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    return 0;
+  }
+  int status = 1;
+  Buffer content = create_buffer(0);
+  int content_read = 0;
+  for (ContentEncoding encoding = ENC_GZIP; encoding < ENC_COUNT; encoding++) {
+    if (!encoding_is_available(encoding)) {
+      continue;
+    }
+    Buffer sibling_name = create_buffer(path->size + 4);
+    buffer_printf(&sibling_name, "%s.%s", path->path, get_encoding_extension(encoding));
+    buffer_put(&sibling_name, '\0');
+    const char *sibling_path = (const char *) sibling_name.data;
+    if (!force && file_exists(sibling_path) && get_mtime(sibling_path) == stat_buffer.st_mtime) {
+      delete_buffer(sibling_name);
+      continue;
+    }
+    if (!content_read) {
+      if (!read_whole_file(path->path, &content)) {
+        delete_buffer(sibling_name);
+        status = 0;
+        break;
+      }
+      content_read = 1;
+    }
+    Buffer compressed = create_buffer(0);
+    if (!compress_bytes(content.data, content.size, encoding, COMPRESS_BEST, &compressed)) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s compression failed" SGR_RESET "\n", path->path,
+          get_encoding_name(encoding));
+      status = 0;
+    } else if (write_whole_file(sibling_path, &compressed)) {
+      struct utimbuf utime_buffer;
+      utime_buffer.actime = stat_buffer.st_atime;
+      utime_buffer.modtime = stat_buffer.st_mtime;
+      utime(sibling_path, &utime_buffer);
+    } else {
+      status = 0;
+    }
+    delete_buffer(compressed);
+    delete_buffer(sibling_name);
+  }
+  delete_buffer(content);
+  return status;
+}
@@ -0,0 +1,34 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "util.h"
+
+typedef enum {
+  ENC_IDENTITY,
+  ENC_GZIP,
+  ENC_BROTLI
+} ContentEncoding;
+
+#define ENC_COUNT 3
+
+typedef enum {
+  COMPRESS_FAST,
+  COMPRESS_BEST
+} CompressionLevel;
+
+int encoding_is_available(ContentEncoding encoding);
+const char *get_encoding_name(ContentEncoding encoding);
+const char *get_encoding_extension(ContentEncoding encoding);
+int extension_is_compressible(const char *extension);
+
+int compress_bytes(const uint8_t *data, size_t size, ContentEncoding encoding, CompressionLevel level,
+    Buffer *output);
+int compress_file(const Path *path, int force);
+
+#endif
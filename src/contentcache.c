@@ -0,0 +1,563 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "contentcache.h"
+
+#include "build.h"
+#include "hashmap.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_DIR ".plet-cache"
+#define CACHE_NAME "content"
+#define CACHE_MAGIC "plet-content-cache"
+#define CACHE_VERSION 3
+#define MAX_VALUE_DEPTH 256
+
+/* The front matter of a content file and, once it has been computed, the body properties of its content object in
+ * serialized form. `dependencies` lists the files read while computing the body. */
+struct CachedContent {
+  char *path;
+  FileStamp stamp;
+  Hash handlers;
+  long offset;
+  Buffer front_matter;
+  Buffer body;
+  Buffer dependencies;
+  int used;
+  CachedContent *next_replaced;
+};
+
+/* Content objects are created and forced by several threads, so access is synchronized. Entries that are replaced
+ * may still be referenced by content objects, so they are kept until the cache is deleted. */
+struct ContentCache {
+  GenericHashMap entries;
+  CachedContent *replaced;
+  pthread_mutex_t lock;
+};
+
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+} CacheReader;
+
+static _Thread_local ContentCache *current_cache = NULL;
+
+static Hash cached_content_hash(const void *p) {
+  const char *path = (*(CachedContent * const *) p)->path;
+  Hash h = INIT_HASH;
+  while (*path) {
+    h = HASH_ADD_BYTE(*path, h);
+    path++;
+  }
+  return h;
+}
+
+static int cached_content_equals(const void *a, const void *b) {
+  return strcmp((*(CachedContent * const *) a)->path, (*(CachedContent * const *) b)->path) == 0;
+}
+
+static ContentCache *create_content_cache(void) {
+  ContentCache *cache = allocate(sizeof(ContentCache));
+  init_generic_hash_map(&cache->entries, sizeof(CachedContent *), 0, cached_content_hash, cached_content_equals,
+      NULL);
+  cache->replaced = NULL;
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+static void delete_cached_content(CachedContent *content) {
+  free(content->path);
+  delete_buffer(content->front_matter);
+  delete_buffer(content->body);
+  delete_buffer(content->dependencies);
+  free(content);
+}
+
+void delete_content_cache(ContentCache *cache) {
+  CachedContent *content;
+  HashMapIterator it = generic_hash_map_iterate(&cache->entries);
+  while (generic_hash_map_next(&it, &content)) {
+    delete_cached_content(content);
+  }
+  while (cache->replaced) {
+    content = cache->replaced;
+    cache->replaced = content->next_replaced;
+    delete_cached_content(content);
+  }
+  delete_generic_hash_map(&cache->entries);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+ContentCache *use_content_cache(ContentCache *cache) {
+  ContentCache *previous = current_cache;
+  current_cache = cache;
+  return previous;
+}
+
+ContentCache *get_content_cache(void) {
+  return current_cache;
+}
+
+static Buffer copy_bytes(const uint8_t *bytes, size_t size) {
+  Buffer buffer = create_buffer(size);
+  buffer_append_bytes(&buffer, bytes, size);
+  return buffer;
+}
+
+static void write_u64(Buffer *buffer, uint64_t value) {
+  buffer_append_bytes(buffer, (const uint8_t *) &value, sizeof(uint64_t));
+}
+
+static void write_i64(Buffer *buffer, int64_t value) {
+  buffer_append_bytes(buffer, (const uint8_t *) &value, sizeof(int64_t));
+}
+
+static void write_sized_bytes(Buffer *buffer, const uint8_t *bytes, size_t size) {
+  write_u64(buffer, size);
+  buffer_append_bytes(buffer, bytes, size);
+}
+
+static int read_bytes(CacheReader *reader, void *dest, size_t size) {
+  if (size > reader->size - reader->offset) {
+    return 0;
+  }
+  memcpy(dest, reader->data + reader->offset, size);
+  reader->offset += size;
+  return 1;
+}
+
+static int read_u64(CacheReader *reader, uint64_t *value) {
+  return read_bytes(reader, value, sizeof(uint64_t));
+}
+
+static int read_i64(CacheReader *reader, int64_t *value) {
+  return read_bytes(reader, value, sizeof(int64_t));
+}
+
+static const uint8_t *read_sized_bytes(CacheReader *reader, size_t *size) {
+  uint64_t length;
+  if (!read_u64(reader, &length) || length > reader->size - reader->offset) {
+    return NULL;
+  }
+  const uint8_t *bytes = reader->data + reader->offset;
+  reader->offset += length;
+  *size = length;
+  return bytes;
+}
+
+/* Functions can't be serialized, nor can values that are nested too deeply, which includes cyclic values. */
+static int serialize_value(Value value, Buffer *buffer, int depth) {
+  if (depth > MAX_VALUE_DEPTH) {
+    return 0;
+  }
+  buffer_put(buffer, value.type);
+  switch (value.type) {
+    case V_NIL:
+      return 1;
+    case V_BOOL:
+    case V_INT:
+      write_i64(buffer, value.int_value);
+      return 1;
+    case V_FLOAT:
+      buffer_append_bytes(buffer, (const uint8_t *) &value.float_value, sizeof(double));
+      return 1;
+    case V_TIME:
+      write_i64(buffer, value.time_value);
+      return 1;
+    case V_SYMBOL:
+      write_sized_bytes(buffer, (const uint8_t *) value.symbol_value, strlen(value.symbol_value));
+      return 1;
+    case V_STRING:
+      write_sized_bytes(buffer, value.string_value->bytes, value.string_value->size);
+      return 1;
+    case V_ARRAY:
+      write_u64(buffer, value.array_value->size);
+      for (size_t i = 0; i < value.array_value->size; i++) {
+        if (!serialize_value(value.array_value->cells[i], buffer, depth + 1)) {
+          return 0;
+        }
+      }
+      return 1;
+    case V_OBJECT: {
+      write_u64(buffer, object_size(value.object_value));
+      ObjectIterator it = iterate_object(value.object_value);
+      Value entry_key, entry_value;
+      while (object_iterator_next(&it, &entry_key, &entry_value)) {
+        if (!serialize_value(entry_key, buffer, depth + 1) || !serialize_value(entry_value, buffer, depth + 1)) {
+          return 0;
+        }
+      }
+      return 1;
+    }
+    case V_FUNCTION:
+    case V_CLOSURE:
+      return 0;
+  }
+  return 0;
+}
+
+static int deserialize_value(CacheReader *reader, Value *value, Env *env, int depth) {
+  uint8_t type;
+  if (depth > MAX_VALUE_DEPTH || !read_bytes(reader, &type, 1)) {
+    return 0;
+  }
+  switch (type) {
+    case V_NIL:
+      *value = nil_value;
+      return 1;
+    case V_BOOL:
+    case V_INT:
+    case V_TIME: {
+      int64_t i;
+      if (!read_i64(reader, &i)) {
+        return 0;
+      }
+      if (type == V_TIME) {
+        *value = create_time(i);
+      } else {
+        *value = (Value) { .type = type, .int_value = i };
+      }
+      return 1;
+    }
+    case V_FLOAT: {
+      double f;
+      if (!read_bytes(reader, &f, sizeof(double))) {
+        return 0;
+      }
+      *value = create_float(f);
+      return 1;
+    }
+    case V_SYMBOL: {
+      size_t size;
+      const uint8_t *bytes = read_sized_bytes(reader, &size);
+      if (!bytes) {
+        return 0;
+      }
+      char short_name[64];
+      char *name = size < sizeof(short_name) ? short_name : allocate(size + 1);
+      memcpy(name, bytes, size);
+      name[size] = '\0';
+      *value = create_symbol(get_symbol(name, env->symbol_map));
+      if (name != short_name) {
+        free(name);
+      }
+      return 1;
+    }
+    case V_STRING: {
+      size_t size;
+      const uint8_t *bytes = read_sized_bytes(reader, &size);
+      if (!bytes) {
+        return 0;
+      }
+      *value = create_string(bytes, size, env->arena);
+      return 1;
+    }
+    case V_ARRAY: {
+      uint64_t size;
+      if (!read_u64(reader, &size) || size > reader->size - reader->offset) {
+        return 0;
+      }
+      *value = create_array(size, env->arena);
+      for (uint64_t i = 0; i < size; i++) {
+        Value elem;
+        if (!deserialize_value(reader, &elem, env, depth + 1)) {
+          return 0;
+        }
+        array_push(value->array_value, elem, env->arena);
+      }
+      return 1;
+    }
+    case V_OBJECT: {
+      uint64_t size;
+      if (!read_u64(reader, &size) || size > reader->size - reader->offset) {
+        return 0;
+      }
+      *value = create_object(size, env->arena);
+      for (uint64_t i = 0; i < size; i++) {
+        Value entry_key, entry_value;
+        if (!deserialize_value(reader, &entry_key, env, depth + 1)
+            || !deserialize_value(reader, &entry_value, env, depth + 1)) {
+          return 0;
+        }
+        object_put(value->object_value, entry_key, entry_value, env->arena);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static Path *get_cache_path(const Path *src_root) {
+  Path *dir = path_append(src_root, CACHE_DIR);
+  Path *path = path_append(dir, CACHE_NAME);
+  delete_path(dir);
+  return path;
+}
+
+static int read_cache_header(CacheReader *reader) {
+  char magic[sizeof(CACHE_MAGIC) - 1];
+  uint64_t version;
+  size_t plet_version_size;
+  if (!read_bytes(reader, magic, sizeof(magic)) || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0
+      || !read_u64(reader, &version) || version != CACHE_VERSION) {
+    return 0;
+  }
+  const uint8_t *plet_version = read_sized_bytes(reader, &plet_version_size);
+  return plet_version && plet_version_size == sizeof(PLET_VERSION) - 1
+    && memcmp(plet_version, PLET_VERSION, plet_version_size) == 0;
+}
+
+static CachedContent *read_cached_content(CacheReader *reader) {
+  size_t path_size, front_matter_size, body_size, dependencies_size;
+  int64_t mtime, mtime_nsec, size, offset;
+  uint64_t handlers;
+  const uint8_t *path = read_sized_bytes(reader, &path_size);
+  if (!path || !read_i64(reader, &mtime) || !read_i64(reader, &mtime_nsec) || !read_i64(reader, &size)
+      || !read_u64(reader, &handlers) || !read_i64(reader, &offset)) {
+    return NULL;
+  }
+  const uint8_t *front_matter = read_sized_bytes(reader, &front_matter_size);
+  const uint8_t *body = front_matter ? read_sized_bytes(reader, &body_size) : NULL;
+  const uint8_t *dependencies = body ? read_sized_bytes(reader, &dependencies_size) : NULL;
+  if (!dependencies) {
+    return NULL;
+  }
+  CachedContent *content = allocate(sizeof(CachedContent));
+  content->path = allocate(path_size + 1);
+  memcpy(content->path, path, path_size);
+  content->path[path_size] = '\0';
+  content->stamp = (FileStamp) { .mtime = mtime, .mtime_nsec = mtime_nsec, .size = size };
+  content->handlers = handlers;
+  content->offset = offset;
+  content->front_matter = copy_bytes(front_matter, front_matter_size);
+  content->body = copy_bytes(body, body_size);
+  content->dependencies = copy_bytes(dependencies, dependencies_size);
+  content->used = 0;
+  content->next_replaced = NULL;
+  return content;
+}
+
+/* Returns an empty cache if the cache file doesn't exist or was written by another version of Plet. */
+ContentCache *load_content_cache(const Path *src_root) {
+  ContentCache *cache = create_content_cache();
+  Path *path = get_cache_path(src_root);
+  FILE *file = fopen(path->path, "rb");
+  delete_path(path);
+  if (!file) {
+    return cache;
+  }
+  Buffer data = create_buffer(0);
+  size_t n;
+  do {
+    if (data.capacity - data.size < 8192) {
+      data.capacity += 8192 > data.capacity ? 8192 : data.capacity;
+      data.data = reallocate(data.data, data.capacity);
+    }
+    n = fread(data.data + data.size, 1, data.capacity - data.size, file);
+    data.size += n;
+  } while (n);
+  fclose(file);
+  CacheReader reader = { .data = data.data, .size = data.size, .offset = 0 };
+  uint64_t count;
+  if (read_cache_header(&reader) && read_u64(&reader, &count)) {
+    for (uint64_t i = 0; i < count; i++) {
+      CachedContent *content = read_cached_content(&reader);
+      if (!content) {
+        break;
+      }
+      generic_hash_map_add(&cache->entries, &content);
+    }
+  }
+  delete_buffer(data);
+  return cache;
+}
+
+/* Only entries that have been used since the cache was loaded are saved, so content that has been deleted or is no
+ * longer listed is dropped from the cache. */
+int save_content_cache(ContentCache *cache, const Path *src_root) {
+  Path *dir = path_append(src_root, CACHE_DIR);
+  if (!mkdir_rec(dir->path)) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "unable to create cache directory" SGR_RESET "\n", dir->path);
+    delete_path(dir);
+    return 0;
+  }
+  Path *path = path_append(dir, CACHE_NAME);
+  Path *temp_path = path_append(dir, CACHE_NAME ".tmp");
+  delete_path(dir);
+  Buffer data = create_buffer(0);
+  buffer_append_bytes(&data, (const uint8_t *) CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1);
+  write_u64(&data, CACHE_VERSION);
+  write_sized_bytes(&data, (const uint8_t *) PLET_VERSION, sizeof(PLET_VERSION) - 1);
+  pthread_mutex_lock(&cache->lock);
+  uint64_t count = 0;
+  CachedContent *content;
+  HashMapIterator it = generic_hash_map_iterate(&cache->entries);
+  while (generic_hash_map_next(&it, &content)) {
+    if (content->used) {
+      count++;
+    }
+  }
+  write_u64(&data, count);
+  it = generic_hash_map_iterate(&cache->entries);
+  while (generic_hash_map_next(&it, &content)) {
+    if (content->used) {
+      write_sized_bytes(&data, (const uint8_t *) content->path, strlen(content->path));
+      write_i64(&data, content->stamp.mtime);
+      write_i64(&data, content->stamp.mtime_nsec);
+      write_i64(&data, content->stamp.size);
+      write_u64(&data, content->handlers);
+      write_i64(&data, content->offset);
+      write_sized_bytes(&data, content->front_matter.data, content->front_matter.size);
+      write_sized_bytes(&data, content->body.data, content->body.size);
+      write_sized_bytes(&data, content->dependencies.data, content->dependencies.size);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  int result = 0;
+  FILE *file = fopen(temp_path->path, "wb");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", temp_path->path, strerror(errno));
+  } else {
+    int written = fwrite(data.data, 1, data.size, file) == data.size;
+    if (fclose(file) != 0 || !written) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", temp_path->path,
+          strerror(errno));
+      remove(temp_path->path);
+    } else if (rename(temp_path->path, path->path) != 0) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    } else {
+      result = 1;
+    }
+  }
+  delete_buffer(data);
+  delete_path(temp_path);
+  delete_path(path);
+  return result;
+}
+
+/* Returns the cached content of a file if its stamp hasn't changed, and the content handlers are the same as when it
+ * was cached. */
+CachedContent *get_cached_content(ContentCache *cache, const Path *path, FileStamp stamp, Hash handlers) {
+  CachedContent key = { .path = (char *) path->path };
+  CachedContent *content = &key;
+  pthread_mutex_lock(&cache->lock);
+  if (!generic_hash_map_get(&cache->entries, &content, &content) || !file_stamp_equals(content->stamp, stamp)
+      || content->handlers != handlers) {
+    content = NULL;
+  } else {
+    content->used = 1;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return content;
+}
+
+int load_cached_front_matter(CachedContent *content, Value *front_matter, long *offset, Env *env) {
+  CacheReader reader = { .data = content->front_matter.data, .size = content->front_matter.size, .offset = 0 };
+  if (!deserialize_value(&reader, front_matter, env, 0) || front_matter->type != V_OBJECT) {
+    return 0;
+  }
+  *offset = content->offset;
+  return 1;
+}
+
+/* Adds the front matter of a file to the cache. Returns NULL if the front matter can't be serialized. */
+CachedContent *add_cached_content(ContentCache *cache, const Path *path, FileStamp stamp, Hash handlers,
+    Value front_matter, long offset) {
+  Buffer serialized = create_buffer(0);
+  if (!serialize_value(front_matter, &serialized, 0)) {
+    delete_buffer(serialized);
+    return NULL;
+  }
+  CachedContent *content = allocate(sizeof(CachedContent));
+  content->path = copy_string(path->path);
+  content->stamp = stamp;
+  content->handlers = handlers;
+  content->offset = offset;
+  content->front_matter = serialized;
+  content->body = create_buffer(0);
+  content->dependencies = create_buffer(0);
+  content->used = 1;
+  content->next_replaced = NULL;
+  CachedContent *existing;
+  int exists;
+  pthread_mutex_lock(&cache->lock);
+  generic_hash_map_set(&cache->entries, &content, &exists, &existing);
+  if (exists) {
+    existing->next_replaced = cache->replaced;
+    cache->replaced = existing;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return content;
+}
+
+/* Loads the cached body properties of a content object and adds the files they were computed from to the current
+ * dependency set. Fails if the body hasn't been cached or if any of those files have changed. */
+int load_cached_body(ContentCache *cache, CachedContent *content, Value *body, Env *env) {
+  pthread_mutex_lock(&cache->lock);
+  CacheReader reader = { .data = content->body.data, .size = content->body.size, .offset = 0 };
+  CacheReader dependencies = { .data = content->dependencies.data, .size = content->dependencies.size, .offset = 0 };
+  pthread_mutex_unlock(&cache->lock);
+  if (!reader.size) {
+    return 0;
+  }
+  for (int add = 0; add < 2; add++) {
+    dependencies.offset = 0;
+    while (dependencies.offset < dependencies.size) {
+      size_t path_size;
+      int64_t mtime, mtime_nsec, size, type;
+      const uint8_t *path_bytes = read_sized_bytes(&dependencies, &path_size);
+      if (!path_bytes || !read_i64(&dependencies, &mtime) || !read_i64(&dependencies, &mtime_nsec)
+          || !read_i64(&dependencies, &size) || !read_i64(&dependencies, &type)) {
+        return 0;
+      }
+      FileStamp stamp = { .mtime = mtime, .mtime_nsec = mtime_nsec, .size = size };
+      Path *path = create_path((const char *) path_bytes, path_size);
+      if (add) {
+        add_dependency(path, stamp, type);
+      } else if (strcmp(path->path, content->path) != 0 && !file_stamp_equals(get_file_stamp(path->path), stamp)) {
+        delete_path(path);
+        return 0;
+      }
+      delete_path(path);
+    }
+  }
+  return deserialize_value(&reader, body, env, 0);
+}
+
+/* The body is only cached once, content objects created from the same entry compute the same body. */
+void add_cached_body(ContentCache *cache, CachedContent *content, Value body, const DependencyList *dependencies) {
+  Buffer serialized = create_buffer(0);
+  if (!serialize_value(body, &serialized, 0)) {
+    delete_buffer(serialized);
+    return;
+  }
+  Buffer serialized_dependencies = create_buffer(0);
+  for (; dependencies; dependencies = dependencies->next) {
+    write_sized_bytes(&serialized_dependencies, (const uint8_t *) dependencies->path->path, dependencies->path->size);
+    write_i64(&serialized_dependencies, dependencies->stamp.mtime);
+    write_i64(&serialized_dependencies, dependencies->stamp.mtime_nsec);
+    write_i64(&serialized_dependencies, dependencies->stamp.size);
+    write_i64(&serialized_dependencies, dependencies->type);
+  }
+  pthread_mutex_lock(&cache->lock);
+  if (!content->body.size) {
+    Buffer empty_body = content->body;
+    Buffer empty_dependencies = content->dependencies;
+    content->body = serialized;
+    content->dependencies = serialized_dependencies;
+    serialized = empty_body;
+    serialized_dependencies = empty_dependencies;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  delete_buffer(serialized);
+  delete_buffer(serialized_dependencies);
+}
@@ -0,0 +1,29 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef CONTENTCACHE_H
+#define CONTENTCACHE_H
+
+#include "manifest.h"
+#include "value.h"
+
+typedef struct ContentCache ContentCache;
+typedef struct CachedContent CachedContent;
+
+ContentCache *load_content_cache(const Path *src_root);
+int save_content_cache(ContentCache *cache, const Path *src_root);
+void delete_content_cache(ContentCache *cache);
+ContentCache *use_content_cache(ContentCache *cache);
+ContentCache *get_content_cache(void);
+
+CachedContent *get_cached_content(ContentCache *cache, const Path *path, FileStamp stamp, Hash handlers);
+int load_cached_front_matter(CachedContent *content, Value *front_matter, long *offset, Env *env);
+CachedContent *add_cached_content(ContentCache *cache, const Path *path, FileStamp stamp, Hash handlers,
+    Value front_matter, long offset);
+int load_cached_body(ContentCache *cache, CachedContent *content, Value *body, Env *env);
+void add_cached_body(ContentCache *cache, CachedContent *content, Value body, const DependencyList *dependencies);
+
+#endif
@@ -7,8 +7,10 @@
 #include "contentmap.h"
 
 #include "build.h"
+#include "contentcache.h"
 #include "html.h"
 #include "interpreter.h"
+#include "manifest.h"
 #include "parser.h"
 #include "reader.h"
 #include "strings.h"
@@ -17,9 +19,12 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 typedef struct PathStack PathStack;
 
@@ -29,9 +34,53 @@ struct PathStack {
    char *name;
 };
 
-static void read_front_matter(Object *obj, FILE *file, const Path *path, Env *env);
-static Value read_file_content(Object *obj, FILE *file, const Path *path, Env *env);
-static Value parse_content(Value content, const Path *path, Env *env);
+typedef struct {
+  Path *path;
+  char *name;
+  Value relative_path;
+} ContentFile;
+
+/* The inputs of the lazy properties of a content object. */
+typedef struct {
+  Object *object;
+  Value path;
+  Value body;
+  long offset;
+  Value title;
+  Env *env;
+  const Node *calling_node;
+  DependencyList *dependencies;
+  ContentCache *cache;
+  CachedContent *cached;
+} LazyContent;
+
+typedef struct ContentWorker ContentWorker;
+
+struct ContentWorker {
+  Env *env;
+  DependencySet *dependencies;
+  ContentWorker *next;
+};
+
+typedef struct {
+  ContentFile *files;
+  Value *objects;
+  size_t size;
+  size_t capacity;
+  size_t next;
+  Env *env;
+  ContentCache *cache;
+  Hash handlers;
+  int eager;
+  ContentWorker *workers;
+  pthread_mutex_t lock;
+} ContentQueue;
+
+static int read_content_file(const Path *path, long offset, Value *content, Arena *arena);
+static long read_front_matter(Object *obj, String *content, const Path *path, Env *env);
+static Value remove_front_matter(Value content, long offset);
+static Value apply_content_handler(Object *obj, Value content, const Path *path, Env *env);
+static Value parse_content(Value content, const Path *path, const HtmlVisitor *visitors, size_t count, Env *env);
 
 static Value path_stack_to_string(PathStack *path_stack, Arena *arena) {
   if (!path_stack) {
@@ -103,22 +152,22 @@ static HtmlTransformation transform_content_includes(Value node, void *context)
   ContentIncludeArgs *args = context;
   if (node.type == V_OBJECT) {
     Value comment;
-    if (object_get_symbol(node.object_value, "comment", &comment) && comment.type == V_STRING) {
+    if (object_get(node.object_value, create_known_symbol(SYM_COMMENT), &comment) && comment.type == V_STRING) {
       if (string_starts_with("include:", comment.string_value)) {
         Path *path = create_path((char *) comment.string_value->bytes + sizeof("include:") - 1,
             comment.string_value->size - sizeof("include:") + 1);
         Path *abs_path = path_join(args->dir, path, 1);
         Value replacement = create_string(NULL, 0, args->env->arena);
         load_asset_module(abs_path, args->env);
-        FILE *file = fopen(abs_path->path, "r");
-        if (file) {
+        Value content;
+        if (read_content_file(abs_path, 0, &content, args->env->arena)) {
           Value front_matter = create_object(0, args->env->arena);
           Value type = copy_c_string(path_get_extension(abs_path), args->env->arena);
-          object_def(front_matter.object_value, "type", type, args->env);
-          read_front_matter(front_matter.object_value, file, abs_path, args->env);
-          Value content = read_file_content(front_matter.object_value, file, abs_path, args->env);
-          fclose(file);
-          replacement = parse_content(content, abs_path, args->env);
+          object_put(front_matter.object_value, create_known_symbol(SYM_TYPE), type, args->env->arena);
+          long offset = read_front_matter(front_matter.object_value, content.string_value, abs_path, args->env);
+          content = remove_front_matter(content, offset);
+          content = apply_content_handler(front_matter.object_value, content, abs_path, args->env);
+          replacement = parse_content(content, abs_path, NULL, 0, args->env);
         } else {
           html_error(node, args->src_file, "include failed: %s: %s", path->path, strerror(errno));
         }
@@ -131,23 +180,27 @@ static HtmlTransformation transform_content_includes(Value node, void *context)
   return HTML_NO_ACTION;
 }
 
-static int has_read_more(Value node) {
-  if (node.type == V_OBJECT) {
+static HtmlTransformation find_title(Value node, void *context) {
+  Value *title_tag = context;
+  if (title_tag->type == V_NIL && node.type == V_OBJECT) {
+    Value node_tag;
+    if (object_get(node.object_value, create_known_symbol(SYM_TAG), &node_tag) && node_tag.type == V_SYMBOL
+        && node_tag.symbol_value == known_symbols[SYM_H1]) {
+      *title_tag = node;
+    }
+  }
+  return HTML_NO_ACTION;
+}
+
+static HtmlTransformation find_read_more(Value node, void *context) {
+  int *read_more = context;
+  if (!*read_more && node.type == V_OBJECT) {
     Value comment;
-    if (object_get_symbol(node.object_value, "comment", &comment) && comment.type == V_STRING) {
-      return string_equals("more", comment.string_value);
-    } else {
-      Value children;
-      if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
-        for (size_t i = 0; i < children.array_value->size; i++) {
-          if (has_read_more(children.array_value->cells[i])) {
-            return 1;
-          }
-        }
-      }
+    if (object_get(node.object_value, create_known_symbol(SYM_COMMENT), &comment) && comment.type == V_STRING) {
+      *read_more = string_equals("more", comment.string_value);
     }
   }
-  return 0;
+  return HTML_NO_ACTION;
 }
 
 static Array *toc_get_section(Array *toc, int level, String **number, String **id, Env *env) {
@@ -156,16 +209,16 @@ static Array *toc_get_section(Array *toc, int level, String **number, String **i
   }
   Object *last_entry = toc->cells[toc->size - 1].object_value;
   Value children;
-  if (!object_get_symbol(last_entry, "children", &children)) {
+  if (!object_get(last_entry, create_known_symbol(SYM_CHILDREN), &children)) {
     children = create_array(0, env->arena);
-    object_def(last_entry, "children", children, env);
+    object_put(last_entry, create_known_symbol(SYM_CHILDREN), children, env->arena);
   }
   Value number_value;
-  if (object_get_symbol(last_entry, "number", &number_value) && number_value.type == V_STRING) {
+  if (object_get(last_entry, create_known_symbol(SYM_NUMBER), &number_value) && number_value.type == V_STRING) {
     *number = number_value.string_value;
   }
   Value id_value;
-  if (object_get_symbol(last_entry, "id", &id_value) && id_value.type == V_STRING) {
+  if (object_get(last_entry, create_known_symbol(SYM_ID), &id_value) && id_value.type == V_STRING) {
     *id = id_value.string_value;
   }
   return toc_get_section(children.array_value, level - 1, number, id, env);
@@ -196,72 +249,74 @@ static Value slugify(String *string, String *prefix, String *sep, Arena *arena)
   return finalize_string_buffer(buffer);
 }
 
-static void build_toc(Value node, Array *toc, int min_level, int max_level, int numbered_headings,
-    String *sep1, String *sep2, String *nested_id_sep, Env *env) {
+typedef struct {
+  Env *env;
+  Array *toc;
+  int min_level;
+  int max_level;
+  int numbered_headings;
+  String *sep1;
+  String *sep2;
+  String *nested_id_sep;
+  Array *placeholders;
+} TocArgs;
+
+/* Headings are added when left, such that includes and links in their children have been processed. */
+static void build_toc(Value node, void *context) {
+  TocArgs *args = context;
+  Env *env = args->env;
   if (node.type == V_OBJECT) {
     Value node_tag;
-    if (object_get_symbol(node.object_value, "tag", &node_tag) && node_tag.type == V_SYMBOL) {
+    if (object_get(node.object_value, create_known_symbol(SYM_TAG), &node_tag) && node_tag.type == V_SYMBOL) {
       if (node_tag.symbol_value[0] == 'h' && node_tag.symbol_value[1] >= '1'
           && node_tag.symbol_value[1] <= '6' && node_tag.symbol_value[2] == '\0') {
         int level = node_tag.symbol_value[1] - '0';
-        if (level >= min_level && level <= max_level && html_get_attribute(node, "data-toc-ignore").type == V_NIL) {
+        if (level >= args->min_level && level <= args->max_level
+            && html_get_attribute(node, "data-toc-ignore").type == V_NIL) {
           String *parent_number = NULL;
           String *parent_id = NULL;
-          Array *section = toc_get_section(toc, level - min_level, &parent_number, &parent_id, env);
+          Array *section = toc_get_section(args->toc, level - args->min_level, &parent_number, &parent_id, env);
           Value entry = create_object(0, env->arena);
           StringBuffer buffer = create_string_buffer(0, env->arena);
           html_text_content(node, &buffer);
           Value title = string_trim(finalize_string_buffer(buffer).string_value, (uint8_t *) " \r\n\t", 4, env->arena);
-          if (numbered_headings >= level) {
+          if (args->numbered_headings >= level) {
             StringBuffer number_buffer = create_string_buffer(0, env->arena);
             if (parent_number) {
               string_buffer_append(&number_buffer, parent_number);
-              string_buffer_append(&number_buffer, sep1);
+              string_buffer_append(&number_buffer, args->sep1);
             }
             string_buffer_printf(&number_buffer, "%zd", section->size + 1);
             Value number = finalize_string_buffer(number_buffer);
-            object_def(entry.object_value, "number", number, env);
-            html_prepend_child(node, (Value) { .type = V_STRING, .string_value = sep2 }, env->arena);
+            object_put(entry.object_value, create_known_symbol(SYM_NUMBER), number, env->arena);
+            html_prepend_child(node, (Value) { .type = V_STRING, .string_value = args->sep2 }, env->arena);
             html_prepend_child(node, number, env->arena);
           }
-          object_def(entry.object_value, "title", title, env);
+          object_put(entry.object_value, create_known_symbol(SYM_TITLE), title, env->arena);
           Value id = html_get_attribute(node, "id");
           if (id.type != V_STRING) {
-            id = slugify(title.string_value, parent_id, nested_id_sep, env->arena);
+            id = slugify(title.string_value, parent_id, args->nested_id_sep, env->arena);
             html_set_attribute(node, "id", id.string_value, env);
           }
-          object_def(entry.object_value, "id", id, env);
+          object_put(entry.object_value, create_known_symbol(SYM_ID), id, env->arena);
           array_push(section, entry, env->arena);
         }
       }
     }
-    Value children;
-    if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
-      for (size_t i = 0; i < children.array_value->size; i++) {
-        build_toc(children.array_value->cells[i], toc, min_level, max_level, numbered_headings,
-            sep1, sep2, nested_id_sep, env);
-      }
-    }
   }
 }
 
-typedef struct {
-  Env *env;
-  Array *toc;
-} InsertTocArgs;
-
-static Value print_toc(Array *toc, Env *env) {
-  Value list = html_create_element("ol", 0, env);
+static void print_toc(Value list, Array *toc, Env *env) {
   for (size_t i = 0; i < toc->size; i++) {
     Value entry = toc->cells[i];
     if (entry.type != V_OBJECT) {
       continue;
     }
     Value title, id;
-    if (!object_get_symbol(entry.object_value, "title", &title) || title.type != V_STRING) {
+    if (!object_get(entry.object_value, create_known_symbol(SYM_TITLE), &title) || title.type != V_STRING) {
       continue;
     }
-    if (!object_get_symbol(entry.object_value, "id", &id) || id.type != V_STRING) {
+    if (!object_get(entry.object_value, create_known_symbol(SYM_ID), &id) || id.type != V_STRING) {
       continue;
     }
     Value list_element = html_create_element("li", 0, env);
@@ -273,32 +328,81 @@ static Value print_toc(Array *toc, Env *env) {
     html_append_child(link, title, env->arena);
     html_append_child(list_element, link, env->arena);
     Value children;
-    if (object_get_symbol(entry.object_value, "children", &children) && children.type == V_ARRAY) {
-      html_append_child(list_element, print_toc(children.array_value, env), env->arena);
+    if (object_get(entry.object_value, create_known_symbol(SYM_CHILDREN), &children) && children.type == V_ARRAY) {
+      Value sublist = html_create_element("ol", 0, env);
+      print_toc(sublist, children.array_value, env);
+      html_append_child(list_element, sublist, env->arena);
     }
     html_append_child(list, list_element, env->arena);
   }
-  return list;
 }
 
+/* The table of contents isn't complete until the whole tree has been visited, so <!--toc--> is replaced by an empty
+ * list that is filled in afterwards. */
 static HtmlTransformation insert_toc(Value node, void *context) {
-  InsertTocArgs *args = context;
+  TocArgs *args = context;
   if (node.type == V_OBJECT) {
     Value comment;
-    if (object_get_symbol(node.object_value, "comment", &comment) && comment.type == V_STRING) {
+    if (object_get(node.object_value, create_known_symbol(SYM_COMMENT), &comment) && comment.type == V_STRING) {
       if (string_equals("toc", comment.string_value)) {
-        return HTML_REPLACE(print_toc(args->toc, args->env));
+        Value placeholder = html_create_element("ol", 0, args->env);
+        array_push(args->placeholders, placeholder, args->env->arena);
+        return HTML_REPLACE(placeholder);
       }
     }
   }
   return HTML_NO_ACTION;
 }
 
-static void read_front_matter(Object *obj, FILE *file, const Path *path, Env *env) {
-  Reader *reader = open_reader(file, path, env->symbol_map);
+/* Reads a content file, or the part of it following offset, into a string allocated in arena using a single read.
+ * Sets errno and returns 0 on failure. */
+static int read_content_file(const Path *path, long offset, Value *content, Arena *arena) {
+  int fd = open(path->path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat stat_buffer;
+  if (fstat(fd, &stat_buffer) != 0) {
+    close(fd);
+    return 0;
+  }
+  size_t size = stat_buffer.st_size > offset ? stat_buffer.st_size - offset : 0;
+  if (size && offset && lseek(fd, offset, SEEK_SET) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return 0;
+  }
+  *content = allocate_string(size, arena);
+  size_t total = 0;
+  while (total < size) {
+    ssize_t n = read(fd, content->string_value->bytes + total, size - total);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      int error = errno;
+      close(fd);
+      errno = error;
+      return 0;
+    } else if (n == 0) {
+      // The file was truncated after fstat()
+      content->string_value->size = total;
+      break;
+    }
+    total += n;
+  }
+  close(fd);
+  return 1;
+}
+
+/* Parses the front matter at the beginning of content, if any, and adds its properties to obj. Returns the offset of
+ * the body. */
+static long read_front_matter(Object *obj, String *content, const Path *path, Env *env) {
+  Reader *reader = open_string_reader(content->bytes, content->size, path, env->symbol_map);
   if (reader_errors(reader)) {
     close_reader(reader);
-    return;
+    return 0;
   }
   set_reader_silent(1, reader);
   TokenStream tokens = read_all(reader, 0);
@@ -308,9 +412,10 @@ static void read_front_matter(Object *obj, FILE *file, const Path *path, Env *en
   if (peek_token(tokens)->type == T_PUNCT && peek_token(tokens)->punct_value == '{') {
     set_reader_silent(0, reader);
     Module *front_matter = parse_object_notation(tokens, path, 0);
+    long offset = reader_offset(reader);
     close_reader(reader);
     if (!front_matter->data_value.parse_error) {
-      Value front_matter_obj = interpret(*front_matter->data_value.root, env).value;
+      Value front_matter_obj = interpret(front_matter->data_value.code, env).value;
       if (front_matter_obj.type == V_OBJECT) {
         ObjectIterator it = iterate_object(front_matter_obj.object_value);
         Value entry_key, entry_value;
@@ -322,36 +427,33 @@ static void read_front_matter(Object *obj, FILE *file, const Path *path, Env *en
             value_name(front_matter_obj.type));
       }
     } else {
-      rewind(file);
+      offset = 0;
     }
     delete_module(front_matter);
-  } else {
-    close_reader(reader);
-    rewind(file);
+    return offset;
   }
+  close_reader(reader);
+  return 0;
 }
 
-static Value read_file_content(Object *obj, FILE *file, const Path *path, Env *env) {
-  Buffer buffer = create_buffer(8192);
-  size_t n;
-  do {
-    if (buffer.size) {
-      buffer.capacity += 8192;
-      buffer.data = reallocate(buffer.data, buffer.capacity);
-    }
-    n = fread(buffer.data + buffer.size, 1, 8192, file);
-    buffer.size += n;
-  } while (n == 8192);
-  if (!feof(file)) {
-    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "read error: %s" SGR_RESET "\n", path->path, strerror(errno));
-  }
-  Value content = create_string(buffer.data, buffer.size, env->arena);
-  delete_buffer(buffer);
+/* Removes the front matter from a string returned by read_content_file() in place. */
+static Value remove_front_matter(Value content, long offset) {
+  if (offset <= 0) {
+    return content;
+  } else if ((size_t) offset >= content.string_value->size) {
+    return create_string(NULL, 0, NULL);
+  }
+  content.string_value->size -= offset;
+  memmove(content.string_value->bytes, content.string_value->bytes + offset, content.string_value->size);
+  return content;
+}
+
+static Value apply_content_handler(Object *obj, Value content, const Path *path, Env *env) {
   Value content_handlers;
   if (env_get(get_symbol("CONTENT_HANDLERS", env->symbol_map), &content_handlers, env)
       && content_handlers.type == V_OBJECT) {
     Value type;
-    if (object_get(obj, create_symbol(get_symbol("type", env->symbol_map)), &type)
+    if (object_get(obj, create_known_symbol(SYM_TYPE), &type)
         && type.type == V_STRING) {
       Value handler;
       if (object_get(content_handlers.object_value, type, &handler)) {
@@ -383,23 +485,38 @@ static Value read_file_content(Object *obj, FILE *file, const Path *path, Env *e
   return content;
 }
 
-static Value parse_content(Value content, const Path *path, Env *env) {
+/* Parses content as HTML and applies the content link and include transformations to it followed by the given
+ * visitors in a single traversal of the tree. */
+static Value parse_content(Value content, const Path *path, const HtmlVisitor *visitors, size_t count, Env *env) {
   Value html;
   if (content.type == V_STRING) {
     html = html_parse(content.string_value, env);
     if (html.type != V_NIL) {
+      HtmlVisitor *pipeline = alloca((count + 2) * sizeof(HtmlVisitor));
+      size_t length = 0;
+      Path *src_root_path = NULL;
+      Path *abs_asset_base = NULL;
+      Path *asset_base = NULL;
       Value src_root;
       if (env_get_symbol("SRC_ROOT", &src_root, env) && src_root.type == V_STRING) {
-        Path *src_root_path = string_to_path(src_root.string_value);
-        Path *abs_asset_base = path_get_parent(path);
-        Path *asset_base = path_get_relative(src_root_path, abs_asset_base);
-        if (asset_base) {
-          ContentLinkArgs content_link_args = {env, asset_base};
-          html_transform(html, transform_content_links, &content_link_args);
-          ContentIncludeArgs content_include_args = {env, path, abs_asset_base};
-          html_transform(html, transform_content_includes, &content_include_args);
-          delete_path(asset_base);
-        }
+        src_root_path = string_to_path(src_root.string_value);
+        abs_asset_base = path_get_parent(path);
+        asset_base = path_get_relative(src_root_path, abs_asset_base);
+      }
+      ContentLinkArgs content_link_args = {env, asset_base};
+      ContentIncludeArgs content_include_args = {env, path, abs_asset_base};
+      if (asset_base) {
+        pipeline[length++] = (HtmlVisitor) {transform_content_links, NULL, &content_link_args};
+        pipeline[length++] = (HtmlVisitor) {transform_content_includes, NULL, &content_include_args};
+      }
+      for (size_t i = 0; i < count; i++) {
+        pipeline[length++] = visitors[i];
+      }
+      html_visit(html, pipeline, length);
+      if (asset_base) {
+        delete_path(asset_base);
+      }
+      if (abs_asset_base) {
         delete_path(abs_asset_base);
         delete_path(src_root_path);
       }
@@ -412,71 +529,246 @@ static Value parse_content(Value content, const Path *path, Env *env) {
   return html;
 }
 
-static Value create_content_object(const Path *path, const char *name, PathStack *path_stack, Env *env) {
+static void add_content_properties(Object *values, Value content, LazyContent *lazy, const Path *path, Env *env) {
+  object_def(values, "content", content, env);
+  int max_toc_level = 6;
+  Value temp;
+  if (object_get_symbol(lazy->object, "toc_depth", &temp) && temp.type == V_INT) {
+    max_toc_level = temp.int_value;
+  }
+  int numbered_headings = 0;
+  if (object_get_symbol(lazy->object, "numbered_headings", &temp) && temp.type == V_INT) {
+    numbered_headings = temp.int_value;
+  }
+  String *nested_id_sep = NULL;
+  if (object_get_symbol(lazy->object, "nested_id_sep", &temp) && temp.type == V_STRING) {
+    nested_id_sep = temp.string_value;
+  }
+  Value title_tag = nil_value;
+  int read_more = 0;
+  Value toc = create_array(0, env->arena);
+  TocArgs toc_args = {env, toc.array_value, 2, max_toc_level, numbered_headings,
+    copy_c_string(".", env->arena).string_value, copy_c_string(". ", env->arena).string_value, nested_id_sep,
+    create_array(0, env->arena).array_value};
+  HtmlVisitor visitors[] = {
+    {find_title, NULL, &title_tag},
+    {find_read_more, NULL, &read_more},
+    {NULL, build_toc, &toc_args},
+    {insert_toc, NULL, &toc_args},
+  };
+  // The table of contents is disabled when toc_depth is less than 2
+  Value html = parse_content(content, path, visitors, max_toc_level > 1 ? 4 : 2, env);
+  for (size_t i = 0; i < toc_args.placeholders->size; i++) {
+    print_toc(toc_args.placeholders->cells[i], toc.array_value, env);
+  }
+  object_def(values, "html", html, env);
+  if (title_tag.type != V_NIL) {
+    StringBuffer title_buffer = create_string_buffer(0, env->arena);
+    html_text_content(title_tag, &title_buffer);
+    object_put(values, create_known_symbol(SYM_TITLE), finalize_string_buffer(title_buffer), env->arena);
+  } else {
+    object_put(values, create_known_symbol(SYM_TITLE), lazy->title, env->arena);
+  }
+  object_def(values, "read_more", read_more ? true_value : false_value, env);
+  object_def(values, "toc", toc, env);
+}
+
+static int compute_content_properties(Object *values, LazyContent *lazy, const Path *path, Env *env) {
+  Value content = lazy->body;
+  if (content.type == V_NIL && !read_content_file(path, lazy->offset, &content, env->arena)) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    return 0;
+  }
+  content = apply_content_handler(lazy->object, content, path, env);
+  add_content_properties(values, content, lazy, path, env);
+  return 1;
+}
+
+/* Reads and parses the body of a content file the first time one of its lazy properties is read. The dependencies
+ * recorded meanwhile are added again by access_content(), since pages that read the properties later depend on the
+ * same files as the page that happened to compute them. */
+static Value force_content(void *context, Arena *arena) {
+  LazyContent *lazy = context;
+  Env *env = create_env(arena, lazy->env->modules, lazy->env->symbol_map);
+  env->parent_env = lazy->env;
+  env->calling_node = lazy->calling_node;
+  DependencySet *dependencies = create_dependency_set();
+  DependencySet *previous = record_dependencies(dependencies);
+  Path *path = string_to_path(lazy->path.string_value);
+  load_asset_module(path, env);
+  Value values;
+  // load_cached_body() also adds the files that the cached body was computed from to the dependencies
+  int cached = lazy->cached && load_cached_body(lazy->cache, lazy->cached, &values, env);
+  int computed = 0;
+  if (!cached) {
+    values = create_object(0, arena);
+    computed = compute_content_properties(values.object_value, lazy, path, env);
+  }
+  if (env->error) {
+    if (env->calling_node) {
+      display_env_error(*env->calling_node, env->error_level, 1, "%s: %s", path->path, env->error);
+    } else {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, env->error);
+    }
+  }
+  record_dependencies(previous);
+  lazy->dependencies = copy_dependencies(dependencies, arena);
+  delete_dependency_set(dependencies);
+  if (computed && lazy->cached && !env->error) {
+    add_cached_body(lazy->cache, lazy->cached, values, lazy->dependencies);
+  }
+  delete_path(path);
+  return values;
+}
+
+static void access_content(void *context) {
+  LazyContent *lazy = context;
+  add_dependency_list(lazy->dependencies);
+}
+
+/* Content is cached per set of content handlers. Built-in handlers only change with Plet itself, user defined handlers
+ * are identified by where they are defined and the stamp of that file. */
+static Hash fingerprint_content_handlers(Env *env) {
+  Value content_handlers;
+  if (!env_get(get_symbol("CONTENT_HANDLERS", env->symbol_map), &content_handlers, env)) {
+    return INIT_HASH;
+  }
+  FingerprintCache *cache = create_fingerprint_cache();
+  Hash h = fingerprint_value(INIT_HASH, content_handlers, cache);
+  if (content_handlers.type == V_OBJECT) {
+    ObjectIterator it = iterate_object(content_handlers.object_value);
+    Value entry_key, entry_value;
+    while (object_iterator_next(&it, &entry_key, &entry_value)) {
+      if (entry_value.type == V_CLOSURE && entry_value.closure_value->body.module.file_name) {
+        FileStamp stamp = get_file_stamp(entry_value.closure_value->body.module.file_name->path);
+        h = fingerprint_value(h, create_time(stamp.mtime), cache);
+        h = fingerprint_value(h, create_int(stamp.mtime_nsec), cache);
+        h = fingerprint_value(h, create_int(stamp.size), cache);
+      }
+    }
+  }
+  delete_fingerprint_cache(cache);
+  return h;
+}
+
+/* User defined content handlers may have side effects, such as modifying variables in index.plet, so when any handler
+ * isn't a built-in function, content is loaded serially and its body properties are computed immediately in the
+ * calling env instead of lazily. */
+static int content_handlers_are_builtin(Env *env) {
+  Value content_handlers;
+  if (!env_get(get_symbol("CONTENT_HANDLERS", env->symbol_map), &content_handlers, env)
+      || content_handlers.type != V_OBJECT) {
+    return 1;
+  }
+  ObjectIterator it = iterate_object(content_handlers.object_value);
+  Value entry_key, entry_value;
+  while (object_iterator_next(&it, &entry_key, &entry_value)) {
+    if (entry_value.type != V_FUNCTION) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* The file is read once when the object is created and only its front matter is parsed, unless the front matter is
+ * loaded from the content cache because the file hasn't changed. The body is parsed, or loaded from the cache, when one
+ * of the properties content, html, title, read_more or toc is first read. If eager is set the body is instead parsed
+ * immediately and never loaded from the cache. */
+static Value create_content_object(const Path *path, const char *name, Value relative_path, ContentCache *cache,
+    Hash handlers, int eager, Env *env) {
   Value obj = create_object(0, env->arena);
-  object_def(obj.object_value, "path", path_to_string(path, env->arena), env);
-  object_def(obj.object_value, "relative_path", path_stack_to_string(path_stack, env->arena), env);
+  Value path_value = path_to_string(path, env->arena);
+  object_def(obj.object_value, "path", path_value, env);
+  object_def(obj.object_value, "relative_path", relative_path, env);
   Value name_value = copy_c_string(name, env->arena);
   for (size_t i = name_value.string_value->size - 1; i > 0; i--) {
     if (name_value.string_value->bytes[i] == '.') {
       Value type_value = create_string(name_value.string_value->bytes + i + 1,
           name_value.string_value->size - i - 1, env->arena);
-      object_def(obj.object_value, "type", type_value, env);
+      object_put(obj.object_value, create_known_symbol(SYM_TYPE), type_value, env->arena);
       name_value.string_value->size = i;
       break;
     }
   }
   object_def(obj.object_value, "name", name_value, env);
   Module *m = load_asset_module(path, env);
-  object_def(obj.object_value, "modified", create_time(m->mtime), env);
-  FILE *file = fopen(path->path, "r");
-  if (!file) {
-    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
-    return nil_value;
-  }
-  read_front_matter(obj.object_value, file, path, env);
-  Value content = read_file_content(obj.object_value, file, path, env);
-  fclose(file);
-  object_def(obj.object_value, "content", content, env);
-  Value html = parse_content(content, path, env);
-  object_def(obj.object_value, "html", html, env);
-  Value title_tag = html_find_tag(get_symbol("h1", env->symbol_map), html);
-  if (title_tag.type != V_NIL) {
-    StringBuffer title_buffer = create_string_buffer(0, env->arena);
-    html_text_content(title_tag, &title_buffer);
-    object_def(obj.object_value, "title", finalize_string_buffer(title_buffer), env);
-  }
-  object_def(obj.object_value, "read_more", has_read_more(html) ? true_value : false_value, env);
-  int max_toc_level = 6;
-  Value temp;
-  if (object_get_symbol(obj.object_value, "toc_depth", &temp) && temp.type == V_INT) {
-    max_toc_level = temp.int_value;
-  }
-  int numbered_headings = 0;
-  if (object_get_symbol(obj.object_value, "numbered_headings", &temp) && temp.type == V_INT) {
-    numbered_headings = temp.int_value;
+  object_def(obj.object_value, "modified", create_time(m->stamp.mtime), env);
+  FileStamp stamp = get_file_stamp(path->path);
+  if (cache && stamp.size < 0) {
+    cache = NULL;
+  }
+  CachedContent *cached = NULL;
+  if (cache) {
+    cached = get_cached_content(cache, path, stamp, handlers);
+  }
+  Value front_matter;
+  Value body = nil_value;
+  long offset;
+  if (!cached || !load_cached_front_matter(cached, &front_matter, &offset, env)) {
+    if (!read_content_file(path, 0, &body, env->arena)) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+      return nil_value;
+    }
+    front_matter = create_object(0, env->arena);
+    offset = read_front_matter(front_matter.object_value, body.string_value, path, env);
+    body = remove_front_matter(body, offset);
+    if (cache) {
+      cached = add_cached_content(cache, path, stamp, handlers, front_matter, offset);
+    }
   }
-  String *nested_id_sep = NULL;
-  if (object_get_symbol(obj.object_value, "nested_id_sep", &temp) && temp.type == V_STRING) {
-    nested_id_sep = temp.string_value;
+  ObjectIterator it = iterate_object(front_matter.object_value);
+  Value entry_key, entry_value;
+  while (object_iterator_next(&it, &entry_key, &entry_value)) {
+    object_put(obj.object_value, entry_key, entry_value, env->arena);
   }
-  Value toc = create_array(0, env->arena);
-  if (max_toc_level > 1) {
-    Value sep1 = copy_c_string(".", env->arena);
-    Value sep2 = copy_c_string(". ", env->arena);
-    build_toc(html, toc.array_value, 2, max_toc_level, numbered_headings, sep1.string_value,
-       sep2.string_value, nested_id_sep, env); 
-    InsertTocArgs insert_toc_args = {env, toc.array_value};
-    html_transform(html, insert_toc, &insert_toc_args);
-  }
-  object_def(obj.object_value, "toc", toc, env);
+  if (eager) {
+    LazyContent content = { .object = obj.object_value, .path = path_value, .body = body, .offset = offset,
+      .title = nil_value };
+    object_get(obj.object_value, create_known_symbol(SYM_TITLE), &content.title);
+    if (!compute_content_properties(obj.object_value, &content, path, env)) {
+      return nil_value;
+    }
+    return obj;
+  }
+  LazyContent *lazy = arena_allocate(sizeof(LazyContent), env->arena);
+  lazy->object = obj.object_value;
+  lazy->path = path_value;
+  lazy->body = body;
+  lazy->offset = offset;
+  lazy->title = nil_value;
+  object_get(obj.object_value, create_known_symbol(SYM_TITLE), &lazy->title);
+  lazy->env = env;
+  lazy->calling_node = env->calling_node;
+  lazy->dependencies = NULL;
+  lazy->cache = cache;
+  lazy->cached = cached;
+  Hash hash = fingerprint_path(INIT_HASH, path);
+  hash = fingerprint_value(hash, create_time(m->stamp.mtime), NULL);
+  hash = fingerprint_value(hash, create_int(m->stamp.mtime_nsec), NULL);
+  hash = fingerprint_value(hash, create_int(m->stamp.size), NULL);
+  Thunk *thunk = create_thunk(force_content, access_content, lazy, hash, env->arena);
+  object_put_lazy(obj.object_value, create_symbol(get_symbol("content", env->symbol_map)), thunk, env->arena);
+  object_put_lazy(obj.object_value, create_symbol(get_symbol("html", env->symbol_map)), thunk, env->arena);
+  object_put_lazy(obj.object_value, create_known_symbol(SYM_TITLE), thunk, env->arena);
+  object_put_lazy(obj.object_value, create_symbol(get_symbol("read_more", env->symbol_map)), thunk, env->arena);
+  object_put_lazy(obj.object_value, create_symbol(get_symbol("toc", env->symbol_map)), thunk, env->arena);
   return obj;
 }
 
-static int find_content(const Path *path, int recursive, const char *suffix, size_t suffix_length,
-    PathStack *path_stack, Array *content, Env *env) {
+static void add_content_file(ContentQueue *queue, const Path *path, const char *name, PathStack *path_stack) {
+  if (queue->size >= queue->capacity) {
+    queue->capacity = queue->capacity ? queue->capacity << 1 : 64;
+    queue->files = reallocate(queue->files, queue->capacity * sizeof(ContentFile));
+  }
+  ContentFile *file = &queue->files[queue->size++];
+  file->path = copy_path(path);
+  file->name = copy_string(name);
+  file->relative_path = path_stack_to_string(path_stack, queue->env->arena);
+}
+
+static void find_content(const Path *path, int recursive, const char *suffix, size_t suffix_length,
+    PathStack *path_stack, ContentQueue *queue) {
   DIR *dir = opendir(path->path);
-  int status = 1;
   if (dir) {
     struct dirent *file;
     while ((file = readdir(dir))) {
@@ -493,25 +785,114 @@ static int find_content(const Path *path, int recursive, const char *suffix, siz
             }
           }
           if (match) {
-            Value obj = create_content_object(subpath, file->d_name, path_stack, env);
-            if (obj.type == V_OBJECT) {
-              array_push(content, obj, env->arena);
-            } else {
-              status = 0;
-            }
+            add_content_file(queue, subpath, file->d_name, path_stack);
           }
         } else if (recursive) {
           PathStack next = {NULL, path_stack, file->d_name};
           if (path_stack) {
             path_stack->next = &next;
           }
-          status = status && find_content(subpath, recursive, suffix, suffix_length, &next, content, env);
+          find_content(subpath, recursive, suffix, suffix_length, &next, queue);
         }
         delete_path(subpath);
       }
     }
     closedir(dir);
   }
+}
+
+/* Each worker creates content objects in its own arena and records its own dependencies. Both are merged into those
+ * of the calling thread once all workers are done. */
+static void *load_content_worker(void *arg) {
+  ContentQueue *queue = arg;
+  ContentWorker *worker = allocate(sizeof(ContentWorker));
+  worker->env = create_env(create_arena(), queue->env->modules, queue->env->symbol_map);
+  worker->env->parent_env = queue->env;
+  worker->env->calling_node = queue->env->calling_node;
+  worker->dependencies = create_dependency_set();
+  DependencySet *previous = record_dependencies(worker->dependencies);
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    size_t i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (i >= queue->size) {
+      break;
+    }
+    queue->objects[i] = create_content_object(queue->files[i].path, queue->files[i].name,
+        queue->files[i].relative_path, queue->cache, queue->handlers, 0, worker->env);
+  }
+  record_dependencies(previous);
+  pthread_mutex_lock(&queue->lock);
+  worker->next = queue->workers;
+  queue->workers = worker;
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+static void load_content_parallel(ContentQueue *queue, int jobs) {
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_t *workers = allocate(jobs * sizeof(pthread_t));
+  int started = 0;
+  while (started < jobs) {
+    int error = pthread_create(&workers[started], NULL, load_content_worker, queue);
+    if (error) {
+      fprintf(stderr, ERROR_LABEL "unable to create worker thread: %s" SGR_RESET "\n", strerror(error));
+      break;
+    }
+    started++;
+  }
+  if (!started) {
+    load_content_worker(queue);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  pthread_mutex_destroy(&queue->lock);
+  while (queue->workers) {
+    ContentWorker *worker = queue->workers;
+    queue->workers = worker->next;
+    if (worker->env->error && !queue->env->error) {
+      queue->env->error_arg = worker->env->error_arg;
+      queue->env->error_level = worker->env->error_level;
+      queue->env->error = worker->env->error;
+    }
+    add_dependencies(worker->dependencies);
+    delete_dependency_set(worker->dependencies);
+    Arena *worker_arena = worker->env->arena;
+    arena_merge(worker_arena, queue->env->arena);
+    worker->env->arena = queue->env->arena;
+    for (size_t i = 0; i < queue->size; i++) {
+      move_to_arena(queue->objects[i], worker_arena, queue->env->arena);
+    }
+    free(worker);
+  }
+}
+
+static int load_content(ContentQueue *queue, Array *content) {
+  Value jobs_value;
+  int jobs = 1;
+  if (env_get_symbol("JOBS", &jobs_value, queue->env) && jobs_value.type == V_INT && jobs_value.int_value > 1) {
+    jobs = jobs_value.int_value < (int64_t) queue->size ? (int) jobs_value.int_value : (int) queue->size;
+  }
+  queue->objects = allocate((queue->size ? queue->size : 1) * sizeof(Value));
+  if (jobs > 1 && !queue->eager) {
+    load_content_parallel(queue, jobs);
+  } else {
+    for (size_t i = 0; i < queue->size; i++) {
+      queue->objects[i] = create_content_object(queue->files[i].path, queue->files[i].name,
+          queue->files[i].relative_path, queue->cache, queue->handlers, queue->eager, queue->env);
+    }
+  }
+  int status = 1;
+  for (size_t i = 0; i < queue->size; i++) {
+    if (queue->objects[i].type == V_OBJECT) {
+      array_push(content, queue->objects[i], queue->env->arena);
+    } else {
+      status = 0;
+    }
+  }
+  free(queue->objects);
   return status;
 }
 
@@ -549,7 +930,19 @@ static Value list_content(const Tuple *args, Env *env) {
     return nil_value;
   }
   Value content = create_array(0, env->arena);
-  int result = find_content(src_path, recursive, suffix, suffix ? strlen(suffix) : 0, NULL, content.array_value, env);
+  ContentQueue queue = { .env = env, .cache = get_content_cache(), .eager = !content_handlers_are_builtin(env) };
+  if (queue.cache) {
+    queue.handlers = fingerprint_content_handlers(env);
+  }
+  find_content(src_path, recursive, suffix, suffix ? strlen(suffix) : 0, NULL, &queue);
+  int result = load_content(&queue, content.array_value);
+  for (size_t i = 0; i < queue.size; i++) {
+    delete_path(queue.files[i].path);
+    free(queue.files[i].name);
+  }
+  if (queue.files) {
+    free(queue.files);
+  }
   if (!result) {
     env_error(env, -1, "encountered one or more errors when listing content");
   }
@@ -574,7 +967,9 @@ static Value read_content(const Tuple *args, Env *env) {
   if (!src_path) {
     return nil_value;
   }
-  Value obj = create_content_object(src_path, path_get_name(src_path), NULL, env);
+  ContentCache *cache = get_content_cache();
+  Value obj = create_content_object(src_path, path_get_name(src_path), path_stack_to_string(NULL, env->arena), cache,
+      cache ? fingerprint_content_handlers(env) : 0, !content_handlers_are_builtin(env), env);
   if (obj.type != V_OBJECT) {
     env_error(env, -1, "content read error");
   }
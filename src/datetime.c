@@ -137,7 +137,8 @@ static Value date(const Tuple *args, Env *env) {
     arg_type_error(1, V_STRING, args, env);
     return nil_value;
   }
-  struct tm *t = localtime(&arg);
+  struct tm tm_buffer;
+  struct tm *t = localtime_r(&arg, &tm_buffer);
   // TODO: improve
   char output[100];
   if (t) {
@@ -166,7 +167,8 @@ static Value iso8601(const Tuple *args, Env *env) {
     arg_error(0, "time|int|string", args, env);
     return nil_value;
   }
-  struct tm *t = localtime(&arg);
+  struct tm tm_buffer;
+  struct tm *t = localtime_r(&arg, &tm_buffer);
   char output[100];
   if (t) {
     size_t size = strftime(output, sizeof(output), "%Y-%m-%dT%H:%M:%S%z", t);
@@ -209,7 +211,8 @@ void import_datetime(Env *env) {
 }
 
 int rfc2822_date(time_t timestamp, Buffer *buffer) {
-  struct tm *t = localtime(&timestamp);
+  struct tm tm_buffer;
+  struct tm *t = localtime_r(&timestamp, &tm_buffer);
   if (t) {
     char timezone[10];
     if (!strftime(timezone, sizeof(timezone), " %z", t)) {
@@ -222,3 +225,38 @@ int rfc2822_date(time_t timestamp, Buffer *buffer) {
     return 0;
   }
 }
+
+int http_date(time_t timestamp, Buffer *buffer) {
+  struct tm tm_buffer;
+  struct tm *t = gmtime_r(&timestamp, &tm_buffer);
+  if (t) {
+    buffer_printf(buffer, "%s, %02d %s %d %02d:%02d:%02d GMT", rfc2822_day_names[t->tm_wday], t->tm_mday,
+        rfc2822_month_names[t->tm_mon], t->tm_year + 1900, t->tm_hour, t->tm_min, t->tm_sec);
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+int parse_http_date(const char *date, time_t *result) {
+  struct tm t;
+  char month[4];
+  if (sscanf(date, "%*3s, %d %3s %d %d:%d:%d GMT", &t.tm_mday, month, &t.tm_year, &t.tm_hour, &t.tm_min,
+        &t.tm_sec) != 6) {
+    return 0;
+  }
+  t.tm_mon = -1;
+  for (int i = 0; i < 12; i++) {
+    if (strcmp(month, rfc2822_month_names[i]) == 0) {
+      t.tm_mon = i;
+      break;
+    }
+  }
+  if (t.tm_mon < 0) {
+    return 0;
+  }
+  t.tm_year -= 1900;
+  t.tm_isdst = 0;
+  *result = timegm(&t);
+  return *result != (time_t) -1;
+}
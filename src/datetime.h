@@ -12,5 +12,7 @@
 void import_datetime(Env *env);
 
 int rfc2822_date(time_t timestamp, Buffer *buffer);
+int http_date(time_t timestamp, Buffer *buffer);
+int parse_http_date(const char *date, time_t *result);
 
 #endif
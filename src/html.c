@@ -11,6 +11,7 @@
 #include "sitemap.h"
 #include "strings.h"
 #include "template.h"
+#include "virtualdist.h"
 
 #include <string.h>
 
@@ -131,13 +132,13 @@ static Value href(const Tuple *args, Env *env) {
 static void html_to_string(Value node, StringBuffer *buffer, Env *env) {
   if (node.type == V_OBJECT) {
     Value tag = nil_value;
-    object_get(node.object_value, create_symbol(get_symbol("tag", env->symbol_map)), &tag);
+    object_get(node.object_value, create_known_symbol(SYM_TAG), &tag);
     if (tag.type == V_SYMBOL) {
       string_buffer_put(buffer, '<');
       string_buffer_printf(buffer, "%s", tag.symbol_value);
       Value attributes;
-      if (object_get(node.object_value, create_symbol(get_symbol("attributes", env->symbol_map)),
-            &attributes) && attributes.type == V_OBJECT) {
+      if (object_get(node.object_value, create_known_symbol(SYM_ATTRIBUTES), &attributes)
+          && attributes.type == V_OBJECT) {
         ObjectIterator it = iterate_object(attributes.object_value);
         Value key, value;
         while (object_iterator_next(&it, &key, &value)) {
@@ -158,15 +159,13 @@ static void html_to_string(Value node, StringBuffer *buffer, Env *env) {
       string_buffer_put(buffer, '>');
     }
     Value children;
-    if (object_get(node.object_value, create_symbol(get_symbol("children", env->symbol_map)), &children)
-        && children.type == V_ARRAY) {
+    if (object_get(node.object_value, create_known_symbol(SYM_CHILDREN), &children) && children.type == V_ARRAY) {
       for (size_t i = 0; i < children.array_value->size; i++) {
         html_to_string(children.array_value->cells[i], buffer, env);
       }
     }
     Value self_closing = nil_value;
-    object_get(node.object_value, create_symbol(get_symbol("self_closing", env->symbol_map)),
-        &self_closing);
+    object_get(node.object_value, create_known_symbol(SYM_SELF_CLOSING), &self_closing);
     if (tag.type == V_SYMBOL && !is_truthy(self_closing)) {
       string_buffer_put(buffer, '<');
       string_buffer_put(buffer, '/');
@@ -189,8 +188,8 @@ static Value html(const Tuple *args, Env *env) {
 
 static Value no_title(const Tuple *args, Env *env) {
   check_args(1, args, env);
-  Value src = args->values[0];
-  Value title_tag = html_find_tag(get_symbol("h1", env->symbol_map), src);
+  Value src = own_value(args->values[0], env);
+  Value title_tag = html_find_tag(known_symbols[SYM_H1], src);
   if (title_tag.type == V_OBJECT) {
     html_remove_node(title_tag.object_value, src);
   }
@@ -226,7 +225,7 @@ static int transform_link(Value node, const char *attribute_name, LinkArgs *args
     } else {
       Path *asset_web_path = path_join(args->asset_root, asset_path, 1);
       Path *dist_path = path_join(args->dist_root, asset_web_path, 1);
-      if (copy_asset(src_path, dist_path)) {
+      if (!add_virtual_copy(dist_path, src_path) && copy_asset(src_path, dist_path)) {
         notify_output_observers(dist_path, args->env);
       }
       html_set_attribute(node, attribute_name, get_web_path(asset_web_path, args->absolute, args->env).string_value,
@@ -255,6 +254,7 @@ static HtmlTransformation transform_links(Value node, void *context) {
 }
 
 static Value links_or_urls(Value src, int absolute, Env *env) {
+  src = own_value(src, env);
   Path *src_root = get_src_root(env);
   if (src_root) {
     Path *dist_root = get_dist_root(env);
@@ -302,7 +302,7 @@ static HtmlTransformation transform_read_more(Value node, void *context) {
   }
   if (node.type == V_OBJECT) {
     Value comment;
-    if (object_get_symbol(node.object_value, "comment", &comment) && comment.type == V_STRING) {
+    if (object_get(node.object_value, create_known_symbol(SYM_COMMENT), &comment) && comment.type == V_STRING) {
       if (string_equals("more", comment.string_value)) {
         args->after_split = 1;
         return HTML_REMOVE;
@@ -314,7 +314,7 @@ static HtmlTransformation transform_read_more(Value node, void *context) {
 
 static Value read_more(const Tuple *args, Env *env) {
   check_args(1, args, env);
-  Value src = args->values[0];
+  Value src = own_value(args->values[0], env);
   ReadMoreArgs context = {0};
   src = html_transform(src, transform_read_more, &context);
   return src;
@@ -360,7 +360,7 @@ static Value convert_gumbo_node(GumboNode *node, Env *env) {
   switch (node->type) {
     case GUMBO_NODE_DOCUMENT: {
       Value obj = create_object(2, env->arena);
-      object_def(obj.object_value, "type", create_symbol(get_symbol("document", env->symbol_map)), env);
+      object_put(obj.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_DOCUMENT), env->arena);
       Value children = create_array(node->v.element.children.length, env->arena);
       for (unsigned int i = 0; i < node->v.element.children.length; i++) {
         Value child = convert_gumbo_node(node->v.element.children.data[i], env);
@@ -368,13 +368,14 @@ static Value convert_gumbo_node(GumboNode *node, Env *env) {
           array_push(children.array_value, child, env->arena);
         }
       }
-      object_def(obj.object_value, "children", children, env);
-      object_def(obj.object_value, "line", create_int(node->v.element.start_pos.line), env);
+      object_put(obj.object_value, create_known_symbol(SYM_CHILDREN), children, env->arena);
+      object_put(obj.object_value, create_known_symbol(SYM_LINE),
+          create_int(node->v.element.start_pos.line), env->arena);
       return obj;
     }
     case GUMBO_NODE_ELEMENT: {
       Value obj = create_object(4, env->arena);
-      object_def(obj.object_value, "type", create_symbol(get_symbol("element", env->symbol_map)), env);
+      object_put(obj.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_ELEMENT), env->arena);
       object_def(obj.object_value, "tag",
           create_symbol(get_symbol(gumbo_normalized_tagname(node->v.element.tag), env->symbol_map)),
           env);
@@ -384,7 +385,7 @@ static Value convert_gumbo_node(GumboNode *node, Env *env) {
         object_put(attributes.object_value, create_symbol(get_symbol(attribute->name, env->symbol_map)),
             copy_c_string(attribute->value, env->arena), env->arena);
       }
-      object_def(obj.object_value, "attributes", attributes, env);
+      object_put(obj.object_value, create_known_symbol(SYM_ATTRIBUTES), attributes, env->arena);
       Value children = create_array(node->v.element.children.length, env->arena);
       for (unsigned int i = 0; i < node->v.element.children.length; i++) {
         Value child = convert_gumbo_node(node->v.element.children.data[i], env);
@@ -392,10 +393,11 @@ static Value convert_gumbo_node(GumboNode *node, Env *env) {
           array_push(children.array_value, child, env->arena);
         }
       }
-      object_def(obj.object_value, "children", children, env);
+      object_put(obj.object_value, create_known_symbol(SYM_CHILDREN), children, env->arena);
       object_def(obj.object_value, "self_closing",
           node->v.element.original_end_tag.length == 0 ? true_value : false_value, env);
-      object_def(obj.object_value, "line", create_int(node->v.element.start_pos.line), env);
+      object_put(obj.object_value, create_known_symbol(SYM_LINE),
+          create_int(node->v.element.start_pos.line), env->arena);
       return obj;
     }
     case GUMBO_NODE_TEXT:
@@ -403,9 +405,10 @@ static Value convert_gumbo_node(GumboNode *node, Env *env) {
       return copy_c_string(node->v.text.text, env->arena);
     case GUMBO_NODE_COMMENT: {
       Value obj = create_object(2, env->arena);
-      object_def(obj.object_value, "type", create_symbol(get_symbol("comment", env->symbol_map)), env);
-      object_def(obj.object_value, "comment", copy_c_string(node->v.text.text, env->arena), env);
-      object_def(obj.object_value, "line", create_int(node->v.text.start_pos.line), env);
+      object_put(obj.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_COMMENT), env->arena);
+      object_put(obj.object_value, create_known_symbol(SYM_COMMENT),
+          copy_c_string(node->v.text.text, env->arena), env->arena);
+      object_put(obj.object_value, create_known_symbol(SYM_LINE), create_int(node->v.text.start_pos.line), env->arena);
       return obj;
     }
     case GUMBO_NODE_WHITESPACE:
@@ -423,8 +426,8 @@ Value html_parse(String *html, Env *env) {
   Value root = convert_gumbo_node(output->root, env);
   gumbo_destroy_output(&options, output);
   if (root.type == V_OBJECT) {
-      object_def(root.object_value, "type", create_symbol(get_symbol("fragment", env->symbol_map)), env);
-      object_def(root.object_value, "tag", nil_value, env);
+      object_put(root.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_FRAGMENT), env->arena);
+      object_put(root.object_value, create_known_symbol(SYM_TAG), nil_value, env->arena);
   }
   return root;
 }
@@ -440,7 +443,7 @@ Value html_parse(String *html, Env *env) {
 void html_text_content(Value node, StringBuffer *buffer) {
   if (node.type == V_OBJECT) {
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children)) {
+    if (object_get(node.object_value, create_known_symbol(SYM_CHILDREN), &children)) {
       if (children.type == V_ARRAY) {
         for (size_t i = 0; i < children.array_value->size; i++) {
           html_text_content(children.array_value->cells[i], buffer);
@@ -455,14 +458,13 @@ void html_text_content(Value node, StringBuffer *buffer) {
 Value html_find_tag(Symbol tag_name, Value node) {
   if (node.type == V_OBJECT) {
     Value node_tag;
-    if (object_get_symbol(node.object_value, "tag", &node_tag)) {
+    if (object_get(node.object_value, create_known_symbol(SYM_TAG), &node_tag)) {
       if (node_tag.type == V_SYMBOL && node_tag.symbol_value == tag_name) {
         return node;
       }
     }
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children)
-        && children.type == V_ARRAY) {
+    if (object_get(node.object_value, create_known_symbol(SYM_CHILDREN), &children) && children.type == V_ARRAY) {
       for (size_t i = 0; i < children.array_value->size; i++) {
         Value result = html_find_tag(tag_name, children.array_value->cells[i]);
         if (result.type != V_NIL) {
@@ -480,7 +482,7 @@ int html_remove_node(Object *needle, Value haystack) {
       return 1;
     }
     Value children;
-    if (object_get_symbol(haystack.object_value, "children", &children)
+    if (object_get(haystack.object_value, create_known_symbol(SYM_CHILDREN), &children)
         && children.type == V_ARRAY) {
       for (size_t i = 0; i < children.array_value->size; i++) {
         if (html_remove_node(needle, children.array_value->cells[i])) {
@@ -493,21 +495,18 @@ int html_remove_node(Object *needle, Value haystack) {
   return 0;
 }
 
-static HtmlTransformation internal_html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *),
-    void *context);
+static HtmlTransformation internal_html_visit(Value node, const HtmlVisitor *visitors, size_t count);
 
-static HtmlTransformation internal_html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *),
-    void *context) {
-  HtmlTransformation transformation = acceptor(node, context);
-  if (transformation.type != HT_NO_ACTION) {
-    return transformation;
+/* Visits the children of a node and then leaves it. */
+static void finish_html_visit(Value node, const HtmlVisitor *visitors, size_t count) {
+  if (!count) {
+    return;
   }
   if (node.type == V_OBJECT) {
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
+    if (object_get(node.object_value, create_known_symbol(SYM_CHILDREN), &children) && children.type == V_ARRAY) {
       for (size_t i = 0; i < children.array_value->size; i++) {
-        HtmlTransformation child_ht = internal_html_transform(children.array_value->cells[i], acceptor,
-            context);
+        HtmlTransformation child_ht = internal_html_visit(children.array_value->cells[i], visitors, count);
         if (child_ht.type == HT_REMOVE) {
           array_remove(children.array_value, i);
           i--;
@@ -517,11 +516,47 @@ static HtmlTransformation internal_html_transform(Value node, HtmlTransformation
       }
     }
   }
+  for (size_t i = 0; i < count; i++) {
+    if (visitors[i].leave) {
+      visitors[i].leave(node, visitors[i].context);
+    }
+  }
+}
+
+static HtmlTransformation internal_html_visit(Value node, const HtmlVisitor *visitors, size_t count) {
+  HtmlTransformation transformation = HTML_NO_ACTION;
+  size_t first = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!visitors[i].enter) {
+      continue;
+    }
+    HtmlTransformation visitor_ht = visitors[i].enter(node, visitors[i].context);
+    if (visitor_ht.type != HT_NO_ACTION) {
+      // The visitors preceding the one that removed or replaced the node finish visiting the original node, and only
+      // the visitors following it visit the replacement
+      finish_html_visit(node, visitors + first, i - first);
+      if (visitor_ht.type == HT_REMOVE) {
+        return visitor_ht;
+      }
+      transformation = visitor_ht;
+      node = visitor_ht.replacement;
+      first = i + 1;
+    }
+  }
+  finish_html_visit(node, visitors + first, count - first);
   return transformation;
 }
 
 Value html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *), void *context) {
-  HtmlTransformation transformation = internal_html_transform(node, acceptor, context);
+  HtmlVisitor visitor = {acceptor, NULL, context};
+  return html_visit(node, &visitor, 1);
+}
+
+/* Applies a pipeline of visitors to a tree in a single traversal. The result is the same as applying the visitors one
+ * at a time using html_transform() as long as each visitor only depends on the node it is given and the nodes
+ * preceding it. */
+Value html_visit(Value node, const HtmlVisitor *visitors, size_t count) {
+  HtmlTransformation transformation = internal_html_visit(node, visitors, count);
   if (transformation.type == HT_REMOVE) {
     return nil_value;
   } else if (transformation.type == HT_REPLACE) {
@@ -534,7 +569,7 @@ Value html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *),
 int html_is_tag(Value node, const char *tag_name) {
   if (node.type == V_OBJECT) {
     Value node_tag;
-    if (object_get_symbol(node.object_value, "tag", &node_tag)) {
+    if (object_get(node.object_value, create_known_symbol(SYM_TAG), &node_tag)) {
       if (node_tag.type == V_SYMBOL && strcmp(node_tag.symbol_value, tag_name) == 0) {
         return 1;
       }
@@ -545,20 +580,22 @@ int html_is_tag(Value node, const char *tag_name) {
 
 Value html_create_element(const char *tag_name, int self_closing, Env *env) {
   Value node = create_object(5, env->arena);
-  object_def(node.object_value, "type", create_symbol(get_symbol("element", env->symbol_map)), env);
-  object_def(node.object_value, "tag", create_symbol(get_symbol(tag_name, env->symbol_map)), env);
+  object_put(node.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_ELEMENT), env->arena);
+  object_put(node.object_value, create_known_symbol(SYM_TAG),
+      create_symbol(get_symbol(tag_name, env->symbol_map)), env->arena);
   Value attributes = create_object(0, env->arena);
-  object_def(node.object_value, "attributes", attributes, env);
+  object_put(node.object_value, create_known_symbol(SYM_ATTRIBUTES), attributes, env->arena);
   Value children = create_array(0, env->arena);
-  object_def(node.object_value, "children", children, env);
-  object_def(node.object_value, "self_closing", self_closing ? true_value : false_value, env);
+  object_put(node.object_value, create_known_symbol(SYM_CHILDREN), children, env->arena);
+  object_put(node.object_value, create_known_symbol(SYM_SELF_CLOSING),
+      self_closing ? true_value : false_value, env->arena);
   return node;
 }
 
 void html_prepend_child(Value node, Value child, Arena *arena) {
   if (node.type == V_OBJECT) {
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
+    if (object_get(node.object_value, create_known_symbol(SYM_CHILDREN), &children) && children.type == V_ARRAY) {
       array_unshift(children.array_value, child, arena);
     }
   }
@@ -567,7 +604,7 @@ void html_prepend_child(Value node, Value child, Arena *arena) {
 void html_append_child(Value node, Value child, Arena *arena) {
   if (node.type == V_OBJECT) {
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
+    if (object_get(node.object_value, create_known_symbol(SYM_CHILDREN), &children) && children.type == V_ARRAY) {
       array_push(children.array_value, child, arena);
     }
   }
@@ -576,7 +613,8 @@ void html_append_child(Value node, Value child, Arena *arena) {
 Value html_get_attribute(Value node, const char *attribute_name) {
   if (node.type == V_OBJECT) {
     Value attributes;
-    if (object_get_symbol(node.object_value, "attributes", &attributes) && attributes.type == V_OBJECT) {
+    if (object_get(node.object_value, create_known_symbol(SYM_ATTRIBUTES), &attributes)
+        && attributes.type == V_OBJECT) {
       Value attribute;
       if (object_get_symbol(attributes.object_value, attribute_name, &attribute)) {
         return attribute;
@@ -589,7 +627,8 @@ Value html_get_attribute(Value node, const char *attribute_name) {
 void html_set_attribute(Value node, const char *attribute_name, String *string_value, Env *env) {
   if (node.type == V_OBJECT) {
     Value attributes;
-    if (object_get_symbol(node.object_value, "attributes", &attributes) && attributes.type == V_OBJECT) {
+    if (object_get(node.object_value, create_known_symbol(SYM_ATTRIBUTES), &attributes)
+        && attributes.type == V_OBJECT) {
       Value value = (Value) { .type = V_STRING, .string_value = string_value };
       object_def(attributes.object_value, attribute_name, value, env);
     }
@@ -599,7 +638,8 @@ void html_set_attribute(Value node, const char *attribute_name, String *string_v
 void html_error(Value node, const Path *path, const char *format, ...) {
   va_list va;
   Value line;
-  if (node.type == V_OBJECT && object_get_symbol(node.object_value, "line", &line) && line.type == V_INT) {
+  if (node.type == V_OBJECT && object_get(node.object_value, create_known_symbol(SYM_LINE), &line)
+      && line.type == V_INT) {
     fprintf(stderr, SGR_BOLD "%s:%" PRId64 ": " ERROR_LABEL, path->path, line.int_value);
   } else {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL, path->path);
@@ -32,7 +32,16 @@ typedef struct {
 #define HTML_REMOVE ((HtmlTransformation) { .type = HT_REMOVE })
 #define HTML_REPLACE(REPLACEMENT) ((HtmlTransformation) { .type = HT_REPLACE, .replacement = (REPLACEMENT) })
 
+/* A visitor in a pipeline of visitors applied by html_visit(). enter is called before the children of a node are
+ * visited and may remove or replace the node, leave is called after. Either may be NULL. */
+typedef struct {
+  HtmlTransformation (*enter)(Value, void *);
+  void (*leave)(Value, void *);
+  void *context;
+} HtmlVisitor;
+
 Value html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *), void *context);
+Value html_visit(Value node, const HtmlVisitor *visitors, size_t count);
 
 int html_is_tag(Value node, const char *tag_name);
 Value html_create_element(const char *tag_name, int self_closing, Env *env);
@@ -9,12 +9,11 @@
 #include "build.h"
 #include "html.h"
 #include "sitemap.h"
+#include "virtualdist.h"
 
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <utime.h>
 
 #ifdef WITH_IMAGEMAGICK
 #include <MagickWand/MagickWand.h>
@@ -44,9 +43,21 @@ static int is_supported(const char *extension) {
   return 0;
 }
 
-static void resize_image(const Path *src_path, const Path *dist_path, int width, int height, ImageArgs *args) {
+/* ImageMagick must be initialized once before any worker threads are started. */
+void init_image_resizing(void) {
 #ifdef WITH_IMAGEMAGICK
   MagickWandGenesis();
+#endif
+}
+
+void terminate_image_resizing(void) {
+#ifdef WITH_IMAGEMAGICK
+  MagickWandTerminus();
+#endif
+}
+
+static void resize_image(const Path *src_path, const Path *dist_path, int width, int height, ImageArgs *args) {
+#ifdef WITH_IMAGEMAGICK
   MagickWand *wand = NewMagickWand();
   MagickBooleanType status = MagickReadImage(wand, src_path->path);
   if (status == MagickFalse) {
@@ -59,17 +70,10 @@ static void resize_image(const Path *src_path, const Path *dist_path, int width,
     MagickSetImageCompressionQuality(wand, args->quality);
     status = MagickWriteImage(wand, dist_path->path);
     if (status == MagickTrue) {
-      struct stat stat_buffer;
-      if (stat(src_path->path, &stat_buffer) == 0) {
-        struct utimbuf utime_buffer;
-        utime_buffer.actime = stat_buffer.st_atime;
-        utime_buffer.modtime = stat_buffer.st_mtime;
-        utime(dist_path->path, &utime_buffer);
-      }
+      copy_file_times(src_path->path, dist_path->path);
     }
   }
   DestroyMagickWand(wand);
-  MagickWandTerminus();
 #else
   if (copy_file(src_path->path, dist_path->path)) {
     notify_output_observers(dist_path, args->env);
@@ -77,12 +81,67 @@ static void resize_image(const Path *src_path, const Path *dist_path, int width,
 #endif
 }
 
+int image_resizing_available(void) {
+#ifdef WITH_IMAGEMAGICK
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* Resizes an image in memory, used when serving a virtual dist. The format is derived from the file extension of
+ * `dest_path`. */
+int resize_image_to_buffer(const Path *src_path, const Path *dest_path, int width, int height, int quality,
+    Buffer *output) {
+#ifdef WITH_IMAGEMAGICK
+  int result = 0;
+  MagickWand *wand = NewMagickWand();
+  if (MagickReadImage(wand, src_path->path) == MagickFalse) {
+    ExceptionType severity;
+    char *description = MagickGetException(wand, &severity);
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "ImageMagick error: %s" SGR_RESET "\n", src_path->path, description);
+    MagickRelinquishMemory(description);
+  } else {
+    MagickResizeImage(wand, width, height, LanczosFilter);
+    MagickSetImageCompressionQuality(wand, quality);
+    MagickSetImageFormat(wand, path_get_extension(dest_path));
+    size_t length;
+    unsigned char *blob = MagickGetImageBlob(wand, &length);
+    if (blob) {
+      buffer_append_bytes(output, blob, length);
+      MagickRelinquishMemory(blob);
+      result = 1;
+    }
+  }
+  DestroyMagickWand(wand);
+  return result;
+#else
+  return 0;
+#endif
+}
+
+static void copy_image(const Path *src_path, const Path *dist_path, ImageArgs *args) {
+  lock_output_path(dist_path);
+  if (asset_has_changed(src_path, dist_path) && copy_file(src_path->path, dist_path->path)) {
+    notify_output_observers(dist_path, args->env);
+  }
+  unlock_output_path(dist_path);
+}
+
+static void copy_resized_image(const Path *src_path, const Path *dist_path, int width, int height, ImageArgs *args) {
+  lock_output_path(dist_path);
+  if (derived_asset_has_changed(src_path, dist_path)) {
+    resize_image(src_path, dist_path, width, height, args);
+  }
+  unlock_output_path(dist_path);
+}
+
 static Path *handle_image(const Path *asset_path, const Path *src_path, int *attr_width, int *attr_height,
     Path **original_asset_web_path, ImageArgs *args) {
   Path *asset_web_path = path_join(args->asset_root, asset_path, 1);
   Path *dist_path = path_join(args->dist_root, asset_web_path, 1);
   Path *dest_dir = path_get_parent(dist_path);
-  if (mkdir_rec(dest_dir->path)) {
+  if (virtual_dist_is_used() || mkdir_rec(dest_dir->path)) {
     char *extension = path_get_lowercase_extension(src_path);
     if (is_supported(extension)) {
       PletImageInfo info = get_image_info(src_path);
@@ -138,10 +197,8 @@ static Path *handle_image(const Path *asset_path, const Path *src_path, int *att
             delete_buffer(new_name);
             Path *asset_web_path_parent = path_get_parent(asset_web_path);
             if (original_asset_web_path) {
-              if (asset_has_changed(src_path, dist_path)) {
-                if (copy_file(src_path->path, dist_path->path)) {
-                  notify_output_observers(dist_path, args->env);
-                }
+              if (!add_virtual_copy(dist_path, src_path)) {
+                copy_image(src_path, dist_path, args);
               }
               *original_asset_web_path = asset_web_path;
             } else {
@@ -153,28 +210,22 @@ static Path *handle_image(const Path *asset_path, const Path *src_path, int *att
             delete_path(dist_path);
             dist_path = path_join(args->dist_root, asset_web_path, 1);
 
-            if (asset_has_changed(src_path, dist_path)) {
-              resize_image(src_path, dist_path, target_width, target_height, args);
-            }
-          } else if (asset_has_changed(src_path, dist_path)) {
-            if (copy_file(src_path->path, dist_path->path)) {
-              notify_output_observers(dist_path, args->env);
+            if (!add_virtual_image(dist_path, src_path, target_width, target_height, args->quality)) {
+              copy_resized_image(src_path, dist_path, target_width, target_height, args);
             }
+          } else if (!add_virtual_copy(dist_path, src_path)) {
+            copy_image(src_path, dist_path, args);
           }
         } else {
           *attr_width = width;
           *attr_height = height;
-          if (asset_has_changed(src_path, dist_path)) {
-            if (copy_file(src_path->path, dist_path->path)) {
-              notify_output_observers(dist_path, args->env);
-            }
+          if (!add_virtual_copy(dist_path, src_path)) {
+            copy_image(src_path, dist_path, args);
           }
         }
       }
-    } else if (asset_has_changed(src_path, dist_path)) {
-      if (copy_file(src_path->path, dist_path->path)) {
-        notify_output_observers(dist_path, args->env);
-      }
+    } else if (!add_virtual_copy(dist_path, src_path)) {
+      copy_image(src_path, dist_path, args);
     }
     free(extension);
   }
@@ -294,7 +345,7 @@ static Value images(const Tuple *args, Env *env) {
       Path *asset_root = create_path("assets", -1);
       ImageArgs context = {max_width.int_value, max_height.int_value, quality.int_value, link_full,
         preserve_lossless, src_root, dist_root, asset_root, env};
-      src = html_transform(src, transform_images, &context);
+      src = html_transform(own_value(src, env), transform_images, &context);
       delete_path(asset_root);
       delete_path(dist_root);
     } else {
@@ -26,5 +26,10 @@ typedef struct {
 } PletImageInfo;
 
 PletImageInfo get_image_info(const Path *path);
+void init_image_resizing(void);
+void terminate_image_resizing(void);
+int image_resizing_available(void);
+int resize_image_to_buffer(const Path *src_path, const Path *dest_path, int width, int height, int quality,
+    Buffer *output);
 
 #endif
@@ -6,6 +6,7 @@
 
 #include "interpreter.h"
 
+#include "compiler.h"
 #include "strings.h"
 
 #include <alloca.h>
@@ -13,8 +14,6 @@
 #include <stdarg.h>
 #include <string.h>
 
-#define RESULT_VALUE(VALUE) ((InterpreterResult) { IR_VALUE, (VALUE) })
-
 typedef enum {
   C_ERROR,
   C_GT,
@@ -22,14 +21,47 @@ typedef enum {
   C_EQ
 } Comparison;
 
-static void eval_error(Node node, const char *format, ...) {
+static InterpreterResultType execute(const Code *code, Buffer *output, Value *result, Env *env);
+
+static void eval_error(const Node *node, const char *format, ...) {
   va_list va;
-  fprintf(stderr, SGR_BOLD "%s:%d:%d: " ERROR_LABEL, node.module.file_name->path, node.start.line, node.start.column);
+  fprintf(stderr, SGR_BOLD "%s:%d:%d: " ERROR_LABEL, node->module.file_name->path, node->start.line, node->start.column);
   va_start(va, format);
   vfprintf(stderr, format, va);
   va_end(va);
   fprintf(stderr, SGR_RESET "\n");
-  print_error_line(node.module.file_name->path, node.start, node.end);
+  print_error_line(node->module.file_name->path, node->start, node->end);
+}
+
+static Env *create_closure_env(Closure *closure, Env *caller) {
+  Env *env = create_env(caller->arena, caller->modules, caller->symbol_map);
+  env->parent_env = closure->env;
+  if (closure->locals) {
+    env->locals = closure->locals;
+    env->slots = arena_allocate(LL_SIZE(closure->locals) * sizeof(Slot), env->arena);
+    memset(env->slots, 0, LL_SIZE(closure->locals) * sizeof(Slot));
+  }
+  return env;
+}
+
+static Value call_closure(Closure *closure, const Tuple *args, Env *env) {
+  Env *closure_env = create_closure_env(closure, env);
+  int i = 0;
+  NameList *params = closure->params;
+  while (params) {
+    Value arg;
+    if (i < args->size) {
+      arg = args->values[i];
+    } else {
+      arg = nil_value;
+    }
+    env_put_slot(i, params->head, arg, closure_env);
+    params = params->tail;
+    i++;
+  }
+  Value return_value;
+  execute(closure->code, NULL, &return_value, closure_env);
+  return return_value;
 }
 
 int apply(Value func, const Tuple *args, Value *return_value, Env *env) {
@@ -38,20 +70,7 @@ int apply(Value func, const Tuple *args, Value *return_value, Env *env) {
     *return_value = func.function_value(args, env);
     return !env->error;
   } else if (func.type == V_CLOSURE) {
-    int i = 0;
-    NameList *params = func.closure_value->params;
-    while (params) {
-      Value arg;
-      if (i < args->size) {
-        arg = args->values[i];
-      } else {
-        arg = nil_value;
-      }
-      env_put(params->head, arg, func.closure_value->env);
-      params = params->tail;
-      i++;
-    }
-    *return_value = interpret(func.closure_value->body, func.closure_value->env).value;
+    *return_value = call_closure(func.closure_value, args, env);
     return 1;
   } else {
     env_error(env, -1, "value of type %s is not a function", value_name(func.type));
@@ -59,42 +78,20 @@ int apply(Value func, const Tuple *args, Value *return_value, Env *env) {
   }
 }
 
-static InterpreterResult eval_apply(Node node, Env *env) {
-  InterpreterResult result;
-  int suppress = node.apply_value.callee->type == N_SUPPRESS;
-  Tuple *args = alloca(sizeof(Tuple) + LL_SIZE(node.apply_value.args) * sizeof(Value));
-  args->size = LL_SIZE(node.apply_value.args);
-  NodeList *arg_nodes = node.apply_value.args;
-  for (int i = 0; i < args->size; i++) {
-    result = interpret(arg_nodes->head, env);
-    if (result.type != IR_VALUE) {
-      return result;
-    }
-    args->values[i] = result.value;
-    arg_nodes = arg_nodes->tail;
-  }
-  Value callee;
-  if (node.apply_value.callee->type == N_NAME) {
-    if (!env_get(node.apply_value.callee->name_value, &callee, env)) {
-      eval_error(*node.apply_value.callee, "undefined function: %s", node.apply_value.callee->name_value);
-      return RESULT_VALUE(nil_value);
-    }
-  } else {
-    result = interpret(*node.apply_value.callee, env);
-    if (result.type != IR_VALUE) {
-      return result;
-    }
-    callee = result.value;
-  }
+static Value eval_apply(const Node *node, Value callee, const Value *arg_values, int arg_count, Env *env) {
+  int suppress = node->apply_value.callee->type == N_SUPPRESS;
+  Tuple *args = alloca(sizeof(Tuple) + arg_count * sizeof(Value));
+  args->size = arg_count;
+  memcpy(args->values, arg_values, arg_count * sizeof(Value));
   if (callee.type == V_FUNCTION) {
     env_clear_error(env);
-    env->calling_node = &node;
+    env->calling_node = node;
     Value return_value = callee.function_value(args, env);
     if (env->error) {
       if (env->error_arg < 0 || env->error_arg >= args->size) {
-        display_env_error(node, env->error_level, env->error_arg != ENV_ARG_NONE, "%s", env->error);
+        display_env_error(*node, env->error_level, env->error_arg != ENV_ARG_NONE, "%s", env->error);
       } else {
-        arg_nodes = node.apply_value.args;
+        NodeList *arg_nodes = node->apply_value.args;
         while (env->error_arg > 0) {
           arg_nodes = arg_nodes->tail;
           env->error_arg--;
@@ -103,128 +100,83 @@ static InterpreterResult eval_apply(Node node, Env *env) {
       }
       env_clear_error(env);
     }
-    return RESULT_VALUE(return_value);
+    return return_value;
   } else if (callee.type == V_CLOSURE) {
-    Env *closure_env = create_child_env(callee.closure_value->env);
-    int i = 0;
-    NameList *params = callee.closure_value->params;
-    while (params) {
-      Value arg;
-      if (i < args->size) {
-        arg = args->values[i];
-      } else {
-        arg = nil_value;
-      }
-      env_put(params->head, arg, closure_env);
-      params = params->tail;
-      i++;
-    }
-    result = interpret(callee.closure_value->body, closure_env);
-    return RESULT_VALUE(result.value);
+    return call_closure(callee.closure_value, args, env);
   } else {
     if (!suppress || callee.type != V_NIL) {
-      eval_error(*node.apply_value.callee, "value of type %s is not a function", value_name(callee.type));
+      eval_error(node->apply_value.callee, "value of type %s is not a function", value_name(callee.type));
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
 }
 
-static InterpreterResult eval_subscript(Node node, Env *env, int suppress_name_error) {
-  int suppress_type_error = node.subscript_value.list->type == N_SUPPRESS;
-  InterpreterResult result = interpret(*node.subscript_value.list, env);
-  if (result.type != IR_VALUE) {
-    return result;
-  }
-  Value object = result.value;
-  result = interpret(*node.subscript_value.index, env);
-  if (result.type != IR_VALUE) {
-    return result;
-  }
-  Value index = result.value;
+static Value eval_subscript(const Node *node, Value object, Value index, int suppress_name_error) {
+  int suppress_type_error = node->subscript_value.list->type == N_SUPPRESS;
   if (object.type == V_OBJECT) {
     Value value;
     if (object_get(object.object_value, index, &value)) {
-      return RESULT_VALUE(value);
+      return value;
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
   if (index.type != V_INT) {
     if (!suppress_name_error) {
-      eval_error(*node.subscript_value.index, "value of type %s is not a valid array index", value_name(index.type));
+      eval_error(node->subscript_value.index, "value of type %s is not a valid array index", value_name(index.type));
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
   if (object.type == V_ARRAY) {
     if (index.int_value < 0 || index.int_value >= object.array_value->size) {
       if (!suppress_name_error) {
-        eval_error(*node.subscript_value.index, "array index out of range: %" PRId64, index.int_value);
+        eval_error(node->subscript_value.index, "array index out of range: %" PRId64, index.int_value);
       }
-      return RESULT_VALUE(nil_value);
+      return nil_value;
     }
-    return RESULT_VALUE(object.array_value->cells[index.int_value]);
+    return object.array_value->cells[index.int_value];
   } else if (object.type == V_STRING) {
     if (index.int_value < 0 || index.int_value >= object.string_value->size) {
       if (!suppress_name_error) {
-        eval_error(*node.subscript_value.index, "string index out of range: %" PRId64, index.int_value);
+        eval_error(node->subscript_value.index, "string index out of range: %" PRId64, index.int_value);
       }
-      return RESULT_VALUE(nil_value);
+      return nil_value;
     }
-    return RESULT_VALUE(create_int(object.string_value->bytes[index.int_value]));
+    return create_int(object.string_value->bytes[index.int_value]);
   } else {
     if (!suppress_type_error || object.type != V_NIL) {
-      eval_error(*node.subscript_value.list, "value of type %s is not indexable", value_name(object.type));
+      eval_error(node->subscript_value.list, "value of type %s is not indexable", value_name(object.type));
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
 }
 
-static InterpreterResult eval_dot(Node node, Env *env, int suppress_name_error) {
-  int suppress_type_error = node.dot_value.object->type == N_SUPPRESS;
-  InterpreterResult result = interpret(*node.dot_value.object, env);
-  if (result.type != IR_VALUE) {
-    return result;
-  }
-  Value object = result.value;
+static Value eval_dot(const Node *node, Value object, int suppress_name_error) {
+  int suppress_type_error = node->dot_value.object->type == N_SUPPRESS;
   if (object.type != V_OBJECT) {
     if (!suppress_type_error || object.type != V_NIL) {
-      eval_error(*node.dot_value.object, "value of type %s is not an object", value_name(object.type));
+      eval_error(node->dot_value.object, "value of type %s is not an object", value_name(object.type));
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
-  Value key = create_symbol(node.dot_value.name);
+  Value key = create_symbol(node->dot_value.name);
   Value value;
   if (object_get(object.object_value, key, &value)) {
-    return RESULT_VALUE(value);
+    return value;
   }
   if (!suppress_name_error) {
-    eval_error(node, "undefined object property: %s", node.dot_value.name);
+    eval_error(node, "undefined object property: %s", node->dot_value.name);
   }
-  return RESULT_VALUE(nil_value);
+  return nil_value;
 }
 
-static InterpreterResult eval_prefix(Node node, Env *env) {
-  InterpreterResult operand = interpret(*node.prefix_value.operand, env);
-  if (operand.type != IR_VALUE) {
-    return operand;
-  }
-  switch (node.prefix_value.operator) {
-    case P_NOT:
-      if (is_truthy(operand.value)) {
-        return RESULT_VALUE(nil_value);
-      } else {
-        return RESULT_VALUE(true_value);
-      }
-    case P_NEG:
-      if (operand.value.type == V_INT) {
-        return RESULT_VALUE(create_int(-operand.value.int_value));
-      } else if (operand.value.type == V_FLOAT) {
-        return RESULT_VALUE(create_float(-operand.value.float_value));
-      } else {
-        eval_error(*node.prefix_value.operand, "value of type is not a number", value_name(operand.value.type));
-        return RESULT_VALUE(nil_value);
-      }
-  }
-  return RESULT_VALUE(nil_value);
+static Value eval_neg(const Node *node, Value operand) {
+  if (operand.type == V_INT) {
+    return create_int(-operand.int_value);
+  } else if (operand.type == V_FLOAT) {
+    return create_float(-operand.float_value);
+  }
+  eval_error(node->prefix_value.operand, "value of type is not a number", value_name(operand.type));
+  return nil_value;
 }
 
 static Value concatenate_strings(Value left, Value right, Env *env) {
@@ -234,9 +186,9 @@ static Value concatenate_strings(Value left, Value right, Env *env) {
   return finalize_string_buffer(buffer);
 }
 
-static InterpreterResult eval_add(Node node, Value left, Value right, Env *env) {
+static Value eval_add(const Node *node, Value left, Value right, Env *env) {
   if (left.type == V_STRING || right.type == V_STRING) {
-    return RESULT_VALUE(concatenate_strings(left, right, env));
+    return concatenate_strings(left, right, env);
   } else if (left.type == V_ARRAY && right.type == V_ARRAY) {
     Value result = create_array(left.array_value->size + right.array_value->size, env->arena);
     for (size_t i = 0; i < left.array_value->size; i++) {
@@ -245,7 +197,7 @@ static InterpreterResult eval_add(Node node, Value left, Value right, Env *env)
     for (size_t i = 0; i < right.array_value->size; i++) {
       array_push(result.array_value, right.array_value->cells[i], env->arena);
     }
-    return RESULT_VALUE(result);
+    return result;
   } else if (left.type == V_OBJECT && right.type == V_OBJECT) {
     Value result = create_object(object_size(left.object_value) + object_size(right.object_value), env->arena);
     Value key, value;
@@ -257,96 +209,96 @@ static InterpreterResult eval_add(Node node, Value left, Value right, Env *env)
     while (object_iterator_next(&it, &key, &value)) {
       object_put(result.object_value, key, value, env->arena);
     }
-    return RESULT_VALUE(result);
+    return result;
   } else if (left.type == V_INT) {
     if (right.type == V_INT) {
-      return RESULT_VALUE(create_int(left.int_value + right.int_value));
+      return create_int(left.int_value + right.int_value);
     } else if (right.type == V_FLOAT) {
-      return RESULT_VALUE(create_float(left.int_value + right.float_value));
+      return create_float(left.int_value + right.float_value);
     }
   } else if (left.type == V_FLOAT) {
     if (right.type == V_INT) {
-      return RESULT_VALUE(create_float(left.float_value + right.int_value));
+      return create_float(left.float_value + right.int_value);
     } else if (right.type == V_FLOAT) {
-      return RESULT_VALUE(create_float(left.float_value + right.float_value));
+      return create_float(left.float_value + right.float_value);
     }
   }
   eval_error(node, "'+'-operator undefined for types %s and %s", value_name(left.type),
       value_name(right.type));
-  return RESULT_VALUE(nil_value);
+  return nil_value;
 }
 
-static InterpreterResult eval_sub(Node node, Value left, Value right, Env *env) {
+static Value eval_sub(const Node *node, Value left, Value right, Env *env) {
   if (left.type == V_INT) {
     if (right.type == V_INT) {
-      return RESULT_VALUE(create_int(left.int_value - right.int_value));
+      return create_int(left.int_value - right.int_value);
     } else if (right.type == V_FLOAT) {
-      return RESULT_VALUE(create_float(left.int_value - right.float_value));
+      return create_float(left.int_value - right.float_value);
     }
   } else if (left.type == V_FLOAT) {
     if (right.type == V_INT) {
-      return RESULT_VALUE(create_float(left.float_value - right.int_value));
+      return create_float(left.float_value - right.int_value);
     } else if (right.type == V_FLOAT) {
-      return RESULT_VALUE(create_float(left.float_value - right.float_value));
+      return create_float(left.float_value - right.float_value);
     }
   }
   eval_error(node, "'-'-operator undefined for types %s and %s", value_name(left.type),
       value_name(right.type));
-  return RESULT_VALUE(nil_value);
+  return nil_value;
 }
 
-static InterpreterResult eval_mul(Node node, Value left, Value right, Env *env) {
+static Value eval_mul(const Node *node, Value left, Value right, Env *env) {
   if (left.type == V_INT) {
     if (right.type == V_INT) {
-      return RESULT_VALUE(create_int(left.int_value * right.int_value));
+      return create_int(left.int_value * right.int_value);
     } else if (right.type == V_FLOAT) {
-      return RESULT_VALUE(create_float(left.int_value * right.float_value));
+      return create_float(left.int_value * right.float_value);
     }
   } else if (left.type == V_FLOAT) {
     if (right.type == V_INT) {
-      return RESULT_VALUE(create_float(left.float_value * right.int_value));
+      return create_float(left.float_value * right.int_value);
     } else if (right.type == V_FLOAT) {
-      return RESULT_VALUE(create_float(left.float_value * right.float_value));
+      return create_float(left.float_value * right.float_value);
     }
   }
   eval_error(node, "'*'-operator undefined for types %s and %s", value_name(left.type),
       value_name(right.type));
-  return RESULT_VALUE(nil_value);
+  return nil_value;
 }
 
-static InterpreterResult eval_div(Node node, Value left, Value right, Env *env) {
+static Value eval_div(const Node *node, Value left, Value right, Env *env) {
   if (left.type == V_INT) {
     if (right.type == V_INT) {
       if (right.int_value == 0) {
         eval_error(node, "divide by zero");
-        return RESULT_VALUE(nil_value);
+        return nil_value;
       }
-      return RESULT_VALUE(create_int(left.int_value / right.int_value));
+      return create_int(left.int_value / right.int_value);
     } else if (right.type == V_FLOAT) {
-      return RESULT_VALUE(create_float(left.int_value / right.float_value));
+      return create_float(left.int_value / right.float_value);
     }
   } else if (left.type == V_FLOAT) {
     if (right.type == V_INT) {
-      return RESULT_VALUE(create_float(left.float_value / right.int_value));
+      return create_float(left.float_value / right.int_value);
     } else if (right.type == V_FLOAT) {
-      return RESULT_VALUE(create_float(left.float_value / right.float_value));
+      return create_float(left.float_value / right.float_value);
     }
   }
   eval_error(node, "'/'-operator undefined for types %s and %s", value_name(left.type),
       value_name(right.type));
-  return RESULT_VALUE(nil_value);
+  return nil_value;
 }
 
-static InterpreterResult eval_mod(Node node, Value left, Value right, Env *env) {
+static Value eval_mod(const Node *node, Value left, Value right, Env *env) {
   if (left.type == V_INT && right.type == V_INT) {
-    return RESULT_VALUE(create_int(left.int_value % right.int_value));
+    return create_int(left.int_value % right.int_value);
   }
   eval_error(node, "'%%'-operator undefined for types %s and %s", value_name(left.type),
       value_name(right.type));
-  return RESULT_VALUE(nil_value);
+  return nil_value;
 }
 
-static Comparison compare_values(Node node, Value left, Value right, const char *op, Env *env) {
+static Comparison compare_values(const Node *node, Value left, Value right, const char *op, Env *env) {
   if (left.type == V_INT) {
     if (right.type == V_INT) {
       if (left.int_value < right.int_value) {
@@ -389,242 +341,8 @@ static Comparison compare_values(Node node, Value left, Value right, const char
   return C_ERROR;
 }
 
-static InterpreterResult eval_infix(Node node, Env *env) {
-  InterpreterResult right, left = interpret(*node.infix_value.left, env);
-  if (left.type != IR_VALUE) {
-    return left;
-  }
-  if (node.infix_value.operator != I_AND && node.infix_value.operator != I_OR) {
-    right = interpret(*node.infix_value.right, env);
-    if (right.type != IR_VALUE) {
-      return right;
-    }
-  }
-  switch (node.infix_value.operator) {
-    case I_NONE:
-      return RESULT_VALUE(nil_value);
-    case I_ADD:
-      return eval_add(node, left.value, right.value, env);
-    case I_SUB:
-      return eval_sub(node, left.value, right.value, env);
-    case I_MUL:
-      return eval_mul(node, left.value, right.value, env);
-    case I_DIV:
-      return eval_div(node, left.value, right.value, env);
-    case I_MOD:
-      return eval_mod(node, left.value, right.value, env);
-    case I_LT:
-      return compare_values(node, left.value, right.value, "<", env) == C_LT
-        ? RESULT_VALUE(true_value)
-        : RESULT_VALUE(nil_value);
-    case I_LEQ: {
-      Comparison c = compare_values(node, left.value, right.value, "<", env);
-      return c == C_LT || c == C_EQ
-        ? RESULT_VALUE(true_value)
-        : RESULT_VALUE(nil_value);
-    }
-    case I_GT:
-      return compare_values(node, left.value, right.value, ">", env) == C_GT
-        ? RESULT_VALUE(true_value)
-        : RESULT_VALUE(nil_value);
-    case I_GEQ: {
-      Comparison c = compare_values(node, left.value, right.value, "<", env);
-      return c == C_GT || c == C_EQ
-        ? RESULT_VALUE(true_value)
-        : RESULT_VALUE(nil_value);
-    }
-    case I_EQ:
-      if (equals(left.value, right.value)) {
-        return RESULT_VALUE(true_value);
-      }
-      return RESULT_VALUE(nil_value);
-    case I_NEQ:
-      if (equals(left.value, right.value)) {
-        return RESULT_VALUE(nil_value);
-      }
-      return RESULT_VALUE(true_value);
-    case I_AND:
-      if (is_truthy(left.value)) {
-        return interpret(*node.infix_value.right, env);
-      }
-      return RESULT_VALUE(nil_value);
-    case I_OR:
-      if (is_truthy(left.value)) {
-        return left;
-      }
-      return interpret(*node.infix_value.right, env);
-  }
-  return RESULT_VALUE(nil_value);
-}
-
-static InterpreterResult eval_if(Node node, Env *env) {
-  InterpreterResult cond = interpret(*node.if_value.cond, env);
-  if (cond.type != IR_VALUE) {
-    return cond;
-  }
-  if (is_truthy(cond.value)) {
-    return interpret(*node.if_value.cons, env);
-  }
-  if (node.if_value.alt) {
-    return interpret(*node.if_value.alt, env);
-  }
-  return RESULT_VALUE(nil_value);
-}
-
-static InterpreterResult eval_for(Node node, Env *env) {
-  InterpreterResult result = interpret(*node.for_value.collection, env);
-  if (result.type != IR_VALUE) {
-    return result;
-  }
-  Value collection = result.value;
-  if (collection.type == V_ARRAY) {
-    if (collection.array_value->size == 0) {
-      if (node.for_value.alt) {
-        return interpret(*node.for_value.alt, env);
-      }
-      return RESULT_VALUE(nil_value);
-    }
-    Buffer buffer = create_buffer(0);
-    for (size_t i = 0; i < collection.array_value->size; i++) {
-      if (node.for_value.key) {
-        env_put(node.for_value.key, create_int(i), env);
-      }
-      env_put(node.for_value.value, collection.array_value->cells[i], env);
-      int64_t loops = env->loops;
-      env->loops = loops + 1;
-      result = interpret(*node.for_value.body, env);
-      env->loops = loops;
-      if (result.type != IR_RETURN) {
-        value_to_string(result.value, &buffer);
-      }
-      if (result.type == IR_CONTINUE && result.level <= 1) {
-        continue;
-      } else if (result.type != IR_VALUE) {
-        break;
-      }
-    }
-    if (result.type == IR_RETURN) {
-      delete_buffer(buffer);
-      return result;
-    } 
-    Value string = create_string(buffer.data, buffer.size, env->arena);
-    delete_buffer(buffer);
-    if ((result.type == IR_CONTINUE || result.type == IR_BREAK) && result.level > 1) {
-      result.value = string;
-      result.level--;
-      return result;
-    }
-    return RESULT_VALUE(string);
-  } else if (collection.type == V_OBJECT) {
-    if (!object_size(collection.object_value)) {
-      if (node.for_value.alt) {
-        return interpret(*node.for_value.alt, env);
-      }
-      return RESULT_VALUE(nil_value);
-    }
-    Buffer buffer = create_buffer(0);
-    Value key, value;
-    ObjectIterator it = iterate_object(collection.object_value);
-    while (object_iterator_next(&it, &key, &value)) {
-      if (node.for_value.key) {
-        env_put(node.for_value.key, key, env);
-      }
-      env_put(node.for_value.value, value, env);
-      int64_t loops = env->loops;
-      env->loops = loops + 1;
-      result = interpret(*node.for_value.body, env);
-      env->loops = loops;
-      if (result.type != IR_RETURN) {
-        value_to_string(result.value, &buffer);
-      }
-      if (result.type == IR_CONTINUE && result.level <= 1) {
-        continue;
-      } else if (result.type != IR_VALUE) {
-        break;
-      }
-    }
-    if (result.type == IR_RETURN) {
-      delete_buffer(buffer);
-      return result;
-    } 
-    Value string = create_string(buffer.data, buffer.size, env->arena);
-    delete_buffer(buffer);
-    if ((result.type == IR_CONTINUE || result.type == IR_BREAK) && result.level > 1) {
-      result.value = string;
-      result.level--;
-      return result;
-    }
-    return RESULT_VALUE(string);
-  } else if (collection.type == V_STRING) {
-    if (collection.string_value->size == 0) {
-      if (node.for_value.alt) {
-        return interpret(*node.for_value.alt, env);
-      }
-      return RESULT_VALUE(nil_value);
-    }
-    Buffer buffer = create_buffer(0);
-    for (size_t i = 0; i < collection.string_value->size; i++) {
-      if (node.for_value.key) {
-        env_put(node.for_value.key, create_int(i), env);
-      }
-      env_put(node.for_value.value, create_int(collection.string_value->bytes[i]), env);
-      int64_t loops = env->loops;
-      env->loops = loops + 1;
-      result = interpret(*node.for_value.body, env);
-      env->loops = loops;
-      if (result.type != IR_RETURN) {
-        value_to_string(result.value, &buffer);
-      }
-      if (result.type == IR_CONTINUE && result.level <= 1) {
-        continue;
-      } else if (result.type != IR_VALUE) {
-        break;
-      }
-    }
-    if (result.type == IR_RETURN) {
-      delete_buffer(buffer);
-      return result;
-    } 
-    Value string = create_string(buffer.data, buffer.size, env->arena);
-    delete_buffer(buffer);
-    if ((result.type == IR_CONTINUE || result.type == IR_BREAK) && result.level > 1) {
-      result.value = string;
-      result.level--;
-      return result;
-    }
-    return RESULT_VALUE(string);
-  } else {
-    eval_error(*node.for_value.collection, "value of type %s is not iterable", value_name(collection.type));
-    if (node.for_value.alt) {
-      return interpret(*node.for_value.alt, env);
-    }
-    return RESULT_VALUE(nil_value);
-  }
-}
-
-static InterpreterResult eval_switch(Node node, Env *env) {
-  InterpreterResult a = interpret(*node.switch_value.expr, env);
-  if (a.type != IR_VALUE) {
-    return a;
-  }
-  while (node.switch_value.cases) {
-    InterpreterResult b = interpret(node.switch_value.cases->key, env);
-    if (b.type != IR_VALUE) {
-      return b;
-    }
-    if (equals(a.value, b.value)) {
-      return interpret(node.switch_value.cases->value, env);
-    }
-    node.switch_value.cases = node.switch_value.cases->tail;
-  }
-  if (node.switch_value.default_case) {
-    return interpret(*node.switch_value.default_case, env);
-  }
-  return RESULT_VALUE(nil_value);
-}
-
-static InterpreterResult eval_assign_operator(Node node, Value existing, Value value, Env *env) {
-  switch (node.assign_value.operator) {
+static Value eval_assign_operator(const Node *node, Value existing, Value value, Env *env) {
+  switch (node->assign_value.operator) {
     case I_ADD:
       return eval_add(node, existing, value, env);
     case I_SUB:
@@ -634,272 +352,425 @@ static InterpreterResult eval_assign_operator(Node node, Value existing, Value v
     case I_DIV:
       return eval_div(node, existing, value, env);
     default:
-      return RESULT_VALUE(value);
+      return value;
   }
 }
 
-static InterpreterResult eval_assign(Node node, Env *env) {
-  InterpreterResult result = interpret(*node.assign_value.right, env);
-  if (result.type != IR_VALUE) {
-    return result;
-  }
-  Value value = result.value;
-  switch (node.assign_value.left->type) {
+/* Assigns `operands[0]` to the left side of the assignment. For subscripts and properties the object and index are
+ * stored in the following operands. */
+static void eval_assign(const Node *node, const Value *operands, Env *env) {
+  Value value = operands[0];
+  switch (node->assign_value.left->type) {
     case N_NAME: {
-      if (node.assign_value.operator != I_NONE) {
+      if (node->assign_value.operator != I_NONE) {
         Value existing;
-        if (!env_get(node.assign_value.left->name_value, &existing, env)) {
-          eval_error(*node.assign_value.left, "undefined variable: %s",
-              node.assign_value.left->name_value);
-          return RESULT_VALUE(nil_value);
-        }
-        result = eval_assign_operator(node, existing, value, env);
-        if (result.type != IR_VALUE) {
-          return result;
+        if (!env_get_slot(node->assign_value.left->slot, node->assign_value.left->name_value, &existing, env)) {
+          eval_error(node->assign_value.left, "undefined variable: %s",
+              node->assign_value.left->name_value);
+          return;
         }
-        value = result.value;
+        value = eval_assign_operator(node, existing, value, env);
       }
-      env_put(node.assign_value.left->name_value, value, env);
+      env_put_slot(node->assign_value.left->slot, node->assign_value.left->name_value, value, env);
       break;
     }
     case N_SUBSCRIPT: {
-      result = interpret(*node.assign_value.left->subscript_value.list, env);
-      if (result.type != IR_VALUE) {
-        return result;
-      }
-      Value object = result.value;
-      result = interpret(*node.assign_value.left->subscript_value.index, env);
-      if (result.type != IR_VALUE) {
-        return result;
-      }
-      Value index = result.value;
-      if (object.type == V_OBJECT) {
-        if (node.assign_value.operator != I_NONE) {
+      Value object = operands[1];
+      Value index = operands[2];
+      if (!is_writable(object, env)) {
+        eval_error(node->assign_value.left->subscript_value.list, "value of type %s is read-only",
+            value_name(object.type));
+      } else if (object.type == V_OBJECT) {
+        if (node->assign_value.operator != I_NONE) {
           Value existing;
           if (!object_get(object.object_value, index, &existing)) {
-            eval_error(*node.assign_value.left, "undefined object property");
-            return RESULT_VALUE(nil_value);
-          }
-          result = eval_assign_operator(node, existing, value, env);
-          if (result.type != IR_VALUE) {
-            return result;
+            eval_error(node->assign_value.left, "undefined object property");
+            return;
           }
-          value = result.value;
+          value = eval_assign_operator(node, existing, value, env);
         }
         object_put(object.object_value, index, value, env->arena);
       } else if (object.type == V_ARRAY) {
         if (index.type != V_INT) {
-          eval_error(*node.assign_value.left->subscript_value.index,
+          eval_error(node->assign_value.left->subscript_value.index,
               "value of type %s is not a valid array index", value_name(index.type));
         } else if (index.int_value < 0 || index.int_value >= object.array_value->size) {
-          eval_error(*node.assign_value.left->subscript_value.index,
+          eval_error(node->assign_value.left->subscript_value.index,
               "array index out of range: %" PRId64, index.int_value);
         } else {
-          if (node.assign_value.operator != I_NONE) {
-            result = eval_assign_operator(node, object.array_value->cells[index.int_value], value, env);
-            if (result.type != IR_VALUE) {
-              return result;
-            }
-            value = result.value;
+          if (node->assign_value.operator != I_NONE) {
+            value = eval_assign_operator(node, object.array_value->cells[index.int_value], value, env);
           }
           object.array_value->cells[index.int_value] = value;
         }
       } else {
-        eval_error(*node.assign_value.left->subscript_value.list, "value of type %s is not indexable",
+        eval_error(node->assign_value.left->subscript_value.list, "value of type %s is not indexable",
             value_name(object.type));
       }
       break;
     }
     case N_DOT: {
-      result = interpret(*node.assign_value.left->dot_value.object, env);
-      if (result.type != IR_VALUE) {
-        return result;
-      }
-      Value object = result.value;
-      if (object.type == V_OBJECT) {
-        Value key = create_symbol(node.assign_value.left->dot_value.name);
-        if (node.assign_value.operator != I_NONE) {
+      Value object = operands[1];
+      if (!is_writable(object, env)) {
+        eval_error(node->assign_value.left->dot_value.object, "value of type %s is read-only",
+            value_name(object.type));
+      } else if (object.type == V_OBJECT) {
+        Value key = create_symbol(node->assign_value.left->dot_value.name);
+        if (node->assign_value.operator != I_NONE) {
           Value existing;
           if (!object_get(object.object_value, key, &existing)) {
-            eval_error(*node.assign_value.left, "undefined object property: %s",
+            eval_error(node->assign_value.left, "undefined object property: %s",
                 key.symbol_value);
-            return RESULT_VALUE(nil_value);
-          }
-          result = eval_assign_operator(node, existing, value, env);
-          if (result.type != IR_VALUE) {
-            return result;
+            return;
           }
-          value = result.value;
+          value = eval_assign_operator(node, existing, value, env);
         }
         object_put(object.object_value, key, value, env->arena);
       } else {
-        eval_error(*node.assign_value.left->dot_value.object, "value of type %s is not an object",
+        eval_error(node->assign_value.left->dot_value.object, "value of type %s is not an object",
             value_name(object.type));
       }
       break;
     }
     default:
-      eval_error(*node.assign_value.left, "left side of assignment is invalid");
+      eval_error(node->assign_value.left, "left side of assignment is invalid");
       break;
   }
-  return RESULT_VALUE(nil_value);
 }
 
-InterpreterResult interpret(Node node, Env *env) {
-  switch (node.type) {
-    case N_NAME: {
-      Value value;
-      if (env_get(node.name_value, &value, env)) {
-        return RESULT_VALUE(value);
-      }
-      eval_error(node, "undefined variable: %s", node.name_value);
-      return RESULT_VALUE(nil_value);
-    }
-    case N_INT:
-      return RESULT_VALUE(create_int(node.int_value));
-    case N_FLOAT:
-      return RESULT_VALUE(create_float(node.float_value));
-    case N_STRING:
-      return RESULT_VALUE(create_string(node.string_value.bytes, node.string_value.size, env->arena));
-    case N_LIST: {
-      Value array = create_array(LL_SIZE(node.list_value), env->arena);
-      while (node.list_value) {
-        InterpreterResult result = interpret(node.list_value->head, env);
-        if (result.type != IR_VALUE) {
-          return result;
-        }
-        array_push(array.array_value, result.value, env->arena);
-        node.list_value = node.list_value->tail;
-      }
-      return RESULT_VALUE(array);
+/* Checks that the collection of a for-loop is iterable. Returns 0 if the loop should be skipped. */
+static int begin_iteration(const Node *node, Value collection) {
+  switch (collection.type) {
+    case V_ARRAY:
+      return collection.array_value->size > 0;
+    case V_OBJECT:
+      return object_size(collection.object_value) > 0;
+    case V_STRING:
+      return collection.string_value->size > 0;
+    default:
+      eval_error(node->for_value.collection, "value of type %s is not iterable", value_name(collection.type));
+      return 0;
+  }
+}
+
+/* Assigns the next element of a collection to the loop variables. `state` contains the collection and the index of
+ * the next element. Returns 0 when there are no more elements. */
+static int next_iteration(const Node *node, Value *state, Env *env) {
+  Value collection = state[0];
+  int64_t i = state[1].int_value;
+  Value key, value;
+  if (collection.type == V_ARRAY) {
+    if (i >= collection.array_value->size) {
+      return 0;
     }
-    case N_OBJECT: {
-      Value object = create_object(LL_SIZE(node.object_value), env->arena);
-      while (node.object_value) {
-        if (node.object_value->key.type == N_NAME) {
-          InterpreterResult result = interpret(node.object_value->value, env);
-          if (result.type != IR_VALUE) {
-            return result;
-          }
-          object_put(object.object_value, create_symbol(node.object_value->key.name_value),
-              result.value, env->arena);
-        } else {
-          InterpreterResult key_result = interpret(node.object_value->key, env);
-          if (key_result.type != IR_VALUE) {
-            return key_result;
-          }
-          InterpreterResult value_result = interpret(node.object_value->value, env);
-          if (value_result.type != IR_VALUE) {
-            return value_result;
-          }
-          object_put(object.object_value, key_result.value, value_result.value, env->arena);
-        }
-        node.object_value = node.object_value->tail;
-      }
-      return RESULT_VALUE(object);
+    key = create_int(i);
+    value = collection.array_value->cells[i];
+    state[1].int_value = i + 1;
+  } else if (collection.type == V_OBJECT) {
+    ObjectIterator it = iterate_object(collection.object_value);
+    it.next_index = i;
+    if (!object_iterator_next(&it, &key, &value)) {
+      return 0;
     }
-    case N_APPLY:
-      return eval_apply(node, env);
-    case N_SUBSCRIPT:
-      return eval_subscript(node, env, 0);
-    case N_DOT:
-      return eval_dot(node, env, 0);
-    case N_PREFIX:
-      return eval_prefix(node, env);
-    case N_INFIX:
-      return eval_infix(node, env);
-    case N_TUPLE:
-      eval_error(node, "unexpected tuple");
-      return RESULT_VALUE(nil_value);
-    case N_FN:
-      return RESULT_VALUE(create_closure(node.fn_value.params, node.fn_value.free_variables,
-            *node.fn_value.body, env, env->arena));
-    case N_IF:
-      return eval_if(node, env);
-    case N_FOR:
-      return eval_for(node, env);
-    case N_SWITCH:
-      return eval_switch(node, env);
-    case N_EXPORT: {
-      if (node.export_value.right) {
-        InterpreterResult result = interpret(*node.export_value.right, env);
-        if (result.type != IR_VALUE) {
-          return result;
-        }
-        env_put(node.export_value.left, result.value, env);
-      }
-      array_push(env->exports, create_symbol(node.export_value.left), env->arena);
-      return RESULT_VALUE(nil_value);
+    state[1].int_value = it.next_index;
+  } else {
+    if (i >= collection.string_value->size) {
+      return 0;
     }
-    case N_ASSIGN:
-      return eval_assign(node, env);
-    case N_BLOCK: {
-      Buffer buffer = create_buffer(0);
-      while (node.block_value) {
-        InterpreterResult result = interpret(node.block_value->head, env);
-        if (result.type != IR_VALUE) {
-          if (result.type != IR_RETURN) {
-            value_to_string(result.value, &buffer);
-            result.value = create_string(buffer.data, buffer.size, env->arena);
+    key = create_int(i);
+    value = create_int(collection.string_value->bytes[i]);
+    state[1].int_value = i + 1;
+  }
+  if (node->for_value.key) {
+    env_put_slot(node->for_value.key_slot, node->for_value.key, key, env);
+  }
+  env_put_slot(node->for_value.value_slot, node->for_value.value, value, env);
+  return 1;
+}
+
+static void control_error(const Node *node, int loops) {
+  const char *keyword = node->type == N_BREAK ? "break" : "continue";
+  if (!loops) {
+    eval_error(node, "unexpected %s outside of loop", keyword);
+  } else {
+    eval_error(node, "invalid numeric argument for %s, expected an integer between 1 and %d", keyword, loops);
+  }
+}
+
+/* Executes compiled code. Values of statements are written to `output`, which may be NULL if the code doesn't write
+ * any output outside of blocks whose output is captured. Returns IR_RETURN if the code was ended by a return
+ * statement. */
+static InterpreterResultType execute(const Code *code, Buffer *output, Value *result, Env *env) {
+  Value *stack = alloca(code->stack_size * sizeof(Value));
+  Value *top = stack;
+  Buffer local_buffer;
+  if (!output && code->buffered) {
+    local_buffer = create_buffer(0);
+    output = &local_buffer;
+  }
+  const Instruction *ip = code->instructions;
+  while (ip->op != OP_RETURN && ip->op != OP_EXIT) {
+    const Node *node = ip->node;
+    switch (ip->op) {
+      case OP_NIL:
+        *(top++) = nil_value;
+        break;
+      case OP_INT:
+        *(top++) = create_int(node->int_value);
+        break;
+      case OP_FLOAT:
+        *(top++) = create_float(node->float_value);
+        break;
+      case OP_STRING:
+        *(top++) = create_string(node->string_value.bytes, node->string_value.size, env->arena);
+        break;
+      case OP_SYMBOL:
+        *(top++) = create_symbol(node->name_value);
+        break;
+      case OP_LOAD:
+        if (!env_get_slot(node->slot, node->name_value, top, env)) {
+          if (!ip->arg) {
+            eval_error(node, "undefined variable: %s", node->name_value);
           }
-          delete_buffer(buffer);
-          return result;
+          *top = nil_value;
         }
-        value_to_string(result.value, &buffer);
-        node.block_value = node.block_value->tail;
-      }
-      Value result = create_string(buffer.data, buffer.size, env->arena);
-      delete_buffer(buffer);
-      return RESULT_VALUE(result);
-    }
-    case N_SUPPRESS:
-      switch (node.suppress_value->type) {
-        case N_NAME: {
-          Value value;
-          if (env_get(node.suppress_value->name_value, &value, env)) {
-            return RESULT_VALUE(value);
-          }
-          return RESULT_VALUE(nil_value);
+        top++;
+        break;
+      case OP_LIST: {
+        top -= ip->arg;
+        Value array = create_array(ip->arg, env->arena);
+        for (int i = 0; i < ip->arg; i++) {
+          array_push(array.array_value, top[i], env->arena);
         }
-        case N_SUBSCRIPT:
-          return eval_subscript(*node.suppress_value, env, 1);
-        case N_DOT:
-          return eval_dot(*node.suppress_value, env, 1);
-        default:
-          return interpret(*node.suppress_value, env);
+        *(top++) = array;
+        break;
       }
-    case N_RETURN: {
-      if (node.return_value) {
-        InterpreterResult result = interpret(*node.return_value, env);
-        if (result.type != IR_VALUE) {
-          return result;
+      case OP_OBJECT: {
+        top -= 2 * ip->arg;
+        Value object = create_object(ip->arg, env->arena);
+        for (int i = 0; i < ip->arg; i++) {
+          object_put(object.object_value, top[2 * i], top[2 * i + 1], env->arena);
         }
-        return (InterpreterResult) { IR_RETURN, result.value };
+        *(top++) = object;
+        break;
       }
-      return (InterpreterResult) { IR_RETURN, nil_value };
-    }
-    case N_BREAK:
-      if (!env->loops) {
-        eval_error(node, "unexpected break outside of loop");
-        return RESULT_VALUE(nil_value);
+      case OP_CALL:
+        top -= ip->arg + 1;
+        *top = eval_apply(node, top[ip->arg], top, ip->arg, env);
+        top++;
+        break;
+      case OP_CALL_NAME: {
+        top -= ip->arg;
+        Value callee;
+        if (env_get(node->apply_value.callee->name_value, &callee, env)) {
+          *top = eval_apply(node, callee, top, ip->arg, env);
+        } else {
+          eval_error(node->apply_value.callee, "undefined function: %s", node->apply_value.callee->name_value);
+          *top = nil_value;
+        }
+        top++;
+        break;
       }
-      if (node.break_value < 1 || node.break_value > env->loops) {
-        eval_error(node, "invalid numeric argument for break, expected an integer between 1 and %" PRId64,
-            env->loops);
-        node.break_value = node.break_value < 1 ? 1 : env->loops;
+      case OP_SUBSCRIPT:
+        top--;
+        top[-1] = eval_subscript(node, top[-1], top[0], ip->arg);
+        break;
+      case OP_DOT:
+        top[-1] = eval_dot(node, top[-1], ip->arg);
+        break;
+      case OP_NOT:
+        top[-1] = is_truthy(top[-1]) ? nil_value : true_value;
+        break;
+      case OP_NEG:
+        top[-1] = eval_neg(node, top[-1]);
+        break;
+      case OP_ADD:
+        top--;
+        top[-1] = eval_add(node, top[-1], top[0], env);
+        break;
+      case OP_SUB:
+        top--;
+        top[-1] = eval_sub(node, top[-1], top[0], env);
+        break;
+      case OP_MUL:
+        top--;
+        top[-1] = eval_mul(node, top[-1], top[0], env);
+        break;
+      case OP_DIV:
+        top--;
+        top[-1] = eval_div(node, top[-1], top[0], env);
+        break;
+      case OP_MOD:
+        top--;
+        top[-1] = eval_mod(node, top[-1], top[0], env);
+        break;
+      case OP_LT:
+        top--;
+        top[-1] = compare_values(node, top[-1], top[0], "<", env) == C_LT ? true_value : nil_value;
+        break;
+      case OP_LEQ: {
+        top--;
+        Comparison c = compare_values(node, top[-1], top[0], "<", env);
+        top[-1] = c == C_LT || c == C_EQ ? true_value : nil_value;
+        break;
       }
-      return (InterpreterResult) { IR_BREAK, nil_value, node.break_value };
-    case N_CONTINUE:
-      if (!env->loops) {
-        eval_error(node, "unexpected continue outside of loop");
-        return RESULT_VALUE(nil_value);
+      case OP_GT:
+        top--;
+        top[-1] = compare_values(node, top[-1], top[0], ">", env) == C_GT ? true_value : nil_value;
+        break;
+      case OP_GEQ: {
+        top--;
+        Comparison c = compare_values(node, top[-1], top[0], "<", env);
+        top[-1] = c == C_GT || c == C_EQ ? true_value : nil_value;
+        break;
       }
-      if (node.continue_value < 1 || node.continue_value > env->loops) {
-        eval_error(node, "invalid numeric argument for continue, expected an integer between 1 and %" PRId64,
-            env->loops);
-        node.continue_value = node.continue_value < 1 ? 1 : env->loops;
+      case OP_EQ:
+        top--;
+        top[-1] = equals(top[-1], top[0]) ? true_value : nil_value;
+        break;
+      case OP_NEQ:
+        top--;
+        top[-1] = equals(top[-1], top[0]) ? nil_value : true_value;
+        break;
+      case OP_AND:
+        if (!is_truthy(top[-1])) {
+          top[-1] = nil_value;
+          ip = code->instructions + ip->arg;
+          continue;
+        }
+        top--;
+        break;
+      case OP_OR:
+        if (is_truthy(top[-1])) {
+          ip = code->instructions + ip->arg;
+          continue;
+        }
+        top--;
+        break;
+      case OP_TUPLE:
+        eval_error(node, "unexpected tuple");
+        *(top++) = nil_value;
+        break;
+      case OP_CLOSURE:
+        *(top++) = create_closure(node->fn_value.params, node->fn_value.free_variables, node->fn_value.locals,
+            *node->fn_value.body, code->functions[ip->arg], env, env->arena);
+        break;
+      case OP_JUMP:
+        ip = code->instructions + ip->arg;
+        continue;
+      case OP_JUMP_IF_FALSE:
+        top--;
+        if (!is_truthy(*top)) {
+          ip = code->instructions + ip->arg;
+          continue;
+        }
+        break;
+      case OP_ITERATE:
+        top--;
+        if (!begin_iteration(node, *top)) {
+          ip = code->instructions + ip->arg;
+          continue;
+        }
+        top[1] = create_int(0);
+        top += 2;
+        break;
+      case OP_NEXT:
+        if (!next_iteration(node, top - 2, env)) {
+          ip = code->instructions + ip->arg;
+          continue;
+        }
+        break;
+      case OP_CASE:
+        top--;
+        if (equals(top[-1], top[0])) {
+          top--;
+          ip = code->instructions + ip->arg;
+          continue;
+        }
+        break;
+      case OP_EXPORT:
+        if (ip->arg) {
+          top--;
+          env_put_slot(node->slot, node->export_value.left, *top, env);
+        }
+        array_push(env->exports, create_symbol(node->export_value.left), env->arena);
+        break;
+      case OP_ASSIGN:
+        top -= ip->arg;
+        eval_assign(node, top, env);
+        break;
+      case OP_BEGIN:
+        *(top++) = create_int(output->size);
+        break;
+      case OP_END: {
+        size_t start = top[-1].int_value;
+        top[-1] = create_string(output->data + start, output->size - start, env->arena);
+        output->size = start;
+        break;
       }
-      return (InterpreterResult) { IR_CONTINUE, nil_value, node.continue_value };
+      case OP_DISCARD:
+        top--;
+        output->size = top->int_value;
+        break;
+      case OP_WRITE:
+        top--;
+        value_to_string(*top, output);
+        break;
+      case OP_WRITE_STRING:
+        buffer_append_bytes(output, node->string_value.bytes, node->string_value.size);
+        break;
+      case OP_POP:
+        top -= ip->arg;
+        break;
+      case OP_CONTROL_ERROR:
+        control_error(node, ip->arg);
+        break;
+      case OP_RETURN:
+      case OP_EXIT:
+        break;
+    }
+    ip++;
   }
-  return RESULT_VALUE(nil_value);
+  InterpreterResultType type = IR_VALUE;
+  if (ip->op == OP_RETURN) {
+    type = IR_RETURN;
+    *result = top[-1];
+  } else if (code->output) {
+    *result = nil_value;
+  } else {
+    *result = top[-1];
+  }
+  if (output == &local_buffer) {
+    delete_buffer(local_buffer);
+  }
+  return type;
+}
+
+InterpreterResult interpret(const Code *code, Env *env) {
+  InterpreterResult result;
+  if (code->output) {
+    // The output of a module is the value of its root block
+    Buffer buffer = create_buffer(0);
+    result.type = execute(code, &buffer, &result.value, env);
+    if (result.type != IR_RETURN) {
+      result.value = create_string(buffer.data, buffer.size, env->arena);
+    }
+    delete_buffer(buffer);
+  } else {
+    result.type = execute(code, NULL, &result.value, env);
+  }
+  return result;
+}
+
+InterpreterResult interpret_output(const Code *code, Buffer *output, Env *env) {
+  size_t start = output->size;
+  InterpreterResult result;
+  result.type = execute(code, output, &result.value, env);
+  if (result.type == IR_RETURN) {
+    output->size = start;
+  } else if (!code->output) {
+    value_to_string(result.value, output);
+    result.value = nil_value;
+  }
+  return result;
 }
@@ -11,18 +11,16 @@
 
 typedef enum {
   IR_VALUE,
-  IR_RETURN,
-  IR_BREAK,
-  IR_CONTINUE
+  IR_RETURN
 } InterpreterResultType;
 
 typedef struct InterpreterResult {
   InterpreterResultType type;
   Value value;
-  int64_t level;
 } InterpreterResult;
 
 int apply(Value func, const Tuple *args, Value *return_value, Env *env);
-InterpreterResult interpret(Node node, Env *env);
+InterpreterResult interpret(const Code *code, Env *env);
+InterpreterResult interpret_output(const Code *code, Buffer *output, Env *env);
 
 #endif
@@ -37,7 +37,7 @@ const char *words[] = {
 
 const size_t num_words = sizeof(words) / sizeof(char *);
 
-static char *lipsum_words(int length) {
+char *lipsum_words(int length) {
   Buffer buffer = create_buffer(0);
   for (int i = 0; i < length; i++) {
     if (i) {
@@ -52,7 +52,7 @@ static char *lipsum_words(int length) {
   return (char *) buffer.data;
 }
 
-static char *lipsum_paragraph(int sentences) {
+char *lipsum_paragraph(int sentences) {
   Buffer buffer = create_buffer(0);
   for (int i = 0; i < sentences; i++) {
     if (i) {
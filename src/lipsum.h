@@ -9,6 +9,8 @@
 
 #include "build.h"
 
+char *lipsum_words(int length);
+char *lipsum_paragraph(int sentences);
 int lipsum(GlobalArgs args);
 
 #endif
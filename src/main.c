@@ -4,12 +4,14 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#include "bench.h"
 #include "build.h"
 #include "collections.h"
 #include "contentmap.h"
 #include "core.h"
 #include "datetime.h"
 #include "html.h"
+#include "images.h"
 #include "interpreter.h"
 #include "lipsum.h"
 #include "markdown.h"
@@ -26,13 +28,16 @@
 #include <string.h>
 #include <unistd.h>
 
-const char *short_options = "hvtp:";
+const char *short_options = "hvtp:j:zm";
 
 const struct option long_options[] = {
   {"help", no_argument, NULL, 'h'},
   {"version", no_argument, NULL, 'v'},
   {"template", no_argument, NULL, 't'},
   {"port", required_argument, NULL, 'p'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"compress", no_argument, NULL, 'z'},
+  {"in-memory", no_argument, NULL, 'm'},
   {0, 0, 0, 0}
 };
 
@@ -47,6 +52,9 @@ static void print_help(const char *program_name) {
   describe_option("v", "version", "Show version information.");
   describe_option("t", "template", "Parse file as a template.");
   describe_option("p", "port", "Port for built-in web server.");
+  describe_option("j", "jobs", "Number of pages to build in parallel.");
+  describe_option("z", "compress", "Write compressed copies of text files.");
+  describe_option("m", "in-memory", "Serve static files and images without writing them to dist.");
   puts("commands:");
   puts("  build             Build site from index.plet");
   puts("  watch             Build site from index.plet and watch for changes");
@@ -55,6 +63,8 @@ static void print_help(const char *program_name) {
   puts("  init              Create a new site in the current directory");
   puts("  clean             Remove generated files");
   puts("  lipsum [<dir>]    Generate random markdown content");
+  puts("  bench-serve [<clients> [<requests>]]");
+  puts("                    Benchmark the built-in web server on a generated site");
 }
 
 static int eval(GlobalArgs args) {
@@ -87,7 +97,7 @@ static int eval(GlobalArgs args) {
       import_contentmap(env);
       import_html(env);
       import_markdown(env);
-      Value output = interpret(*module->user_value.root, env).value;
+      Value output = interpret(module->user_value.code, env).value;
       if (output.type == V_STRING) {
         for (size_t i = 0 ; i < output.string_value->size; i++) {
           putchar((char) output.string_value->bytes[i]);
@@ -137,14 +147,47 @@ static int clean(GlobalArgs args) {
     }
   }
   delete_path(dist);
+  Path *cache = path_append(root, ".plet-cache");
+  if (is_dir(cache->path)) {
+    if (!delete_dir(cache)) {
+      status = 1;
+    }
+  }
+  delete_path(cache);
   delete_path(root);
   return status;
 }
 
+static int run_command(const char *command, GlobalArgs args) {
+  if (strcmp(command, "build") == 0) {
+    return build(args);
+  } else if (strcmp(command, "watch") == 0) {
+    return watch(args);
+  } else if (strcmp(command, "serve") == 0) {
+    return serve(args);
+  } else if (strcmp(command, "eval") == 0) {
+    return eval(args);
+  } else if (strcmp(command, "init") == 0) {
+    return init(args);
+  } else if (strcmp(command, "clean") == 0) {
+    return clean(args);
+  } else if (strcmp(command, "lipsum") == 0) {
+    return lipsum(args);
+  } else if (strcmp(command, "bench-serve") == 0) {
+    return bench_serve(args);
+  } else {
+    fprintf(stderr, ERROR_LABEL "unrecognized command: %s" SGR_RESET "\n", command);
+    return 1;
+  }
+}
+
 int main(int argc, char *argv[]) {
   GlobalArgs args;
   args.parse_as_template = 0;
   args.port = "6500";
+  args.jobs = 1;
+  args.compress = 0;
+  args.in_memory = 0;
   int opt;
   int option_index;
   while ((opt = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1) {
@@ -153,7 +196,7 @@ int main(int argc, char *argv[]) {
         print_help(argv[0]);
         return 0;
       case 'v':
-        puts("Plet 0.1.0");
+        puts("Plet " PLET_VERSION);
         return 0;
       case 't':
         args.parse_as_template = 1;
@@ -161,6 +204,22 @@ int main(int argc, char *argv[]) {
       case 'p':
         args.port = optarg;
         break;
+      case 'j': {
+        char *end;
+        long jobs = strtol(optarg, &end, 10);
+        if (*end || jobs < 1 || jobs > 1024) {
+          fprintf(stderr, ERROR_LABEL "invalid number of jobs: %s" SGR_RESET "\n", optarg);
+          return 1;
+        }
+        args.jobs = (int) jobs;
+        break;
+      }
+      case 'z':
+        args.compress = 1;
+        break;
+      case 'm':
+        args.in_memory = 1;
+        break;
     }
   }
   if (optind >= argc) {
@@ -172,22 +231,8 @@ int main(int argc, char *argv[]) {
   args.command_name = command;
   args.argc = argc - optind - 1;
   args.argv = argv + optind + 1;
-  if (strcmp(command, "build") == 0) {
-    return build(args);
-  } else if (strcmp(command, "watch") == 0) {
-    return watch(args);
-  } else if (strcmp(command, "serve") == 0) {
-    return serve(args);
-  } else if (strcmp(command, "eval") == 0) {
-    return eval(args);
-  } else if (strcmp(command, "init") == 0) {
-    return init(args);
-  } else if (strcmp(command, "clean") == 0) {
-    return clean(args);
-  } else if (strcmp(command, "lipsum") == 0) {
-    return lipsum(args);
-  } else {
-    fprintf(stderr, ERROR_LABEL "unrecognized command: %s" SGR_RESET "\n", command);
-    return 1;
-  }
+  init_image_resizing();
+  int status = run_command(command, args);
+  terminate_image_resizing();
+  return status;
 }
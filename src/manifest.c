@@ -0,0 +1,516 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "manifest.h"
+
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MANIFEST_DIR ".plet-cache"
+#define MANIFEST_NAME "manifest"
+#define MANIFEST_VERSION 2
+
+typedef struct {
+  char *path;
+  FileStamp stamp;
+  ModuleType type;
+} DependencyEntry;
+
+struct DependencySet {
+  GenericHashMap map;
+};
+
+typedef struct {
+  const void *pointer;
+  Hash hash;
+} FingerprintEntry;
+
+struct FingerprintCache {
+  GenericHashMap map;
+};
+
+typedef struct {
+  char *path;
+  FileStamp stamp;
+  int state;
+} ManifestFile;
+
+typedef struct {
+  char *dest;
+  Hash fingerprint;
+  size_t size;
+  const char **dependencies;
+} ManifestPage;
+
+struct Manifest {
+  Hash site_fingerprint;
+  GenericHashMap files;
+  GenericHashMap pages;
+};
+
+/* Dependencies are recorded per thread so that pages compiled in parallel each get their own set. */
+static _Thread_local DependencySet *current_dependencies = NULL;
+
+static Hash hash_bytes(Hash h, const void *bytes, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    h = HASH_ADD_BYTE(((const uint8_t *) bytes)[i], h);
+  }
+  return h;
+}
+
+static Hash string_entry_hash(const void *entry) {
+  const char *string = *(char * const *) entry;
+  return hash_bytes(INIT_HASH, string, strlen(string));
+}
+
+static int string_entry_equals(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b) == 0;
+}
+
+DependencySet *create_dependency_set(void) {
+  DependencySet *dependencies = allocate(sizeof(DependencySet));
+  init_generic_hash_map(&dependencies->map, sizeof(DependencyEntry), 0, string_entry_hash, string_entry_equals,
+      NULL);
+  return dependencies;
+}
+
+void delete_dependency_set(DependencySet *dependencies) {
+  DependencyEntry entry;
+  HashMapIterator it = generic_hash_map_iterate(&dependencies->map);
+  while (generic_hash_map_next(&it, &entry)) {
+    free(entry.path);
+  }
+  delete_generic_hash_map(&dependencies->map);
+  free(dependencies);
+}
+
+DependencySet *record_dependencies(DependencySet *dependencies) {
+  DependencySet *previous = current_dependencies;
+  current_dependencies = dependencies;
+  return previous;
+}
+
+void add_dependency(const Path *path, FileStamp stamp, ModuleType type) {
+  if (!current_dependencies || type == M_SYSTEM) {
+    return;
+  }
+  DependencyEntry entry = { .path = (char *) path->path, .stamp = stamp, .type = type };
+  if (generic_hash_map_get(&current_dependencies->map, &entry, &entry)) {
+    return;
+  }
+  entry.path = copy_string(path->path);
+  generic_hash_map_add(&current_dependencies->map, &entry);
+}
+
+/* Adds dependencies recorded on another thread to the current set. */
+void add_dependencies(DependencySet *dependencies) {
+  if (!current_dependencies) {
+    return;
+  }
+  DependencyEntry entry;
+  HashMapIterator it = generic_hash_map_iterate(&dependencies->map);
+  while (generic_hash_map_next(&it, &entry)) {
+    if (!generic_hash_map_get(&current_dependencies->map, &entry, NULL)) {
+      entry.path = copy_string(entry.path);
+      generic_hash_map_add(&current_dependencies->map, &entry);
+    }
+  }
+}
+
+/* Copies the dependencies of a set into an arena, so that they can be added to other sets later with
+ * add_dependency_list(). */
+DependencyList *copy_dependencies(DependencySet *dependencies, Arena *arena) {
+  DependencyList *list = NULL;
+  DependencyEntry entry;
+  HashMapIterator it = generic_hash_map_iterate(&dependencies->map);
+  while (generic_hash_map_next(&it, &entry)) {
+    DependencyList *node = arena_allocate(sizeof(DependencyList), arena);
+    size_t length = strlen(entry.path);
+    node->path = arena_allocate(sizeof(Path) + length + 1, arena);
+    node->path->size = length;
+    memcpy(node->path->path, entry.path, length + 1);
+    node->stamp = entry.stamp;
+    node->type = entry.type;
+    node->next = list;
+    list = node;
+  }
+  return list;
+}
+
+void add_dependency_list(const DependencyList *list) {
+  for (; list; list = list->next) {
+    add_dependency(list->path, list->stamp, list->type);
+  }
+}
+
+Hash hash_code_dependencies(Hash h, DependencySet *dependencies) {
+  Hash sum = 0;
+  DependencyEntry entry;
+  HashMapIterator it = generic_hash_map_iterate(&dependencies->map);
+  while (generic_hash_map_next(&it, &entry)) {
+    if (entry.type != M_ASSET) {
+      Hash entry_hash = hash_bytes(INIT_HASH, entry.path, strlen(entry.path));
+      entry_hash = hash_bytes(entry_hash, &entry.stamp.mtime, sizeof(time_t));
+      entry_hash = hash_bytes(entry_hash, &entry.stamp.mtime_nsec, sizeof(long));
+      sum += hash_bytes(entry_hash, &entry.stamp.size, sizeof(int64_t));
+    }
+  }
+  return hash_bytes(h, &sum, sizeof(Hash));
+}
+
+static Hash fingerprint_entry_hash(const void *entry) {
+  return HASH_ADD_PTR(((const FingerprintEntry *) entry)->pointer, INIT_HASH);
+}
+
+static int fingerprint_entry_equals(const void *a, const void *b) {
+  return ((const FingerprintEntry *) a)->pointer == ((const FingerprintEntry *) b)->pointer;
+}
+
+FingerprintCache *create_fingerprint_cache(void) {
+  FingerprintCache *cache = allocate(sizeof(FingerprintCache));
+  init_generic_hash_map(&cache->map, sizeof(FingerprintEntry), 0, fingerprint_entry_hash, fingerprint_entry_equals,
+      NULL);
+  return cache;
+}
+
+void delete_fingerprint_cache(FingerprintCache *cache) {
+  delete_generic_hash_map(&cache->map);
+  free(cache);
+}
+
+Hash fingerprint_path(Hash h, const Path *path) {
+  return hash_bytes(h, path->path, path->size + 1);
+}
+
+static Hash fingerprint_closure(Closure *closure, FingerprintCache *cache) {
+  Hash h = INIT_HASH;
+  Node *body = &closure->body;
+  if (body->module.file_name) {
+    h = fingerprint_path(h, body->module.file_name);
+  }
+  h = hash_bytes(h, &body->start, sizeof(Pos));
+  // The values captured by the closure, e.g. content read by index.plet, affect its result
+  for (NameList *name = closure->free_variables; name; name = name->tail) {
+    Value value;
+    if (env_get(name->head, &value, closure->env)) {
+      h = hash_bytes(h, name->head, strlen(name->head));
+      h = fingerprint_value(h, value, cache);
+    }
+  }
+  return h;
+}
+
+static Hash fingerprint_container(Value value, FingerprintCache *cache) {
+  FingerprintEntry entry;
+  if (value.type == V_CLOSURE) {
+    entry.pointer = value.closure_value;
+  } else if (value.type == V_ARRAY) {
+    entry.pointer = value.array_value;
+  } else {
+    entry.pointer = value.object_value;
+  }
+  if (generic_hash_map_get(&cache->map, &entry, &entry)) {
+    return entry.hash;
+  }
+  // Placeholder entry that terminates cyclic references
+  entry.hash = INIT_HASH;
+  generic_hash_map_add(&cache->map, &entry);
+  Hash h = INIT_HASH;
+  if (value.type == V_CLOSURE) {
+    h = fingerprint_closure(value.closure_value, cache);
+  } else if (value.type == V_ARRAY) {
+    for (size_t i = 0; i < value.array_value->size; i++) {
+      h = fingerprint_value(h, value.array_value->cells[i], cache);
+    }
+  } else {
+    // Lazy properties are fingerprinted by their inputs so that they don't have to be computed
+    ObjectIterator it = iterate_object(value.object_value);
+    Value entry_key, entry_value;
+    Thunk *thunk;
+    while (object_iterator_next_lazy(&it, &entry_key, &entry_value, &thunk)) {
+      h = fingerprint_value(h, entry_key, cache);
+      if (thunk) {
+        Hash thunk_fingerprint = thunk_hash(thunk);
+        h = hash_bytes(h, &thunk_fingerprint, sizeof(Hash));
+      } else {
+        h = fingerprint_value(h, entry_value, cache);
+      }
+    }
+  }
+  entry.hash = h;
+  generic_hash_map_set(&cache->map, &entry, NULL, NULL);
+  return h;
+}
+
+Hash fingerprint_value(Hash h, Value value, FingerprintCache *cache) {
+  h = HASH_ADD_BYTE(value.type, h);
+  switch (value.type) {
+    case V_NIL:
+      break;
+    case V_BOOL:
+    case V_INT:
+      h = hash_bytes(h, &value.int_value, sizeof(int64_t));
+      break;
+    case V_FLOAT:
+      h = hash_bytes(h, &value.float_value, sizeof(double));
+      break;
+    case V_TIME:
+      h = hash_bytes(h, &value.time_value, sizeof(time_t));
+      break;
+    case V_SYMBOL:
+      h = hash_bytes(h, value.symbol_value, strlen(value.symbol_value));
+      break;
+    case V_STRING:
+      h = hash_bytes(h, &value.string_value->size, sizeof(size_t));
+      h = hash_bytes(h, value.string_value->bytes, value.string_value->size);
+      break;
+    case V_ARRAY:
+    case V_OBJECT:
+    case V_CLOSURE: {
+      Hash container = fingerprint_container(value, cache);
+      h = hash_bytes(h, &container, sizeof(Hash));
+      break;
+    }
+    case V_FUNCTION:
+      // Function pointers are not stable between builds, built-in functions only change with Plet itself
+      break;
+  }
+  return h;
+}
+
+Manifest *create_manifest(Hash site_fingerprint) {
+  Manifest *manifest = allocate(sizeof(Manifest));
+  manifest->site_fingerprint = site_fingerprint;
+  init_generic_hash_map(&manifest->files, sizeof(ManifestFile), 0, string_entry_hash, string_entry_equals, NULL);
+  init_generic_hash_map(&manifest->pages, sizeof(ManifestPage), 0, string_entry_hash, string_entry_equals, NULL);
+  return manifest;
+}
+
+void delete_manifest(Manifest *manifest) {
+  ManifestFile file;
+  HashMapIterator it = generic_hash_map_iterate(&manifest->files);
+  while (generic_hash_map_next(&it, &file)) {
+    free(file.path);
+  }
+  ManifestPage page;
+  it = generic_hash_map_iterate(&manifest->pages);
+  while (generic_hash_map_next(&it, &page)) {
+    free(page.dest);
+    if (page.dependencies) {
+      free(page.dependencies);
+    }
+  }
+  delete_generic_hash_map(&manifest->files);
+  delete_generic_hash_map(&manifest->pages);
+  free(manifest);
+}
+
+static const char *manifest_add_file(Manifest *manifest, const char *path, FileStamp stamp) {
+  ManifestFile file = { .path = (char *) path, .stamp = stamp, .state = 0 };
+  if (generic_hash_map_get(&manifest->files, &file, &file)) {
+    if (!file_stamp_equals(file.stamp, stamp)) {
+      // The file changed while the site was being built, so make sure that all pages depending on it are rebuilt by
+      // recording a stamp that can't match any file
+      file.stamp = (FileStamp) { .mtime = 0, .mtime_nsec = -1, .size = -1 };
+      generic_hash_map_set(&manifest->files, &file, NULL, NULL);
+    }
+    return file.path;
+  }
+  file.path = copy_string(path);
+  generic_hash_map_add(&manifest->files, &file);
+  return file.path;
+}
+
+static void manifest_set_page(Manifest *manifest, ManifestPage page) {
+  ManifestPage existing;
+  int exists;
+  generic_hash_map_set(&manifest->pages, &page, &exists, &existing);
+  if (exists) {
+    free(existing.dest);
+    if (existing.dependencies) {
+      free(existing.dependencies);
+    }
+  }
+}
+
+static int read_line(Buffer *line, FILE *file) {
+  line->size = 0;
+  int c;
+  while ((c = fgetc(file)) != EOF && c != '\n') {
+    buffer_put(line, c);
+  }
+  buffer_put(line, '\0');
+  return c != EOF || line->size > 1;
+}
+
+static Path *get_manifest_path(const Path *src_root) {
+  Path *dir = path_append(src_root, MANIFEST_DIR);
+  Path *path = path_append(dir, MANIFEST_NAME);
+  delete_path(dir);
+  return path;
+}
+
+Manifest *load_manifest(const Path *src_root) {
+  Path *path = get_manifest_path(src_root);
+  FILE *file = fopen(path->path, "r");
+  delete_path(path);
+  if (!file) {
+    return NULL;
+  }
+  Manifest *manifest = NULL;
+  Buffer line = create_buffer(0);
+  int version, offset;
+  uint64_t hash;
+  if (read_line(&line, file) && sscanf((char *) line.data, "plet-manifest %d %" SCNx64, &version, &hash) == 2
+      && version == MANIFEST_VERSION) {
+    manifest = create_manifest(hash);
+    ManifestPage page = { .dest = NULL };
+    size_t capacity = 0;
+    int valid = 1;
+    while (valid && read_line(&line, file)) {
+      intmax_t mtime, size;
+      long mtime_nsec;
+      if (sscanf((char *) line.data, "page %" SCNx64 " %n", &hash, &offset) == 1) {
+        if (page.dest) {
+          manifest_set_page(manifest, page);
+        }
+        page.dest = copy_string((char *) line.data + offset);
+        page.fingerprint = hash;
+        page.size = 0;
+        page.dependencies = NULL;
+        capacity = 0;
+      } else if (page.dest && sscanf((char *) line.data, "dep %jd %ld %jd %n", &mtime, &mtime_nsec, &size,
+            &offset) == 3) {
+        if (page.size >= capacity) {
+          capacity = capacity ? capacity << 1 : 4;
+          page.dependencies = reallocate(page.dependencies, capacity * sizeof(const char *));
+        }
+        FileStamp stamp = { .mtime = mtime, .mtime_nsec = mtime_nsec, .size = size };
+        page.dependencies[page.size++] = manifest_add_file(manifest, (char *) line.data + offset, stamp);
+      } else {
+        valid = 0;
+      }
+    }
+    if (page.dest) {
+      manifest_set_page(manifest, page);
+    }
+    if (!valid) {
+      delete_manifest(manifest);
+      manifest = NULL;
+    }
+  }
+  delete_buffer(line);
+  fclose(file);
+  return manifest;
+}
+
+int save_manifest(Manifest *manifest, const Path *src_root) {
+  Path *dir = path_append(src_root, MANIFEST_DIR);
+  if (!mkdir_rec(dir->path)) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "unable to create cache directory" SGR_RESET "\n", dir->path);
+    delete_path(dir);
+    return 0;
+  }
+  Path *path = path_append(dir, MANIFEST_NAME);
+  Path *temp_path = path_append(dir, MANIFEST_NAME ".tmp");
+  delete_path(dir);
+  int result = 0;
+  FILE *file = fopen(temp_path->path, "w");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", temp_path->path, strerror(errno));
+  } else {
+    fprintf(file, "plet-manifest %d %" PRIx64 "\n", MANIFEST_VERSION, (uint64_t) manifest->site_fingerprint);
+    ManifestPage page;
+    HashMapIterator it = generic_hash_map_iterate(&manifest->pages);
+    while (generic_hash_map_next(&it, &page)) {
+      fprintf(file, "page %" PRIx64 " %s\n", (uint64_t) page.fingerprint, page.dest);
+      for (size_t i = 0; i < page.size; i++) {
+        ManifestFile dependency = { .path = (char *) page.dependencies[i] };
+        generic_hash_map_get(&manifest->files, &dependency, &dependency);
+        fprintf(file, "dep %jd %ld %jd %s\n", (intmax_t) dependency.stamp.mtime, dependency.stamp.mtime_nsec,
+            (intmax_t) dependency.stamp.size, dependency.path);
+      }
+    }
+    if (fclose(file) != 0) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", temp_path->path,
+          strerror(errno));
+    } else if (rename(temp_path->path, path->path) != 0) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    } else {
+      result = 1;
+    }
+  }
+  delete_path(temp_path);
+  delete_path(path);
+  return result;
+}
+
+Hash get_site_fingerprint(const Manifest *manifest) {
+  return manifest->site_fingerprint;
+}
+
+int page_is_up_to_date(Manifest *manifest, const Path *dest, Hash fingerprint) {
+  ManifestPage page = { .dest = (char *) dest->path };
+  if (!generic_hash_map_get(&manifest->pages, &page, &page) || page.fingerprint != fingerprint
+      || !file_exists(dest->path)) {
+    return 0;
+  }
+  for (size_t i = 0; i < page.size; i++) {
+    ManifestFile file = { .path = (char *) page.dependencies[i] };
+    generic_hash_map_get(&manifest->files, &file, &file);
+    if (!file.state) {
+      file.state = file_stamp_equals(get_file_stamp(file.path), file.stamp) ? 1 : -1;
+      generic_hash_map_set(&manifest->files, &file, NULL, NULL);
+    }
+    if (file.state < 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void manifest_add_page(Manifest *manifest, const Path *dest, Hash fingerprint, DependencySet *dependencies) {
+  ManifestPage page;
+  page.dest = copy_string(dest->path);
+  page.fingerprint = fingerprint;
+  page.size = dependencies->map.size;
+  page.dependencies = page.size ? allocate(page.size * sizeof(const char *)) : NULL;
+  size_t i = 0;
+  DependencyEntry entry;
+  HashMapIterator it = generic_hash_map_iterate(&dependencies->map);
+  while (generic_hash_map_next(&it, &entry)) {
+    page.dependencies[i++] = manifest_add_file(manifest, entry.path, entry.stamp);
+  }
+  manifest_set_page(manifest, page);
+}
+
+void manifest_copy_page(Manifest *manifest, Manifest *previous, const Path *dest) {
+  ManifestPage page = { .dest = (char *) dest->path };
+  if (!generic_hash_map_get(&previous->pages, &page, &page)) {
+    return;
+  }
+  const char **dependencies = page.dependencies;
+  page.dest = copy_string(dest->path);
+  page.dependencies = page.size ? allocate(page.size * sizeof(const char *)) : NULL;
+  for (size_t i = 0; i < page.size; i++) {
+    ManifestFile file = { .path = (char *) dependencies[i] };
+    generic_hash_map_get(&previous->files, &file, &file);
+    page.dependencies[i] = manifest_add_file(manifest, file.path, file.stamp);
+  }
+  manifest_set_page(manifest, page);
+}
+
+void watch_manifest_files(Manifest *manifest, Watcher *watcher) {
+  ManifestFile file;
+  HashMapIterator it = generic_hash_map_iterate(&manifest->files);
+  while (generic_hash_map_next(&it, &file)) {
+    watch_file(file.path, file.stamp, watcher);
+  }
+}
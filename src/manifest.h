@@ -0,0 +1,50 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "hashmap.h"
+#include "value.h"
+#include "watcher.h"
+
+typedef struct DependencySet DependencySet;
+typedef struct DependencyList DependencyList;
+typedef struct FingerprintCache FingerprintCache;
+typedef struct Manifest Manifest;
+
+struct DependencyList {
+  DependencyList *next;
+  Path *path;
+  FileStamp stamp;
+  ModuleType type;
+};
+
+DependencySet *create_dependency_set(void);
+void delete_dependency_set(DependencySet *dependencies);
+DependencySet *record_dependencies(DependencySet *dependencies);
+void add_dependency(const Path *path, FileStamp stamp, ModuleType type);
+void add_dependencies(DependencySet *dependencies);
+DependencyList *copy_dependencies(DependencySet *dependencies, Arena *arena);
+void add_dependency_list(const DependencyList *list);
+Hash hash_code_dependencies(Hash h, DependencySet *dependencies);
+
+FingerprintCache *create_fingerprint_cache(void);
+void delete_fingerprint_cache(FingerprintCache *cache);
+Hash fingerprint_path(Hash h, const Path *path);
+Hash fingerprint_value(Hash h, Value value, FingerprintCache *cache);
+
+Manifest *create_manifest(Hash site_fingerprint);
+void delete_manifest(Manifest *manifest);
+Manifest *load_manifest(const Path *src_root);
+int save_manifest(Manifest *manifest, const Path *src_root);
+Hash get_site_fingerprint(const Manifest *manifest);
+int page_is_up_to_date(Manifest *manifest, const Path *dest, Hash fingerprint);
+void manifest_add_page(Manifest *manifest, const Path *dest, Hash fingerprint, DependencySet *dependencies);
+void manifest_copy_page(Manifest *manifest, Manifest *previous, const Path *dest);
+void watch_manifest_files(Manifest *manifest, Watcher *watcher);
+
+#endif
@@ -4,9 +4,11 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#define _GNU_SOURCE
 #include "module.h"
 
 #include "collections.h"
+#include "compiler.h"
 #include "contentmap.h"
 #include "core.h"
 #include "datetime.h"
@@ -15,18 +17,28 @@
 #include "html.h"
 #include "images.h"
 #include "interpreter.h"
+#include "manifest.h"
+#include "markdown.h"
 #include "parser.h"
 #include "reader.h"
 #include "sitemap.h"
 #include "strings.h"
+#include "template.h"
 #include "util.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 struct ModuleMap {
   GenericHashMap map;
+  pthread_mutex_t lock;
+  Env *preludes[2];
+  int retain_replaced;
+  Module **replaced;
+  size_t replaced_size;
+  size_t replaced_capacity;
 };
 
 typedef struct {
@@ -51,6 +63,17 @@ static int module_equals(const void *a, const void *b) {
 ModuleMap *create_module_map(void) {
   ModuleMap *module_map = allocate(sizeof(ModuleMap));
   init_generic_hash_map(&module_map->map, sizeof(ModuleEntry), 0, module_hash, module_equals, NULL);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&module_map->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  module_map->preludes[PRELUDE_USER] = NULL;
+  module_map->preludes[PRELUDE_TEMPLATE] = NULL;
+  module_map->retain_replaced = 0;
+  module_map->replaced = NULL;
+  module_map->replaced_size = 0;
+  module_map->replaced_capacity = 0;
   return module_map;
 }
 
@@ -61,14 +84,87 @@ void delete_module_map(ModuleMap *module_map) {
     delete_module(entry.value);
   }
   delete_generic_hash_map(&module_map->map);
+  release_replaced_modules(module_map->replaced_size, module_map);
+  if (module_map->replaced) {
+    free(module_map->replaced);
+  }
+  for (int i = 0; i < 2; i++) {
+    if (module_map->preludes[i]) {
+      delete_arena(module_map->preludes[i]->arena);
+    }
+  }
+  pthread_mutex_destroy(&module_map->lock);
   free(module_map);
 }
 
+void lock_module_map(ModuleMap *module_map) {
+  pthread_mutex_lock(&module_map->lock);
+}
+
+void unlock_module_map(ModuleMap *module_map) {
+  pthread_mutex_unlock(&module_map->lock);
+}
+
+/* Keeps replaced modules around until they are released, since values in environments that are still in use may
+ * refer to their syntax trees. */
+void retain_replaced_modules(ModuleMap *module_map) {
+  lock_module_map(module_map);
+  module_map->retain_replaced = 1;
+  unlock_module_map(module_map);
+}
+
+size_t get_replaced_module_count(ModuleMap *module_map) {
+  lock_module_map(module_map);
+  size_t count = module_map->replaced_size;
+  unlock_module_map(module_map);
+  return count;
+}
+
+void release_replaced_modules(size_t count, ModuleMap *module_map) {
+  lock_module_map(module_map);
+  for (size_t i = 0; i < count; i++) {
+    delete_module(module_map->replaced[i]);
+  }
+  module_map->replaced_size -= count;
+  memmove(module_map->replaced, module_map->replaced + count, module_map->replaced_size * sizeof(Module *));
+  unlock_module_map(module_map);
+}
+
+Env *get_prelude(PreludeType type, ModuleMap *module_map, SymbolMap *symbol_map) {
+  lock_module_map(module_map);
+  Env *env = module_map->preludes[type];
+  if (!env) {
+    env = create_env(create_arena(), module_map, symbol_map);
+    import_core(env);
+    import_strings(env);
+    import_collections(env);
+    import_datetime(env);
+    switch (type) {
+      case PRELUDE_USER:
+        import_exec(env);
+        break;
+      case PRELUDE_TEMPLATE:
+        import_contentmap(env);
+        import_template(env);
+        import_html(env);
+        import_images(env);
+        import_markdown(env);
+        break;
+    }
+    module_map->preludes[type] = env;
+  }
+  unlock_module_map(module_map);
+  return env;
+}
+
 Module *get_module(const Path *file_name, ModuleMap *module_map) {
   ModuleEntry entry;
   ModuleEntry query;
   query.key = file_name;
-  if (generic_hash_map_get(&module_map->map, &query, &entry)) {
+  lock_module_map(module_map);
+  int exists = generic_hash_map_get(&module_map->map, &query, &entry);
+  unlock_module_map(module_map);
+  if (exists) {
     return entry.value;
   }
   return NULL;
@@ -77,17 +173,27 @@ Module *get_module(const Path *file_name, ModuleMap *module_map) {
 void add_module(Module *module, ModuleMap *module_map) {
   ModuleEntry existing;
   int exists;
+  lock_module_map(module_map);
   generic_hash_map_set(&module_map->map, &(ModuleEntry) { .key = module->file_name, .value = module }, &exists, &existing);
   if (exists) {
-    delete_module(existing.value);
+    if (module_map->retain_replaced) {
+      if (module_map->replaced_size >= module_map->replaced_capacity) {
+        module_map->replaced_capacity = module_map->replaced_capacity ? module_map->replaced_capacity << 1 : 16;
+        module_map->replaced = reallocate(module_map->replaced, module_map->replaced_capacity * sizeof(Module *));
+      }
+      module_map->replaced[module_map->replaced_size++] = existing.value;
+    } else {
+      delete_module(existing.value);
+    }
   }
+  unlock_module_map(module_map);
 }
 
 void add_system_module(const char *name, void (*import_func)(Env *), ModuleMap *module_map) {
   Module *module = allocate(sizeof(Module));
   module->type = M_SYSTEM;
   module->file_name = create_path(name, -1);
-  module->mtime = 0;
+  module->stamp = (FileStamp) { .mtime = 0, .mtime_nsec = 0, .size = -1 };
   module->dirty = 0;
   module->system_value.import_func = import_func;
   add_module(module, module_map);
@@ -109,7 +215,7 @@ Module *create_module(const Path *file_name, ModuleType type) {
   Module *module = allocate(sizeof(Module));
   module->type = type;
   module->file_name = copy_path(file_name);
-  module->mtime = get_mtime(file_name->path);
+  module->stamp = get_file_stamp(file_name->path);
   module->dirty = 0;
   switch (type) {
     case M_SYSTEM:
@@ -117,10 +223,12 @@ Module *create_module(const Path *file_name, ModuleType type) {
       break;
     case M_USER:
       module->user_value.root = NULL;
+      module->user_value.code = NULL;
       module->user_value.parse_error = 0;
       break;
     case M_DATA:
       module->data_value.root = NULL;
+      module->data_value.code = NULL;
       module->data_value.parse_error = 0;
       break;
     case M_ASSET:
@@ -134,9 +242,15 @@ Module *create_module(const Path *file_name, ModuleType type) {
 void delete_module(Module *module) {
   switch (module->type) {
     case M_USER:
+      if (module->user_value.code) {
+        delete_code(module->user_value.code);
+      }
       DELETE_NODE(module->user_value.root);
       break;
     case M_DATA:
+      if (module->data_value.code) {
+        delete_code(module->data_value.code);
+      }
       DELETE_NODE(module->data_value.root);
       break;
     case M_SYSTEM:
@@ -159,7 +273,7 @@ Path *get_src_path(const Path *path, Env *env) {
   return combined;
 }
 
-Module *load_user_module(const Path *name, Env *env) {
+static Module *load_user_module_unlocked(const Path *name, Env *env) {
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     if (m->type != M_USER) {
@@ -167,6 +281,8 @@ Module *load_user_module(const Path *name, Env *env) {
     }
     return m;
   }
+  // The stamp is taken before reading, such that changes made while reading are detected later
+  FileStamp stamp = get_file_stamp(name->path);
   FILE *file = fopen(name->path, "r");
   if (!file) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", name->path, strerror(errno));
@@ -186,11 +302,12 @@ Module *load_user_module(const Path *name, Env *env) {
     delete_module(m);
     return NULL;
   }
+  m->stamp = stamp;
   add_module(m, env->modules);
   return m;
 }
 
-Module *load_data_module(const Path *name, Env *env) {
+static Module *load_data_module_unlocked(const Path *name, Env *env) {
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     if (m->type != M_DATA) {
@@ -198,6 +315,8 @@ Module *load_data_module(const Path *name, Env *env) {
     }
     return m;
   }
+  // The stamp is taken before reading, such that changes made while reading are detected later
+  FileStamp stamp = get_file_stamp(name->path);
   FILE *file = fopen(name->path, "r");
   if (!file) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", name->path, strerror(errno));
@@ -217,30 +336,57 @@ Module *load_data_module(const Path *name, Env *env) {
     delete_module(m);
     return NULL;
   }
+  m->stamp = stamp;
   add_module(m, env->modules);
   return m;
 }
 
+Module *load_user_module(const Path *name, Env *env) {
+  lock_module_map(env->modules);
+  Module *m = load_user_module_unlocked(name, env);
+  unlock_module_map(env->modules);
+  if (m) {
+    add_dependency(m->file_name, m->stamp, m->type);
+  }
+  return m;
+}
+
+Module *load_data_module(const Path *name, Env *env) {
+  lock_module_map(env->modules);
+  Module *m = load_data_module_unlocked(name, env);
+  unlock_module_map(env->modules);
+  if (m) {
+    add_dependency(m->file_name, m->stamp, m->type);
+  }
+  return m;
+}
+
 Module *load_asset_module(const Path *name, Env *env) {
+  lock_module_map(env->modules);
   Module *m = get_module(name, env->modules);
-  if (m && !m->dirty) {
-    return m;
+  if (!m || m->dirty) {
+    m = create_module(name, M_ASSET);
+    add_module(m, env->modules);
   }
-  m = create_module(name, M_ASSET);
-  add_module(m, env->modules);
+  unlock_module_map(env->modules);
+  add_dependency(m->file_name, m->stamp, m->type);
   return m;
 }
 
 Value read_asset_module(const Path *name, Env *env) {
+  lock_module_map(env->modules);
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     if (m->type != M_ASSET) {
+      unlock_module_map(env->modules);
       return nil_value;
     }
   } else {
     m = create_module(name, M_ASSET);
     add_module(m, env->modules);
   }
+  unlock_module_map(env->modules);
+  add_dependency(m->file_name, m->stamp, m->type);
   FILE *file = fopen(name->path, "r");
   if (!file) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", name->path, strerror(errno));
@@ -292,11 +438,7 @@ Module *load_module(const Path *name, Env *env) {
 Env *create_user_env(Module *module, ModuleMap *modules, SymbolMap *symbol_map) {
   Arena *arena = create_arena();
   Env *env = create_env(arena, modules, symbol_map);
-  import_core(env);
-  import_strings(env);
-  import_collections(env);
-  import_datetime(env);
-  import_exec(env);
+  env->parent_env = get_prelude(PRELUDE_USER, modules, symbol_map);
   env_def("FILE", path_to_string(module->file_name, env->arena), env);
   Path *dir = path_get_parent(module->file_name);
   env_def("DIR", path_to_string(dir, env->arena), env);
@@ -312,7 +454,7 @@ Value import_module(Module *module, Env *env) {
     case M_USER: {
       Env *user_env = create_user_env(module, env->modules, env->symbol_map);
       Value result_value = nil_value;
-      InterpreterResult result = interpret(*module->user_value.root, user_env);
+      InterpreterResult result = interpret(module->user_value.code, user_env);
       Env *export_env = create_env(env->arena, env->modules, env->symbol_map);
       if (result.type == IR_RETURN) {
         result_value = copy_value(result.value, export_env);
@@ -330,25 +472,41 @@ Value import_module(Module *module, Env *env) {
       return result_value;
     }
     case M_DATA:
-      return interpret(*module->data_value.root, env).value;
+      return interpret(module->data_value.code, env).value;
     case M_ASSET:
       return path_to_string(module->file_name, env->arena);
   }
   return nil_value;
 }
 
+int invalidate_module(const Path *file_name, ModuleMap *module_map) {
+  ModuleEntry entry;
+  ModuleEntry query;
+  query.key = file_name;
+  int exists = 0;
+  lock_module_map(module_map);
+  if (generic_hash_map_get(&module_map->map, &query, &entry) && entry.value->type != M_SYSTEM) {
+    entry.value->dirty = 1;
+    exists = 1;
+  }
+  unlock_module_map(module_map);
+  return exists;
+}
+
 int detect_changes(ModuleMap *modules) {
   int changed = 0;
   ModuleEntry entry;
+  lock_module_map(modules);
   HashMapIterator it = generic_hash_map_iterate(&modules->map);
   while (generic_hash_map_next(&it, &entry)) {
     if (entry.value->type == M_SYSTEM) {
       continue;
     }
-    if (entry.value->dirty || entry.value->mtime != get_mtime(entry.value->file_name->path)) {
+    if (entry.value->dirty || !file_stamp_equals(entry.value->stamp, get_file_stamp(entry.value->file_name->path))) {
       entry.value->dirty = 1;
       changed = 1;
     }
   }
+  unlock_module_map(modules);
   return changed;
 }
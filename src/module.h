@@ -9,11 +9,22 @@
 
 #include "value.h"
 
+typedef enum {
+  PRELUDE_USER,
+  PRELUDE_TEMPLATE
+} PreludeType;
+
 Module *create_module(const Path *file_name, ModuleType type);
 void delete_module(Module *module);
 
 ModuleMap *create_module_map(void);
 void delete_module_map(ModuleMap *module_map);
+void lock_module_map(ModuleMap *module_map);
+void unlock_module_map(ModuleMap *module_map);
+void retain_replaced_modules(ModuleMap *module_map);
+size_t get_replaced_module_count(ModuleMap *module_map);
+void release_replaced_modules(size_t count, ModuleMap *module_map);
+Env *get_prelude(PreludeType type, ModuleMap *module_map, SymbolMap *symbol_map);
 Module *get_module(const Path *file_name, ModuleMap *module_map);
 void add_module(Module *module, ModuleMap *module_map);
 void add_system_module(const char *name, void (*import_func)(Env *), ModuleMap *module_map);
@@ -29,6 +40,7 @@ Module *load_module(const Path *name, Env *env);
 Env *create_user_env(Module *module, ModuleMap *modules, SymbolMap *symbol_map);
 Value import_module(Module *module, Env *env);
 
+int invalidate_module(const Path *file_name, ModuleMap *module_map);
 int detect_changes(ModuleMap *modules);
 
 #endif
@@ -6,6 +6,7 @@
 
 #include "parser.h"
 
+#include "compiler.h"
 #include "util.h"
 
 #include <string.h>
@@ -38,6 +39,7 @@ static Node create_node(NodeType type, Parser *parser) {
   node.module.file_name = parser->module->file_name;
   node.start = peek_token(parser->tokens)->start;
   node.end = node.start;
+  node.slot = -1;
   switch (type) {
     case N_NAME:
       node.name_value = NULL;
@@ -83,6 +85,7 @@ static Node create_node(NodeType type, Parser *parser) {
     case N_FN:
       node.fn_value.params = NULL;
       node.fn_value.free_variables = NULL;
+      node.fn_value.locals = NULL;
       node.fn_value.body = NULL;
       break;
     case N_IF:
@@ -93,6 +96,8 @@ static Node create_node(NodeType type, Parser *parser) {
     case N_FOR:
       node.for_value.key = NULL;
       node.for_value.value = NULL;
+      node.for_value.key_slot = -1;
+      node.for_value.value_slot = -1;
       node.for_value.collection = NULL;
       node.for_value.body = NULL;
       node.for_value.alt = NULL;
@@ -715,6 +720,7 @@ static Node parse_fat_arrow(Parser *parser) {
 static Node parse_partial_dot(Parser *parser) {
   Node fn = create_node(N_FN, parser);
   fn.fn_value.params = allocate(sizeof(NameList));
+  fn.fn_value.params->size = 1;
   fn.fn_value.params->tail = NULL;
   fn.fn_value.params->head = "o";
   Node expr = create_node(N_NAME, parser);
@@ -963,12 +969,232 @@ static Node parse_template(Parser *parser) {
   return block;
 }
 
+static int find_slot(Symbol name, NameList *locals) {
+  int slot = 0;
+  for (NameList *local = locals; local; local = local->tail) {
+    if (local->head == name) {
+      return slot;
+    }
+    slot++;
+  }
+  return -1;
+}
+
+static void add_local(Symbol name, NameList **locals, NameList **last) {
+  if (name && find_slot(name, *locals) < 0) {
+    NameList *head = *locals;
+    NameList *tail = *last;
+    LL_APPEND(NameList, head, tail, name);
+    *locals = head;
+    *last = tail;
+  }
+}
+
+static void collect_locals(Node *node, NameList **locals, NameList **last) {
+  if (!node) {
+    return;
+  }
+  switch (node->type) {
+    case N_NAME:
+    case N_INT:
+    case N_FLOAT:
+    case N_STRING:
+    case N_TUPLE:
+    case N_FN:
+    case N_BREAK:
+    case N_CONTINUE:
+      break;
+    case N_LIST:
+      for (NodeList *item = node->list_value; item; item = item->tail) {
+        collect_locals(&item->head, locals, last);
+      }
+      break;
+    case N_OBJECT:
+      for (PropertyList *property = node->object_value; property; property = property->tail) {
+        collect_locals(&property->key, locals, last);
+        collect_locals(&property->value, locals, last);
+      }
+      break;
+    case N_APPLY:
+      collect_locals(node->apply_value.callee, locals, last);
+      for (NodeList *arg = node->apply_value.args; arg; arg = arg->tail) {
+        collect_locals(&arg->head, locals, last);
+      }
+      break;
+    case N_SUBSCRIPT:
+      collect_locals(node->subscript_value.list, locals, last);
+      collect_locals(node->subscript_value.index, locals, last);
+      break;
+    case N_DOT:
+      collect_locals(node->dot_value.object, locals, last);
+      break;
+    case N_PREFIX:
+      collect_locals(node->prefix_value.operand, locals, last);
+      break;
+    case N_INFIX:
+      collect_locals(node->infix_value.left, locals, last);
+      collect_locals(node->infix_value.right, locals, last);
+      break;
+    case N_IF:
+      collect_locals(node->if_value.cond, locals, last);
+      collect_locals(node->if_value.cons, locals, last);
+      collect_locals(node->if_value.alt, locals, last);
+      break;
+    case N_FOR:
+      add_local(node->for_value.key, locals, last);
+      add_local(node->for_value.value, locals, last);
+      collect_locals(node->for_value.collection, locals, last);
+      collect_locals(node->for_value.body, locals, last);
+      collect_locals(node->for_value.alt, locals, last);
+      break;
+    case N_SWITCH:
+      collect_locals(node->switch_value.expr, locals, last);
+      for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+        collect_locals(&c->key, locals, last);
+        collect_locals(&c->value, locals, last);
+      }
+      collect_locals(node->switch_value.default_case, locals, last);
+      break;
+    case N_EXPORT:
+      add_local(node->export_value.left, locals, last);
+      collect_locals(node->export_value.right, locals, last);
+      break;
+    case N_ASSIGN:
+      if (node->assign_value.left->type == N_NAME) {
+        add_local(node->assign_value.left->name_value, locals, last);
+      } else {
+        collect_locals(node->assign_value.left, locals, last);
+      }
+      collect_locals(node->assign_value.right, locals, last);
+      break;
+    case N_BLOCK:
+      for (NodeList *statement = node->block_value; statement; statement = statement->tail) {
+        collect_locals(&statement->head, locals, last);
+      }
+      break;
+    case N_SUPPRESS:
+      collect_locals(node->suppress_value, locals, last);
+      break;
+    case N_RETURN:
+      collect_locals(node->return_value, locals, last);
+      break;
+  }
+}
+
+static void resolve_slots(Node *node, NameList *locals) {
+  if (!node) {
+    return;
+  }
+  switch (node->type) {
+    case N_NAME:
+      node->slot = find_slot(node->name_value, locals);
+      if (node->slot < 0 && locals) {
+        node->slot = FREE_SLOT;
+      }
+      break;
+    case N_INT:
+    case N_FLOAT:
+    case N_STRING:
+    case N_TUPLE:
+    case N_BREAK:
+    case N_CONTINUE:
+      break;
+    case N_LIST:
+      for (NodeList *item = node->list_value; item; item = item->tail) {
+        resolve_slots(&item->head, locals);
+      }
+      break;
+    case N_OBJECT:
+      for (PropertyList *property = node->object_value; property; property = property->tail) {
+        resolve_slots(&property->key, locals);
+        resolve_slots(&property->value, locals);
+      }
+      break;
+    case N_APPLY:
+      resolve_slots(node->apply_value.callee, locals);
+      for (NodeList *arg = node->apply_value.args; arg; arg = arg->tail) {
+        resolve_slots(&arg->head, locals);
+      }
+      break;
+    case N_SUBSCRIPT:
+      resolve_slots(node->subscript_value.list, locals);
+      resolve_slots(node->subscript_value.index, locals);
+      break;
+    case N_DOT:
+      resolve_slots(node->dot_value.object, locals);
+      break;
+    case N_PREFIX:
+      resolve_slots(node->prefix_value.operand, locals);
+      break;
+    case N_INFIX:
+      resolve_slots(node->infix_value.left, locals);
+      resolve_slots(node->infix_value.right, locals);
+      break;
+    case N_FN: {
+      NameList *fn_locals = NULL;
+      NameList *last = NULL;
+      for (NameList *param = node->fn_value.params; param; param = param->tail) {
+        LL_APPEND(NameList, fn_locals, last, param->head);
+      }
+      collect_locals(node->fn_value.body, &fn_locals, &last);
+      node->fn_value.locals = fn_locals;
+      resolve_slots(node->fn_value.body, fn_locals);
+      break;
+    }
+    case N_IF:
+      resolve_slots(node->if_value.cond, locals);
+      resolve_slots(node->if_value.cons, locals);
+      resolve_slots(node->if_value.alt, locals);
+      break;
+    case N_FOR:
+      if (node->for_value.key) {
+        node->for_value.key_slot = find_slot(node->for_value.key, locals);
+      }
+      node->for_value.value_slot = find_slot(node->for_value.value, locals);
+      resolve_slots(node->for_value.collection, locals);
+      resolve_slots(node->for_value.body, locals);
+      resolve_slots(node->for_value.alt, locals);
+      break;
+    case N_SWITCH:
+      resolve_slots(node->switch_value.expr, locals);
+      for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+        resolve_slots(&c->key, locals);
+        resolve_slots(&c->value, locals);
+      }
+      resolve_slots(node->switch_value.default_case, locals);
+      break;
+    case N_EXPORT:
+      node->slot = find_slot(node->export_value.left, locals);
+      resolve_slots(node->export_value.right, locals);
+      break;
+    case N_ASSIGN:
+      resolve_slots(node->assign_value.left, locals);
+      resolve_slots(node->assign_value.right, locals);
+      break;
+    case N_BLOCK:
+      for (NodeList *statement = node->block_value; statement; statement = statement->tail) {
+        resolve_slots(&statement->head, locals);
+      }
+      break;
+    case N_SUPPRESS:
+      resolve_slots(node->suppress_value, locals);
+      break;
+    case N_RETURN:
+      resolve_slots(node->return_value, locals);
+      break;
+  }
+}
+
 Module *parse(TokenStream tokens, const Path *file_name) {
   Module *m = create_module(file_name, M_USER);
   Parser parser = (Parser) { .tokens = tokens, .module = m, .free_variables = NULL, .errors = 0,
     .end.line = 1, .end.column = 1, .ignore_lf = 0, .object_notation = 0 };
   ASSIGN_NODE(m->user_value.root, parse_template(&parser));
   expect_type(T_EOF, &parser);
+  if (!parser.errors) {
+    resolve_slots(m->user_value.root, NULL);
+    m->user_value.code = compile(m->user_value.root, 1);
+  }
   delete_name_list(parser.free_variables);
   m->user_value.parse_error = parser.errors;
   return m;
@@ -983,6 +1209,9 @@ Module *parse_object_notation(TokenStream tokens, const Path *file_name, int exp
     skip_lf(&parser);
     expect_type(T_EOF, &parser);
   }
+  if (!parser.errors) {
+    m->data_value.code = compile(m->data_value.root, 0);
+  }
   delete_name_list(parser.free_variables);
   m->data_value.parse_error = parser.errors;
   return m;
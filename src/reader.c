@@ -23,6 +23,9 @@ struct ParenStack {
 
 struct Reader {
   FILE *file;
+  const uint8_t *bytes;
+  size_t size;
+  size_t offset;
   Path *file_name;
   SymbolMap *symbol_map;
   ParenStack *parens;
@@ -43,6 +46,9 @@ const char *keywords[] = {
 Reader *open_reader(FILE *file, const Path *file_name, SymbolMap *symbol_map) {
   Reader *r = allocate(sizeof(Reader));
   r->file = file;
+  r->bytes = NULL;
+  r->size = 0;
+  r->offset = 0;
   r->file_name = copy_path(file_name);
   r->symbol_map = symbol_map;
   r->parens = NULL;
@@ -56,6 +62,13 @@ Reader *open_reader(FILE *file, const Path *file_name, SymbolMap *symbol_map) {
   return r;
 }
 
+Reader *open_string_reader(const uint8_t *bytes, size_t size, const Path *file_name, SymbolMap *symbol_map) {
+  Reader *r = open_reader(NULL, file_name, symbol_map);
+  r->bytes = bytes;
+  r->size = size;
+  return r;
+}
+
 int reader_errors(Reader *r) {
   return r->errors;
 }
@@ -64,6 +77,10 @@ void set_reader_silent(int silent, Reader *r) {
   r->silent = silent;
 }
 
+size_t reader_offset(Reader *r) {
+  return r->offset;
+}
+
 static uint8_t get_top_paren(Reader *r) {
   if (r->parens) {
     return r->parens->paren;
@@ -115,9 +132,23 @@ static void reader_error(Reader *r, const char *format, ...) {
   print_error_line(r->file_name->path, r->pos, r->pos);
 }
 
+static int read_byte(Reader *r) {
+  if (!r->file) {
+    if (r->offset >= r->size) {
+      return EOF;
+    }
+    return r->bytes[r->offset++];
+  }
+  int c = fgetc(r->file);
+  if (c != EOF) {
+    r->offset++;
+  }
+  return c;
+}
+
 static int peek_n(uint8_t n, Reader *r) {
   while (r->la < n) {
-    int c = fgetc(r->file);
+    int c = read_byte(r);
     if (c == EOF) {
       return EOF;
     }
@@ -140,7 +171,7 @@ static int pop(Reader *r) {
       r->buffer[i] = r->buffer[i + 1];
     }
   } else {
-    c = fgetc(r->file);
+    c = read_byte(r);
   }
   if (c == '\n') {
     r->pos.line++;
@@ -15,9 +15,11 @@
 typedef struct Reader Reader;
 
 Reader *open_reader(FILE *file, const Path *file_name, SymbolMap *symbol_map);
+Reader *open_string_reader(const uint8_t *bytes, size_t size, const Path *file_name, SymbolMap *symbol_map);
 void close_reader(Reader *r);
 int reader_errors(Reader *r);
 void set_reader_silent(int silent, Reader *r);
+size_t reader_offset(Reader *r);
 
 TokenStream read_all(Reader *r, int is_template);
 
@@ -7,20 +7,120 @@
 #define _GNU_SOURCE
 #include "server.h"
 
+#include "compress.h"
 #include "datetime.h"
+#include "hashmap.h"
+#include "images.h"
 #include "module.h"
 #include "sitemap.h"
+#include "virtualdist.h"
+#include "watcher.h"
 
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#else
+#include <poll.h>
+#endif
+
+#define SERVER_BACKLOG 128
+#define MAX_EVENTS 64
+#define MAX_HEADERS 64
+#define MAX_REQUEST_HEAD 16384
+#define MAX_INPUT_BUFFER 65536
+#define READ_CHUNK 8192
+#define KEEP_ALIVE_TIMEOUT 30
+#define SEND_FILE_CHUNK 65536
+#define HEARTBEAT_INTERVAL 15
+#define POLL_INTERVAL 100
+#define COMPRESS_MIN_SIZE 256
+#define COMPRESSED_CACHE_LIMIT (32 * 1024 * 1024)
+#define IMAGE_CACHE_LIMIT (64 * 1024 * 1024)
+
+#define HOT_RELOAD_SCRIPT \
+  "<script>(function() {" \
+  "var eventSource = new EventSource('/.plet-hot-reload-event-source');" \
+  "eventSource.addEventListener('changes_detected', function (e) {" \
+  "console.log('Changes detected, reloading...');" \
+  "eventSource.close();" \
+  "location.reload();" \
+  "});" \
+  "})();</script>"
+
+typedef struct Connection Connection;
+
+typedef struct {
+  const uint8_t *dest;
+  size_t size;
+  size_t position;
+  Object *page;
+} SiteMapEntry;
+
+typedef struct {
+  char *path;
+  char *extension;
+  uint8_t *content;
+  size_t size;
+  Hash hash;
+} CachedPage;
+
+/* A compressed response body. Entries are keyed on the hash of the uncompressed content rather than the path, so they
+ * can be reused after a rebuild as long as the page hasn't changed. */
+typedef struct {
+  Hash hash;
+  size_t size;
+  ContentEncoding encoding;
+  uint8_t *body;
+  size_t body_size;
+} CompressedBody;
+
+/* An image resized for a virtual dist. Images outlive rebuilds, so entries are also keyed on the modification time of
+ * the source image, and the least recently used ones are evicted once IMAGE_CACHE_LIMIT is reached. */
+typedef struct CachedImage CachedImage;
+
+struct CachedImage {
+  CachedPage page;
+  time_t mtime;
+  CachedImage *newer;
+  CachedImage *older;
+};
+
+typedef struct RenderJob RenderJob;
+
+/* A page or, if `page_object` is NULL, an image in a virtual dist to be rendered by a worker. */
+struct RenderJob {
+  Connection *connection;
+  Env *env;
+  VirtualDist *virtual_dist;
+  int generation;
+  Object *page_object;
+  VirtualFile image;
+  time_t image_mtime;
+  Path *dist_path;
+  char *if_none_match;
+  int keep_alive;
+  int accepted_encodings;
+  int status;
+  CachedPage page;
+  CompressedBody compressed;
+  RenderJob *next;
+};
 
 typedef struct {
   SymbolMap *symbol_map;
@@ -28,40 +128,172 @@ typedef struct {
   Path *src_root;
   Path *dist_root;
   Env *env;
+  Watcher *watcher;
+  GenericHashMap site_map_index;
+  GenericHashMap page_cache;
+  GenericHashMap compressed_cache;
+  size_t compressed_cache_size;
+  VirtualDist *virtual_dist;
+  GenericHashMap image_cache;
+  CachedImage *newest_image;
+  CachedImage *oldest_image;
+  size_t image_cache_size;
+  int epfd;
+  int sfd;
+  Connection *connections;
+  int connection_count;
+  int event_source_count;
+  time_t last_heartbeat;
+  pthread_t *workers;
+  int worker_count;
+  int jobs;
+  pthread_mutex_t jobs_lock;
+  pthread_cond_t jobs_available;
+  pthread_cond_t jobs_finished;
+  RenderJob *queued_jobs;
+  RenderJob *last_queued_job;
+  RenderJob *completed_jobs;
+  int unfinished_jobs;
+  int stopping;
+  int generation;
+  pthread_t rebuild_thread;
+  int rebuild_done;
+  int rebuilding;
+  int rebuild_pending;
+  Env *next_env;
+  VirtualDist *next_virtual_dist;
+  size_t replaced_modules;
+  int wakeup_pipe[2];
+  int stop_fd;
+  int stopped;
 } ServerInfo;
 
-static ssize_t write_buffer(int fd, Buffer buffer) {
-  return write(fd, buffer.data, buffer.size);
+typedef struct {
+  const char *name;
+  const char *value;
+} Header;
+
+typedef struct {
+  char *method;
+  char *uri;
+  char *version;
+  Header headers[MAX_HEADERS];
+  int header_count;
+  int keep_alive;
+} Request;
+
+struct Connection {
+  int fd;
+  Buffer input;
+  Buffer output;
+  size_t written;
+  int file_fd;
+  off_t file_offset;
+  off_t file_end;
+  RenderJob *job;
+  int event_source;
+  int closing;
+  time_t last_active;
+  Connection *prev;
+  Connection *next;
+};
+
+static const char *get_header(const Request *request, const char *name) {
+  for (int i = 0; i < request->header_count; i++) {
+    if (strcasecmp(request->headers[i].name, name) == 0) {
+      return request->headers[i].value;
+    }
+  }
+  return NULL;
+}
+
+static char *trim_header_value(char *value) {
+  while (*value == ' ' || *value == '\t') {
+    value++;
+  }
+  size_t length = strlen(value);
+  while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t')) {
+    value[--length] = '\0';
+  }
+  return value;
+}
+
+/* Parses a request head in place. The head must be NUL-terminated after the CRLF that ends the last header line. */
+static int parse_request(char *head, Request *request) {
+  char *line_end = strstr(head, "\r\n");
+  if (!line_end) {
+    return 0;
+  }
+  *line_end = '\0';
+  request->method = head;
+  char *space = strchr(request->method, ' ');
+  if (!space) {
+    return 0;
+  }
+  *space = '\0';
+  request->uri = space + 1;
+  space = strchr(request->uri, ' ');
+  if (!space) {
+    return 0;
+  }
+  *space = '\0';
+  request->version = space + 1;
+  if (strncmp(request->version, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0) {
+    return 0;
+  }
+  request->header_count = 0;
+  char *line = line_end + 2;
+  while (*line) {
+    line_end = strstr(line, "\r\n");
+    if (!line_end) {
+      return 0;
+    }
+    *line_end = '\0';
+    char *colon = strchr(line, ':');
+    if (!colon || colon == line) {
+      return 0;
+    }
+    *colon = '\0';
+    if (request->header_count < MAX_HEADERS) {
+      request->headers[request->header_count].name = line;
+      request->headers[request->header_count].value = trim_header_value(colon + 1);
+      request->header_count++;
+    }
+    line = line_end + 2;
+  }
+  const char *connection = get_header(request, "Connection");
+  if (strcmp(request->version, "HTTP/1.0") == 0) {
+    request->keep_alive = connection && strcasestr(connection, "keep-alive");
+  } else {
+    request->keep_alive = !connection || !strcasestr(connection, "close");
+  }
+  // Request bodies are not supported, so the connection can't be reused if the client sent one
+  const char *content_length = get_header(request, "Content-Length");
+  if ((content_length && atol(content_length) != 0) || get_header(request, "Transfer-Encoding")) {
+    request->keep_alive = 0;
+  }
+  return 1;
 }
 
-static void write_server_headers(int cfd, int status_code, const char *status) {
-  Buffer buffer = create_buffer(32);
-  buffer_printf(&buffer, "HTTP/1.1 %d %s\r\nConnection: close\r\nAllow: GET\r\nCache-Control: no-cache\r\n",
-      status_code, status);
-  write_buffer(cfd, buffer);
-  buffer.size = 0;
-  buffer_printf(&buffer, "Date: ");
-  if (rfc2822_date(time(NULL), &buffer)) {
-    buffer_printf(&buffer, "\r\n");
-    write_buffer(cfd, buffer);
+static void write_server_headers(Buffer *output, int status_code, const char *status, int keep_alive) {
+  buffer_printf(output, "HTTP/1.1 %d %s\r\nConnection: %s\r\nAllow: GET\r\nCache-Control: no-cache\r\n",
+      status_code, status, keep_alive ? "keep-alive" : "close");
+  size_t size = output->size;
+  buffer_printf(output, "Date: ");
+  if (http_date(time(NULL), output)) {
+    buffer_printf(output, "\r\n");
+  } else {
+    output->size = size;
   }
-  delete_buffer(buffer);
 }
 
-static void not_found_response(int cfd) {
-  write_server_headers(cfd, 404, "Not Found");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: text/plain\r\n\r\nNot Found");
-  write_buffer(cfd, response);
-  delete_buffer(response);
+static void text_response(int status_code, const char *status, const char *text, int keep_alive, Buffer *output) {
+  write_server_headers(output, status_code, status, keep_alive);
+  buffer_printf(output, "Content-Type: text/plain\r\nContent-Length: %zu\r\n\r\n%s", strlen(text), text);
 }
 
-static void internal_server_error_response(int cfd, const char *error) {
-  write_server_headers(cfd, 500, "Internal Server Error");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: text/plain\r\n\r\n%s", error);
-  write_buffer(cfd, response);
-  delete_buffer(response);
+static void not_found_response(const Request *request, Buffer *output) {
+  text_response(404, "Not Found", "Not Found", request->keep_alive, output);
 }
 
 static const char *get_mime_type(const char *file_extension) {
@@ -99,201 +331,1376 @@ static const char *get_mime_type(const char *file_extension) {
   return "text/plain";
 }
 
-static void inject_sse_client(int cfd) {
-  Buffer js = create_buffer(256);
-  buffer_printf(&js, "<script>");
-  buffer_printf(&js, "(function() {");
-  buffer_printf(&js, "var eventSource = new EventSource('/.plet-hot-reload-event-source');");
-  buffer_printf(&js, "eventSource.addEventListener('changes_detected', function (e) {");
-  buffer_printf(&js, "console.log('Changes detected, reloading...');");
-  buffer_printf(&js, "eventSource.close();");
-  buffer_printf(&js, "location.reload();");
-  buffer_printf(&js, "});");
-  buffer_printf(&js, "})();");
-  buffer_printf(&js, "</script>");
-  write_buffer(cfd, js);
-  delete_buffer(js);
-}
-
-static void ok_response(int cfd, const char *file_extension, String *content) {
-  write_server_headers(cfd, 200, "OK");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: %s\r\n\r\n", get_mime_type(file_extension));
-  write_buffer(cfd, response);
-  delete_buffer(response);
-  if (strcmp(file_extension, "html") == 0) {
-    for (size_t i = 0; i < content->size - (sizeof("</body>") - 1); i++) {
-      if (memcmp(content->bytes + i, "</body>", sizeof("</body>") - 1) == 0) {
-        write(cfd, content->bytes, i);
-        inject_sse_client(cfd);
-        write(cfd, content->bytes + i, content->size - i);
-        return;
-      }
+/* Returns the set of encodings accepted by the client as a bit mask indexed by ContentEncoding. */
+static int get_accepted_encodings(const Request *request) {
+  const char *accept_encoding = get_header(request, "Accept-Encoding");
+  int accepted = 1 << ENC_IDENTITY;
+  int rejected = 0;
+  int wildcard = 0;
+  while (accept_encoding && *accept_encoding) {
+    accept_encoding += strspn(accept_encoding, " \t,");
+    size_t length = strcspn(accept_encoding, " \t;,");
+    size_t element_length = strcspn(accept_encoding, ",");
+    const char *quality = strstr(accept_encoding, "q=");
+    int acceptable = !quality || quality >= accept_encoding + element_length || strtod(quality + 2, NULL) > 0;
+    int encoding = 0;
+    if ((length == 4 && strncasecmp(accept_encoding, "gzip", 4) == 0)
+        || (length == 6 && strncasecmp(accept_encoding, "x-gzip", 6) == 0)) {
+      encoding = 1 << ENC_GZIP;
+    } else if (length == 2 && strncasecmp(accept_encoding, "br", 2) == 0) {
+      encoding = 1 << ENC_BROTLI;
+    } else if (length == 1 && *accept_encoding == '*') {
+      wildcard = acceptable;
     }
+    if (acceptable) {
+      accepted |= encoding;
+    } else {
+      rejected |= encoding;
+    }
+    accept_encoding += element_length;
+  }
+  if (wildcard) {
+    accepted |= ~rejected & ((1 << ENC_GZIP) | (1 << ENC_BROTLI));
   }
-  write(cfd, content->bytes, content->size);
+  return accepted;
 }
 
-static void event_source_response(int cfd, ModuleMap *modules) {
-  write_server_headers(cfd, 200, "OK");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: text/event-stream\r\n\r\n");
-  write_buffer(cfd, response);
-  int counter = 0;
-  while (1) {
-    struct timespec delay;
-    delay.tv_sec = 0;
-    delay.tv_nsec = 100000000L;
-    nanosleep(&delay, NULL);
-    response.size = 0;
-    if (detect_changes(modules)) {
-      buffer_printf(&response, "event: changes_detected\ndata:\n\n", counter++);
-    } else {
-      buffer_printf(&response, "event: no_changes\ndata:\n\n", counter++);
+static int is_compressible(const char *extension) {
+  return !*extension || extension_is_compressible(extension);
+}
+
+static ContentEncoding choose_page_encoding(const CachedPage *page, int accepted_encodings) {
+  if (page->size < COMPRESS_MIN_SIZE || !is_compressible(page->extension)) {
+    return ENC_IDENTITY;
+  } else if ((accepted_encodings & (1 << ENC_BROTLI)) && encoding_is_available(ENC_BROTLI)) {
+    return ENC_BROTLI;
+  } else if ((accepted_encodings & (1 << ENC_GZIP)) && encoding_is_available(ENC_GZIP)) {
+    return ENC_GZIP;
+  }
+  return ENC_IDENTITY;
+}
+
+static const uint8_t *find_body_end(const CachedPage *page) {
+  if (strcmp(page->extension, "html") == 0) {
+    return memmem(page->content, page->size, "</body>", sizeof("</body>") - 1);
+  }
+  return NULL;
+}
+
+/* Appends the content of a page with the hot reload script injected before the end of the body of HTML pages. */
+static void append_page_body(const CachedPage *page, Buffer *output) {
+  const uint8_t *body_end = find_body_end(page);
+  if (body_end) {
+    buffer_append_bytes(output, page->content, body_end - page->content);
+    buffer_append_bytes(output, (const uint8_t *) HOT_RELOAD_SCRIPT, sizeof(HOT_RELOAD_SCRIPT) - 1);
+    buffer_append_bytes(output, body_end, page->size - (body_end - page->content));
+  } else {
+    buffer_append_bytes(output, page->content, page->size);
+  }
+}
+
+/* Compresses the body of a page. Called from the render workers, and from the event loop when a cached page is
+ * requested with an encoding that hasn't been used for it yet. */
+static int compress_page(const CachedPage *page, ContentEncoding encoding, CompressedBody *compressed) {
+  Buffer body = create_buffer(page->size + sizeof(HOT_RELOAD_SCRIPT));
+  append_page_body(page, &body);
+  Buffer output = create_buffer(body.size / 2);
+  int status = compress_bytes(body.data, body.size, encoding, COMPRESS_FAST, &output);
+  delete_buffer(body);
+  if (!status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s compression failed" SGR_RESET "\n", page->path,
+        get_encoding_name(encoding));
+    delete_buffer(output);
+    return 0;
+  }
+  compressed->hash = page->hash;
+  compressed->size = page->size;
+  compressed->encoding = encoding;
+  compressed->body = output.data;
+  compressed->body_size = output.size;
+  return 1;
+}
+
+static void ok_response(const CachedPage *page, const CompressedBody *compressed, const char *if_none_match,
+    int keep_alive, Buffer *output) {
+  char etag[32];
+  if (compressed) {
+    snprintf(etag, sizeof(etag), "\"%016llx-%s\"", (unsigned long long) page->hash,
+        get_encoding_name(compressed->encoding));
+  } else {
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long) page->hash);
+  }
+  const char *vary = is_compressible(page->extension) ? "Vary: Accept-Encoding\r\n" : "";
+  if (if_none_match && (strstr(if_none_match, etag) || strcmp(if_none_match, "*") == 0)) {
+    write_server_headers(output, 304, "Not Modified", keep_alive);
+    buffer_printf(output, "%sETag: %s\r\n\r\n", vary, etag);
+    return;
+  }
+  write_server_headers(output, 200, "OK", keep_alive);
+  if (compressed) {
+    buffer_printf(output, "Content-Type: %s\r\nContent-Length: %zu\r\nContent-Encoding: %s\r\n%sETag: %s\r\n\r\n",
+        get_mime_type(page->extension), compressed->body_size, get_encoding_name(compressed->encoding), vary, etag);
+    buffer_append_bytes(output, compressed->body, compressed->body_size);
+    return;
+  }
+  size_t length = page->size + (find_body_end(page) ? sizeof(HOT_RELOAD_SCRIPT) - 1 : 0);
+  buffer_printf(output, "Content-Type: %s\r\nContent-Length: %zu\r\n%sETag: %s\r\n\r\n",
+      get_mime_type(page->extension), length, vary, etag);
+  append_page_body(page, output);
+}
+
+/* Parses a single byte range. Returns 1 if the range is satisfiable, -1 if it isn't, and 0 if the header should be
+ * ignored. */
+static int parse_range(const char *range, off_t size, off_t *start, off_t *end) {
+  if (strncmp(range, "bytes=", sizeof("bytes=") - 1) != 0 || strchr(range, ',')) {
+    return 0;
+  }
+  range += sizeof("bytes=") - 1;
+  char *rest;
+  if (*range == '-') {
+    long long suffix = strtoll(range + 1, &rest, 10);
+    if (rest == range + 1 || *rest || suffix < 0) {
+      return 0;
+    } else if (suffix == 0 || size == 0) {
+      return -1;
     }
-    if (write_buffer(cfd, response) < 0) {
-      break;
+    *start = suffix >= size ? 0 : size - suffix;
+    *end = size - 1;
+    return 1;
+  } else if (!isdigit(*range)) {
+    return 0;
+  }
+  long long first = strtoll(range, &rest, 10);
+  if (*rest != '-') {
+    return 0;
+  }
+  range = rest + 1;
+  long long last = size - 1;
+  if (*range) {
+    last = strtoll(range, &rest, 10);
+    if (rest == range || *rest || last < first) {
+      return 0;
+    }
+  }
+  if (first >= size) {
+    return -1;
+  }
+  *start = first;
+  *end = last < size ? last : size - 1;
+  return 1;
+}
+
+/* Opens a precompressed sibling of a static file, e.g. one written by `plet build --compress`, if the client accepts
+ * its encoding and it has the same modification time as the file. */
+static int open_precompressed_file(const Path *path, time_t mtime, int accepted_encodings, ContentEncoding *encoding,
+    struct stat *stat_buffer) {
+  static const ContentEncoding preferred[] = {ENC_BROTLI, ENC_GZIP};
+  for (size_t i = 0; i < sizeof(preferred) / sizeof(ContentEncoding); i++) {
+    if (!(accepted_encodings & (1 << preferred[i]))) {
+      continue;
+    }
+    Buffer name = create_buffer(path->size + 4);
+    buffer_printf(&name, "%s.%s", path->path, get_encoding_extension(preferred[i]));
+    buffer_put(&name, '\0');
+    int fd = open((char *) name.data, O_RDONLY);
+    delete_buffer(name);
+    if (fd >= 0) {
+      if (fstat(fd, stat_buffer) == 0 && S_ISREG(stat_buffer->st_mode) && stat_buffer->st_mtime == mtime) {
+        *encoding = preferred[i];
+        return fd;
+      }
+      close(fd);
     }
   }
-  delete_buffer(response);
+  return -1;
 }
 
-static void file_response(int cfd, const Path *path) {
-  FILE *file = fopen(path->path, "r");
-  if (!file) {
+/* Writes the response headers for a static file. The body is sent from the file descriptor by flush_output() once
+ * the headers have been written. */
+static void file_response(const Path *path, const Request *request, Connection *connection) {
+  Buffer *output = &connection->output;
+  int fd = open(path->path, O_RDONLY);
+  if (fd < 0) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
-    not_found_response(cfd);
+    not_found_response(request, output);
     return;
   }
-  write_server_headers(cfd, 200, "OK");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: %s\r\n\r\n", get_mime_type(path_get_extension(path)));
-  write_buffer(cfd, response);
-  delete_buffer(response);
-  char *buffer = allocate(4096);
-  size_t n;
-  do {
-    n = fread(buffer, 1, 4096, file);
-    write(cfd, buffer, n);
-  } while (n == 4096);
-  if (!feof(file)) {
-    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "read error: %s" SGR_RESET "\n", path->path, strerror(errno));
+  struct stat stat_buffer;
+  if (fstat(fd, &stat_buffer) != 0 || !S_ISREG(stat_buffer.st_mode)) {
+    not_found_response(request, output);
+    close(fd);
+    return;
   }
-  free(buffer);
-}
-
-static char *get_next_token(char *buffer, ssize_t n, ssize_t *offset) {
-  while (*offset < n && isspace(buffer[*offset])) {
-      (*offset)++;
+  off_t size = stat_buffer.st_size;
+  Buffer last_modified = create_buffer(32);
+  http_date(stat_buffer.st_mtime, &last_modified);
+  buffer_put(&last_modified, '\0');
+  const char *if_modified_since = get_header(request, "If-Modified-Since");
+  time_t since;
+  if (if_modified_since && parse_http_date(if_modified_since, &since) && stat_buffer.st_mtime <= since) {
+    write_server_headers(output, 304, "Not Modified", request->keep_alive);
+    buffer_printf(output, "Last-Modified: %s\r\n\r\n", last_modified.data);
+    delete_buffer(last_modified);
+    close(fd);
+    return;
+  }
+  const char *range_header = get_header(request, "Range");
+  const char *vary = extension_is_compressible(path_get_extension(path)) ? "Vary: Accept-Encoding\r\n" : "";
+  ContentEncoding encoding = ENC_IDENTITY;
+  if (*vary && !range_header) {
+    struct stat compressed_stat;
+    int compressed_fd = open_precompressed_file(path, stat_buffer.st_mtime, get_accepted_encodings(request),
+        &encoding, &compressed_stat);
+    if (compressed_fd >= 0) {
+      close(fd);
+      fd = compressed_fd;
+      size = compressed_stat.st_size;
+    }
   }
-  char *token = buffer + *offset;
-  while (*offset < n && !isspace(buffer[*offset])) {
-      (*offset)++;
+  off_t start = 0;
+  off_t end = size - 1;
+  int range = 0;
+  const char *if_range = get_header(request, "If-Range");
+  if (range_header && (!if_range || strcmp(if_range, (char *) last_modified.data) == 0)) {
+    range = parse_range(range_header, size, &start, &end);
   }
-  if (*offset >= n) {
-    return NULL;
+  if (range < 0) {
+    write_server_headers(output, 416, "Range Not Satisfiable", request->keep_alive);
+    buffer_printf(output, "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", (long long) size);
+    delete_buffer(last_modified);
+    close(fd);
+    return;
+  }
+  if (range) {
+    write_server_headers(output, 206, "Partial Content", request->keep_alive);
+    buffer_printf(output, "Content-Range: bytes %lld-%lld/%lld\r\n", (long long) start, (long long) end,
+        (long long) size);
+  } else {
+    write_server_headers(output, 200, "OK", request->keep_alive);
+  }
+  buffer_printf(output, "Content-Type: %s\r\nContent-Length: %lld\r\n", get_mime_type(path_get_extension(path)),
+      (long long) (end - start + 1));
+  if (encoding != ENC_IDENTITY) {
+    buffer_printf(output, "Content-Encoding: %s\r\n", get_encoding_name(encoding));
+  }
+  buffer_printf(output, "%sLast-Modified: %s\r\nAccept-Ranges: bytes\r\n\r\n", vary, last_modified.data);
+  delete_buffer(last_modified);
+  if (end >= start) {
+    connection->file_fd = fd;
+    connection->file_offset = start;
+    connection->file_end = end + 1;
+  } else {
+    close(fd);
   }
-  buffer[*offset] = '\0';
-  (*offset)++;
-  return token;
 }
 
-static Object *find_in_site_map(const Path *dist_path, Env *env) {
+static Hash site_map_entry_hash(const void *p) {
+  const SiteMapEntry *entry = p;
+  Hash h = INIT_HASH;
+  for (size_t i = 0; i < entry->size; i++) {
+    h = HASH_ADD_BYTE(entry->dest[i], h);
+  }
+  return h;
+}
+
+static int site_map_entry_equals(const void *a, const void *b) {
+  const SiteMapEntry *entry_a = a;
+  const SiteMapEntry *entry_b = b;
+  return entry_a->size == entry_b->size && memcmp(entry_a->dest, entry_b->dest, entry_a->size) == 0;
+}
+
+/* Indexes the pages in SITE_MAP by destination path. The index points into the arena of the environment, so it must
+ * be rebuilt whenever index.plet is evaluated again. */
+static void init_site_map_index(ServerInfo *info) {
+  init_generic_hash_map(&info->site_map_index, sizeof(SiteMapEntry), 0, site_map_entry_hash, site_map_entry_equals,
+      NULL);
   Value site_map;
-  if (!env_get_symbol("SITE_MAP", &site_map, env) || site_map.type != V_ARRAY) {
-    fprintf(stderr, ERROR_LABEL "SITE_MAP is missign or not an object" SGR_RESET "\n");
-    return NULL;
+  if (!env_get_symbol("SITE_MAP", &site_map, info->env) || site_map.type != V_ARRAY) {
+    fprintf(stderr, ERROR_LABEL "SITE_MAP is missing or not an array" SGR_RESET "\n");
+    return;
   }
-  Path *index_path = path_append(dist_path, "index.html");
-  Value dist = path_to_string(dist_path, env->arena);
-  Value index = path_to_string(index_path, env->arena);
-  delete_path(index_path);
   for (size_t i = 0; i < site_map.array_value->size; i++) {
     Value page = site_map.array_value->cells[i];
     Value dest;
-    if (page.type == V_OBJECT && object_get_symbol(page.object_value, "dest", &dest)) {
-      if (equals(dest, dist) || equals(dest, index)) {
-        return page.object_value;
+    if (page.type == V_OBJECT && object_get(page.object_value, create_known_symbol(SYM_DEST), &dest)
+        && dest.type == V_STRING) {
+      SiteMapEntry entry = { dest.string_value->bytes, dest.string_value->size, i, page.object_value };
+      // The first page with a given destination takes precedence
+      if (!generic_hash_map_get(&info->site_map_index, &entry, NULL)) {
+        generic_hash_map_set(&info->site_map_index, &entry, NULL, NULL);
       }
     }
   }
+}
+
+static void delete_site_map_index(ServerInfo *info) {
+  delete_generic_hash_map(&info->site_map_index);
+}
+
+static Object *find_in_site_map(const Path *dist_path, ServerInfo *info) {
+  Path *index_path = path_append(dist_path, "index.html");
+  SiteMapEntry dist = { (const uint8_t *) dist_path->path, dist_path->size };
+  SiteMapEntry index = { (const uint8_t *) index_path->path, index_path->size };
+  int dist_found = generic_hash_map_get(&info->site_map_index, &dist, &dist);
+  int index_found = generic_hash_map_get(&info->site_map_index, &index, &index);
+  delete_path(index_path);
+  if (dist_found && (!index_found || dist.position < index.position)) {
+    return dist.page;
+  } else if (index_found) {
+    return index.page;
+  }
   return NULL;
 }
 
-static void handle_request(int cfd, ServerInfo *info) {
-  char *buffer = allocate(4096);
-  ssize_t n = recv(cfd, buffer, 4096, 0);
-  if (n == -1) {
-    fprintf(stderr, ERROR_LABEL "request failed: %s" SGR_RESET "\n", strerror(errno));
-  } else if (n == 0) {
-    fprintf(stderr, ERROR_LABEL "client closed connection" SGR_RESET "\n");
+static Hash cached_page_hash(const void *p) {
+  const char *path = ((const CachedPage *) p)->path;
+  Hash h = INIT_HASH;
+  while (*path) {
+    h = HASH_ADD_BYTE(*path, h);
+    path++;
+  }
+  return h;
+}
+
+static int cached_page_equals(const void *a, const void *b) {
+  return strcmp(((const CachedPage *) a)->path, ((const CachedPage *) b)->path) == 0;
+}
+
+static void init_page_cache(ServerInfo *info) {
+  init_generic_hash_map(&info->page_cache, sizeof(CachedPage), 0, cached_page_hash, cached_page_equals, NULL);
+}
+
+static void delete_page_cache(ServerInfo *info) {
+  CachedPage page;
+  HashMapIterator it = generic_hash_map_iterate(&info->page_cache);
+  while (generic_hash_map_next(&it, &page)) {
+    free(page.path);
+    free(page.extension);
+    free(page.content);
+  }
+  delete_generic_hash_map(&info->page_cache);
+}
+
+static void delete_cached_page(CachedPage *page) {
+  free(page->path);
+  free(page->extension);
+  free(page->content);
+}
+
+static Hash compressed_body_hash(const void *p) {
+  const CompressedBody *compressed = p;
+  return HASH_ADD_BYTE(compressed->encoding, compressed->hash);
+}
+
+static int compressed_body_equals(const void *a, const void *b) {
+  const CompressedBody *compressed_a = a;
+  const CompressedBody *compressed_b = b;
+  return compressed_a->hash == compressed_b->hash && compressed_a->size == compressed_b->size
+    && compressed_a->encoding == compressed_b->encoding;
+}
+
+static void init_compressed_cache(ServerInfo *info) {
+  init_generic_hash_map(&info->compressed_cache, sizeof(CompressedBody), 0, compressed_body_hash,
+      compressed_body_equals, NULL);
+  info->compressed_cache_size = 0;
+}
+
+static void delete_compressed_cache(ServerInfo *info) {
+  CompressedBody compressed;
+  HashMapIterator it = generic_hash_map_iterate(&info->compressed_cache);
+  while (generic_hash_map_next(&it, &compressed)) {
+    free(compressed.body);
+  }
+  delete_generic_hash_map(&info->compressed_cache);
+}
+
+/* Adds a compressed body to the cache, which takes ownership of it. If the cache already contains the same body,
+ * the new one is freed and replaced with the cached one. */
+static void cache_compressed_body(CompressedBody *compressed, ServerInfo *info) {
+  CompressedBody existing;
+  if (generic_hash_map_get(&info->compressed_cache, compressed, &existing)) {
+    free(compressed->body);
+    *compressed = existing;
+    return;
+  }
+  if (info->compressed_cache_size + compressed->body_size > COMPRESSED_CACHE_LIMIT) {
+    // Bodies of old versions of pages are never removed individually, so start over once the limit is reached
+    delete_compressed_cache(info);
+    init_compressed_cache(info);
+  }
+  generic_hash_map_set(&info->compressed_cache, compressed, NULL, NULL);
+  info->compressed_cache_size += compressed->body_size;
+}
+
+/* Finds or creates the compressed body of a cached page. Returns 0 if the page should be sent uncompressed. */
+static int get_compressed_page(const CachedPage *page, ContentEncoding encoding, ServerInfo *info,
+    CompressedBody *compressed) {
+  if (encoding == ENC_IDENTITY) {
+    return 0;
+  }
+  compressed->hash = page->hash;
+  compressed->size = page->size;
+  compressed->encoding = encoding;
+  if (generic_hash_map_get(&info->compressed_cache, compressed, compressed)) {
+    return 1;
+  }
+  if (!compress_page(page, encoding, compressed)) {
+    return 0;
+  }
+  cache_compressed_body(compressed, info);
+  return 1;
+}
+
+static Hash cached_image_hash(const void *p) {
+  return cached_page_hash(&(*(CachedImage * const *) p)->page);
+}
+
+static int cached_image_equals(const void *a, const void *b) {
+  return cached_page_equals(&(*(CachedImage * const *) a)->page, &(*(CachedImage * const *) b)->page);
+}
+
+static void init_image_cache(ServerInfo *info) {
+  init_generic_hash_map(&info->image_cache, sizeof(CachedImage *), 0, cached_image_hash, cached_image_equals, NULL);
+  info->newest_image = NULL;
+  info->oldest_image = NULL;
+  info->image_cache_size = 0;
+}
+
+static void delete_image_cache(ServerInfo *info) {
+  while (info->newest_image) {
+    CachedImage *older = info->newest_image->older;
+    delete_cached_page(&info->newest_image->page);
+    free(info->newest_image);
+    info->newest_image = older;
+  }
+  delete_generic_hash_map(&info->image_cache);
+}
+
+static void unlink_cached_image(CachedImage *image, ServerInfo *info) {
+  if (image->newer) {
+    image->newer->older = image->older;
   } else {
-    ssize_t i = 0;
-    char *method = get_next_token(buffer, n, &i);
-    if (!method) {
-      fprintf(stderr, ERROR_LABEL "invalid request" SGR_RESET "\n");
-    } else if (strcmp(method, "GET") == 0) {
-      char *uri = get_next_token(buffer, n, &i);
-      if (!uri) {
-        fprintf(stderr, ERROR_LABEL "invalid request" SGR_RESET "\n");
-      } else if (strcmp(uri, "/.plet-hot-reload-event-source") == 0) {
-        free(buffer);
-        if (fork() == 0) {
-          event_source_response(cfd, info->modules);
-          shutdown(cfd, SHUT_RDWR);
-          close(cfd);
-          exit(0);
-        }
+    info->newest_image = image->older;
+  }
+  if (image->older) {
+    image->older->newer = image->newer;
+  } else {
+    info->oldest_image = image->newer;
+  }
+}
+
+static void link_cached_image(CachedImage *image, ServerInfo *info) {
+  image->newer = NULL;
+  image->older = info->newest_image;
+  if (info->newest_image) {
+    info->newest_image->newer = image;
+  } else {
+    info->oldest_image = image;
+  }
+  info->newest_image = image;
+}
+
+static void remove_cached_image(CachedImage *image, ServerInfo *info) {
+  generic_hash_map_remove(&info->image_cache, &image, NULL);
+  unlink_cached_image(image, info);
+  info->image_cache_size -= image->page.size;
+  delete_cached_page(&image->page);
+  free(image);
+}
+
+/* Finds a resized image and marks it as the most recently used one. Entries for older versions of the source image
+ * are removed. */
+static CachedImage *find_cached_image(const char *path, time_t mtime, ServerInfo *info) {
+  CachedImage key = { .page = { .path = (char *) path } };
+  CachedImage *image = &key;
+  if (!generic_hash_map_get(&info->image_cache, &image, &image)) {
+    return NULL;
+  }
+  if (image->mtime != mtime) {
+    remove_cached_image(image, info);
+    return NULL;
+  }
+  unlink_cached_image(image, info);
+  link_cached_image(image, info);
+  return image;
+}
+
+/* Adds a resized image to the cache, which takes ownership of the page. Returns NULL if the image is too large to be
+ * cached, in which case the page is still owned by the caller. */
+static CachedImage *cache_image(CachedPage *page, time_t mtime, ServerInfo *info) {
+  if (page->size > IMAGE_CACHE_LIMIT) {
+    return NULL;
+  }
+  CachedImage *image = find_cached_image(page->path, mtime, info);
+  if (image) {
+    // The image was also resized for another request
+    delete_cached_page(page);
+    return image;
+  }
+  while (info->oldest_image && info->image_cache_size + page->size > IMAGE_CACHE_LIMIT) {
+    remove_cached_image(info->oldest_image, info);
+  }
+  image = allocate(sizeof(CachedImage));
+  image->page = *page;
+  image->mtime = mtime;
+  link_cached_image(image, info);
+  generic_hash_map_set(&info->image_cache, &image, NULL, NULL);
+  info->image_cache_size += page->size;
+  return image;
+}
+
+static Hash hash_page_content(const CachedPage *page) {
+  Hash h = INIT_HASH;
+  for (size_t i = 0; i < page->size; i++) {
+    h = HASH_ADD_BYTE(page->content[i], h);
+  }
+  return h;
+}
+
+/* Renders a page into a new cache entry. Called from the render workers. */
+static int render_page(Object *page_object, const Path *dist_path, Env *env, CachedPage *page) {
+  Path *dest_path = NULL;
+  Value dest_path_value;
+  if (object_get(page_object, create_known_symbol(SYM_DEST), &dest_path_value) && dest_path_value.type == V_STRING) {
+    dest_path = string_to_path(dest_path_value.string_value);
+  }
+  fprintf(stderr, "Compiling %s\n", dest_path ? dest_path->path : dist_path->path);
+  Env *template_env = NULL;
+  Value page_output = compile_page_object(page_object, env, &template_env);
+  int status = 0;
+  if (page_output.type == V_STRING) {
+    String *content = page_output.string_value;
+    page->path = copy_string(dist_path->path);
+    page->extension = copy_string(dest_path ? path_get_extension(dest_path) : path_get_extension(dist_path));
+    page->content = allocate(content->size ? content->size : 1);
+    memcpy(page->content, content->bytes, content->size);
+    page->size = content->size;
+    page->hash = hash_page_content(page);
+    status = 1;
+  }
+  if (template_env) {
+    delete_template_env(template_env);
+  }
+  if (dest_path) {
+    delete_path(dest_path);
+  }
+  return status;
+}
+
+/* Resizes an image in a virtual dist into a new cache entry. Called from the render workers. */
+static int render_image(const VirtualFile *image, const Path *dist_path, CachedPage *page) {
+  fprintf(stderr, "Resizing %s\n", dist_path->path);
+  Buffer output = create_buffer(0);
+  if (!resize_image_to_buffer(image->src, dist_path, image->width, image->height, image->quality, &output)) {
+    delete_buffer(output);
+    return 0;
+  }
+  page->path = copy_string(dist_path->path);
+  page->extension = copy_string(path_get_extension(dist_path));
+  page->content = output.data;
+  page->size = output.size;
+  page->hash = hash_page_content(page);
+  return 1;
+}
+
+static void wake_event_loop(ServerInfo *info) {
+  // The pipe is non-blocking, if it's full the event loop is going to wake up anyway
+  while (write(info->wakeup_pipe[1], "", 1) < 0 && errno == EINTR) {
+  }
+}
+
+static void *render_worker(void *arg) {
+  ServerInfo *info = arg;
+  pthread_mutex_lock(&info->jobs_lock);
+  while (1) {
+    while (!info->queued_jobs && !info->stopping) {
+      pthread_cond_wait(&info->jobs_available, &info->jobs_lock);
+    }
+    RenderJob *job = info->queued_jobs;
+    if (!job) {
+      break;
+    }
+    info->queued_jobs = job->next;
+    if (!info->queued_jobs) {
+      info->last_queued_job = NULL;
+    }
+    pthread_mutex_unlock(&info->jobs_lock);
+    VirtualDist *previous_dist = use_virtual_dist(job->virtual_dist);
+    if (job->page_object) {
+      job->status = render_page(job->page_object, job->dist_path, job->env, &job->page);
+    } else {
+      job->status = render_image(&job->image, job->dist_path, &job->page);
+    }
+    use_virtual_dist(previous_dist);
+    if (job->status) {
+      ContentEncoding encoding = choose_page_encoding(&job->page, job->accepted_encodings);
+      if (encoding != ENC_IDENTITY && !compress_page(&job->page, encoding, &job->compressed)) {
+        job->compressed.body = NULL;
+      }
+    }
+    pthread_mutex_lock(&info->jobs_lock);
+    job->next = info->completed_jobs;
+    info->completed_jobs = job;
+    info->unfinished_jobs--;
+    if (!info->unfinished_jobs) {
+      pthread_cond_broadcast(&info->jobs_finished);
+    }
+    wake_event_loop(info);
+  }
+  pthread_mutex_unlock(&info->jobs_lock);
+  return NULL;
+}
+
+static RenderJob *create_render_job(Path *dist_path, const Request *request, Connection *connection,
+    ServerInfo *info) {
+  RenderJob *job = allocate(sizeof(RenderJob));
+  job->connection = connection;
+  job->env = info->env;
+  job->virtual_dist = info->virtual_dist;
+  job->generation = info->generation;
+  job->page_object = NULL;
+  job->dist_path = dist_path;
+  const char *if_none_match = get_header(request, "If-None-Match");
+  job->if_none_match = if_none_match ? copy_string(if_none_match) : NULL;
+  job->keep_alive = request->keep_alive;
+  job->accepted_encodings = get_accepted_encodings(request);
+  job->status = 0;
+  job->compressed.body = NULL;
+  job->next = NULL;
+  return job;
+}
+
+/* Queues a page or an image to be rendered by a worker. The connection won't handle any further requests until the
+ * response has been added by finish_render_job(). */
+static void queue_render_job(RenderJob *job, ServerInfo *info) {
+  job->connection->job = job;
+  pthread_mutex_lock(&info->jobs_lock);
+  if (info->last_queued_job) {
+    info->last_queued_job->next = job;
+  } else {
+    info->queued_jobs = job;
+  }
+  info->last_queued_job = job;
+  info->unfinished_jobs++;
+  pthread_cond_signal(&info->jobs_available);
+  pthread_mutex_unlock(&info->jobs_lock);
+}
+
+/* Waits for all queued pages to be rendered. Must be called before the environment is deleted. */
+static void wait_for_render_jobs(ServerInfo *info) {
+  pthread_mutex_lock(&info->jobs_lock);
+  while (info->unfinished_jobs) {
+    pthread_cond_wait(&info->jobs_finished, &info->jobs_lock);
+  }
+  pthread_mutex_unlock(&info->jobs_lock);
+}
+
+/* Serves a file in the virtual dist from its source file, resizing images on demand. Returns 1 if `dist_path` was
+ * passed on to a render job. */
+static int virtual_file_response(VirtualFile *file, Path *dist_path, const Request *request, Connection *connection,
+    ServerInfo *info) {
+  if (!file_exists(file->src->path)) {
+    // Mapped directories may contain files in dist that don't exist in the source directory
+    file_response(dist_path, request, connection);
+    delete_path(file->src);
+    return 0;
+  }
+  FileStamp stamp = get_file_stamp(file->src->path);
+  time_t mtime = stamp.mtime;
+  // Source files aren't modules, so they have to be watched for the browser to be reloaded when they change
+  watch_file(file->src->path, stamp, info->watcher);
+  if (file->type == VIRTUAL_IMAGE && image_resizing_available()) {
+    CachedImage *image = find_cached_image(dist_path->path, mtime, info);
+    if (!image) {
+      RenderJob *job = create_render_job(dist_path, request, connection, info);
+      job->image = *file;
+      job->image_mtime = mtime;
+      queue_render_job(job, info);
+      return 1;
+    }
+    ok_response(&image->page, NULL, get_header(request, "If-None-Match"), request->keep_alive, &connection->output);
+  } else {
+    file_response(file->src, request, connection);
+  }
+  delete_path(file->src);
+  return 0;
+}
+
+static void page_response(const Request *request, Connection *connection, ServerInfo *info) {
+  Buffer *output = &connection->output;
+  Path *path = create_path(request->uri, -1);
+  Path *dist_path = get_dist_path(path, info->env);
+  delete_path(path);
+  if (!dist_path) {
+    not_found_response(request, output);
+    return;
+  }
+  CachedPage page = { .path = dist_path->path };
+  if (generic_hash_map_get(&info->page_cache, &page, &page)) {
+    CompressedBody compressed;
+    ContentEncoding encoding = choose_page_encoding(&page, get_accepted_encodings(request));
+    int is_compressed = get_compressed_page(&page, encoding, info, &compressed);
+    ok_response(&page, is_compressed ? &compressed : NULL, get_header(request, "If-None-Match"), request->keep_alive,
+        output);
+  } else {
+    Object *page_object = find_in_site_map(dist_path, info);
+    if (page_object) {
+      RenderJob *job = create_render_job(dist_path, request, connection, info);
+      job->page_object = page_object;
+      queue_render_job(job, info);
+      return;
+    }
+    VirtualFile file;
+    if (info->virtual_dist && find_virtual_file(info->virtual_dist, dist_path, &file)) {
+      if (virtual_file_response(&file, dist_path, request, connection, info)) {
         return;
-      } else {
-        Path *path = create_path(uri, -1);
-        Path *dist_path = get_dist_path(path, info->env);
-        delete_path(path);
-        if (dist_path) {
-          Object *page = find_in_site_map(dist_path, info->env);
-          if (page) {
-            Path *dest_path = NULL;
-            Value dest_path_value;
-            if (object_get_symbol(page, "dest", &dest_path_value) && dest_path_value.type == V_STRING) {
-              dest_path = string_to_path(dest_path_value.string_value);
-            }
-            fprintf(stderr, "Compiling %s\n", dest_path ? dest_path->path : dist_path->path);
-            Env *template_env = NULL;
-            Value output = compile_page_object(page, info->env, &template_env);
-            if (output.type == V_STRING) {
-              ok_response(cfd, dest_path ? path_get_extension(dest_path) : path_get_extension(dist_path),
-                  output.string_value);
-            } else {
-              internal_server_error_response(cfd, "Invalid template output");
-            }
-            if (template_env) {
-              delete_template_env(template_env);
-            }
-            if (dest_path) {
-              delete_path(dest_path);
-            }
-          } else {
-            file_response(cfd, dist_path);
-          }
-          delete_path(dist_path);
-        } else {
-          not_found_response(cfd);
+      }
+    } else {
+      file_response(dist_path, request, connection);
+    }
+  }
+  delete_path(dist_path);
+}
+
+static Connection *open_connection(int fd, ServerInfo *info) {
+  Connection *connection = allocate(sizeof(Connection));
+  connection->fd = fd;
+  connection->input = create_buffer(0);
+  connection->output = create_buffer(0);
+  connection->written = 0;
+  connection->file_fd = -1;
+  connection->job = NULL;
+  connection->event_source = 0;
+  connection->closing = 0;
+  connection->last_active = time(NULL);
+  connection->prev = NULL;
+  connection->next = info->connections;
+  if (info->connections) {
+    info->connections->prev = connection;
+  }
+  info->connections = connection;
+  info->connection_count++;
+  return connection;
+}
+
+static void close_connection(Connection *connection, ServerInfo *info) {
+  close(connection->fd);
+  if (connection->file_fd >= 0) {
+    close(connection->file_fd);
+  }
+  if (connection->job) {
+    connection->job->connection = NULL;
+  }
+  info->connection_count--;
+  if (connection->event_source) {
+    info->event_source_count--;
+  }
+  if (connection->prev) {
+    connection->prev->next = connection->next;
+  } else {
+    info->connections = connection->next;
+  }
+  if (connection->next) {
+    connection->next->prev = connection->prev;
+  }
+  delete_buffer(connection->input);
+  delete_buffer(connection->output);
+  free(connection);
+}
+
+/* Turns the connection into a hot reload event stream. Events are pushed to all event streams by broadcast_event(). */
+static void event_source_response(Connection *connection, ServerInfo *info) {
+  write_server_headers(&connection->output, 200, "OK", 0);
+  buffer_printf(&connection->output, "Content-Type: text/event-stream\r\n\r\n");
+  connection->event_source = 1;
+  if (!info->event_source_count) {
+    info->last_heartbeat = time(NULL);
+  }
+  info->event_source_count++;
+}
+
+static void handle_request(Request *request, Connection *connection, ServerInfo *info) {
+  if (strcmp(request->method, "GET") != 0) {
+    request->keep_alive = 0;
+    text_response(405, "Method Not Allowed", "Method Not Allowed", 0, &connection->output);
+  } else if (strcmp(request->uri, "/.plet-hot-reload-event-source") == 0) {
+    event_source_response(connection, info);
+  } else {
+    page_response(request, connection, info);
+  }
+}
+
+static int has_pending_output(const Connection *connection) {
+  return connection->written < connection->output.size || connection->file_fd >= 0;
+}
+
+static int is_drained(const Connection *connection) {
+  return !has_pending_output(connection) && !connection->job;
+}
+
+static ssize_t send_file_chunk(Connection *connection) {
+  off_t remaining = connection->file_end - connection->file_offset;
+  size_t count = remaining < SEND_FILE_CHUNK ? remaining : SEND_FILE_CHUNK;
+#if defined(__linux__)
+  return sendfile(connection->fd, connection->file_fd, &connection->file_offset, count);
+#else
+  uint8_t buffer[SEND_FILE_CHUNK];
+  ssize_t n = pread(connection->file_fd, buffer, count, connection->file_offset);
+  if (n <= 0) {
+    return n;
+  }
+  n = write(connection->fd, buffer, n);
+  if (n > 0) {
+    connection->file_offset += n;
+  }
+  return n;
+#endif
+}
+
+/* Writes pending output followed by the pending file body, if any. Returns 0 on errors. */
+static int flush_output(Connection *connection) {
+  while (connection->written < connection->output.size) {
+    ssize_t n = write(connection->fd, connection->output.data + connection->written,
+        connection->output.size - connection->written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    connection->written += n;
+    connection->last_active = time(NULL);
+  }
+  connection->output.size = 0;
+  connection->written = 0;
+  if (connection->file_fd >= 0) {
+    while (connection->file_offset < connection->file_end) {
+      ssize_t n = send_file_chunk(connection);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
         }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      } else if (n == 0) {
+        // The file was truncated after the headers were sent, so the response can't be completed
+        return 0;
+      }
+      connection->last_active = time(NULL);
+    }
+    close(connection->file_fd);
+    connection->file_fd = -1;
+  }
+  return 1;
+}
+
+/* Reads available input. Returns 0 when the peer has closed the connection or on errors. */
+static int read_input(Connection *connection) {
+  while (connection->input.size < MAX_INPUT_BUFFER) {
+    if (connection->input.capacity < connection->input.size + READ_CHUNK) {
+      connection->input.capacity = connection->input.size + READ_CHUNK;
+      connection->input.data = reallocate(connection->input.data, connection->input.capacity);
+    }
+    ssize_t n = read(connection->fd, connection->input.data + connection->input.size, READ_CHUNK);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    } else if (n == 0) {
+      return 0;
+    }
+    connection->input.size += n;
+    connection->last_active = time(NULL);
+  }
+  return 1;
+}
+
+/* Handles pipelined requests in order. A request is only handled once the responses to the previous requests have
+ * been written, which also stops clients from queueing up unbounded output. Returns 0 if the connection should be
+ * closed. */
+static int process_requests(Connection *connection, ServerInfo *info) {
+  while (!connection->closing && !connection->event_source && is_drained(connection)) {
+    uint8_t *head_end = memmem(connection->input.data, connection->input.size, "\r\n\r\n", 4);
+    if (!head_end) {
+      if (connection->input.size > MAX_REQUEST_HEAD) {
+        text_response(431, "Request Header Fields Too Large", "Request Header Fields Too Large", 0,
+            &connection->output);
+        connection->closing = 1;
+      }
+      break;
+    }
+    size_t head_size = head_end + 4 - connection->input.data;
+    if (head_size > MAX_REQUEST_HEAD) {
+      text_response(431, "Request Header Fields Too Large", "Request Header Fields Too Large", 0,
+          &connection->output);
+      connection->closing = 1;
+      break;
+    }
+    head_end[2] = '\0';
+    Request request;
+    if (!parse_request((char *) connection->input.data, &request)) {
+      text_response(400, "Bad Request", "Bad Request", 0, &connection->output);
+      connection->closing = 1;
+      break;
+    }
+    handle_request(&request, connection, info);
+    if (!request.keep_alive) {
+      connection->closing = 1;
+    }
+    connection->input.size -= head_size;
+    memmove(connection->input.data, connection->input.data + head_size, connection->input.size);
+    if (!flush_output(connection)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void handle_connection(Connection *connection, ServerInfo *info) {
+  int open = 1;
+  while (1) {
+    if (!flush_output(connection)) {
+      close_connection(connection, info);
+      return;
+    }
+    if (open && !connection->closing) {
+      open = read_input(connection);
+    }
+    size_t input_size = connection->input.size;
+    if (!process_requests(connection, info) || !flush_output(connection)) {
+      close_connection(connection, info);
+      return;
+    }
+    if (connection->event_source) {
+      // Anything sent after the event stream request is ignored
+      connection->input.size = 0;
+    }
+    int drained = is_drained(connection);
+    if ((connection->closing || !open) && drained) {
+      close_connection(connection, info);
+      return;
+    }
+    // Keep going while requests are being handled and the input buffer was full, since the socket may still have
+    // unread data that edge-triggered epoll won't report again
+    if (!drained || connection->input.size == input_size || input_size < MAX_INPUT_BUFFER) {
+      return;
+    }
+  }
+}
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+#if defined(__linux__)
+
+static int init_event_loop(ServerInfo *info) {
+  info->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (info->epfd < 0) {
+    return 0;
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = NULL;
+  if (epoll_ctl(info->epfd, EPOLL_CTL_ADD, info->sfd, &event) != 0) {
+    return 0;
+  }
+  // The watcher and the rebuild thread only wake up the event loop, their descriptors are read by check_for_changes()
+  // and finish_rebuild()
+  event.events = EPOLLIN;
+  event.data.ptr = info;
+  int watcher_fd = get_watcher_fd(info->watcher);
+  if (watcher_fd >= 0 && epoll_ctl(info->epfd, EPOLL_CTL_ADD, watcher_fd, &event) != 0) {
+    return 0;
+  }
+  if (epoll_ctl(info->epfd, EPOLL_CTL_ADD, info->wakeup_pipe[0], &event) != 0) {
+    return 0;
+  }
+  event.data.ptr = &info->stop_fd;
+  return info->stop_fd < 0 || epoll_ctl(info->epfd, EPOLL_CTL_ADD, info->stop_fd, &event) == 0;
+}
+
+static int watch_connection(Connection *connection, ServerInfo *info) {
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = connection;
+  return epoll_ctl(info->epfd, EPOLL_CTL_ADD, connection->fd, &event) == 0;
+}
+
+/* Waits for socket events. Connections are registered edge-triggered, so every handler must read and write until the
+ * socket would block. */
+static int wait_for_events(ServerInfo *info, int timeout, Connection ***ready, int *accept_ready) {
+  static struct epoll_event events[MAX_EVENTS];
+  static Connection *connections[MAX_EVENTS];
+  int n = epoll_wait(info->epfd, events, MAX_EVENTS, timeout);
+  int count = 0;
+  *accept_ready = 0;
+  for (int i = 0; i < n; i++) {
+    if (!events[i].data.ptr) {
+      *accept_ready = 1;
+    } else if (events[i].data.ptr == &info->stop_fd) {
+      info->stopped = 1;
+    } else if (events[i].data.ptr != info) {
+      connections[count++] = events[i].data.ptr;
+    }
+  }
+  *ready = connections;
+  return n < 0 ? -1 : count;
+}
+
+#else
+
+static int init_event_loop(ServerInfo *info) {
+  info->epfd = -1;
+  return 1;
+}
+
+static int watch_connection(Connection *connection, ServerInfo *info) {
+  return 1;
+}
+
+static int wait_for_events(ServerInfo *info, int timeout, Connection ***ready, int *accept_ready) {
+  static struct pollfd *fds = NULL;
+  static Connection **connections = NULL;
+  static int capacity = 0;
+  if (capacity < info->connection_count + 4) {
+    capacity = info->connection_count + 4 + MAX_EVENTS;
+    fds = reallocate(fds, capacity * sizeof(struct pollfd));
+    connections = reallocate(connections, capacity * sizeof(Connection *));
+  }
+  fds[0].fd = info->sfd;
+  fds[0].events = POLLIN;
+  fds[1].fd = get_watcher_fd(info->watcher);
+  fds[1].events = POLLIN;
+  fds[2].fd = info->wakeup_pipe[0];
+  fds[2].events = POLLIN;
+  fds[3].fd = info->stop_fd;
+  fds[3].events = POLLIN;
+  int nfds = 4;
+  for (Connection *connection = info->connections; connection; connection = connection->next) {
+    fds[nfds].fd = connection->fd;
+    fds[nfds].events = has_pending_output(connection) ? POLLOUT : POLLIN;
+    connections[nfds - 4] = connection;
+    nfds++;
+  }
+  int n = poll(fds, nfds, timeout);
+  if (n < 0) {
+    return -1;
+  }
+  *accept_ready = (fds[0].revents & POLLIN) != 0;
+  if (fds[3].revents) {
+    info->stopped = 1;
+  }
+  int count = 0;
+  for (int i = 4; i < nfds; i++) {
+    if (fds[i].revents) {
+      connections[count++] = connections[i - 4];
+    }
+  }
+  *ready = connections;
+  return count;
+}
+
+#endif
+
+static void accept_connections(ServerInfo *info) {
+  while (1) {
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int cfd = accept(info->sfd, (struct sockaddr *) &client_addr, &client_addr_len);
+    if (cfd < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, ERROR_LABEL "accept failed: %s" SGR_RESET "\n", strerror(errno));
+      }
+      return;
+    }
+    if (!set_nonblocking(cfd)) {
+      fprintf(stderr, ERROR_LABEL "unable to configure connection: %s" SGR_RESET "\n", strerror(errno));
+      close(cfd);
+      continue;
+    }
+    // Headers and file bodies are sent separately, so Nagle's algorithm would delay the body until the client's
+    // delayed ACK
+    int option = 1;
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    Connection *connection = open_connection(cfd, info);
+    if (!watch_connection(connection, info)) {
+      fprintf(stderr, ERROR_LABEL "unable to watch connection: %s" SGR_RESET "\n", strerror(errno));
+      close_connection(connection, info);
+    }
+  }
+}
+
+static void broadcast_event(const char *event, ServerInfo *info) {
+  Connection *connection = info->connections;
+  while (connection) {
+    Connection *next = connection->next;
+    if (connection->event_source && !connection->closing) {
+      buffer_printf(&connection->output, "%s", event);
+      if (!flush_output(connection)) {
+        // The connection may be waiting to be handled by the event loop, so it's closed by handle_timeouts() instead
+        connection->closing = 1;
+      }
+    }
+    connection = next;
+  }
+}
+
+/* Closes idle connections and sends heartbeats to event streams. Returns the number of milliseconds until this needs
+ * to be done again, or -1 if there is nothing to wait for. */
+static int handle_timeouts(ServerInfo *info) {
+  time_t now = time(NULL);
+  time_t deadline = 0;
+  if (info->event_source_count) {
+    if (now - info->last_heartbeat >= HEARTBEAT_INTERVAL) {
+      broadcast_event(": heartbeat\n\n", info);
+      info->last_heartbeat = now;
+    }
+    deadline = info->last_heartbeat + HEARTBEAT_INTERVAL;
+  }
+  Connection *connection = info->connections;
+  while (connection) {
+    Connection *next = connection->next;
+    if (connection->event_source) {
+      if (connection->closing) {
+        close_connection(connection, info);
+      }
+    } else if (now - connection->last_active >= KEEP_ALIVE_TIMEOUT) {
+      close_connection(connection, info);
+    } else if (!deadline || connection->last_active + KEEP_ALIVE_TIMEOUT < deadline) {
+      deadline = connection->last_active + KEEP_ALIVE_TIMEOUT;
+    }
+    connection = next;
+  }
+  int timeout = deadline ? (deadline - now) * 1000 : -1;
+  if (info->event_source_count && get_watcher_fd(info->watcher) < 0 && (timeout < 0 || timeout > POLL_INTERVAL)) {
+    // Without inotify the watcher has to be polled for changes to be pushed to event streams
+    timeout = POLL_INTERVAL;
+  }
+  int watcher_delay = get_watcher_delay(info->watcher);
+  if (watcher_delay >= 0 && (timeout < 0 || watcher_delay < timeout)) {
+    // Changes are reported by check_for_changes() once they have settled
+    timeout = watcher_delay;
+  }
+  return timeout;
+}
+
+static void *rebuild_worker(void *arg) {
+  ServerInfo *info = arg;
+  VirtualDist *virtual_dist = info->virtual_dist ? create_virtual_dist() : NULL;
+  VirtualDist *previous_dist = use_virtual_dist(virtual_dist);
+  Env *env = eval_index(info->src_root, info->modules, info->symbol_map, info->jobs);
+  use_virtual_dist(previous_dist);
+  if (!env && virtual_dist) {
+    delete_virtual_dist(virtual_dist);
+    virtual_dist = NULL;
+  }
+  pthread_mutex_lock(&info->jobs_lock);
+  info->next_env = env;
+  info->next_virtual_dist = virtual_dist;
+  info->rebuild_done = 1;
+  wake_event_loop(info);
+  pthread_mutex_unlock(&info->jobs_lock);
+  return NULL;
+}
+
+/* Evaluates index.plet on a background thread while requests are served from the current environment. */
+static void start_rebuild(ServerInfo *info) {
+  info->rebuild_pending = 0;
+  // Modules replaced from now on may be used by the new environment, the ones replaced before are only used by the
+  // current environment
+  info->replaced_modules = get_replaced_module_count(info->modules);
+  int error = pthread_create(&info->rebuild_thread, NULL, rebuild_worker, info);
+  if (error) {
+    fprintf(stderr, ERROR_LABEL "unable to start build: %s" SGR_RESET "\n", strerror(error));
+    return;
+  }
+  info->rebuilding = 1;
+}
+
+static void finish_rebuild(ServerInfo *info) {
+  pthread_join(info->rebuild_thread, NULL);
+  info->rebuilding = 0;
+  info->rebuild_done = 0;
+  if (info->next_env) {
+    wait_for_render_jobs(info);
+    info->generation++;
+    delete_page_cache(info);
+    init_page_cache(info);
+    delete_site_map_index(info);
+    delete_arena(info->env->arena);
+    release_replaced_modules(info->replaced_modules, info->modules);
+    info->env = info->next_env;
+    info->next_env = NULL;
+    if (info->next_virtual_dist) {
+      inherit_virtual_files(info->next_virtual_dist, info->virtual_dist);
+      delete_virtual_dist(info->virtual_dist);
+      info->virtual_dist = info->next_virtual_dist;
+      info->next_virtual_dist = NULL;
+    }
+    init_site_map_index(info);
+    broadcast_event("event: changes_detected\ndata:\n\n", info);
+  } else {
+    fprintf(stderr, WARN_LABEL "build failed, serving the previous version of the site" SGR_RESET "\n");
+  }
+  if (info->rebuild_pending) {
+    start_rebuild(info);
+  }
+}
+
+static void finish_render_job(RenderJob *job, ServerInfo *info) {
+  CachedPage *page = &job->page;
+  CachedPage cached;
+  int owned = job->status;
+  if (job->status && !job->page_object) {
+    CachedImage *image = cache_image(page, job->image_mtime, info);
+    if (image) {
+      page = &image->page;
+      owned = 0;
+    }
+  } else if (job->status && job->generation == info->generation) {
+    if (generic_hash_map_get(&info->page_cache, page, &cached)) {
+      // The page was also rendered for another request
+      page = &cached;
     } else {
-      write_server_headers(cfd, 405, "Method Not Allowed");
-      Buffer response = create_buffer(32);
-      buffer_printf(&response, "Content-Type: text/plain\r\n\r\nMethod Not Allowed");
-      write_buffer(cfd, response);
-      delete_buffer(response);
+      generic_hash_map_set(&info->page_cache, page, NULL, NULL);
+      owned = 0;
+    }
+  }
+  CompressedBody *compressed = NULL;
+  if (job->compressed.body) {
+    cache_compressed_body(&job->compressed, info);
+    if (job->compressed.hash == page->hash) {
+      compressed = &job->compressed;
     }
   }
-  free(buffer);
-  shutdown(cfd, SHUT_RDWR);
-  close(cfd);
+  Connection *connection = job->connection;
+  if (connection) {
+    connection->job = NULL;
+    if (job->status) {
+      ok_response(page, compressed, job->if_none_match, job->keep_alive, &connection->output);
+    } else if (job->page_object) {
+      text_response(500, "Internal Server Error", "Invalid template output", job->keep_alive, &connection->output);
+    } else {
+      text_response(500, "Internal Server Error", "Unable to resize image", job->keep_alive, &connection->output);
+    }
+    handle_connection(connection, info);
+  }
+  if (owned) {
+    delete_cached_page(&job->page);
+  }
+  delete_path(job->dist_path);
+  if (!job->page_object) {
+    delete_path(job->image.src);
+  }
+  if (job->if_none_match) {
+    free(job->if_none_match);
+  }
+  free(job);
 }
 
-int serve(GlobalArgs args) {
+/* Handles rendered pages and completed builds. */
+static void handle_wakeups(ServerInfo *info) {
+  char bytes[64];
+  while (read(info->wakeup_pipe[0], bytes, sizeof(bytes)) > 0) {
+  }
+  pthread_mutex_lock(&info->jobs_lock);
+  RenderJob *jobs = info->completed_jobs;
+  info->completed_jobs = NULL;
+  int rebuild_done = info->rebuild_done;
+  pthread_mutex_unlock(&info->jobs_lock);
+  while (jobs) {
+    RenderJob *next = jobs->next;
+    finish_render_job(jobs, info);
+    jobs = next;
+  }
+  if (rebuild_done) {
+    finish_rebuild(info);
+  }
+}
+
+static int start_workers(int count, ServerInfo *info) {
+  info->workers = allocate(count * sizeof(pthread_t));
+  for (info->worker_count = 0; info->worker_count < count; info->worker_count++) {
+    int error = pthread_create(&info->workers[info->worker_count], NULL, render_worker, info);
+    if (error) {
+      fprintf(stderr, ERROR_LABEL "unable to start worker: %s" SGR_RESET "\n", strerror(error));
+      break;
+    }
+  }
+  if (!info->worker_count) {
+    free(info->workers);
+    return 0;
+  }
+  return 1;
+}
+
+static void stop_workers(ServerInfo *info) {
+  pthread_mutex_lock(&info->jobs_lock);
+  info->stopping = 1;
+  pthread_cond_broadcast(&info->jobs_available);
+  pthread_mutex_unlock(&info->jobs_lock);
+  for (int i = 0; i < info->worker_count; i++) {
+    pthread_join(info->workers[i], NULL);
+  }
+  free(info->workers);
+  while (info->completed_jobs) {
+    RenderJob *next = info->completed_jobs->next;
+    finish_render_job(info->completed_jobs, info);
+    info->completed_jobs = next;
+  }
+}
+
+static void check_for_changes(ServerInfo *info) {
+  if (wait_for_changes(info->watcher, 0)) {
+    fprintf(stderr, INFO_LABEL "changes detected" SGR_RESET "\n");
+    if (info->rebuilding) {
+      info->rebuild_pending = 1;
+    } else {
+      start_rebuild(info);
+    }
+  }
+}
+
+static void run_event_loop(ServerInfo *info) {
+  while (!info->stopped) {
+    Connection **ready;
+    int accept_ready;
+    int n = wait_for_events(info, handle_timeouts(info), &ready, &accept_ready);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, ERROR_LABEL "unable to wait for connections: %s" SGR_RESET "\n", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      handle_connection(ready[i], info);
+    }
+    if (accept_ready) {
+      accept_connections(info);
+    }
+    // Handled last since finishing a render job may close its connection
+    handle_wakeups(info);
+    check_for_changes(info);
+  }
+  if (info->rebuilding) {
+    pthread_join(info->rebuild_thread, NULL);
+    info->rebuilding = 0;
+    if (info->next_env) {
+      delete_arena(info->next_env->arena);
+    }
+    if (info->next_virtual_dist) {
+      delete_virtual_dist(info->next_virtual_dist);
+    }
+  }
+}
+
+/* Runs the server until `stop_fd` becomes readable, e.g. when the write end of a pipe is written to or closed. */
+int serve_until(GlobalArgs args, int stop_fd) {
   ServerInfo info;
   info.src_root = find_project_root();
   if (!info.src_root) {
@@ -301,12 +1708,41 @@ int serve(GlobalArgs args) {
     return 1;
   }
   info.dist_root = path_append(info.src_root, "dist");
+  info.connections = NULL;
+  info.connection_count = 0;
+  info.event_source_count = 0;
+  info.queued_jobs = NULL;
+  info.last_queued_job = NULL;
+  info.completed_jobs = NULL;
+  info.unfinished_jobs = 0;
+  info.stopping = 0;
+  info.generation = 0;
+  info.rebuild_done = 0;
+  info.rebuilding = 0;
+  info.rebuild_pending = 0;
+  info.next_env = NULL;
+  info.virtual_dist = args.in_memory ? create_virtual_dist() : NULL;
+  info.next_virtual_dist = NULL;
+  info.epfd = -1;
+  info.wakeup_pipe[0] = info.wakeup_pipe[1] = -1;
+  info.stop_fd = stop_fd;
+  info.jobs = args.jobs;
+  info.stopped = 0;
   int status = 0;
   info.symbol_map = create_symbol_map();
   info.modules = create_module_map();
   add_system_modules(info.modules);
-  info.env = eval_index(info.src_root, info.modules, info.symbol_map);
+  retain_replaced_modules(info.modules);
+  // With a virtual dist static files and images are mapped to their source files instead of being copied to dist
+  VirtualDist *previous_dist = use_virtual_dist(info.virtual_dist);
+  info.env = eval_index(info.src_root, info.modules, info.symbol_map, info.jobs);
+  use_virtual_dist(previous_dist);
+  info.watcher = create_watcher(info.src_root, info.modules);
+  init_page_cache(&info);
+  init_compressed_cache(&info);
+  init_image_cache(&info);
   if (info.env) {
+    init_site_map_index(&info);
     struct addrinfo hints, *res, *p;
     memset (&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -320,49 +1756,75 @@ int serve(GlobalArgs args) {
       for (p = res; p != NULL; p = p->ai_next) {
         int option = 1;
         sfd = socket(p->ai_family, p->ai_socktype, 0);
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
         if (sfd == -1) {
           continue;
         }
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
         if (bind(sfd, p->ai_addr, p->ai_addrlen) == 0) {
           break;
         }
+        close(sfd);
       }
+      freeaddrinfo(res);
       if (p == NULL) {
         fprintf(stderr, ERROR_LABEL "could not bind to port %s: %s" SGR_RESET "\n", args.port, strerror(errno));
         status = 1;
+      } else if (listen(sfd, SERVER_BACKLOG) != 0) {
+        fprintf(stderr, ERROR_LABEL "could not listen to port %s: %s" SGR_RESET "\n", args.port, strerror(errno));
+        status = 1;
+        close(sfd);
       } else {
-        freeaddrinfo(res);
-        if (listen (sfd, 1000000) != 0) {
-          fprintf(stderr, ERROR_LABEL "could not listen to port %s: %s" SGR_RESET "\n", args.port, strerror(errno));
+        info.sfd = sfd;
+        pthread_mutex_init(&info.jobs_lock, NULL);
+        pthread_cond_init(&info.jobs_available, NULL);
+        pthread_cond_init(&info.jobs_finished, NULL);
+        if (!set_nonblocking(sfd) || pipe(info.wakeup_pipe) != 0 || !set_nonblocking(info.wakeup_pipe[0])
+            || !set_nonblocking(info.wakeup_pipe[1]) || !init_event_loop(&info)) {
+          fprintf(stderr, ERROR_LABEL "unable to create event loop: %s" SGR_RESET "\n", strerror(errno));
+          status = 1;
+        } else if (!start_workers(args.jobs, &info)) {
           status = 1;
         } else {
           signal(SIGPIPE, SIG_IGN);
           fprintf(stderr, INFO_LABEL "server listening on http://localhost:%s/" SGR_RESET "\n", args.port);
-          while (1) {
-            struct sockaddr_in client_addr;
-            socklen_t client_addr_len = sizeof(client_addr);
-            int cfd = accept(sfd, (struct sockaddr *) &client_addr, &client_addr_len);
-            if (detect_changes(info.modules)) {
-              fprintf(stderr, INFO_LABEL "changes detected" SGR_RESET "\n");
-              delete_arena(info.env->arena);
-              info.env = eval_index(info.src_root, info.modules, info.symbol_map);
-              if (!info.env) {
-                break;
-              }
-            }
-            handle_request(cfd, &info);
+          run_event_loop(&info);
+          while (info.connections) {
+            close_connection(info.connections, &info);
           }
+          stop_workers(&info);
         }
+        pthread_cond_destroy(&info.jobs_finished);
+        pthread_cond_destroy(&info.jobs_available);
+        pthread_mutex_destroy(&info.jobs_lock);
+        if (info.epfd >= 0) {
+          close(info.epfd);
+        }
+        if (info.wakeup_pipe[0] >= 0) {
+          close(info.wakeup_pipe[0]);
+          close(info.wakeup_pipe[1]);
+        }
+        close(sfd);
       }
     }
     if (info.env) {
+      delete_site_map_index(&info);
       delete_arena(info.env->arena);
     }
   }
+  delete_page_cache(&info);
+  delete_compressed_cache(&info);
+  delete_image_cache(&info);
+  if (info.virtual_dist) {
+    delete_virtual_dist(info.virtual_dist);
+  }
+  delete_watcher(info.watcher);
   delete_symbol_map(info.symbol_map);
   delete_module_map(info.modules);
   delete_path(info.src_root);
   delete_path(info.dist_root);
   return status;
 }
+
+int serve(GlobalArgs args) {
+  return serve_until(args, -1);
+}
@@ -10,5 +10,6 @@
 #include "build.h"
 
 int serve(GlobalArgs args);
+int serve_until(GlobalArgs args, int stop_fd);
 
 #endif
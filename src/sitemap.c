@@ -8,14 +8,18 @@
 
 #include "alloca.h"
 #include "build.h"
+#include "compress.h"
 #include "interpreter.h"
+#include "manifest.h"
 #include "module.h"
 #include "strings.h"
+#include "virtualdist.h"
 
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -34,6 +38,27 @@ typedef struct {
   Value handler;
 } PageInfo;
 
+typedef enum {
+  PAGE_INVALID,
+  PAGE_PENDING,
+  PAGE_FAILED,
+  PAGE_COMPILED,
+  PAGE_UP_TO_DATE
+} PageStatus;
+
+typedef struct {
+  PageInfo *pages;
+  PageStatus *status;
+  DependencySet **dependencies;
+  size_t size;
+  size_t next;
+  size_t pending;
+  size_t processed;
+  const Path *dist_root;
+  Env *env;
+  pthread_mutex_t lock;
+} PageQueue;
+
 typedef struct {
   PageType type;
   const Path *src;
@@ -47,22 +72,22 @@ static Value encode_page_info(ConstPageInfo page, Env *env) {
   Value object = create_object(0, env->arena);
   switch (page.type) {
     case P_COPY:
-      object_def(object.object_value, "type", create_symbol(get_symbol("copy", env->symbol_map)), env);
-      object_def(object.object_value, "src", path_to_string(page.src, env->arena), env);
-      object_def(object.object_value, "dest", path_to_string(page.dest, env->arena), env);
+      object_put(object.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_COPY), env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_SRC), path_to_string(page.src, env->arena), env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_DEST), path_to_string(page.dest, env->arena), env->arena);
       break;
     case P_TEMPLATE:
-      object_def(object.object_value, "type", create_symbol(get_symbol("template", env->symbol_map)), env);
-      object_def(object.object_value, "src", path_to_string(page.src, env->arena), env);
-      object_def(object.object_value, "dest", path_to_string(page.dest, env->arena), env);
-      object_def(object.object_value, "web_path", page.web_path, env);
-      object_def(object.object_value, "data", page.data, env);
+      object_put(object.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_TEMPLATE), env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_SRC), path_to_string(page.src, env->arena), env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_DEST), path_to_string(page.dest, env->arena), env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_WEB_PATH), page.web_path, env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_DATA), page.data, env->arena);
       break;
     case P_TASK:
-      object_def(object.object_value, "type", create_symbol(get_symbol("task", env->symbol_map)), env);
-      object_def(object.object_value, "src", path_to_string(page.src, env->arena), env);
-      object_def(object.object_value, "dest", path_to_string(page.dest, env->arena), env);
-      object_def(object.object_value, "handler", page.handler, env);
+      object_put(object.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_TASK), env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_SRC), path_to_string(page.src, env->arena), env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_DEST), path_to_string(page.dest, env->arena), env->arena);
+      object_put(object.object_value, create_known_symbol(SYM_HANDLER), page.handler, env->arena);
       break;
   }
   return object;
@@ -73,26 +98,26 @@ static int decode_page_info(Value value, PageInfo *page) {
     return 0;
   }
   Value type, src, dest;
-  if (!object_get_symbol(value.object_value, "type", &type) || type.type != V_SYMBOL) {
+  if (!object_get(value.object_value, create_known_symbol(SYM_TYPE), &type) || type.type != V_SYMBOL) {
     return 0;
   }
-  if (!object_get_symbol(value.object_value, "src", &src) || src.type != V_STRING) {
+  if (!object_get(value.object_value, create_known_symbol(SYM_SRC), &src) || src.type != V_STRING) {
     return 0;
   }
-  if (!object_get_symbol(value.object_value, "dest", &dest) || dest.type != V_STRING) {
+  if (!object_get(value.object_value, create_known_symbol(SYM_DEST), &dest) || dest.type != V_STRING) {
     return 0;
   }
-  if (strcmp(type.symbol_value, "copy") == 0) {
+  if (type.symbol_value == known_symbols[SYM_COPY]) {
     page->type = P_COPY;
     page->src = string_to_path(src.string_value);
     page->dest = string_to_path(dest.string_value);
     return 1;
-  } else if (strcmp(type.symbol_value, "template") == 0) {
+  } else if (type.symbol_value == known_symbols[SYM_TEMPLATE]) {
     Value web_path, data;
-    if (!object_get_symbol(value.object_value, "web_path", &web_path) || web_path.type != V_STRING) {
+    if (!object_get(value.object_value, create_known_symbol(SYM_WEB_PATH), &web_path) || web_path.type != V_STRING) {
       return 0;
     }
-    if (!object_get_symbol(value.object_value, "data", &data)) {
+    if (!object_get(value.object_value, create_known_symbol(SYM_DATA), &data)) {
       data = nil_value;
     }
     page->type = P_TEMPLATE;
@@ -101,9 +126,9 @@ static int decode_page_info(Value value, PageInfo *page) {
     page->web_path = web_path;
     page->data = data;
     return 1;
-  } else if (strcmp(type.symbol_value, "task") == 0) {
+  } else if (type.symbol_value == known_symbols[SYM_TASK]) {
     Value handler;
-    if (!object_get_symbol(value.object_value, "handler", &handler)
+    if (!object_get(value.object_value, create_known_symbol(SYM_HANDLER), &handler)
         || (handler.type != V_FUNCTION && handler.type != V_CLOSURE)) {
       return 0;
     }
@@ -164,7 +189,7 @@ static Value add_static(const Tuple *args, Env *env) {
     env_error(env, -1, "SITE_MAP is missign or not an object");
     return nil_value;
   }
-  if (!copy_static_files(src_path, dest_path, site_map.array_value, env)) {
+  if (!add_virtual_copy(dest_path, src_path) && !copy_static_files(src_path, dest_path, site_map.array_value, env)) {
     env_error(env, -1, "failed copying one or more files to dist");
   }
   delete_path(dest_path);
@@ -424,24 +449,29 @@ void import_sitemap(Env *env) {
 
 static int compile_page(PageInfo page, Env *env) {
   switch (page.type) {
-    case P_COPY:
+    case P_COPY: {
       load_asset_module(page.src, env);
-      return copy_file(page.src->path, page.dest->path);
+      lock_output_path(page.dest);
+      int status = copy_file(page.src->path, page.dest->path);
+      unlock_output_path(page.dest);
+      return status;
+    }
     case P_TEMPLATE: {
       int status = 0;
       Module *module = get_template(page.src, env);
       if (module) {
         Env *template_env = create_template_env(page.data, env);
         env_def("PATH", copy_value(page.web_path, template_env), template_env);
-        Value output = eval_template(module, template_env);
-        if (output.type == V_STRING) {
+        Buffer output = create_buffer(0);
+        Value value;
+        if (eval_template_output(module, &output, &value, template_env)) {
           Path *dir = path_get_parent(page.dest);
           if (mkdir_rec(dir->path)) {
             FILE *dest = fopen(page.dest->path, "w");
             if (!dest) {
               fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", page.dest->path, strerror(errno));
             } else {
-              if (fwrite(output.string_value->bytes, 1, output.string_value->size, dest) != output.string_value->size) {
+              if (fwrite(output.data, 1, output.size, dest) != output.size) {
                 fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", page.dest->path,
                     strerror(errno));
               } else {
@@ -454,6 +484,7 @@ static int compile_page(PageInfo page, Env *env) {
           }
           delete_path(dir);
         }
+        delete_buffer(output);
         delete_template_env(template_env);
       }
       return status;
@@ -536,7 +567,160 @@ void notify_output_observers(const Path *path, Env *env) {
   }
 }
 
-int compile_pages(Env *env) {
+static void print_progress(size_t i, size_t n, const Path *dist_root, const Path *dest) {
+  Path *site_path = path_get_relative(dist_root, dest);
+  fprintf(stderr, "[%zd/%zd] Processing %-50.*s\r", i, n,
+      site_path->size > 50 ? 50 : (int) site_path->size, site_path->path);
+  fflush(stderr);
+  delete_path(site_path);
+}
+
+static void compile_queued_page(PageQueue *queue, size_t i) {
+  if (queue->pages[i].type != P_TEMPLATE) {
+    queue->status[i] = compile_page(queue->pages[i], queue->env) ? PAGE_COMPILED : PAGE_FAILED;
+    return;
+  }
+  DependencySet *dependencies = create_dependency_set();
+  DependencySet *previous = record_dependencies(dependencies);
+  queue->status[i] = compile_page(queue->pages[i], queue->env) ? PAGE_COMPILED : PAGE_FAILED;
+  record_dependencies(previous);
+  queue->dependencies[i] = dependencies;
+}
+
+static void compile_pages_serial(PageQueue *queue) {
+  for (size_t i = 0; i < queue->size; i++) {
+    if (queue->status[i] == PAGE_PENDING) {
+      print_progress(++queue->processed, queue->pending, queue->dist_root, queue->pages[i].dest);
+      compile_queued_page(queue, i);
+    }
+    if (queue->status[i] == PAGE_COMPILED || queue->status[i] == PAGE_UP_TO_DATE) {
+      notify_output_observers(queue->pages[i].dest, queue->env);
+    }
+  }
+}
+
+static void *compile_pages_worker(void *arg) {
+  PageQueue *queue = arg;
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    size_t i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (i >= queue->size) {
+      break;
+    }
+    if (queue->status[i] != PAGE_PENDING || queue->pages[i].type == P_TASK) {
+      continue;
+    }
+    pthread_mutex_lock(&queue->lock);
+    print_progress(++queue->processed, queue->pending, queue->dist_root, queue->pages[i].dest);
+    pthread_mutex_unlock(&queue->lock);
+    compile_queued_page(queue, i);
+  }
+  return NULL;
+}
+
+static void run_page_workers(PageQueue *queue, void *(*worker)(void *), int jobs) {
+  pthread_t *workers = allocate(jobs * sizeof(pthread_t));
+  int started = 0;
+  while (started < jobs) {
+    int error = pthread_create(&workers[started], NULL, worker, queue);
+    if (error) {
+      fprintf(stderr, ERROR_LABEL "unable to create worker thread: %s" SGR_RESET "\n", strerror(error));
+      break;
+    }
+    started++;
+  }
+  if (!started) {
+    worker(queue);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+}
+
+static void compile_pages_parallel(PageQueue *queue, int jobs) {
+  pthread_mutex_init(&queue->lock, NULL);
+  run_page_workers(queue, compile_pages_worker, jobs);
+  pthread_mutex_destroy(&queue->lock);
+  for (size_t i = 0; i < queue->size; i++) {
+    if (queue->status[i] == PAGE_PENDING) {
+      print_progress(++queue->processed, queue->pending, queue->dist_root, queue->pages[i].dest);
+      compile_queued_page(queue, i);
+    }
+    if (queue->status[i] == PAGE_COMPILED || queue->status[i] == PAGE_UP_TO_DATE) {
+      notify_output_observers(queue->pages[i].dest, queue->env);
+    }
+  }
+}
+
+/* Pages that were just compiled are always compressed, the siblings of up to date pages are only compressed if they
+ * are missing or stale. */
+static void compress_queued_page(PageQueue *queue, size_t i) {
+  if (queue->status[i] == PAGE_COMPILED || queue->status[i] == PAGE_UP_TO_DATE) {
+    compress_file(queue->pages[i].dest, queue->status[i] == PAGE_COMPILED);
+  }
+}
+
+static void *compress_pages_worker(void *arg) {
+  PageQueue *queue = arg;
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    size_t i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (i >= queue->size) {
+      break;
+    }
+    compress_queued_page(queue, i);
+  }
+  return NULL;
+}
+
+static void compress_pages(PageQueue *queue, int jobs) {
+  if (jobs > 1) {
+    queue->next = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    run_page_workers(queue, compress_pages_worker, jobs);
+    pthread_mutex_destroy(&queue->lock);
+  } else {
+    for (size_t i = 0; i < queue->size; i++) {
+      compress_queued_page(queue, i);
+    }
+  }
+}
+
+static Hash fingerprint_page(PageInfo page, FingerprintCache *cache) {
+  Hash h = HASH_ADD_BYTE(page.type, INIT_HASH);
+  h = fingerprint_path(h, page.src);
+  h = fingerprint_value(h, page.web_path, cache);
+  return fingerprint_value(h, page.data, cache);
+}
+
+/* Anything that may affect every page: the exported values of index.plet, the scripts and data it imported, and the
+ * structure of the site map. Content and other assets read by index.plet only matter through these values. */
+static Hash fingerprint_site(PageQueue *queue, DependencySet *index_dependencies, FingerprintCache *cache) {
+  Hash h = hash_code_dependencies(INIT_HASH, index_dependencies);
+  Env *env = queue->env;
+  Symbol site_map_symbol = get_symbol("SITE_MAP", env->symbol_map);
+  for (size_t i = 0; i < env->exports->size; i++) {
+    Value value;
+    if (env->exports->cells[i].type == V_SYMBOL && env->exports->cells[i].symbol_value != site_map_symbol
+        && env_get(env->exports->cells[i].symbol_value, &value, env)) {
+      h = fingerprint_value(h, env->exports->cells[i], cache);
+      h = fingerprint_value(h, value, cache);
+    }
+  }
+  for (size_t i = 0; i < queue->size; i++) {
+    if (queue->status[i] != PAGE_INVALID) {
+      h = HASH_ADD_BYTE(queue->pages[i].type, h);
+      h = fingerprint_path(h, queue->pages[i].src);
+      h = fingerprint_path(h, queue->pages[i].dest);
+    }
+  }
+  return h;
+}
+
+int compile_pages(Env *env, DependencySet *index_dependencies, int jobs, int compress) {
   Value site_map;
   if (!env_get_symbol("SITE_MAP", &site_map, env) || site_map.type != V_ARRAY) {
     fprintf(stderr, ERROR_LABEL "SITE_MAP undefined or not an array" SGR_RESET "\n");
@@ -547,24 +731,91 @@ int compile_pages(Env *env) {
     fprintf(stderr, ERROR_LABEL "DIST_ROOT undefined or not a string" SGR_RESET "\n");
     return 0;
   }
-  for (size_t i = 0; i < site_map.array_value->size; i++) {
-    Value page_value = site_map.array_value->cells[i];
-    PageInfo page;
-    if (!decode_page_info(page_value, &page)) {
+  Path *src_root = get_src_root(env);
+  PageQueue queue;
+  queue.size = site_map.array_value->size;
+  queue.pages = allocate(queue.size * sizeof(PageInfo));
+  queue.status = allocate(queue.size * sizeof(PageStatus));
+  queue.dependencies = allocate(queue.size * sizeof(DependencySet *));
+  queue.next = 0;
+  queue.pending = 0;
+  queue.processed = 0;
+  queue.dist_root = dist_root;
+  queue.env = env;
+  for (size_t i = 0; i < queue.size; i++) {
+    queue.dependencies[i] = NULL;
+    if (decode_page_info(site_map.array_value->cells[i], &queue.pages[i])) {
+      queue.status[i] = PAGE_PENDING;
+    } else {
       fprintf(stderr, ERROR_LABEL "invalid page object at index %zd of SITE_MAP" SGR_RESET "\n", i);
+      queue.status[i] = PAGE_INVALID;
+    }
+  }
+  FingerprintCache *cache = create_fingerprint_cache();
+  Hash *fingerprints = allocate(queue.size * sizeof(Hash));
+  Manifest *manifest = create_manifest(fingerprint_site(&queue, index_dependencies, cache));
+  Manifest *previous = src_root ? load_manifest(src_root) : NULL;
+  if (previous && get_site_fingerprint(previous) != get_site_fingerprint(manifest)) {
+    delete_manifest(previous);
+    previous = NULL;
+  }
+  for (size_t i = 0; i < queue.size; i++) {
+    PageInfo page = queue.pages[i];
+    if (queue.status[i] == PAGE_INVALID) {
       continue;
     }
-    Path *site_path = path_get_relative(dist_root, page.dest);
-    fprintf(stderr, "[%zd/%zd] Processing %-50.*s\r", i + 1, site_map.array_value->size,
-        site_path->size > 50 ? 50 : (int) site_path->size, site_path->path);
-    fflush(stderr);
-    delete_path(site_path);
-    if (compile_page(page, env)) {
-      notify_output_observers(page.dest, env);
+    if (page.type == P_TEMPLATE) {
+      fingerprints[i] = fingerprint_page(page, cache);
+      if (previous && page_is_up_to_date(previous, page.dest, fingerprints[i])) {
+        manifest_copy_page(manifest, previous, page.dest);
+        queue.status[i] = PAGE_UP_TO_DATE;
+      }
+    } else if (page.type == P_COPY && !asset_has_changed(page.src, page.dest)) {
+      load_asset_module(page.src, env);
+      queue.status[i] = PAGE_UP_TO_DATE;
+    }
+    if (queue.status[i] == PAGE_PENDING) {
+      queue.pending++;
     }
-    delete_path(page.src);
-    delete_path(page.dest);
   }
+  delete_fingerprint_cache(cache);
+  if (previous) {
+    delete_manifest(previous);
+  }
+  if (queue.pending < queue.size) {
+    fprintf(stderr, INFO_LABEL "%zd of %zd pages are up to date" SGR_RESET "\n", queue.size - queue.pending,
+        queue.size);
+  }
+  if (jobs > 1 && queue.pending > 1) {
+    compile_pages_parallel(&queue, jobs);
+  } else {
+    compile_pages_serial(&queue);
+  }
+  if (compress) {
+    compress_pages(&queue, jobs);
+  }
+  for (size_t i = 0; i < queue.size; i++) {
+    if (queue.status[i] == PAGE_INVALID) {
+      continue;
+    }
+    if (queue.dependencies[i]) {
+      if (queue.status[i] == PAGE_COMPILED) {
+        manifest_add_page(manifest, queue.pages[i].dest, fingerprints[i], queue.dependencies[i]);
+      }
+      delete_dependency_set(queue.dependencies[i]);
+    }
+    delete_path(queue.pages[i].src);
+    delete_path(queue.pages[i].dest);
+  }
+  if (src_root) {
+    save_manifest(manifest, src_root);
+    delete_path(src_root);
+  }
+  delete_manifest(manifest);
+  free(fingerprints);
+  free(queue.pages);
+  free(queue.status);
+  free(queue.dependencies);
   delete_path(dist_root);
   return 0;
 }
@@ -7,13 +7,14 @@
 #ifndef SITEMAP_H
 #define SITEMAP_H
 
+#include "manifest.h"
 #include "value.h"
 
 void import_sitemap(Env *env);
 
 void notify_output_observers(const Path *path, Env *env);
 Value compile_page_object(Object *object, Env *env, Env **template_env);
-int compile_pages(Env *env);
+int compile_pages(Env *env, DependencySet *index_dependencies, int jobs, int compress);
 
 #endif
 
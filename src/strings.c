@@ -4,6 +4,7 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#define _GNU_SOURCE
 #include "strings.h"
 
 #include <alloca.h>
@@ -335,7 +336,8 @@ static void json_encode_value(Value value, Buffer *buffer) {
       buffer_printf(buffer, "}");
       break;
     case V_TIME: {
-      struct tm *utc = gmtime(&value.time_value);
+      struct tm tm_buffer;
+      struct tm *utc = gmtime_r(&value.time_value, &tm_buffer);
       if (utc) {
         char date[26];
         if (strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", utc)) {
@@ -489,9 +491,9 @@ void string_buffer_append_value(StringBuffer *buffer, Value value) {
     case V_OBJECT:
       break;
     case V_TIME: {
-      struct tm *t;
+      struct tm tm_buffer;
       char date[26];
-      t = localtime(&value.time_value);
+      struct tm *t = localtime_r(&value.time_value, &tm_buffer);
       if (t) {
         if (strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", t)) {
           string_buffer_printf(buffer, "%s", date);
@@ -4,15 +4,43 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#define _GNU_SOURCE
 #include "token.h"
 
 #include "hashmap.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
+const Symbol known_symbols[NUM_KNOWN_SYMBOLS] = {
+  [SYM_ATTRIBUTES] = "attributes",
+  [SYM_CHILDREN] = "children",
+  [SYM_COMMENT] = "comment",
+  [SYM_COPY] = "copy",
+  [SYM_DATA] = "data",
+  [SYM_DEST] = "dest",
+  [SYM_DOCUMENT] = "document",
+  [SYM_ELEMENT] = "element",
+  [SYM_FRAGMENT] = "fragment",
+  [SYM_H1] = "h1",
+  [SYM_HANDLER] = "handler",
+  [SYM_ID] = "id",
+  [SYM_LINE] = "line",
+  [SYM_NUMBER] = "number",
+  [SYM_SELF_CLOSING] = "self_closing",
+  [SYM_SRC] = "src",
+  [SYM_TAG] = "tag",
+  [SYM_TASK] = "task",
+  [SYM_TEMPLATE] = "template",
+  [SYM_TITLE] = "title",
+  [SYM_TYPE] = "type",
+  [SYM_WEB_PATH] = "web_path",
+};
+
 struct SymbolMap {
   GenericHashMap map;
+  pthread_rwlock_t lock;
 };
 
 static Hash symbol_hash(const void *p) {
@@ -32,26 +60,49 @@ static int symbol_equals(const void *a, const void *b) {
 SymbolMap *create_symbol_map(void) {
   SymbolMap *symbol_map = allocate(sizeof(SymbolMap));
   init_generic_hash_map(&symbol_map->map, sizeof(Symbol), 0, symbol_hash, symbol_equals, NULL);
+  for (int i = 0; i < NUM_KNOWN_SYMBOLS; i++) {
+    generic_hash_map_add(&symbol_map->map, &known_symbols[i]);
+  }
+  pthread_rwlock_init(&symbol_map->lock, NULL);
   return symbol_map;
 }
 
+static int is_known_symbol(Symbol symbol) {
+  for (int i = 0; i < NUM_KNOWN_SYMBOLS; i++) {
+    if (known_symbols[i] == symbol) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 void delete_symbol_map(SymbolMap *symbol_map) {
   char *symbol;
   HashMapIterator it = generic_hash_map_iterate(&symbol_map->map);
   while (generic_hash_map_next(&it, &symbol)) {
-    free(symbol);
+    if (!is_known_symbol(symbol)) {
+      free(symbol);
+    }
   }
   delete_generic_hash_map(&symbol_map->map);
+  pthread_rwlock_destroy(&symbol_map->lock);
   free(symbol_map);
 }
 
 Symbol get_symbol(const char *name, SymbolMap *symbol_map) {
   Symbol symbol;
-  if (generic_hash_map_get(&symbol_map->map, &name, &symbol)) {
+  pthread_rwlock_rdlock(&symbol_map->lock);
+  int exists = generic_hash_map_get(&symbol_map->map, &name, &symbol);
+  pthread_rwlock_unlock(&symbol_map->lock);
+  if (exists) {
     return symbol;
   }
-  symbol = copy_string(name);
-  generic_hash_map_add(&symbol_map->map, &symbol);
+  pthread_rwlock_wrlock(&symbol_map->lock);
+  if (!generic_hash_map_get(&symbol_map->map, &name, &symbol)) {
+    symbol = copy_string(name);
+    generic_hash_map_add(&symbol_map->map, &symbol);
+  }
+  pthread_rwlock_unlock(&symbol_map->lock);
   return symbol;
 }
 
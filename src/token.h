@@ -16,6 +16,35 @@ typedef const char *Symbol;
 
 typedef struct SymbolMap SymbolMap;
 
+typedef enum {
+  SYM_ATTRIBUTES,
+  SYM_CHILDREN,
+  SYM_COMMENT,
+  SYM_COPY,
+  SYM_DATA,
+  SYM_DEST,
+  SYM_DOCUMENT,
+  SYM_ELEMENT,
+  SYM_FRAGMENT,
+  SYM_H1,
+  SYM_HANDLER,
+  SYM_ID,
+  SYM_LINE,
+  SYM_NUMBER,
+  SYM_SELF_CLOSING,
+  SYM_SRC,
+  SYM_TAG,
+  SYM_TASK,
+  SYM_TEMPLATE,
+  SYM_TITLE,
+  SYM_TYPE,
+  SYM_WEB_PATH,
+  NUM_KNOWN_SYMBOLS
+} KnownSymbol;
+
+/* Interned in every symbol map, so they can be compared by pointer. */
+extern const Symbol known_symbols[NUM_KNOWN_SYMBOLS];
+
 typedef struct Token Token;
 
 typedef enum {
@@ -4,6 +4,7 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#define _GNU_SOURCE
 #include "util.h"
 
 #include <ctype.h>
@@ -14,8 +15,8 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <utime.h>
 
 #if defined(_WIN32)
 #include <io.h>
@@ -92,6 +93,14 @@ void *arena_reallocate(void *old, size_t old_size, size_t size, Arena *arena) {
   return old;
 }
 
+/* Moves the blocks of `source` to the end of `arena`, so that memory allocated from `source` lives as long as
+ * `arena`. `source` must not be used afterwards. */
+void arena_merge(Arena *source, Arena *arena) {
+  Arena *last = source->last;
+  arena->last->next = source;
+  arena->last = last;
+}
+
 char *copy_string(const char *src) {
   size_t l = strlen(src) + 1;
   char *dest = allocate(l);
@@ -276,6 +285,20 @@ time_t get_mtime(const char *path) {
   return 0;
 }
 
+/* Returns a stamp with a size of -1 if the file doesn't exist. */
+FileStamp get_file_stamp(const char *path) {
+  struct stat stat_buffer;
+  if (stat(path, &stat_buffer) == 0) {
+    return (FileStamp) { .mtime = stat_buffer.st_mtim.tv_sec, .mtime_nsec = stat_buffer.st_mtim.tv_nsec,
+      .size = stat_buffer.st_size };
+  }
+  return (FileStamp) { .mtime = 0, .mtime_nsec = 0, .size = -1 };
+}
+
+int file_stamp_equals(FileStamp a, FileStamp b) {
+  return a.mtime == b.mtime && a.mtime_nsec == b.mtime_nsec && a.size == b.size;
+}
+
 int is_dir(const char *path) {
   struct stat stat_buffer;
   return stat(path, &stat_buffer) == 0 && S_ISDIR(stat_buffer.st_mode);
@@ -312,17 +335,21 @@ int copy_file(const char *src_path, const char *dest_path) {
   }
   fclose(src);
   if (status) {
-    struct stat stat_buffer;
-    if (stat(src_path, &stat_buffer) == 0) {
-      struct utimbuf utime_buffer;
-      utime_buffer.actime = stat_buffer.st_atime;
-      utime_buffer.modtime = stat_buffer.st_mtime;
-      utime(dest_path, &utime_buffer);
-    }
+    copy_file_times(src_path, dest_path);
   }
   return status;
 }
 
+/* Gives a file the access and modification times of another file, including nanoseconds, so that it compares as
+ * up to date with it. */
+void copy_file_times(const char *src_path, const char *dest_path) {
+  struct stat stat_buffer;
+  if (stat(src_path, &stat_buffer) == 0) {
+    struct timespec times[2] = { stat_buffer.st_atim, stat_buffer.st_mtim };
+    utimensat(AT_FDCWD, dest_path, times, 0);
+  }
+}
+
 static int check_dir(const char *path) {
   struct stat stat_buffer;
   if (stat(path, &stat_buffer) == 0 && S_ISDIR(stat_buffer.st_mode)) {
@@ -62,6 +62,14 @@ typedef struct {
   char path[];
 } Path;
 
+/* Identifies the version of a file that was read. The size is included since two writes within the resolution of the
+ * file system's timestamps leave the modification time unchanged. */
+typedef struct {
+  time_t mtime;
+  long mtime_nsec;
+  int64_t size;
+} FileStamp;
+
 void *allocate(size_t size);
 
 void *reallocate(void *old, size_t size);
@@ -72,6 +80,7 @@ void delete_arena(Arena *arena);
 
 void *arena_allocate(size_t size, Arena *arena);
 void *arena_reallocate(void *old, size_t old_size, size_t size, Arena *arena);
+void arena_merge(Arena *source, Arena *arena);
 
 char *copy_string(const char *src);
 
@@ -88,8 +97,11 @@ void print_error_line(const char *file_name, Pos start, Pos end);
 char *combine_paths(const char *path1, const char *path2);
 int file_exists(const char *path);
 time_t get_mtime(const char *path);
+FileStamp get_file_stamp(const char *path);
+int file_stamp_equals(FileStamp a, FileStamp b);
 int is_dir(const char *path);
 int copy_file(const char *src_path, const char *dest_path);
+void copy_file_times(const char *src_path, const char *dest_path);
 int mkdir_rec(const char *path);
 int delete_dir(const Path *path);
 
@@ -4,25 +4,58 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#define _GNU_SOURCE
 #include "value.h"
 
 #include "util.h"
 
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <string.h>
 
 #define INITIAL_ARRAY_CAPACITY 16
+#define OBJECT_INDEX_THRESHOLD 16
 
 static NameList *arena_copy_name_list(NameList *list, Arena *arena);
 static Node copy_node(Node node, Arena *arena);
+static void object_append(Object *object, Value key, Value value, Hash hash, Arena *arena);
+
+typedef enum {
+  THUNK_PENDING,
+  THUNK_FORCING,
+  THUNK_FORCED
+} ThunkState;
+
+struct Thunk {
+  ThunkFunc func;
+  ThunkAccessFunc access;
+  void *context;
+  Hash hash;
+  ThunkState state;
+  pthread_t owner;
+};
+
+typedef struct {
+  Value key;
+  Value value;
+  Hash hash;
+  int removed;
+  Thunk *thunk;
+} ObjectEntry;
 
 struct Object {
-  Entry *entries;
+  ObjectEntry *entries;
   size_t capacity;
+  size_t length;
   size_t size;
+  size_t *index;
+  size_t index_mask;
+  Arena *arena;
 };
 
+static Value get_entry_value(Object *object, ObjectEntry *entry);
+
 typedef struct RefStack RefStack;
 struct RefStack {
   RefStack *next;
@@ -40,6 +73,11 @@ static int entry_equals(const void *a, const void *b) {
 
 String *empty_string = &(String) { .size = 0 };
 
+/* Lazy properties may be read from several threads at once, e.g. when pages are compiled in parallel. The lock protects
+ * the state of all thunks. */
+static pthread_mutex_t thunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thunk_forced = PTHREAD_COND_INITIALIZER;
+
 Env *create_env(Arena *arena, ModuleMap *modules, SymbolMap *symbol_map) {
   Env *env = arena_allocate(sizeof(Env), arena);
   env->arena = arena;
@@ -51,8 +89,9 @@ Env *create_env(Arena *arena, ModuleMap *modules, SymbolMap *symbol_map) {
   env->error_arg = -1;
   env->error_level = ENV_ERROR;
   init_generic_hash_map(&env->global, sizeof(Entry), 0, entry_hash, entry_equals, arena);
+  env->locals = NULL;
+  env->slots = NULL;
   env->exports = create_array(0, arena).array_value;
-  env->loops = 0;
   return env;
 }
 
@@ -62,13 +101,40 @@ Env *create_child_env(Env *parent) {
   return env;
 }
 
+static int env_find_slot(Symbol name, Env *env) {
+  int slot = 0;
+  for (NameList *local = env->locals; local; local = local->tail) {
+    if (local->head == name) {
+      return slot;
+    }
+    slot++;
+  }
+  return -1;
+}
+
 void env_put(Symbol symbol, Value value, Env *env) {
-  generic_hash_map_set(&env->global, &(Entry) { .key = create_symbol(symbol), .value = value }, NULL, NULL);\
+  if (env->slots) {
+    int slot = env_find_slot(symbol, env);
+    if (slot >= 0) {
+      env->slots[slot] = (Slot) { .value = value, .defined = 1 };
+      return;
+    }
+  }
+  generic_hash_map_set(&env->global, &(Entry) { .key = create_symbol(symbol), .value = value }, NULL, NULL);
 }
 
-int env_get(Symbol name, Value *value, Env *env) {
+void env_put_slot(int slot, Symbol name, Value value, Env *env) {
+  if (slot >= 0 && env->slots) {
+    env->slots[slot] = (Slot) { .value = value, .defined = 1 };
+  } else {
+    env_put(name, value, env);
+  }
+}
+
+static int env_get_global(Symbol name, Value *value, Env *env) {
   Entry entry;
-  if (generic_hash_map_get(&env->global, &(Entry) { .key = create_symbol(name) }, &entry)) {
+  // The maps of function envs are usually empty, since their variables are stored in slots
+  if (env->global.size && generic_hash_map_get(&env->global, &(Entry) { .key = create_symbol(name) }, &entry)) {
     *value = entry.value;
     return 1;
   }
@@ -78,6 +144,33 @@ int env_get(Symbol name, Value *value, Env *env) {
   return 0;
 }
 
+int env_get(Symbol name, Value *value, Env *env) {
+  if (env->slots) {
+    int slot = env_find_slot(name, env);
+    if (slot >= 0) {
+      return env_get_slot(slot, name, value, env);
+    }
+  }
+  return env_get_global(name, value, env);
+}
+
+int env_get_slot(int slot, Symbol name, Value *value, Env *env) {
+  if (slot == FREE_SLOT) {
+    // The parser has determined that the name isn't a local, so there is no need to search the locals of the env
+    return env_get_global(name, value, env);
+  } else if (slot < 0 || !env->slots) {
+    return env_get(name, value, env);
+  }
+  if (env->slots[slot].defined) {
+    *value = env->slots[slot].value;
+    return 1;
+  }
+  if (env->parent_env) {
+    return env_get(name, value, env->parent_env);
+  }
+  return 0;
+}
+
 int env_get_symbol(const char *name, Value *value, Env *env) {
   return env_get(get_symbol(name, env->symbol_map), value, env);
 }
@@ -390,14 +483,13 @@ static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack
       }
       Value copy = create_object(value.object_value->size, env->arena);
       RefStack nested = (RefStack) { .next = ref_stack, .old = value.object_value, .new = copy.object_value };
-      ObjectIterator it = iterate_object(value.object_value);
-      Value entry_key, entry_value;
-      while (object_iterator_next(&it, &entry_key, &entry_value)) {
-        copy.object_value->entries[copy.object_value->size] = (Entry) {
-          .key = copy_value_detect_cycles(entry_key, env, &nested),
-          .value = copy_value_detect_cycles(entry_value, env, &nested)
-        };
-        copy.object_value->size++;
+      for (size_t i = 0; i < value.object_value->length; i++) {
+        ObjectEntry *entry = &value.object_value->entries[i];
+        if (!entry->removed) {
+          object_append(copy.object_value, copy_value_detect_cycles(entry->key, env, &nested),
+              copy_value_detect_cycles(get_entry_value(value.object_value, entry), env, &nested), entry->hash,
+              env->arena);
+        }
       }
       return copy;
     }
@@ -412,7 +504,9 @@ static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack
       Closure *copy = arena_allocate(sizeof(Closure), env->arena);
       copy->params = value.closure_value->params;
       copy->body = copy_node(value.closure_value->body, env->arena);
+      copy->code = value.closure_value->code;
       copy->free_variables = arena_copy_name_list(value.closure_value->free_variables, env->arena);
+      copy->locals = arena_copy_name_list(value.closure_value->locals, env->arena);
       RefStack nested = (RefStack) { .next = ref_stack, .old = value.closure_value, .new = copy };
       copy->env = env;
       for (NameList *name = value.closure_value->free_variables; name; name = name->tail) {
@@ -433,6 +527,70 @@ Value copy_value(Value value, Env *env) {
   return copy_value_detect_cycles(value, env, NULL);
 }
 
+int is_writable(Value value, Env *env) {
+  switch (value.type) {
+    case V_ARRAY:
+      return value.array_value->arena == env->arena;
+    case V_OBJECT:
+      return value.object_value->arena == env->arena;
+    default:
+      return 1;
+  }
+}
+
+/* Updates arrays and objects allocated from `source` to belong to `arena` once the blocks of `source` have been merged
+ * into `arena` with arena_merge(), so that they remain writable. */
+void move_to_arena(Value value, Arena *source, Arena *arena) {
+  if (value.type == V_ARRAY && value.array_value->arena == source) {
+    value.array_value->arena = arena;
+    for (size_t i = 0; i < value.array_value->size; i++) {
+      move_to_arena(value.array_value->cells[i], source, arena);
+    }
+  } else if (value.type == V_OBJECT && value.object_value->arena == source) {
+    value.object_value->arena = arena;
+    for (size_t i = 0; i < value.object_value->length; i++) {
+      ObjectEntry *entry = &value.object_value->entries[i];
+      if (!entry->removed && !entry->thunk) {
+        move_to_arena(entry->key, source, arena);
+        move_to_arena(entry->value, source, arena);
+      }
+    }
+  }
+}
+
+static Value own_value_detect_cycles(Value value, Env *env, RefStack *ref_stack);
+
+static Value own_value_detect_cycles(Value value, Env *env, RefStack *ref_stack) {
+  if (!is_writable(value, env)) {
+    return copy_value(value, env);
+  }
+  if (value.type == V_ARRAY) {
+    if (get_existing_ref(ref_stack, value.array_value)) {
+      return value;
+    }
+    RefStack nested = (RefStack) { .next = ref_stack, .old = value.array_value, .new = value.array_value };
+    for (size_t i = 0; i < value.array_value->size; i++) {
+      value.array_value->cells[i] = own_value_detect_cycles(value.array_value->cells[i], env, &nested);
+    }
+  } else if (value.type == V_OBJECT) {
+    if (get_existing_ref(ref_stack, value.object_value)) {
+      return value;
+    }
+    RefStack nested = (RefStack) { .next = ref_stack, .old = value.object_value, .new = value.object_value };
+    for (size_t i = 0; i < value.object_value->length; i++) {
+      if (!value.object_value->entries[i].removed && !value.object_value->entries[i].thunk) {
+        value.object_value->entries[i].value = own_value_detect_cycles(value.object_value->entries[i].value, env,
+            &nested);
+      }
+    }
+  }
+  return value;
+}
+
+Value own_value(Value value, Env *env) {
+  return own_value_detect_cycles(value, env, NULL);
+}
+
 void value_to_string(Value value, Buffer *buffer) {
   switch (value.type) {
     case V_NIL:
@@ -458,9 +616,9 @@ void value_to_string(Value value, Buffer *buffer) {
     case V_OBJECT:
       break;
     case V_TIME: {
-      struct tm *t;
+      struct tm tm_buffer;
       char date[26];
-      t = localtime(&value.time_value);
+      struct tm *t = localtime_r(&value.time_value, &tm_buffer);
       if (t) {
         if (strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", t)) {
           buffer_printf(buffer, "%s", date);
@@ -557,6 +715,7 @@ Value create_array(size_t capacity, Arena *arena) {
   array->capacity = capacity < INITIAL_ARRAY_CAPACITY ? INITIAL_ARRAY_CAPACITY : capacity;
   array->size = 0;
   array->cells = arena_allocate(array->capacity * sizeof(Value), arena);
+  array->arena = arena;
   return (Value) { .type = V_ARRAY, .array_value = array };
 }
 
@@ -620,45 +779,197 @@ int array_remove(Array *array, int index) {
   return 0;
 }
 
+static Hash object_key_hash(Value key) {
+  switch (key.type) {
+    case V_BOOL:
+      return HASH_ADD_BYTE(!key.int_value, HASH_ADD_BYTE(V_BOOL, INIT_HASH));
+    case V_FLOAT:
+      if (key.float_value >= -9223372036854775808.0 && key.float_value < 9223372036854775808.0
+          && key.float_value == (int64_t) key.float_value) {
+        return value_hash(INIT_HASH, create_int((int64_t) key.float_value));
+      }
+      return value_hash(INIT_HASH, key);
+    case V_SYMBOL:
+      // Symbols are interned, so equal symbols are the same pointer
+      return HASH_ADD_PTR(key.symbol_value, HASH_ADD_BYTE(V_SYMBOL, INIT_HASH));
+    case V_ARRAY:
+      return HASH_ADD_BYTE(V_ARRAY, INIT_HASH);
+    case V_OBJECT:
+      return HASH_ADD_BYTE(V_OBJECT, INIT_HASH);
+    default:
+      return value_hash(INIT_HASH, key);
+  }
+}
+
+static void object_index_insert(Object *object, size_t position) {
+  size_t i = object->entries[position].hash & object->index_mask;
+  while (object->index[i]) {
+    i = (i + 1) & object->index_mask;
+  }
+  object->index[i] = position + 1;
+}
+
+static void object_build_index(Object *object, Arena *arena) {
+  if (object->capacity <= OBJECT_INDEX_THRESHOLD) {
+    object->index = NULL;
+    return;
+  }
+  size_t index_capacity = 1;
+  while (index_capacity < object->capacity << 1) {
+    index_capacity <<= 1;
+  }
+  object->index = arena_allocate(index_capacity * sizeof(size_t), arena);
+  memset(object->index, 0, index_capacity * sizeof(size_t));
+  object->index_mask = index_capacity - 1;
+  for (size_t i = 0; i < object->length; i++) {
+    if (!object->entries[i].removed) {
+      object_index_insert(object, i);
+    }
+  }
+}
+
+static ObjectEntry *object_find(Object *object, Value key, Hash hash) {
+  if (object->index) {
+    for (size_t i = hash & object->index_mask; object->index[i]; i = (i + 1) & object->index_mask) {
+      ObjectEntry *entry = &object->entries[object->index[i] - 1];
+      if (!entry->removed && entry->hash == hash && equals(key, entry->key)) {
+        return entry;
+      }
+    }
+    return NULL;
+  }
+  for (size_t i = 0; i < object->length; i++) {
+    ObjectEntry *entry = &object->entries[i];
+    if (!entry->removed && entry->hash == hash && equals(key, entry->key)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void object_append(Object *object, Value key, Value value, Hash hash, Arena *arena) {
+  if (object->length >= object->capacity) {
+    if (object->size > object->capacity >> 1) {
+      size_t new_capacity = object->capacity << 1;
+      ObjectEntry *new_entries = arena_allocate(new_capacity * sizeof(ObjectEntry), arena);
+      size_t size = 0;
+      for (size_t i = 0; i < object->length; i++) {
+        if (!object->entries[i].removed) {
+          new_entries[size++] = object->entries[i];
+        }
+      }
+      object->entries = new_entries;
+      object->capacity = new_capacity;
+    } else {
+      size_t size = 0;
+      for (size_t i = 0; i < object->length; i++) {
+        if (!object->entries[i].removed) {
+          object->entries[size++] = object->entries[i];
+        }
+      }
+    }
+    object->length = object->size;
+    object_build_index(object, arena);
+  }
+  object->entries[object->length] = (ObjectEntry) { .key = key, .value = value, .hash = hash, .removed = 0,
+    .thunk = NULL };
+  if (object->index) {
+    object_index_insert(object, object->length);
+  }
+  object->length++;
+  object->size++;
+}
+
 Value create_object(size_t capacity, Arena *arena) {
   Object *object = arena_allocate(sizeof(Object), arena);
   object->capacity = capacity < INITIAL_ARRAY_CAPACITY ? INITIAL_ARRAY_CAPACITY : capacity;
+  object->length = 0;
   object->size = 0;
-  object->entries = arena_allocate(object->capacity * sizeof(Entry), arena);
+  object->entries = arena_allocate(object->capacity * sizeof(ObjectEntry), arena);
+  object->arena = arena;
+  object_build_index(object, arena);
   return (Value) { .type = V_OBJECT, .object_value = object };
 }
 
 void object_put(Object *object, Value key, Value value, Arena *arena) {
-  Value old;
-  object_remove(object, key, &old);
-  if (object->size >= object->capacity) {
-    size_t new_capacity = object->capacity << 1;
-    Entry *new_entries = arena_allocate(new_capacity * sizeof(Entry), arena);
-    memcpy(new_entries, object->entries, object->capacity * sizeof(Entry));
-    object->entries = new_entries;
-    object->capacity = new_capacity;
-  }
-  object->entries[object->size] = (Entry) { .key = key, .value = value };
-  object->size++;
+  Hash hash = object_key_hash(key);
+  ObjectEntry *existing = object_find(object, key, hash);
+  if (existing) {
+    existing->removed = 1;
+    object->size--;
+  }
+  object_append(object, key, value, hash, arena);
 }
 
-int object_get(Object *object, Value key, Value *value) {
-  for (size_t i = 0; i < object->size; i++) {
-    if (equals(key, object->entries[i].key)) {
-      if (value) {
-        *value = object->entries[i].value;
+/* Adds a property whose value is computed by `thunk` the first time it's read. A thunk may be shared by several
+ * properties of the same object, but not by properties of different objects. */
+void object_put_lazy(Object *object, Value key, Thunk *thunk, Arena *arena) {
+  object_put(object, key, nil_value, arena);
+  object->entries[object->length - 1].thunk = thunk;
+}
+
+static void force_thunk(Thunk *thunk, Object *object) {
+  if (__atomic_load_n(&thunk->state, __ATOMIC_ACQUIRE) == THUNK_FORCED) {
+    return;
+  }
+  pthread_mutex_lock(&thunk_lock);
+  // A thunk that reads its own properties sees them as nil instead of waiting for itself
+  while (thunk->state == THUNK_FORCING && !pthread_equal(thunk->owner, pthread_self())) {
+    pthread_cond_wait(&thunk_forced, &thunk_lock);
+  }
+  if (thunk->state == THUNK_PENDING) {
+    __atomic_store_n(&thunk->state, THUNK_FORCING, __ATOMIC_RELAXED);
+    thunk->owner = pthread_self();
+    pthread_mutex_unlock(&thunk_lock);
+    // The values are computed in a separate arena since other threads may be forcing thunks of the same object
+    Arena *arena = create_arena();
+    Value values = thunk->func(thunk->context, arena);
+    pthread_mutex_lock(&thunk_lock);
+    arena_merge(arena, object->arena);
+    for (size_t i = 0; i < object->length; i++) {
+      ObjectEntry *entry = &object->entries[i];
+      if (!entry->removed && entry->thunk == thunk) {
+        if (values.type != V_OBJECT || !object_get(values.object_value, entry->key, &entry->value)) {
+          entry->value = nil_value;
+        }
+        move_to_arena(entry->value, arena, object->arena);
       }
-      return 1;
     }
+    __atomic_store_n(&thunk->state, THUNK_FORCED, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&thunk_forced);
   }
-  return 0;
+  pthread_mutex_unlock(&thunk_lock);
+}
+
+static Value get_entry_value(Object *object, ObjectEntry *entry) {
+  if (entry->thunk) {
+    force_thunk(entry->thunk, object);
+    if (entry->thunk->access) {
+      entry->thunk->access(entry->thunk->context);
+    }
+  }
+  return entry->value;
 }
 
+int object_get(Object *object, Value key, Value *value) {
+  ObjectEntry *entry = object_find(object, key, object_key_hash(key));
+  if (!entry) {
+    return 0;
+  }
+  if (value) {
+    *value = get_entry_value(object, entry);
+  }
+  return 1;
+}
+
+/* Looks up a symbol key by name. Since the name isn't interned its hash is unknown, so this scans the entries. */
 int object_get_symbol(Object *object, const char *key, Value *value) {
-  for (size_t i = 0; i < object->size; i++) {
-    if (object->entries[i].key.type == V_SYMBOL && strcmp(object->entries[i].key.symbol_value, key) == 0) {
+  for (size_t i = 0; i < object->length; i++) {
+    ObjectEntry *entry = &object->entries[i];
+    if (!entry->removed && entry->key.type == V_SYMBOL
+        && (entry->key.symbol_value == key || strcmp(entry->key.symbol_value, key) == 0)) {
       if (value) {
-        *value = object->entries[i].value;
+        *value = get_entry_value(object, entry);
       }
       return 1;
     }
@@ -667,19 +978,16 @@ int object_get_symbol(Object *object, const char *key, Value *value) {
 }
 
 int object_remove(Object *object, Value key, Value *value) {
-  for (size_t i = 0; i < object->size; i++) {
-    if (equals(key, object->entries[i].key)) {
-      if (value) {
-        *value = object->entries[i].value;
-      }
-      if (i < object->size - 1) {
-        memmove(&object->entries[i], &object->entries[i + 1], (object->size - i - 1) * sizeof(Entry));
-      }
-      object->size--;
-      return 1;
-    }
+  ObjectEntry *entry = object_find(object, key, object_key_hash(key));
+  if (!entry) {
+    return 0;
   }
-  return 0;
+  if (value) {
+    *value = get_entry_value(object, entry);
+  }
+  entry->removed = 1;
+  object->size--;
+  return 1;
 }
 
 size_t object_size(Object *object) {
@@ -691,24 +999,63 @@ ObjectIterator iterate_object(Object *object) {
 }
 
 int object_iterator_next(ObjectIterator *it, Value *key, Value *value) {
-  if (it->next_index < it->object->size) {
-    if (key) {
-      *key = it->object->entries[it->next_index].key;
+  while (it->next_index < it->object->length) {
+    ObjectEntry *entry = &it->object->entries[it->next_index++];
+    if (!entry->removed) {
+      if (key) {
+        *key = entry->key;
+      }
+      if (value) {
+        *value = get_entry_value(it->object, entry);
+      }
+      return 1;
     }
-    if (value) {
-      *value = it->object->entries[it->next_index].value;
+  }
+  return 0;
+}
+
+/* Like object_iterator_next(), but doesn't compute lazy properties. For a lazy property `thunk` is set to its thunk and
+ * `value` is left unchanged, otherwise `thunk` is set to NULL. */
+int object_iterator_next_lazy(ObjectIterator *it, Value *key, Value *value, Thunk **thunk) {
+  while (it->next_index < it->object->length) {
+    ObjectEntry *entry = &it->object->entries[it->next_index++];
+    if (!entry->removed) {
+      if (key) {
+        *key = entry->key;
+      }
+      *thunk = entry->thunk;
+      if (value && !entry->thunk) {
+        *value = entry->value;
+      }
+      return 1;
     }
-    it->next_index++;
-    return 1;
   }
   return 0;
 }
 
-Value create_closure(NameList *params, NameList *free_variables, Node body, Env *env, Arena *arena) {
+Thunk *create_thunk(ThunkFunc func, ThunkAccessFunc access, void *context, Hash hash, Arena *arena) {
+  Thunk *thunk = arena_allocate(sizeof(Thunk), arena);
+  thunk->func = func;
+  thunk->access = access;
+  thunk->context = context;
+  thunk->hash = hash;
+  thunk->state = THUNK_PENDING;
+  return thunk;
+}
+
+/* A hash of the inputs of the thunk, used in place of the values of its properties when fingerprinting pages. */
+Hash thunk_hash(const Thunk *thunk) {
+  return thunk->hash;
+}
+
+Value create_closure(NameList *params, NameList *free_variables, NameList *locals, Node body, Code *code, Env *env,
+    Arena *arena) {
   Closure *closure = arena_allocate(sizeof(Closure), arena);
   closure->params = params;
   closure->body = copy_node(body, arena);
+  closure->code = code;
   closure->free_variables = arena_copy_name_list(free_variables, arena);
+  closure->locals = arena_copy_name_list(locals, arena);
   closure->env = env;
   return (Value) { .type = V_CLOSURE, .closure_value = closure };
 }
@@ -798,6 +1145,7 @@ static Node copy_node(Node node, Arena *arena) {
     case N_FN:
       node.fn_value.params = arena_copy_name_list(node.fn_value.params, arena);
       node.fn_value.free_variables = arena_copy_name_list(node.fn_value.free_variables, arena);
+      node.fn_value.locals = arena_copy_name_list(node.fn_value.locals, arena);
       node.fn_value.body = copy_node_pointer(node.fn_value.body, arena);
       break;
     case N_IF:
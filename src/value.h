@@ -16,6 +16,7 @@
 
 typedef struct Module Module;
 typedef struct ModuleMap ModuleMap;
+typedef struct Code Code;
 
 typedef struct Env Env;
 
@@ -25,8 +26,9 @@ typedef struct Array Array;
 typedef struct Object Object;
 typedef struct ObjectIterator ObjectIterator;
 typedef struct Entry Entry;
+typedef struct Slot Slot;
 typedef struct Closure Closure;
-
+typedef struct Thunk Thunk;
 
 typedef struct Tuple Tuple;
 
@@ -44,13 +46,14 @@ struct Env {
   ModuleMap *modules;
   SymbolMap *symbol_map;
   Env *parent_env;
-  Node *calling_node;
+  const Node *calling_node;
   char *error;
   int error_arg;
   EnvErrorLevel error_level;
   GenericHashMap global;
+  NameList *locals;
+  Slot *slots;
   Array *exports;
-  int64_t loops;
 };
 
 typedef enum {
@@ -63,7 +66,7 @@ typedef enum {
 struct Module {
   ModuleType type;
   Path *file_name;
-  time_t mtime;
+  FileStamp stamp;
   int dirty;
   union {
     struct {
@@ -71,10 +74,12 @@ struct Module {
     } system_value;
     struct {
       Node *root;
+      Code *code;
       int parse_error;
     } user_value;
     struct {
       Node *root;
+      Code *code;
       int parse_error;
     } data_value;
     struct {
@@ -124,6 +129,7 @@ struct Value {
 #define create_float(f) ((Value) { .type = V_FLOAT, .float_value = (f) })
 
 #define create_symbol(s) ((Value) { .type = V_SYMBOL, .symbol_value = (s) })
+#define create_known_symbol(s) create_symbol(known_symbols[(s)])
 
 #define create_time(i) ((Value) { .type = V_TIME, .time_value = (i) })
 
@@ -136,6 +142,7 @@ struct Array {
   Value *cells;
   size_t capacity;
   size_t size;
+  Arena *arena;
 };
 
 struct ObjectIterator {
@@ -148,10 +155,17 @@ struct Entry {
   Value value;
 };
 
+struct Slot {
+  Value value;
+  int defined;
+};
+
 struct Closure {
   NameList *params;
   Node body;
+  Code *code;
   NameList *free_variables;
+  NameList *locals;
   Env *env;
 };
 
@@ -160,12 +174,21 @@ struct Tuple {
   Value values[];
 };
 
+/* Computes the values of the lazy properties that share a thunk. Returns an object mapping each property to its value,
+ * allocated in `arena`. */
+typedef Value (*ThunkFunc)(void *context, Arena *arena);
+
+/* Called whenever the value of a lazy property is read. */
+typedef void (*ThunkAccessFunc)(void *context);
+
 Env *create_env(Arena *arena, ModuleMap *modules, SymbolMap *symbol_map);
 
 Env *create_child_env(Env *parent);
 
 void env_put(Symbol name, Value value, Env *env);
 
+void env_put_slot(int slot, Symbol name, Value value, Env *env);
+
 #define env_def(name, value, env) env_put(get_symbol((name), (env)->symbol_map), (value), (env))
 
 #define env_def_fn(name, func, env) \
@@ -212,6 +235,8 @@ void env_put(Symbol name, Value value, Env *env);
 
 int env_get(Symbol name, Value *value, Env *env);
 
+int env_get_slot(int slot, Symbol name, Value *value, Env *env);
+
 int env_get_symbol(const char *name, Value *value, Env *env);
 
 const String *get_env_string(const char *name, Env *env);
@@ -234,6 +259,12 @@ Hash value_hash(Hash h, Value value);
 
 Value copy_value(Value value, Env *env);
 
+int is_writable(Value value, Env *env);
+
+void move_to_arena(Value value, Arena *source, Arena *arena);
+
+Value own_value(Value value, Env *env);
+
 void value_to_string(Value value, Buffer *buffer);
 
 const char *value_name(ValueType type);
@@ -270,6 +301,8 @@ void object_put(Object *object, Value key, Value value, Arena *arena);
 #define object_def(object, name, value, env) \
   object_put((object), create_symbol(get_symbol((name), (env)->symbol_map)), (value), (env)->arena)
 
+void object_put_lazy(Object *object, Value key, Thunk *thunk, Arena *arena);
+
 int object_get(Object *object, Value key, Value *value);
 
 int object_get_symbol(Object *object, const char *key, Value *value);
@@ -282,6 +315,13 @@ ObjectIterator iterate_object(Object *object);
 
 int object_iterator_next(ObjectIterator *it, Value *key, Value *value);
 
-Value create_closure(NameList *params, NameList *free_variables, Node body, Env *env, Arena *arena);
+int object_iterator_next_lazy(ObjectIterator *it, Value *key, Value *value, Thunk **thunk);
+
+Thunk *create_thunk(ThunkFunc func, ThunkAccessFunc access, void *context, Hash hash, Arena *arena);
+
+Hash thunk_hash(const Thunk *thunk);
+
+Value create_closure(NameList *params, NameList *free_variables, NameList *locals, Node body, Code *code, Env *env,
+    Arena *arena);
 
 #endif
@@ -0,0 +1,180 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "virtualdist.h"
+
+#include "hashmap.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  char *dest;
+  VirtualFileType type;
+  char *src;
+  int width;
+  int height;
+  int quality;
+} VirtualEntry;
+
+/* Maps paths in dist to the source files they would otherwise have been copied or resized from. Mappings are added
+ * while index.plet is evaluated and while pages are rendered, so access is synchronized. */
+struct VirtualDist {
+  GenericHashMap entries;
+  pthread_mutex_t lock;
+};
+
+static _Thread_local VirtualDist *current_dist = NULL;
+
+static Hash virtual_entry_hash(const void *p) {
+  const char *dest = ((const VirtualEntry *) p)->dest;
+  Hash h = INIT_HASH;
+  while (*dest) {
+    h = HASH_ADD_BYTE(*dest, h);
+    dest++;
+  }
+  return h;
+}
+
+static int virtual_entry_equals(const void *a, const void *b) {
+  return strcmp(((const VirtualEntry *) a)->dest, ((const VirtualEntry *) b)->dest) == 0;
+}
+
+VirtualDist *create_virtual_dist(void) {
+  VirtualDist *dist = allocate(sizeof(VirtualDist));
+  init_generic_hash_map(&dist->entries, sizeof(VirtualEntry), 0, virtual_entry_hash, virtual_entry_equals, NULL);
+  pthread_mutex_init(&dist->lock, NULL);
+  return dist;
+}
+
+void delete_virtual_dist(VirtualDist *dist) {
+  VirtualEntry entry;
+  HashMapIterator it = generic_hash_map_iterate(&dist->entries);
+  while (generic_hash_map_next(&it, &entry)) {
+    free(entry.dest);
+    free(entry.src);
+  }
+  delete_generic_hash_map(&dist->entries);
+  pthread_mutex_destroy(&dist->lock);
+  free(dist);
+}
+
+/* Copies the mappings of a previous virtual dist that haven't been replaced. Assets are mapped when pages are
+ * rendered, so this keeps them available after a rebuild, like files left in dist would be. */
+void inherit_virtual_files(VirtualDist *dist, VirtualDist *previous) {
+  VirtualEntry entry;
+  pthread_mutex_lock(&dist->lock);
+  HashMapIterator it = generic_hash_map_iterate(&previous->entries);
+  while (generic_hash_map_next(&it, &entry)) {
+    if (!generic_hash_map_get(&dist->entries, &entry, NULL)) {
+      entry.dest = copy_string(entry.dest);
+      entry.src = copy_string(entry.src);
+      generic_hash_map_add(&dist->entries, &entry);
+    }
+  }
+  pthread_mutex_unlock(&dist->lock);
+}
+
+/* Selects the virtual dist that files are added to on the current thread instead of being written to dist. Returns
+ * the previously selected one. */
+VirtualDist *use_virtual_dist(VirtualDist *dist) {
+  VirtualDist *previous = current_dist;
+  current_dist = dist;
+  return previous;
+}
+
+int virtual_dist_is_used(void) {
+  return current_dist != NULL;
+}
+
+static int add_virtual_entry(VirtualEntry entry) {
+  if (!current_dist) {
+    return 0;
+  }
+  VirtualEntry existing;
+  pthread_mutex_lock(&current_dist->lock);
+  if (generic_hash_map_get(&current_dist->entries, &entry, &existing)) {
+    free(existing.src);
+    entry.dest = existing.dest;
+  } else {
+    entry.dest = copy_string(entry.dest);
+  }
+  entry.src = copy_string(entry.src);
+  generic_hash_map_set(&current_dist->entries, &entry, NULL, NULL);
+  pthread_mutex_unlock(&current_dist->lock);
+  return 1;
+}
+
+/* Maps a file or a directory in dist to a file or directory in the source tree. Returns 0 if no virtual dist is used,
+ * in which case the caller should copy the file. */
+int add_virtual_copy(const Path *dest, const Path *src) {
+  VirtualEntry entry = { (char *) dest->path, VIRTUAL_COPY, (char *) src->path, 0, 0, 0 };
+  return add_virtual_entry(entry);
+}
+
+/* Maps a file in dist to a resized version of an image. Returns 0 if no virtual dist is used, in which case the caller
+ * should resize the image. */
+int add_virtual_image(const Path *dest, const Path *src, int width, int height, int quality) {
+  VirtualEntry entry = { (char *) dest->path, VIRTUAL_IMAGE, (char *) src->path, width, height, quality };
+  return add_virtual_entry(entry);
+}
+
+static int has_hidden_component(const Path *path) {
+  for (int32_t i = 0; i < path->size; i++) {
+    if (path->path[i] == '.' && (i == 0 || IS_PATH_SEP(path->path[i - 1]))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Looks up a path in dist. Files inside a mapped directory are resolved relative to the source directory, skipping
+ * hidden files like copy_static_files() does. On success `file->src` must be deleted by the caller. */
+int find_virtual_file(VirtualDist *dist, const Path *dest, VirtualFile *file) {
+  int found = 0;
+  pthread_mutex_lock(&dist->lock);
+  VirtualEntry entry = { .dest = (char *) dest->path };
+  if (generic_hash_map_get(&dist->entries, &entry, &entry)) {
+    file->type = entry.type;
+    file->src = create_path(entry.src, -1);
+    file->width = entry.width;
+    file->height = entry.height;
+    file->quality = entry.quality;
+    found = 1;
+  } else {
+    Path *dir = path_get_parent(dest);
+    while (1) {
+      entry.dest = dir->path;
+      if (generic_hash_map_get(&dist->entries, &entry, &entry)) {
+        if (entry.type == VIRTUAL_COPY) {
+          Path *relative = path_get_relative(dir, dest);
+          if (relative && !has_hidden_component(relative)) {
+            Path *src_dir = create_path(entry.src, -1);
+            file->type = VIRTUAL_COPY;
+            file->src = path_join(src_dir, relative, 1);
+            delete_path(src_dir);
+            found = 1;
+          }
+          if (relative) {
+            delete_path(relative);
+          }
+        }
+        break;
+      }
+      Path *parent = path_get_parent(dir);
+      if (parent->size >= dir->size) {
+        delete_path(parent);
+        break;
+      }
+      delete_path(dir);
+      dir = parent;
+    }
+    delete_path(dir);
+  }
+  pthread_mutex_unlock(&dist->lock);
+  return found;
+}
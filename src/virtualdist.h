@@ -0,0 +1,36 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef VIRTUALDIST_H
+#define VIRTUALDIST_H
+
+#include "util.h"
+
+typedef struct VirtualDist VirtualDist;
+
+typedef enum {
+  VIRTUAL_COPY,
+  VIRTUAL_IMAGE
+} VirtualFileType;
+
+typedef struct {
+  VirtualFileType type;
+  Path *src;
+  int width;
+  int height;
+  int quality;
+} VirtualFile;
+
+VirtualDist *create_virtual_dist(void);
+void delete_virtual_dist(VirtualDist *dist);
+void inherit_virtual_files(VirtualDist *dist, VirtualDist *previous);
+VirtualDist *use_virtual_dist(VirtualDist *dist);
+int virtual_dist_is_used(void);
+int add_virtual_copy(const Path *dest, const Path *src);
+int add_virtual_image(const Path *dest, const Path *src, int width, int height, int quality);
+int find_virtual_file(VirtualDist *dist, const Path *dest, VirtualFile *file);
+
+#endif
@@ -0,0 +1,335 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "watcher.h"
+
+#include "hashmap.h"
+#include "module.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#define POLL_INTERVAL 100
+#define DEBOUNCE_DELAY 50
+#define MAX_DEBOUNCE_DELAY 1000
+
+typedef struct {
+  char *path;
+  FileStamp stamp;
+} WatchedFile;
+
+struct Watcher {
+  ModuleMap *modules;
+  GenericHashMap files;
+  int fd;
+  Path *dist_root;
+  Path **dirs;
+  int dirs_capacity;
+  int changes_pending;
+  long first_change;
+  long last_change;
+};
+
+static Hash watched_file_hash(const void *p) {
+  const char *path = ((const WatchedFile *) p)->path;
+  Hash h = INIT_HASH;
+  while (*path) {
+    h = HASH_ADD_BYTE(*path, h);
+    path++;
+  }
+  return h;
+}
+
+static int watched_file_equals(const void *a, const void *b) {
+  return strcmp(((const WatchedFile *) a)->path, ((const WatchedFile *) b)->path) == 0;
+}
+
+static void sleep_ms(int ms) {
+  struct timespec delay;
+  delay.tv_sec = ms / 1000;
+  delay.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&delay, NULL);
+}
+
+#if defined(__linux__)
+
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+static int add_watch(const Path *dir, Watcher *watcher) {
+  if (strcmp(dir->path, watcher->dist_root->path) == 0) {
+    return 1;
+  }
+  int wd = inotify_add_watch(watcher->fd, dir->path, WATCH_MASK | IN_ONLYDIR);
+  if (wd < 0) {
+    fprintf(stderr, SGR_BOLD "%s: " WARN_LABEL "unable to watch directory: %s" SGR_RESET "\n", dir->path,
+        strerror(errno));
+    return 0;
+  }
+  if (wd >= watcher->dirs_capacity) {
+    int capacity = watcher->dirs_capacity ? watcher->dirs_capacity : 64;
+    while (capacity <= wd) {
+      capacity <<= 1;
+    }
+    watcher->dirs = reallocate(watcher->dirs, capacity * sizeof(Path *));
+    memset(watcher->dirs + watcher->dirs_capacity, 0, (capacity - watcher->dirs_capacity) * sizeof(Path *));
+    watcher->dirs_capacity = capacity;
+  }
+  if (watcher->dirs[wd]) {
+    delete_path(watcher->dirs[wd]);
+  }
+  watcher->dirs[wd] = copy_path(dir);
+  DIR *d = opendir(dir->path);
+  int status = 1;
+  if (d) {
+    struct dirent *file;
+    while ((file = readdir(d))) {
+      if (file->d_name[0] != '.') {
+        Path *subpath = path_append(dir, file->d_name);
+        if (is_dir(subpath->path)) {
+          status = status && add_watch(subpath, watcher);
+        }
+        delete_path(subpath);
+      }
+    }
+    closedir(d);
+  }
+  return status;
+}
+
+static int handle_event(const struct inotify_event *event, Watcher *watcher) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    detect_changes(watcher->modules);
+    return 1;
+  }
+  if (event->wd < 0 || event->wd >= watcher->dirs_capacity || !watcher->dirs[event->wd]) {
+    return 0;
+  }
+  if (event->mask & IN_IGNORED) {
+    delete_path(watcher->dirs[event->wd]);
+    watcher->dirs[event->wd] = NULL;
+    return 0;
+  }
+  size_t name_length = event->len ? strlen(event->name) : 0;
+  // Skip hidden files as well as swap and backup files created by editors
+  if (!name_length || event->name[0] == '.' || event->name[name_length - 1] == '~') {
+    return 0;
+  }
+  Path *path = path_append(watcher->dirs[event->wd], event->name);
+  int changed = 0;
+  if (event->mask & IN_ISDIR) {
+    if (strcmp(path->path, watcher->dist_root->path) != 0) {
+      if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        add_watch(path, watcher);
+      }
+      changed = (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) != 0;
+    }
+  } else {
+    WatchedFile file = { .path = path->path };
+    changed = invalidate_module(path, watcher->modules);
+    changed |= generic_hash_map_get(&watcher->files, &file, &file);
+    // New, removed and renamed files may affect the result of list_content()
+    changed |= (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) != 0;
+  }
+  delete_path(path);
+  return changed;
+}
+
+static int read_events(Watcher *watcher) {
+  union {
+    struct inotify_event event;
+    char bytes[4096];
+  } buffer;
+  int changed = 0;
+  while (1) {
+    ssize_t n = read(watcher->fd, buffer.bytes, sizeof(buffer.bytes));
+    if (n <= 0) {
+      break;
+    }
+    for (ssize_t i = 0; i < n;) {
+      const struct inotify_event *event = (const struct inotify_event *) (buffer.bytes + i);
+      changed |= handle_event(event, watcher);
+      i += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  return changed;
+}
+
+static long get_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/* Returns the number of milliseconds until pending changes have settled, such that a save touching several files only
+ * triggers one rebuild. */
+static long get_settle_delay(const Watcher *watcher, long now) {
+  long quiet = watcher->last_change + DEBOUNCE_DELAY - now;
+  long max = watcher->first_change + MAX_DEBOUNCE_DELAY - now;
+  long delay = quiet < max ? quiet : max;
+  return delay > 0 ? delay : 0;
+}
+
+/* Events are read without blocking and only reported once they have settled, so with a timeout of 0 this can be called
+ * from an event loop that uses get_watcher_delay() to wake up again. */
+static int wait_for_events(Watcher *watcher, int timeout) {
+  struct pollfd pfd = { .fd = watcher->fd, .events = POLLIN };
+  long deadline = timeout >= 0 ? get_ms() + timeout : -1;
+  while (1) {
+    if (read_events(watcher)) {
+      long now = get_ms();
+      if (!watcher->changes_pending) {
+        watcher->changes_pending = 1;
+        watcher->first_change = now;
+      }
+      watcher->last_change = now;
+    }
+    long now = get_ms();
+    long wait = -1;
+    if (watcher->changes_pending) {
+      wait = get_settle_delay(watcher, now);
+      if (!wait) {
+        watcher->changes_pending = 0;
+        return 1;
+      }
+    }
+    if (deadline >= 0) {
+      if (now >= deadline) {
+        return 0;
+      } else if (wait < 0 || deadline - now < wait) {
+        wait = deadline - now;
+      }
+    }
+    if (poll(&pfd, 1, wait) < 0 && errno != EINTR) {
+      return 0;
+    }
+  }
+}
+
+#endif
+
+Watcher *create_watcher(const Path *src_root, ModuleMap *modules) {
+  Watcher *watcher = allocate(sizeof(Watcher));
+  watcher->modules = modules;
+  init_generic_hash_map(&watcher->files, sizeof(WatchedFile), 0, watched_file_hash, watched_file_equals, NULL);
+  watcher->fd = -1;
+  watcher->dist_root = path_append(src_root, "dist");
+  watcher->dirs = NULL;
+  watcher->dirs_capacity = 0;
+  watcher->changes_pending = 0;
+  watcher->first_change = 0;
+  watcher->last_change = 0;
+#if defined(__linux__)
+  watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watcher->fd < 0) {
+    fprintf(stderr, WARN_LABEL "inotify unavailable, polling for changes: %s" SGR_RESET "\n", strerror(errno));
+  } else if (!add_watch(src_root, watcher)) {
+    fprintf(stderr, WARN_LABEL "unable to watch all directories, polling for changes" SGR_RESET "\n");
+    close(watcher->fd);
+    watcher->fd = -1;
+  }
+#endif
+  return watcher;
+}
+
+void delete_watcher(Watcher *watcher) {
+#if defined(__linux__)
+  if (watcher->fd >= 0) {
+    close(watcher->fd);
+  }
+#endif
+  for (int i = 0; i < watcher->dirs_capacity; i++) {
+    if (watcher->dirs[i]) {
+      delete_path(watcher->dirs[i]);
+    }
+  }
+  if (watcher->dirs) {
+    free(watcher->dirs);
+  }
+  clear_watched_files(watcher);
+  delete_generic_hash_map(&watcher->files);
+  delete_path(watcher->dist_root);
+  free(watcher);
+}
+
+void watch_file(const char *path, FileStamp stamp, Watcher *watcher) {
+  WatchedFile file = { .path = (char *) path };
+  if (!generic_hash_map_get(&watcher->files, &file, &file)) {
+    file.path = copy_string(path);
+  }
+  file.stamp = stamp;
+  generic_hash_map_set(&watcher->files, &file, NULL, NULL);
+}
+
+void clear_watched_files(Watcher *watcher) {
+  WatchedFile file;
+  HashMapIterator it = generic_hash_map_iterate(&watcher->files);
+  while (generic_hash_map_next(&it, &file)) {
+    free(file.path);
+  }
+  delete_generic_hash_map(&watcher->files);
+  init_generic_hash_map(&watcher->files, sizeof(WatchedFile), 0, watched_file_hash, watched_file_equals, NULL);
+}
+
+static int detect_file_changes(Watcher *watcher) {
+  WatchedFile file;
+  HashMapIterator it = generic_hash_map_iterate(&watcher->files);
+  while (generic_hash_map_next(&it, &file)) {
+    if (!file_stamp_equals(get_file_stamp(file.path), file.stamp)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int poll_changes(Watcher *watcher, int timeout) {
+  while (1) {
+    if (detect_changes(watcher->modules) || detect_file_changes(watcher)) {
+      return 1;
+    } else if (!timeout) {
+      return 0;
+    }
+    int delay = timeout < 0 || timeout > POLL_INTERVAL ? POLL_INTERVAL : timeout;
+    sleep_ms(delay);
+    if (timeout > 0) {
+      timeout -= delay;
+    }
+  }
+}
+
+int wait_for_changes(Watcher *watcher, int timeout) {
+#if defined(__linux__)
+  if (watcher->fd >= 0) {
+    return wait_for_events(watcher, timeout);
+  }
+#endif
+  return poll_changes(watcher, timeout);
+}
+
+/* Returns the number of milliseconds until changes that have been read by wait_for_changes() have settled, or -1 if
+ * there are no pending changes. */
+int get_watcher_delay(const Watcher *watcher) {
+#if defined(__linux__)
+  if (watcher->changes_pending) {
+    return get_settle_delay(watcher, get_ms());
+  }
+#endif
+  return -1;
+}
+
+/* Returns a file descriptor that becomes readable when changes may be available, or -1 if the watcher has to be polled
+ * for changes. */
+int get_watcher_fd(const Watcher *watcher) {
+  return watcher->fd;
+}
@@ -0,0 +1,22 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include "value.h"
+
+typedef struct Watcher Watcher;
+
+Watcher *create_watcher(const Path *src_root, ModuleMap *modules);
+void delete_watcher(Watcher *watcher);
+void watch_file(const char *path, FileStamp stamp, Watcher *watcher);
+void clear_watched_files(Watcher *watcher);
+int wait_for_changes(Watcher *watcher, int timeout);
+int get_watcher_delay(const Watcher *watcher);
+int get_watcher_fd(const Watcher *watcher);
+
+#endif
@@ -22,7 +22,12 @@
   test();\
   printf("%s: All tests passed\n", #test)
 
+void test_contentcache(void);
+void test_contentmap(void);
 void test_hashmap(void);
+void test_html(void);
+void test_interpreter(void);
+void test_sitemap(void);
 void test_strings(void);
 void test_util(void);
 void test_value(void);
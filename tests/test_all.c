@@ -7,7 +7,12 @@
 #include "test.h"
 
 int main(void) {
+  run_test_suite(test_contentcache);
+  run_test_suite(test_contentmap);
   run_test_suite(test_hashmap);
+  run_test_suite(test_html);
+  run_test_suite(test_interpreter);
+  run_test_suite(test_sitemap);
   run_test_suite(test_strings);
   run_test_suite(test_util);
   run_test_suite(test_value);
@@ -0,0 +1,238 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "../src/contentcache.h"
+#include "../src/module.h"
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  Arena *arena;
+  ModuleMap *modules;
+  SymbolMap *symbol_map;
+  Env *env;
+  Path *src_root;
+  Path *content_path;
+  Path *include_path;
+} CacheTest;
+
+static void write_file(const Path *path, const char *text) {
+  FILE *file = fopen(path->path, "w");
+  assert(file);
+  fputs(text, file);
+  fclose(file);
+}
+
+static char *read_test_file(const Path *path, size_t *size) {
+  FILE *file = fopen(path->path, "rb");
+  assert(file);
+  assert(fseek(file, 0, SEEK_END) == 0);
+  long length = ftell(file);
+  assert(length > 0);
+  rewind(file);
+  char *data = allocate(length);
+  assert(fread(data, 1, length, file) == (size_t) length);
+  fclose(file);
+  *size = length;
+  return data;
+}
+
+static Value test_function(const Tuple *args, Env *env) {
+  return nil_value;
+}
+
+static CacheTest create_cache_test(void) {
+  char template[] = "/tmp/plet-test-XXXXXX";
+  assert(mkdtemp(template));
+  CacheTest test;
+  test.arena = create_arena();
+  test.modules = create_module_map();
+  test.symbol_map = create_symbol_map();
+  test.env = create_env(test.arena, test.modules, test.symbol_map);
+  test.src_root = create_path(template, -1);
+  test.content_path = path_append(test.src_root, "post.md");
+  test.include_path = path_append(test.src_root, "include.html");
+  write_file(test.content_path, "{title: 'Post'}\nBody\n");
+  write_file(test.include_path, "<p>Included</p>\n");
+  return test;
+}
+
+static void delete_cache_test(CacheTest test) {
+  delete_dir(test.src_root);
+  delete_path(test.include_path);
+  delete_path(test.content_path);
+  delete_path(test.src_root);
+  delete_arena(test.arena);
+  delete_module_map(test.modules);
+  delete_symbol_map(test.symbol_map);
+}
+
+/* An object containing a value of every serializable type */
+static Value create_test_value(Env *env) {
+  Value object = create_object(0, env->arena);
+  object_def(object.object_value, "nil", nil_value, env);
+  object_def(object.object_value, "true", true_value, env);
+  object_def(object.object_value, "false", false_value, env);
+  object_def(object.object_value, "int", create_int(-1234567890123), env);
+  object_def(object.object_value, "float", create_float(2.5), env);
+  object_def(object.object_value, "time", create_time(1612345678), env);
+  object_def(object.object_value, "symbol", create_symbol(get_symbol("foo", env->symbol_map)), env);
+  object_def(object.object_value, "string", copy_c_string("bar\nbaz", env->arena), env);
+  object_def(object.object_value, "empty", create_string(NULL, 0, env->arena), env);
+  Value array = create_array(0, env->arena);
+  array_push(array.array_value, create_int(1), env->arena);
+  array_push(array.array_value, create_array(0, env->arena), env->arena);
+  array_push(array.array_value, create_object(0, env->arena), env->arena);
+  object_def(object.object_value, "array", array, env);
+  Value nested = create_object(0, env->arena);
+  object_put(nested.object_value, create_int(42), copy_c_string("int key", env->arena), env->arena);
+  object_put(nested.object_value, copy_c_string("string key", env->arena), true_value, env->arena);
+  object_def(object.object_value, "object", nested, env);
+  return object;
+}
+
+static Path *get_cache_file(const Path *src_root) {
+  Path *dir = path_append(src_root, ".plet-cache");
+  Path *path = path_append(dir, "content");
+  delete_path(dir);
+  return path;
+}
+
+/* Saves a cache containing a single entry with front matter and a body that depends on the include file. */
+static void save_test_cache(CacheTest test, Value front_matter, Value body) {
+  ContentCache *cache = load_content_cache(test.src_root);
+  CachedContent *content = add_cached_content(cache, test.content_path, get_file_stamp(test.content_path->path), 1234,
+      front_matter, 16);
+  assert(content);
+  DependencyList include = { .next = NULL, .path = test.include_path,
+    .stamp = get_file_stamp(test.include_path->path), .type = M_ASSET };
+  DependencyList self = { .next = &include, .path = test.content_path,
+    .stamp = get_file_stamp(test.content_path->path), .type = M_ASSET };
+  add_cached_body(cache, content, body, &self);
+  assert(save_content_cache(cache, test.src_root));
+  delete_content_cache(cache);
+}
+
+static void test_content_cache_round_trip(void) {
+  CacheTest test = create_cache_test();
+  Value front_matter = create_test_value(test.env);
+  Value body = create_object(0, test.arena);
+  object_def(body.object_value, "html", copy_c_string("<p>Body</p>", test.arena), test.env);
+  object_def(body.object_value, "values", front_matter, test.env);
+  save_test_cache(test, front_matter, body);
+
+  ContentCache *cache = load_content_cache(test.src_root);
+  FileStamp stamp = get_file_stamp(test.content_path->path);
+  assert(!get_cached_content(cache, test.content_path, stamp, 4321));
+  CachedContent *content = get_cached_content(cache, test.content_path, stamp, 1234);
+  assert(content);
+  Value cached_front_matter, cached_body;
+  long offset;
+  assert(load_cached_front_matter(content, &cached_front_matter, &offset, test.env));
+  assert(offset == 16);
+  assert(equals(cached_front_matter, front_matter));
+  assert(load_cached_body(cache, content, &cached_body, test.env));
+  assert(equals(cached_body, body));
+  delete_content_cache(cache);
+
+  // Functions can't be cached
+  cache = load_content_cache(test.src_root);
+  Value function = { .type = V_FUNCTION, .function_value = test_function };
+  object_def(front_matter.object_value, "function", function, test.env);
+  assert(!add_cached_content(cache, test.content_path, stamp, 1234, front_matter, 16));
+  delete_content_cache(cache);
+
+  delete_cache_test(test);
+}
+
+static void test_content_cache_corrupt(void) {
+  CacheTest test = create_cache_test();
+  Value front_matter = create_test_value(test.env);
+  save_test_cache(test, front_matter, front_matter);
+  FileStamp stamp = get_file_stamp(test.content_path->path);
+  Path *cache_path = get_cache_file(test.src_root);
+  size_t size;
+  char *data = read_test_file(cache_path, &size);
+
+  for (size_t length = 0; length < size; length++) {
+    FILE *file = fopen(cache_path->path, "wb");
+    assert(file);
+    fwrite(data, 1, length, file);
+    fclose(file);
+    ContentCache *cache = load_content_cache(test.src_root);
+    assert(!get_cached_content(cache, test.content_path, stamp, 1234));
+    delete_content_cache(cache);
+  }
+
+  // Any single corrupt byte is either rejected or yields a value without crashing
+  for (size_t i = 0; i < size; i++) {
+    char original = data[i];
+    data[i] ^= 0xff;
+    FILE *file = fopen(cache_path->path, "wb");
+    assert(file);
+    fwrite(data, 1, size, file);
+    fclose(file);
+    data[i] = original;
+    ContentCache *cache = load_content_cache(test.src_root);
+    CachedContent *content = get_cached_content(cache, test.content_path, stamp, 1234);
+    if (i < sizeof("plet-content-cache") - 1) {
+      assert(!content);
+    }
+    if (content) {
+      Value value;
+      long offset;
+      load_cached_front_matter(content, &value, &offset, test.env);
+      load_cached_body(cache, content, &value, test.env);
+    }
+    delete_content_cache(cache);
+  }
+
+  free(data);
+  delete_path(cache_path);
+  delete_cache_test(test);
+}
+
+static void test_content_cache_dependencies(void) {
+  CacheTest test = create_cache_test();
+  Value front_matter = create_object(0, test.arena);
+  Value body = copy_c_string("<p>Included</p>", test.arena);
+  save_test_cache(test, front_matter, body);
+  FileStamp stamp = get_file_stamp(test.content_path->path);
+
+  ContentCache *cache = load_content_cache(test.src_root);
+  CachedContent *content = get_cached_content(cache, test.content_path, stamp, 1234);
+  assert(content);
+  Value value;
+  assert(load_cached_body(cache, content, &value, test.env));
+  assert(equals(value, body));
+  delete_content_cache(cache);
+
+  write_file(test.include_path, "<p>Changed</p>\n");
+  cache = load_content_cache(test.src_root);
+  content = get_cached_content(cache, test.content_path, stamp, 1234);
+  assert(content);
+  assert(!load_cached_body(cache, content, &value, test.env));
+  delete_content_cache(cache);
+
+  remove(test.include_path->path);
+  cache = load_content_cache(test.src_root);
+  content = get_cached_content(cache, test.content_path, stamp, 1234);
+  assert(content);
+  assert(!load_cached_body(cache, content, &value, test.env));
+  delete_content_cache(cache);
+
+  delete_cache_test(test);
+}
+
+void test_contentcache(void) {
+  run_test(test_content_cache_round_trip);
+  run_test(test_content_cache_corrupt);
+  run_test(test_content_cache_dependencies);
+}
@@ -0,0 +1,83 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "../src/build.h"
+#include "../src/module.h"
+#include "../src/strings.h"
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define TEST_POSTS 5
+
+static const char *test_index =
+  "seen = []\n"
+  "CONTENT_HANDLERS = {'txt': x => do\n"
+  "  seen | push(x)\n"
+  "  return \"<b>{x}</b>\"\n"
+  "end do}\n"
+  "posts = list_content('content', {suffix: '.txt'})\n";
+
+static void write_file(const Path *dir, const char *name, const char *text) {
+  Path *path = path_append(dir, name);
+  FILE *file = fopen(path->path, "w");
+  assert(file);
+  fputs(text, file);
+  fclose(file);
+  delete_path(path);
+}
+
+static void eval_user_handlers(const Path *src_root, int jobs) {
+  ModuleMap *modules = create_module_map();
+  SymbolMap *symbol_map = create_symbol_map();
+  add_system_modules(modules);
+  Path *root = copy_path(src_root);
+  Env *env = eval_index(root, modules, symbol_map, jobs);
+  assert(env);
+  assert(!env->error);
+  Value seen, posts;
+  assert(env_get(get_symbol("seen", symbol_map), &seen, env) && seen.type == V_ARRAY);
+  assert(seen.array_value->size == TEST_POSTS);
+  assert(env_get(get_symbol("posts", symbol_map), &posts, env) && posts.type == V_ARRAY);
+  assert(posts.array_value->size == TEST_POSTS);
+  for (size_t i = 0; i < posts.array_value->size; i++) {
+    Value content;
+    assert(object_get_symbol(posts.array_value->cells[i].object_value, "content", &content));
+    assert(content.type == V_STRING && string_starts_with("<b>post", content.string_value));
+  }
+  delete_arena(env->arena);
+  delete_path(root);
+  delete_module_map(modules);
+  delete_symbol_map(symbol_map);
+}
+
+static void test_user_content_handlers(void) {
+  char template[] = "/tmp/plet-test-XXXXXX";
+  assert(mkdtemp(template));
+  Path *src_root = create_path(template, -1);
+  write_file(src_root, "index.plet", test_index);
+  Path *content_dir = path_append(src_root, "content");
+  assert(mkdir(content_dir->path, 0777) == 0);
+  for (int i = 0; i < TEST_POSTS; i++) {
+    char name[32], text[32];
+    snprintf(name, sizeof(name), "post%d.txt", i);
+    snprintf(text, sizeof(text), "post %d\n", i);
+    write_file(content_dir, name, text);
+  }
+  // User defined handlers may modify variables in index.plet, so they must run in list_content
+  eval_user_handlers(src_root, 1);
+  eval_user_handlers(src_root, 4);
+  delete_path(content_dir);
+  delete_dir(src_root);
+  delete_path(src_root);
+}
+
+void test_contentmap(void) {
+  run_test(test_user_content_handlers);
+}
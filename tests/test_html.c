@@ -0,0 +1,172 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "../src/html.h"
+#include "../src/module.h"
+
+#include "test.h"
+
+#include <string.h>
+
+typedef struct {
+  Env *env;
+  char log[1024];
+} VisitorLog;
+
+static void append_text(Value node, const char *text, Env *env) {
+  html_append_child(node, copy_c_string(text, env->arena), env->arena);
+}
+
+static Value create_comment(const char *comment, Env *env) {
+  Value node = create_object(2, env->arena);
+  object_put(node.object_value, create_known_symbol(SYM_TYPE), create_known_symbol(SYM_COMMENT), env->arena);
+  object_put(node.object_value, create_known_symbol(SYM_COMMENT), copy_c_string(comment, env->arena), env->arena);
+  return node;
+}
+
+/* <div><h1>Title</h1><p>First<img><!--more--></p><p><img>Second<h1>Sub</h1></p></div> */
+static Value create_tree(Env *env) {
+  Value root = html_create_element("div", 0, env);
+  Value h1 = html_create_element("h1", 0, env);
+  append_text(h1, "Title", env);
+  html_append_child(root, h1, env->arena);
+  Value p1 = html_create_element("p", 0, env);
+  append_text(p1, "First", env);
+  html_append_child(p1, html_create_element("img", 1, env), env->arena);
+  html_append_child(p1, create_comment("more", env), env->arena);
+  html_append_child(root, p1, env->arena);
+  Value p2 = html_create_element("p", 0, env);
+  html_append_child(p2, html_create_element("img", 1, env), env->arena);
+  append_text(p2, "Second", env);
+  Value sub = html_create_element("h1", 0, env);
+  append_text(sub, "Sub", env);
+  html_append_child(p2, sub, env->arena);
+  html_append_child(root, p2, env->arena);
+  return root;
+}
+
+static void log_node(Value node, const char *prefix, VisitorLog *log) {
+  Value tag = nil_value;
+  if (node.type == V_OBJECT) {
+    object_get(node.object_value, create_known_symbol(SYM_TAG), &tag);
+  }
+  strcat(log->log, prefix);
+  if (tag.type == V_SYMBOL) {
+    strcat(log->log, tag.symbol_value);
+  } else if (node.type == V_STRING) {
+    strncat(log->log, (const char *) node.string_value->bytes, node.string_value->size);
+  } else {
+    strcat(log->log, "?");
+  }
+  strcat(log->log, " ");
+}
+
+/* Replaces h1 elements with h2 elements containing the same children */
+static HtmlTransformation replace_headings(Value node, void *context) {
+  VisitorLog *log = context;
+  if (html_is_tag(node, "h1")) {
+    Value replacement = html_create_element("h2", 0, log->env);
+    Value children;
+    if (object_get(node.object_value, create_known_symbol(SYM_CHILDREN), &children)) {
+      object_put(replacement.object_value, create_known_symbol(SYM_CHILDREN), children, log->env->arena);
+    }
+    log_node(node, "r:", log);
+    return HTML_REPLACE(replacement);
+  }
+  return HTML_NO_ACTION;
+}
+
+static HtmlTransformation remove_images(Value node, void *context) {
+  VisitorLog *log = context;
+  if (html_is_tag(node, "img")) {
+    log_node(node, "x:", log);
+    return HTML_REMOVE;
+  }
+  return HTML_NO_ACTION;
+}
+
+static HtmlTransformation enter_node(Value node, void *context) {
+  log_node(node, "+", context);
+  return HTML_NO_ACTION;
+}
+
+static void leave_node(Value node, void *context) {
+  log_node(node, "-", context);
+}
+
+static void test_html_visit(void) {
+  Arena *arena = create_arena();
+  ModuleMap *modules = create_module_map();
+  SymbolMap *symbol_map = create_symbol_map();
+  Env *env = create_env(arena, modules, symbol_map);
+
+  VisitorLog separate[4] = {{env, ""}, {env, ""}, {env, ""}, {env, ""}};
+  Value expected = create_tree(env);
+  HtmlVisitor tracer = {enter_node, leave_node, &separate[0]};
+  expected = html_visit(expected, &tracer, 1);
+  expected = html_transform(expected, replace_headings, &separate[1]);
+  expected = html_transform(expected, remove_images, &separate[2]);
+  tracer.context = &separate[3];
+  expected = html_visit(expected, &tracer, 1);
+
+  VisitorLog fused[4] = {{env, ""}, {env, ""}, {env, ""}, {env, ""}};
+  HtmlVisitor visitors[] = {
+    {enter_node, leave_node, &fused[0]},
+    {replace_headings, NULL, &fused[1]},
+    {remove_images, NULL, &fused[2]},
+    {enter_node, leave_node, &fused[3]},
+  };
+  Value actual = html_visit(create_tree(env), visitors, 4);
+
+  assert(equals(expected, actual));
+  for (int i = 0; i < 4; i++) {
+    assert(strcmp(separate[i].log, fused[i].log) == 0);
+  }
+  assert(strcmp(fused[0].log, "+div +h1 +Title -Title -h1 +p +First -First +img -img +? -? -p +p +img -img +Second "
+        "-Second +h1 +Sub -Sub -h1 -p -div ") == 0);
+  assert(strcmp(fused[1].log, "r:h1 r:h1 ") == 0);
+  assert(strcmp(fused[2].log, "x:img x:img ") == 0);
+  assert(strcmp(fused[3].log, "+div +h2 +Title -Title -h2 +p +First -First +? -? -p +p +Second -Second +h2 +Sub -Sub "
+        "-h2 -p -div ") == 0);
+
+  delete_arena(arena);
+  delete_module_map(modules);
+  delete_symbol_map(symbol_map);
+}
+
+static void test_html_visit_replace_root(void) {
+  Arena *arena = create_arena();
+  ModuleMap *modules = create_module_map();
+  SymbolMap *symbol_map = create_symbol_map();
+  Env *env = create_env(arena, modules, symbol_map);
+
+  VisitorLog log = {env, ""};
+  Value root = html_create_element("h1", 0, env);
+  append_text(root, "Title", env);
+  HtmlVisitor visitors[] = {
+    {enter_node, leave_node, &log},
+    {replace_headings, NULL, &log},
+    {enter_node, leave_node, &log},
+  };
+  Value result = html_visit(root, visitors, 3);
+  assert(html_is_tag(result, "h2"));
+  // Visitors preceding the replacing visitor finish visiting the original node before the replacement is visited
+  assert(strcmp(log.log, "+h1 r:h1 +Title -Title -h1 +h2 +Title -Title -h2 ") == 0);
+
+  log.log[0] = '\0';
+  HtmlVisitor remove = {remove_images, NULL, &log};
+  assert(html_visit(html_create_element("img", 1, env), &remove, 1).type == V_NIL);
+  assert(strcmp(log.log, "x:img ") == 0);
+
+  delete_arena(arena);
+  delete_module_map(modules);
+  delete_symbol_map(symbol_map);
+}
+
+void test_html(void) {
+  run_test(test_html_visit);
+  run_test(test_html_visit_replace_root);
+}
@@ -0,0 +1,124 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "../src/interpreter.h"
+#include "../src/module.h"
+#include "../src/parser.h"
+#include "../src/reader.h"
+
+#include "test.h"
+
+#include <string.h>
+
+/* Parses and interprets a script, then checks the type and string value of the result */
+static void assert_result(const char *source, InterpreterResultType type, const char *expected) {
+  Path *file_name = create_path("test.plet", -1);
+  SymbolMap *symbol_map = create_symbol_map();
+  Reader *reader = open_string_reader((const uint8_t *) source, strlen(source), file_name, symbol_map);
+  TokenStream tokens = read_all(reader, 0);
+  assert(!reader_errors(reader));
+  Module *module = parse(tokens, file_name);
+  close_reader(reader);
+  assert(!module->user_value.parse_error);
+  assert(module->user_value.code);
+  ModuleMap *modules = create_module_map();
+  add_system_modules(modules);
+  add_module(module, modules);
+  Env *env = create_user_env(module, modules, symbol_map);
+  InterpreterResult result = interpret(module->user_value.code, env);
+  assert(!env->error);
+  assert(result.type == type);
+  Buffer buffer = create_buffer(0);
+  value_to_string(result.value, &buffer);
+  assert(buffer.size == strlen(expected) && memcmp(buffer.data, expected, buffer.size) == 0);
+  delete_buffer(buffer);
+  delete_arena(env->arena);
+  delete_module_map(modules);
+  delete_symbol_map(symbol_map);
+  delete_path(file_name);
+}
+
+static void test_interpret_loops(void) {
+  assert_result(
+      "for a in [1, 2, 3]\n"
+      "  for b in [1, 2, 3]\n"
+      "    if b == 2\n"
+      "      continue 2\n"
+      "    end if\n"
+      "    \"{a}{b} \"\n"
+      "  end for\n"
+      "  \"unreachable\"\n"
+      "end for\n"
+      "for a in [1, 2, 3]\n"
+      "  for b in [1, 2, 3]\n"
+      "    if a == 2\n"
+      "      break 2\n"
+      "    end if\n"
+      "    \"{a}{b} \"\n"
+      "  end for\n"
+      "end for\n", IR_VALUE, "11 21 31 11 12 13 ");
+  assert_result(
+      "for k: v in {a: 1, b: 2}\n"
+      "  \"{k}={v};\"\n"
+      "end for\n"
+      "for i: c in \"xy\"\n"
+      "  \"{i}={c};\"\n"
+      "end for\n"
+      "for v in []\n"
+      "  \"nonempty\"\n"
+      "else\n"
+      "  \"empty\"\n"
+      "end for\n", IR_VALUE, "a=1;b=2;0=120;1=121;empty");
+}
+
+static void test_interpret_values(void) {
+  assert_result(
+      "fib = n => if n < 2 then n else fib(n - 1) + fib(n - 2)\n"
+      "add = x => y => x + y\n"
+      "name = n => switch n\n"
+      "case 1\n"
+      "  \"one\"\n"
+      "case 2\n"
+      "  \"two\"\n"
+      "default\n"
+      "  \"many\"\n"
+      "end switch\n"
+      "list = items => for item in items\n"
+      "  \"<{item}>\"\n"
+      "else\n"
+      "  \"none\"\n"
+      "end for\n"
+      "\"{fib(10)} {add(1)(2)} {name(2)} {name(5)} {list([1, 2])} {list([])}\"\n", IR_VALUE,
+      "55 3 two many <1><2> none");
+  assert_result(
+      "obj = {a: [1, 2]}\n"
+      "obj.a[1] += 3\n"
+      "obj.b = nil\n"
+      "\"{obj.a[1]} {obj.b?.c} {undefined?} {nil or 2} {1 and nil}\"\n", IR_VALUE, "5   2 ");
+}
+
+static void test_interpret_return(void) {
+  assert_result(
+      "\"discarded\"\n"
+      "for i in [1, 2, 3]\n"
+      "  if i == 2\n"
+      "    return i * 10\n"
+      "  end if\n"
+      "end for\n", IR_RETURN, "20");
+  assert_result(
+      "find = items => for item in items\n"
+      "  if item > 1\n"
+      "    return item\n"
+      "  end if\n"
+      "end for\n"
+      "find([1, 2, 3])\n", IR_VALUE, "2");
+}
+
+void test_interpreter(void) {
+  run_test(test_interpret_loops);
+  run_test(test_interpret_values);
+  run_test(test_interpret_return);
+}
@@ -0,0 +1,112 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "../src/build.h"
+#include "../src/contentcache.h"
+#include "../src/module.h"
+#include "../src/sitemap.h"
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+static const char *test_index =
+  "posts = list_content('content', {suffix: '.txt'}) | sort_by(.name)\n"
+  "export latest = () => posts[0].author\n"
+  "add_page('about.html', 'templates/about.plet', {})\n";
+
+static void write_file(const Path *dir, const char *name, const char *text) {
+  Path *path = path_append(dir, name);
+  FILE *file = fopen(path->path, "w");
+  assert(file);
+  fputs(text, file);
+  fclose(file);
+  delete_path(path);
+}
+
+static void assert_file_equals(const Path *dir, const char *name, const char *expected) {
+  Path *path = path_append(dir, name);
+  FILE *file = fopen(path->path, "r");
+  assert(file);
+  char actual[64] = {0};
+  assert(fread(actual, 1, sizeof(actual) - 1, file) == strlen(expected));
+  fclose(file);
+  assert(strcmp(actual, expected) == 0);
+  delete_path(path);
+}
+
+/* Builds the site the same way as `plet build` */
+static void build_test_site(const Path *src_root) {
+  ModuleMap *modules = create_module_map();
+  SymbolMap *symbol_map = create_symbol_map();
+  add_system_modules(modules);
+  Path *root = copy_path(src_root);
+  ContentCache *content_cache = load_content_cache(root);
+  ContentCache *previous_cache = use_content_cache(content_cache);
+  DependencySet *index_dependencies = create_dependency_set();
+  DependencySet *previous = record_dependencies(index_dependencies);
+  Env *env = eval_index(root, modules, symbol_map, 1);
+  record_dependencies(previous);
+  assert(env && !env->error);
+  compile_pages(env, index_dependencies, 1, 0);
+  delete_arena(env->arena);
+  assert(save_content_cache(content_cache, root));
+  delete_dependency_set(index_dependencies);
+  use_content_cache(previous_cache);
+  delete_content_cache(content_cache);
+  delete_path(root);
+  delete_module_map(modules);
+  delete_symbol_map(symbol_map);
+}
+
+static void test_rebuild_closure_dependencies(void) {
+  char template[] = "/tmp/plet-test-XXXXXX";
+  assert(mkdtemp(template));
+  Path *src_root = create_path(template, -1);
+  write_file(src_root, "index.plet", test_index);
+  Path *templates_dir = path_append(src_root, "templates");
+  assert(mkdir(templates_dir->path, 0777) == 0);
+  write_file(templates_dir, "about.plet", "{latest()}");
+  Path *content_dir = path_append(src_root, "content");
+  assert(mkdir(content_dir->path, 0777) == 0);
+  write_file(content_dir, "a.txt", "{author: 'Ann'}\nA\n");
+  write_file(content_dir, "b.txt", "{author: 'Zed'}\nB\n");
+  Path *dist_root = path_append(src_root, "dist");
+  Path *about_path = path_append(dist_root, "about.html");
+
+  build_test_site(src_root);
+  assert_file_equals(dist_root, "about.html", "Ann");
+
+  // Nothing has changed, so the page is up to date and isn't written again
+  struct utimbuf old_time = { .actime = 0, .modtime = 0 };
+  assert(utime(about_path->path, &old_time) == 0);
+  build_test_site(src_root);
+  assert(get_file_stamp(about_path->path).mtime == 0);
+
+  // The page only depends on the content through a value captured by a closure exported from index.plet
+  Path *content_path = path_append(content_dir, "a.txt");
+  write_file(content_dir, "a.txt", "{author: 'Bob'}\nA\n");
+  struct utimbuf new_time = { .actime = time(NULL) + 10, .modtime = time(NULL) + 10 };
+  assert(utime(content_path->path, &new_time) == 0);
+  build_test_site(src_root);
+  assert_file_equals(dist_root, "about.html", "Bob");
+
+  delete_path(content_path);
+  delete_path(about_path);
+  delete_path(dist_root);
+  delete_path(content_dir);
+  delete_path(templates_dir);
+  delete_dir(src_root);
+  delete_path(src_root);
+}
+
+void test_sitemap(void) {
+  run_test(test_rebuild_closure_dependencies);
+}
@@ -50,6 +50,22 @@ static void test_arena_reallocate(void) {
   delete_arena(arena);
 }
 
+static void test_arena_merge(void) {
+  Arena *arena = create_arena();
+  char *p1 = arena_allocate(10, arena);
+  Arena *source = create_arena();
+  char *p2 = arena_allocate(10, source);
+  arena_allocate(100000, source);
+  memcpy(p1, "arena", 6);
+  memcpy(p2, "source", 7);
+  arena_merge(source, arena);
+  char *p3 = arena_allocate(10, arena);
+  assert(p3 != p1 + 10);
+  assert(strcmp(p1, "arena") == 0);
+  assert(strcmp(p2, "source") == 0);
+  delete_arena(arena);
+}
+
 static void test_buffer_printf(void) {
   Buffer buffer1 = create_buffer(0);
   for (int i = 0; i < 1000; i++) {
@@ -533,6 +549,7 @@ static void test_path_get_relative(void) {
 void test_util(void) {
   run_test(test_arena);
   run_test(test_arena_reallocate);
+  run_test(test_arena_merge);
   run_test(test_buffer_printf);
   run_test(test_create_path);
   run_test(test_copy_path);
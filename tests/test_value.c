@@ -109,6 +109,134 @@ static void test_reallocate_string(void) {
   delete_arena(arena);
 }
 
+static void test_object_put(void) {
+  Arena *arena = create_arena();
+  Value object = create_object(0, arena);
+  for (size_t i = 0; i < 1000; i++) {
+    object_put(object.object_value, create_int(i), create_int(i * 2), arena);
+  }
+  assert(object_size(object.object_value) == 1000);
+  for (size_t i = 0; i < 1000; i++) {
+    Value value;
+    assert(object_get(object.object_value, create_int(i), &value));
+    assert(value.type == V_INT);
+    assert(value.int_value == i * 2);
+  }
+  Value value;
+  assert(object_get(object.object_value, create_float(10.0), &value));
+  assert(value.int_value == 20);
+  assert(!object_get(object.object_value, create_int(1000), NULL));
+  object_put(object.object_value, create_int(0), create_int(-1), arena);
+  assert(object_size(object.object_value) == 1000);
+  ObjectIterator it = iterate_object(object.object_value);
+  Value key;
+  for (size_t i = 1; i < 1000; i++) {
+    assert(object_iterator_next(&it, &key, &value));
+    assert(key.int_value == i);
+    assert(value.int_value == i * 2);
+  }
+  assert(object_iterator_next(&it, &key, &value));
+  assert(key.int_value == 0);
+  assert(value.int_value == -1);
+  assert(!object_iterator_next(&it, &key, &value));
+  delete_arena(arena);
+}
+
+static void test_object_remove(void) {
+  Arena *arena = create_arena();
+  Value object = create_object(0, arena);
+  assert(!object_remove(object.object_value, create_int(0), NULL));
+  for (size_t i = 0; i < 1000; i++) {
+    object_put(object.object_value, create_int(i), create_int(i), arena);
+  }
+  for (size_t i = 0; i < 1000; i += 2) {
+    Value value;
+    assert(object_remove(object.object_value, create_int(i), &value));
+    assert(value.int_value == i);
+  }
+  assert(!object_remove(object.object_value, create_int(0), NULL));
+  assert(object_size(object.object_value) == 500);
+  for (size_t i = 0; i < 1000; i++) {
+    assert(object_get(object.object_value, create_int(i), NULL) == i % 2);
+  }
+  for (size_t i = 1000; i < 2000; i++) {
+    object_put(object.object_value, create_int(i), create_int(i), arena);
+  }
+  assert(object_size(object.object_value) == 1500);
+  ObjectIterator it = iterate_object(object.object_value);
+  Value key;
+  for (size_t i = 1; i < 1000; i += 2) {
+    assert(object_iterator_next(&it, &key, NULL));
+    assert(key.int_value == i);
+  }
+  for (size_t i = 1000; i < 2000; i++) {
+    assert(object_iterator_next(&it, &key, NULL));
+    assert(key.int_value == i);
+  }
+  assert(!object_iterator_next(&it, &key, NULL));
+  delete_arena(arena);
+}
+
+static void test_object_get_symbol(void) {
+  Arena *arena = create_arena();
+  SymbolMap *symbol_map = create_symbol_map();
+  Value object = create_object(0, arena);
+  char name[16];
+  for (size_t i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "key%zu", i);
+    object_put(object.object_value, create_symbol(get_symbol(name, symbol_map)), create_int(i), arena);
+  }
+  for (size_t i = 0; i < 100; i++) {
+    Value value;
+    snprintf(name, sizeof(name), "key%zu", i);
+    assert(object_get_symbol(object.object_value, name, &value));
+    assert(value.int_value == i);
+  }
+  assert(!object_get_symbol(object.object_value, "key100", NULL));
+  delete_arena(arena);
+  delete_symbol_map(symbol_map);
+}
+
+static Value force_test_thunk(void *context, Arena *arena) {
+  int *forced = context;
+  (*forced)++;
+  Value values = create_object(0, arena);
+  object_put(values.object_value, create_int(1), create_int(10), arena);
+  object_put(values.object_value, create_int(2), create_array(0, arena), arena);
+  return values;
+}
+
+static void test_object_put_lazy(void) {
+  Arena *arena = create_arena();
+  Value object = create_object(0, arena);
+  int forced = 0;
+  Thunk *thunk = create_thunk(force_test_thunk, NULL, &forced, 42, arena);
+  object_put(object.object_value, create_int(0), create_int(0), arena);
+  object_put_lazy(object.object_value, create_int(1), thunk, arena);
+  object_put_lazy(object.object_value, create_int(2), thunk, arena);
+  object_put_lazy(object.object_value, create_int(3), thunk, arena);
+  assert(object_size(object.object_value) == 4);
+  assert(object_get(object.object_value, create_int(1), NULL));
+  ObjectIterator it = iterate_object(object.object_value);
+  Value key, value;
+  Thunk *entry_thunk;
+  assert(object_iterator_next_lazy(&it, &key, &value, &entry_thunk));
+  assert(entry_thunk == NULL);
+  assert(object_iterator_next_lazy(&it, &key, &value, &entry_thunk));
+  assert(thunk_hash(entry_thunk) == 42);
+  assert(forced == 0);
+  assert(object_get(object.object_value, create_int(1), &value));
+  assert(value.int_value == 10);
+  assert(forced == 1);
+  assert(object_get(object.object_value, create_int(2), &value));
+  assert(value.type == V_ARRAY);
+  assert(value.array_value->arena == arena);
+  assert(object_get(object.object_value, create_int(3), &value));
+  assert(value.type == V_NIL);
+  assert(forced == 1);
+  delete_arena(arena);
+}
+
 void test_value(void) {
   run_test(test_env);
   run_test(test_array_push);
@@ -116,5 +244,9 @@ void test_value(void) {
   run_test(test_array_remove);
   run_test(test_allocate_string);
   run_test(test_reallocate_string);
+  run_test(test_object_put);
+  run_test(test_object_remove);
+  run_test(test_object_get_symbol);
+  run_test(test_object_put_lazy);
 }
 